@@ -5,15 +5,18 @@
 #include "audio_codec.h"
 #include "mqtt_protocol.h"
 #include "websocket_protocol.h"
+#include "replay_protocol.h"
 #include "font_awesome_symbols.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 
 #define TAG "Application"
 
@@ -57,6 +60,8 @@ Application::Application() {
         .skip_unhandled_events = true
     };
     esp_timer_create(&clock_timer_args, &clock_timer_handle_);
+
+    RegisterMessageHandlers();
 }
 
 Application::~Application() {
@@ -102,77 +107,153 @@ void Application::CheckNewVersion(Ota& ota) {
         retry_count = 0;
         retry_delay = 10; // 重置重试延迟时间
 
-        if (ota.HasNewVersion()) {
-            Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::P3_UPGRADE);
+        if (UpgradeOrActivate(ota)) {
+            break;
+        }
+    }
+}
 
-            vTaskDelay(pdMS_TO_TICKS(3000));
+/*
+ * Acts on the result of the last CheckVersion: upgrades the firmware, or shows the activation code
+ * and waits for the activation. Returns false when the version has to be checked again.
+ */
+bool Application::UpgradeOrActivate(Ota& ota) {
+    auto& board = Board::GetInstance();
+    auto display = board.GetDisplay();
+    if (ota.HasNewVersion()) {
+        Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "happy", Lang::Sounds::P3_UPGRADE);
 
-            SetDeviceState(kDeviceStateUpgrading);
-            
-            display->SetIcon(FONT_AWESOME_DOWNLOAD);
-            std::string message = std::string(Lang::Strings::NEW_VERSION) + ota.GetFirmwareVersion();
-            display->SetChatMessage("system", message.c_str());
-
-            board.SetPowerSaveMode(false);
-            audio_service_.Stop();
-            vTaskDelay(pdMS_TO_TICKS(1000));
-
-            bool upgrade_success = ota.StartUpgrade([display](int progress, size_t speed) {
-                std::thread([display, progress, speed]() {
-                    char buffer[32];
-                    snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
-                    display->SetChatMessage("system", buffer);
-                }).detach();
-            });
+        vTaskDelay(pdMS_TO_TICKS(3000));
 
-            if (!upgrade_success) {
-                // Upgrade failed, restart audio service and continue running
-                ESP_LOGE(TAG, "Firmware upgrade failed, restarting audio service and continuing operation...");
-                audio_service_.Start(); // Restart audio service
-                board.SetPowerSaveMode(true); // Restore power save mode
-                Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "sad", Lang::Sounds::P3_EXCLAMATION);
-                vTaskDelay(pdMS_TO_TICKS(3000));
-                // Continue to normal operation (don't break, just fall through)
-            } else {
-                // Upgrade success, reboot immediately
-                ESP_LOGI(TAG, "Firmware upgrade successful, rebooting...");
-                display->SetChatMessage("system", "Upgrade successful, rebooting...");
-                vTaskDelay(pdMS_TO_TICKS(1000)); // Brief pause to show message
-                Reboot();
-                return; // This line will never be reached after reboot
-            }
+        SetDeviceState(kDeviceStateUpgrading);
+        
+        display->SetIcon(FONT_AWESOME_DOWNLOAD);
+        std::string message = std::string(Lang::Strings::NEW_VERSION) + ota.GetFirmwareVersion();
+        display->SetChatMessage("system", message.c_str());
+
+        board.SetPowerSaveMode(false);
+        audio_service_.Stop();
+        vTaskDelay(pdMS_TO_TICKS(1000));
+
+        bool upgrade_success = ota.StartUpgrade([display](int progress, size_t speed) {
+            std::thread([display, progress, speed]() {
+                char buffer[32];
+                snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
+                display->SetChatMessage("system", buffer);
+            }).detach();
+        });
+
+        if (!upgrade_success) {
+            // Upgrade failed, restart audio service and continue running
+            ESP_LOGE(TAG, "Firmware upgrade failed, restarting audio service and continuing operation...");
+            audio_service_.Start(); // Restart audio service
+            board.SetPowerSaveMode(true); // Restore power save mode
+            Alert(Lang::Strings::ERROR, Lang::Strings::UPGRADE_FAILED, "sad", Lang::Sounds::P3_EXCLAMATION);
+            vTaskDelay(pdMS_TO_TICKS(3000));
+            // Continue to normal operation (don't break, just fall through)
+        } else {
+            // Upgrade success, reboot immediately
+            ESP_LOGI(TAG, "Firmware upgrade successful, rebooting...");
+            display->SetChatMessage("system", "Upgrade successful, rebooting...");
+            vTaskDelay(pdMS_TO_TICKS(1000)); // Brief pause to show message
+            Reboot();
+            return true; // This line will never be reached after reboot
         }
+    }
 
-        // No new version, mark the current version as valid
-        ota.MarkCurrentVersionValid();
-        if (!ota.HasActivationCode() && !ota.HasActivationChallenge()) {
+    // No new version, mark the current version as valid
+    ota.MarkCurrentVersionValid();
+    if (!ota.HasActivationCode() && !ota.HasActivationChallenge()) {
+        xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
+        return true;
+    }
+
+    display->SetStatus(Lang::Strings::ACTIVATION);
+    // Activation code is shown to the user and waiting for the user to input
+    if (ota.HasActivationCode()) {
+        ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
+    }
+
+    // This will block the loop until the activation is done or timeout
+    for (int i = 0; i < 10; ++i) {
+        ESP_LOGI(TAG, "Activating... %d/%d", i + 1, 10);
+        esp_err_t err = ota.Activate();
+        if (err == ESP_OK) {
             xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
-            // Exit the loop if done checking new version
+            break;
+        } else if (err == ESP_ERR_TIMEOUT) {
+            vTaskDelay(pdMS_TO_TICKS(3000));
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(10000));
+        }
+        if (device_state_ == kDeviceStateIdle) {
             break;
         }
+    }
+    return false;
+}
 
-        display->SetStatus(Lang::Strings::ACTIVATION);
-        // Activation code is shown to the user and waiting for the user to input
-        if (ota.HasActivationCode()) {
-            ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
+// Started with the cached OTA config, refreshes it while the device is already usable
+void Application::CheckNewVersionInBackground() {
+    const int MAX_RETRY = 10;
+    int retry_delay = 10;
+    bool mqtt = ota_->HasMqttConfig();
+
+    boot_profiler_.Begin("ota_check");
+    for (int retry_count = 1; !ota_->CheckVersion(); retry_count++) {
+        if (retry_count >= MAX_RETRY) {
+            ESP_LOGE(TAG, "Too many retries, exit background version check");
+            boot_profiler_.End("ota_check");
+            return;
         }
+        ESP_LOGW(TAG, "Background version check failed, retry in %d seconds (%d/%d)", retry_delay, retry_count, MAX_RETRY);
+        vTaskDelay(pdMS_TO_TICKS(retry_delay * 1000));
+        retry_delay *= 2;
+    }
+    boot_profiler_.End("ota_check");
 
-        // This will block the loop until the activation is done or timeout
-        for (int i = 0; i < 10; ++i) {
-            ESP_LOGI(TAG, "Activating... %d/%d", i + 1, 10);
-            esp_err_t err = ota.Activate();
-            if (err == ESP_OK) {
-                xEventGroupSetBits(event_group_, MAIN_EVENT_CHECK_NEW_VERSION_DONE);
-                break;
-            } else if (err == ESP_ERR_TIMEOUT) {
-                vTaskDelay(pdMS_TO_TICKS(3000));
-            } else {
-                vTaskDelay(pdMS_TO_TICKS(10000));
-            }
-            if (device_state_ == kDeviceStateIdle) {
-                break;
-            }
+    // The protocol reads its settings on connect, only a change of the protocol type waits for the next boot
+    if (ota_->HasMqttConfig() != mqtt) {
+        ESP_LOGW(TAG, "Protocol changed to %s, effective after reboot", ota_->HasMqttConfig() ? "MQTT" : "WebSocket");
+    }
+
+    // The result is acted on in the main loop, which owns the device state
+    Schedule([this]() {
+        has_server_time_ = ota_->HasServerTime();
+        if (!ota_->HasNewVersion() && !ota_->HasActivationCode() && !ota_->HasActivationChallenge()) {
+            ota_->MarkCurrentVersionValid();
+            return;
         }
+        version_check_pending_ = true;
+        ApplyPendingVersionCheck();
+    });
+}
+
+/*
+ * Upgrades or activates with the result of the background version check, the same way as at boot.
+ * A conversation is not interrupted, OnClockTimer retries once the device is idle again.
+ */
+void Application::ApplyPendingVersionCheck() {
+    if (!version_check_pending_ || device_state_ != kDeviceStateIdle || preopening_) {
+        return;
+    }
+    version_check_pending_ = false;
+    ReleaseWarmChannel();
+    ReleasePreopenedChannel();
+
+    SetDeviceState(kDeviceStateActivating);
+    bool done = UpgradeOrActivate(*ota_);
+    auto display = Board::GetInstance().GetDisplay();
+    display->SetChatMessage("system", "");
+    SetDeviceState(kDeviceStateIdle);
+
+    // The server answers differently after an activation attempt, the version is checked again
+    if (!done) {
+        xTaskCreate([](void* arg) {
+            Application* app = (Application*)arg;
+            app->CheckNewVersionInBackground();
+            vTaskDelete(NULL);
+        }, "check_new_version", 4096 * 2, this, 2, nullptr);
     }
 }
 
@@ -213,6 +294,7 @@ void Application::Alert(const char* status, const char* message, const char* emo
     display->SetEmotion(emotion);
     display->SetChatMessage("system", message);
     if (!sound.empty()) {
+        WaitForAudioReady();
         audio_service_.PlaySound(sound);
     }
 }
@@ -247,11 +329,8 @@ void Application::ToggleChatState() {
 
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
+            if (!OpenAudioChannel()) {
+                return;
             }
 
             SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
@@ -262,7 +341,7 @@ void Application::ToggleChatState() {
         });
     } else if (device_state_ == kDeviceStateListening) {
         Schedule([this]() {
-            protocol_->CloseAudioChannel();
+            EndConversation();
         });
     }
 }
@@ -284,11 +363,8 @@ void Application::StartListening() {
     
     if (device_state_ == kDeviceStateIdle) {
         Schedule([this]() {
-            if (!protocol_->IsAudioChannelOpened()) {
-                SetDeviceState(kDeviceStateConnecting);
-                if (!protocol_->OpenAudioChannel()) {
-                    return;
-                }
+            if (!OpenAudioChannel()) {
+                return;
             }
 
             SetListeningMode(kListeningModeManualStop);
@@ -326,16 +402,13 @@ void Application::StopListening() {
     });
 }
 
-void Application::Start() {
+void Application::InitializeAudio() {
+    boot_profiler_.Begin("audio");
     auto& board = Board::GetInstance();
-    SetDeviceState(kDeviceStateStarting);
-
-    /* Setup the display */
-    auto display = board.GetDisplay();
-
-    /* Setup the audio service */
     auto codec = board.GetAudioCodec();
     audio_service_.Initialize(codec);
+    audio_service_.ConfigureOutputLimiter(board.GetOutputLimiterConfig());
+    audio_service_.ConfigureBeamformer(board.GetBeamformerConfig());
     audio_service_.Start();
 
     AudioServiceCallbacks callbacks;
@@ -348,37 +421,123 @@ void Application::Start() {
     callbacks.on_vad_change = [this](bool speaking) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+    callbacks.on_speech_onset = [this]() {
+        Schedule([this]() {
+            PrepareForInteraction(kAudioWarmUpReasonSpeechOnset);
+        });
+    };
+    callbacks.on_speaker_direction = [this](int azimuth, float confidence) {
+        Schedule([this, azimuth, confidence]() {
+            speaker_direction_ = azimuth;
+            speaker_direction_confidence_ = confidence;
+            speaker_direction_time_ = esp_timer_get_time();
+        });
+    };
     audio_service_.SetCallbacks(callbacks);
+    boot_profiler_.End("audio");
+    xEventGroupSetBits(event_group_, MAIN_EVENT_AUDIO_READY);
+}
+
+void Application::InitializeTools() {
+    boot_profiler_.Begin("mcp_tools");
+#if CONFIG_USE_SESSION_RECORDER
+    session_recorder_ = std::make_unique<SessionRecorder>(CONFIG_SESSION_RECORDER_BUFFER_KB * 1024);
+    session_recorder_->Start();
+#endif
+
+    // Add MCP common tools before initializing the protocol
+    McpServer::GetInstance().AddCommonTools();
+    boot_profiler_.End("mcp_tools");
+    xEventGroupSetBits(event_group_, MAIN_EVENT_TOOLS_READY);
+}
+
+// The network may start before the audio service is ready, see Start
+void Application::WaitForAudioReady() {
+    xEventGroupWaitBits(event_group_, MAIN_EVENT_AUDIO_READY, pdFALSE, pdTRUE, portMAX_DELAY);
+}
+
+void Application::Start() {
+    boot_profiler_.Begin("board");
+    auto& board = Board::GetInstance();
+    SetDeviceState(kDeviceStateStarting);
+
+    /* Setup the display */
+    auto display = board.GetDisplay();
+    boot_profiler_.End("board");
+
+    /* Setup the audio service and the MCP tools while the network starts */
+#if CONFIG_USE_PARALLEL_BOOT
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        app->InitializeAudio();
+        app->InitializeTools();
+        vTaskDelete(NULL);
+    }, "boot_init", 4096 * 2, this, 4, NULL);
+#else
+    InitializeAudio();
+    InitializeTools();
+#endif
 
     /* Start the clock timer to update the status bar */
     esp_timer_start_periodic(clock_timer_handle_, 1000000);
 
     /* Wait for the network to be ready */
+    boot_profiler_.Begin("network");
     board.StartNetwork();
+    boot_profiler_.End("network");
 
     // Update the status bar immediately to show the network state
     display->UpdateStatusBar(true);
 
-    // Check for new firmware version or get the MQTT broker address
-    Ota ota;
-    CheckNewVersion(ota);
+    // The version check plays sounds and shows the activation code
+    WaitForAudioReady();
+
+    // Check for new firmware version or get the MQTT broker address,
+    // with the cached response of this firmware the check runs in the background after the protocol is started
+    boot_profiler_.Begin("ota_config");
+    ota_ = std::make_unique<Ota>();
+    bool cached_config = false;
+#if CONFIG_USE_CACHED_OTA_CONFIG
+    cached_config = ota_->LoadCachedResponse();
+#endif
+    if (!cached_config) {
+        CheckNewVersion(*ota_);
+    }
+    boot_profiler_.End("ota_config");
+    ESP_LOGI(TAG, "Using the %s OTA config", cached_config ? "cached" : "checked");
 
     // Initialize the protocol
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
-    // Add MCP common tools before initializing the protocol
-    McpServer::GetInstance().AddCommonTools();
+    // The MCP tools are registered in parallel with the network start and the version check
+    xEventGroupWaitBits(event_group_, MAIN_EVENT_TOOLS_READY, pdFALSE, pdTRUE, portMAX_DELAY);
 
-    if (ota.HasMqttConfig()) {
+    boot_profiler_.Begin("protocol");
+    auto codec = board.GetAudioCodec();
+    if (strlen(CONFIG_SESSION_REPLAY_FILE) > 0 && access(CONFIG_SESSION_REPLAY_FILE, R_OK) == 0) {
+        ESP_LOGW(TAG, "Replaying the session capture instead of connecting to the server");
+        protocol_ = std::make_unique<ReplayProtocol>(CONFIG_SESSION_REPLAY_FILE, CONFIG_SESSION_REPLAY_SPEED_PERCENT);
+    } else if (ota_->HasMqttConfig()) {
         protocol_ = std::make_unique<MqttProtocol>();
-    } else if (ota.HasWebsocketConfig()) {
+    } else if (ota_->HasWebsocketConfig()) {
         protocol_ = std::make_unique<WebsocketProtocol>();
     } else {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
         protocol_ = std::make_unique<MqttProtocol>();
     }
+    protocol_->SetSessionRecorder(session_recorder_.get());
 
     protocol_->OnNetworkError([this](const std::string& message) {
+        if (preopening_) {
+            // Nobody is waiting for a speculative connection, retry on the real interaction
+            ESP_LOGW(TAG, "Audio channel pre-open failed: %s", message.c_str());
+            return;
+        }
+        if (channel_warm_) {
+            // The idle channel is marked broken and reopened on the next interaction
+            ESP_LOGW(TAG, "Warm audio channel failed: %s", message.c_str());
+            return;
+        }
         last_error_message_ = message;
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
@@ -389,120 +548,66 @@ void Application::Start() {
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveMode(false);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
-            ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
+        // The protocol measures the new channel from scratch, the uplink must not stay in DTX meanwhile
+        Schedule([this]() {
+            audio_service_.SetUplinkQuality(kLinkQualityUnknown);
+        });
+        if (audio_service_.GetPreferredDecodeSampleRate() != codec->output_sample_rate()) {
+            ESP_LOGW(TAG, "Device output sample rate %d is not supported by Opus, resampling may cause distortion",
+                codec->output_sample_rate());
+        } else if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+            ESP_LOGI(TAG, "Server sample rate %d, decoding to %d without resampling",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
     });
     protocol_->OnAudioChannelClosed([this, &board]() {
         board.SetPowerSaveMode(true);
         Schedule([this]() {
+            if (channel_preopened_) {
+                channel_preopened_ = false;
+                preopen_statistics_.wasted++;
+            }
+            if (channel_warm_) {
+                channel_warm_ = false;
+                keep_warm_statistics_.dropped++;
+            }
             auto display = Board::GetInstance().GetDisplay();
             display->SetChatMessage("system", "");
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
-                        SetDeviceState(kDeviceStateSpeaking);
-                    }
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (device_state_ == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
-            }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
-            }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
-            }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
-                    // Do a reboot if user requests a OTA update
-                    Schedule([this]() {
-                        Reboot();
-                    });
-                } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
-                }
-            }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
-            } else {
-                ESP_LOGW(TAG, "Alert command requires status, message and emotion");
-            }
-#if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
-            if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
-                });
-            } else {
-                ESP_LOGW(TAG, "Invalid custom message format: missing payload");
-            }
-#endif
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+    protocol_->OnIncomingMessage([this](const MessageView& message) {
+        return message_dispatcher_.Dispatch(message);
+    });
+    protocol_->OnIncomingJson([this](const cJSON* root) {
+        if (!message_dispatcher_.Dispatch(root)) {
+            auto type = cJSON_GetObjectItem(root, "type");
+            ESP_LOGW(TAG, "Unknown message type: %s", cJSON_IsString(type) ? type->valuestring : "(none)");
         }
     });
     bool protocol_started = protocol_->Start();
+    boot_profiler_.End("protocol");
 
     SetDeviceState(kDeviceStateIdle);
 
-    has_server_time_ = ota.HasServerTime();
+    has_server_time_ = ota_->HasServerTime();
     if (protocol_started) {
-        std::string message = std::string(Lang::Strings::VERSION) + ota.GetCurrentVersion();
+        std::string message = std::string(Lang::Strings::VERSION) + ota_->GetCurrentVersion();
         display->ShowNotification(message.c_str());
         display->SetChatMessage("system", "");
         // Play the success sound to indicate the device is ready
         audio_service_.PlaySound(Lang::Sounds::P3_SUCCESS);
     }
+    boot_profiler_.MarkReady();
+    boot_profiler_.Log(board.GetBootReadyTargetMs());
+
+    if (cached_config) {
+        xTaskCreate([](void* arg) {
+            Application* app = (Application*)arg;
+            app->CheckNewVersionInBackground();
+            vTaskDelete(NULL);
+        }, "check_new_version", 4096 * 2, this, 2, nullptr);
+    }
 
     // Print heap stats
     SystemInfo::PrintHeapStats();
@@ -514,6 +619,41 @@ void Application::OnClockTimer() {
     auto display = Board::GetInstance().GetDisplay();
     display->UpdateStatusBar();
 
+    if (channel_preopened_ && esp_timer_get_time() > preopen_expire_time_) {
+        Schedule([this]() {
+            ReleasePreopenedChannel();
+        });
+    }
+
+    if ((device_state_ == kDeviceStateListening || device_state_ == kDeviceStateSpeaking) &&
+        clock_ticks_ % LINK_PROBE_INTERVAL_SECONDS == 0) {
+        Schedule([this]() {
+            ProbeLink();
+        });
+    }
+
+    if (version_check_pending_ && device_state_ == kDeviceStateIdle) {
+        Schedule([this]() {
+            ApplyPendingVersionCheck();
+        });
+    }
+
+    if (channel_warm_) {
+        int64_t now = esp_timer_get_time();
+        if (now > warm_expire_time_) {
+            Schedule([this]() {
+                ReleaseWarmChannel();
+            });
+        } else if (now > warm_next_ping_time_) {
+            warm_next_ping_time_ = now + CHANNEL_KEEP_WARM_PING_SECONDS * 1000000LL;
+            Schedule([this]() {
+                if (channel_warm_) {
+                    protocol_->SendPing();
+                }
+            });
+        }
+    }
+
     // Print the debug info every 10 seconds
     if (clock_ticks_ % 10 == 0) {
         // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
@@ -565,6 +705,10 @@ void Application::MainEventLoop() {
             if (device_state_ == kDeviceStateListening) {
                 auto led = Board::GetInstance().GetLed();
                 led->OnStateChanged();
+                if (!audio_service_.IsVoiceDetected()) {
+                    // Do not hold the end of the utterance in a batch
+                    protocol_->FlushAudio();
+                }
             }
         }
 
@@ -587,16 +731,14 @@ void Application::OnWakeWordDetected() {
     if (device_state_ == kDeviceStateIdle) {
         audio_service_.EncodeWakeWord();
 
-        if (!protocol_->IsAudioChannelOpened()) {
-            SetDeviceState(kDeviceStateConnecting);
-            if (!protocol_->OpenAudioChannel()) {
-                audio_service_.EnableWakeWordDetection(true);
-                return;
-            }
+        if (!OpenAudioChannel()) {
+            audio_service_.EnableWakeWordDetection(true);
+            return;
         }
 
         auto wake_word = audio_service_.GetLastWakeWord();
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
+        wake_word_unconfirmed_ = true;
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
         while (auto packet = audio_service_.PopWakeWordPacket()) {
@@ -632,6 +774,10 @@ void Application::SetDeviceState(DeviceState state) {
     if (device_state_ == state) {
         return;
     }
+    if (state != kDeviceStateStarting) {
+        // Such as the Wi-Fi configuration mode entered from StartNetwork
+        WaitForAudioReady();
+    }
     
     clock_ticks_ = 0;
     auto previous_state = device_state_;
@@ -645,11 +791,26 @@ void Application::SetDeviceState(DeviceState state) {
     auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
+    if (channel_warm_ && state != kDeviceStateIdle) {
+        // A conversation started on the warm channel, by the device or by the server
+        channel_warm_ = false;
+        keep_warm_statistics_.reused++;
+        keep_warm_statistics_.connect_ms += last_connect_ms_;
+        board.SetPowerSaveMode(false);
+        ESP_LOGI(TAG, "Warm audio channel reused, saved about %lu ms", last_connect_ms_);
+    }
     switch (state) {
         case kDeviceStateUnknown:
         case kDeviceStateIdle:
             display->SetStatus(Lang::Strings::STANDBY);
             display->SetEmotion("neutral");
+            if (wake_word_unconfirmed_) {
+                // The session ended without any recognized speech, likely a false wake up
+                wake_word_unconfirmed_ = false;
+                if (auto flight_recorder = audio_service_.flight_recorder()) {
+                    flight_recorder->Snapshot("wake_word_false_trigger");
+                }
+            }
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(true);
             break;
@@ -661,6 +822,13 @@ void Application::SetDeviceState(DeviceState state) {
         case kDeviceStateListening:
             display->SetStatus(Lang::Strings::LISTENING);
             display->SetEmotion("neutral");
+            if (channel_preopened_) {
+                channel_preopened_ = false;
+                preopen_consecutive_wasted_ = 0;
+                preopen_statistics_.useful++;
+                preopen_statistics_.connect_ms += preopen_connect_ms_;
+                ESP_LOGI(TAG, "Pre-opened audio channel used, saved %lu ms", preopen_connect_ms_);
+            }
 
             // Make sure the audio processor is running
             if (!audio_service_.IsAudioProcessorRunning()) {
@@ -710,7 +878,7 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (device_state_ == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
-                protocol_->CloseAudioChannel();
+                EndConversation();
             }
         });
     }
@@ -721,7 +889,7 @@ bool Application::CanEnterSleepMode() {
         return false;
     }
 
-    if (protocol_ && protocol_->IsAudioChannelOpened()) {
+    if (protocol_ && (preopening_ || protocol_->IsAudioChannelOpened())) {
         return false;
     }
 
@@ -769,5 +937,408 @@ void Application::SetAecMode(AecMode mode) {
 }
 
 void Application::PlaySound(const std::string_view& sound) {
+    WaitForAudioReady();
     audio_service_.PlaySound(sound);
-}
\ No newline at end of file
+}
+
+// Called on early signals (speech onset, button press down, pickup motion) before
+// the user actually starts talking, so the codec is ready by the time it is needed
+void Application::PrepareForInteraction(AudioWarmUpReason reason) {
+    if (device_state_ != kDeviceStateIdle && device_state_ != kDeviceStateListening) {
+        return;
+    }
+    audio_service_.WarmUp(reason);
+#if CONFIG_AUDIO_CHANNEL_PREOPEN
+    if (device_state_ == kDeviceStateIdle && reason != kAudioWarmUpReasonTtsStart) {
+        // Queued before the click or wake word event, so the interaction finds the channel open or opening
+        Schedule([this, reason]() {
+            PreopenAudioChannel(reason);
+        });
+    }
+#endif
+}
+
+/*
+ * Connect and send the hello before the interaction is confirmed, the connect phase is the
+ * largest part of the wake to listen latency. The channel is held for a bounded time, and
+ * the pre-open is suppressed for a growing time after each one that was not used. The connect
+ * runs on its own task; an interaction that starts meanwhile waits for it in OpenAudioChannel.
+ */
+void Application::PreopenAudioChannel(AudioWarmUpReason reason) {
+    // A warm channel that went bad is replaced on the real interaction, see OpenAudioChannel
+    if (!protocol_ || device_state_ != kDeviceStateIdle || channel_warm_ || preopening_ || protocol_->IsAudioChannelOpened()) {
+        return;
+    }
+    int64_t start_time = esp_timer_get_time();
+    if (start_time < preopen_backoff_until_) {
+        preopen_statistics_.skipped++;
+        return;
+    }
+
+    preopen_statistics_.attempts++;
+    preopening_ = true;
+    preopen_success_ = false;
+    preopen_start_time_ = start_time;
+    preopen_reason_ = reason;
+    xEventGroupClearBits(event_group_, MAIN_EVENT_PREOPEN_DONE);
+
+    // A slow connect or TLS handshake must not hold up the main loop, the result is taken over by FinishPreopen.
+    // The connect used to run on the main task, the pre-open task gets the same stack for the TLS handshake
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        app->preopen_success_ = app->protocol_->OpenAudioChannel();
+        xEventGroupSetBits(app->event_group_, MAIN_EVENT_PREOPEN_DONE);
+        app->Schedule([app]() {
+            app->FinishPreopen();
+        });
+        vTaskDelete(NULL);
+    }, "preopen_channel", CONFIG_ESP_MAIN_TASK_STACK_SIZE, this, 2, NULL);
+}
+
+// Runs in the main loop once the pre-open task is done, or earlier from OpenAudioChannel
+void Application::FinishPreopen() {
+    if (!preopening_) {
+        return;
+    }
+    preopening_ = false;
+    preopen_connect_ms_ = (esp_timer_get_time() - preopen_start_time_) / 1000;
+    if (!preopen_success_) {
+        preopen_statistics_.failed++;
+        preopen_backoff_until_ = esp_timer_get_time() + CHANNEL_PREOPEN_BACKOFF_MS * 1000LL;
+        return;
+    }
+
+    ESP_LOGI(TAG, "Audio channel pre-opened in %lu ms (reason %d)", preopen_connect_ms_, preopen_reason_);
+    last_connect_ms_ = preopen_connect_ms_;
+    channel_preopened_ = true;
+#if CONFIG_AUDIO_CHANNEL_PREOPEN
+    preopen_expire_time_ = esp_timer_get_time() + CONFIG_AUDIO_CHANNEL_PREOPEN_HOLD_SECONDS * 1000000LL;
+#endif
+}
+
+void Application::ReleasePreopenedChannel() {
+    if (!channel_preopened_ || device_state_ != kDeviceStateIdle) {
+        return;
+    }
+    channel_preopened_ = false;
+    preopen_statistics_.wasted++;
+    preopen_consecutive_wasted_++;
+    int64_t backoff_ms = std::min((int64_t)CHANNEL_PREOPEN_BACKOFF_MS << std::min(preopen_consecutive_wasted_ - 1, 8),
+        (int64_t)CHANNEL_PREOPEN_MAX_BACKOFF_MS);
+    preopen_backoff_until_ = esp_timer_get_time() + backoff_ms * 1000;
+    ESP_LOGI(TAG, "Pre-opened audio channel not used, closing, next pre-open in %lld s (useful %lu, wasted %lu)",
+        backoff_ms / 1000, preopen_statistics_.useful, preopen_statistics_.wasted);
+    protocol_->CloseAudioChannel();
+}
+
+// Reuses the warm channel if it is still alive, otherwise opens a new one
+bool Application::OpenAudioChannel() {
+    if (preopening_) {
+        // The pre-open is the connection this interaction needs, wait for it instead of connecting twice
+        xEventGroupWaitBits(event_group_, MAIN_EVENT_PREOPEN_DONE, pdFALSE, pdTRUE, portMAX_DELAY);
+        FinishPreopen();
+    }
+    // A live warm channel is counted as reused when the conversation starts, see SetDeviceState
+    if (channel_warm_ && !protocol_->IsAudioChannelOpened()) {
+        channel_warm_ = false;
+        keep_warm_statistics_.reopened++;
+        ESP_LOGW(TAG, "Warm audio channel is no longer usable, reopening");
+    }
+    if (protocol_->IsAudioChannelOpened()) {
+        return true;
+    }
+
+    SetDeviceState(kDeviceStateConnecting);
+    int64_t start_time = esp_timer_get_time();
+    if (!protocol_->OpenAudioChannel()) {
+        return false;
+    }
+    last_connect_ms_ = (esp_timer_get_time() - start_time) / 1000;
+    return true;
+}
+
+/*
+ * Ends the conversation from the device side. With keep-warm enabled the transport stays up,
+ * pinged every CHANNEL_KEEP_WARM_PING_SECONDS, so the next wake skips the connect and hello.
+ */
+void Application::EndConversation() {
+#if CONFIG_AUDIO_CHANNEL_KEEP_WARM_MINUTES > 0
+    if (protocol_->IsAudioChannelOpened()) {
+        protocol_->SendAbortSpeaking(kAbortReasonNone);
+        int64_t now = esp_timer_get_time();
+        channel_warm_ = true;
+        warm_expire_time_ = now + CONFIG_AUDIO_CHANNEL_KEEP_WARM_MINUTES * 60 * 1000000LL;
+        warm_next_ping_time_ = now + CHANNEL_KEEP_WARM_PING_SECONDS * 1000000LL;
+        keep_warm_statistics_.parked++;
+        ESP_LOGI(TAG, "Conversation ended, keeping the audio channel warm for %d minutes",
+            CONFIG_AUDIO_CHANNEL_KEEP_WARM_MINUTES);
+        auto& board = Board::GetInstance();
+        board.SetPowerSaveMode(true);
+        board.GetDisplay()->SetChatMessage("system", "");
+        SetDeviceState(kDeviceStateIdle);
+        return;
+    }
+#endif
+    protocol_->CloseAudioChannel();
+}
+
+void Application::ReleaseWarmChannel() {
+    if (!channel_warm_ || device_state_ != kDeviceStateIdle) {
+        return;
+    }
+    channel_warm_ = false;
+    keep_warm_statistics_.expired++;
+    ESP_LOGI(TAG, "Warm audio channel not used, closing (reused %lu, reopened %lu)",
+        keep_warm_statistics_.reused, keep_warm_statistics_.reopened);
+    protocol_->CloseAudioChannel();
+}
+
+/*
+ * Pings the server during conversations and adapts the uplink to the measured link.
+ * Servers that never answered a probe on this channel are not probed further.
+ */
+void Application::ProbeLink() {
+    if (!protocol_ || !protocol_->IsAudioChannelOpened()) {
+        return;
+    }
+    auto statistics = protocol_->link_quality_statistics();
+    if (statistics.probes_answered == 0 && statistics.probes_sent >= 3) {
+        return;
+    }
+    protocol_->SendPing();
+    audio_service_.SetUplinkQuality(protocol_->link_quality());
+}
+
+void Application::WriteLinkQuality(JsonWriter& writer) {
+    if (!protocol_) {
+        writer.Null();
+        return;
+    }
+    protocol_->WriteLinkQuality(writer);
+}
+
+void Application::WriteLinkQualityField(JsonWriter& writer, const char* key) {
+    if (!protocol_) {
+        return;
+    }
+    writer.Key(key);
+    protocol_->WriteLinkQuality(writer);
+}
+
+/*
+ * Handlers of the messages from the server. They run on the protocol task, so anything that
+ * touches the device state or the display is scheduled to the main loop with a copy of the text.
+ * The frequent messages have view handlers, so a CBOR message reaches them without a tree.
+ */
+void Application::RegisterMessageHandlers() {
+    message_dispatcher_.RegisterView("tts", "start", [this](const MessageView& message) {
+        audio_service_.WarmUp(kAudioWarmUpReasonTtsStart);
+        Schedule([this]() {
+            aborted_ = false;
+            if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
+                SetDeviceState(kDeviceStateSpeaking);
+            }
+        });
+    });
+    message_dispatcher_.RegisterView("tts", "stop", [this](const MessageView& message) {
+        Schedule([this]() {
+            if (device_state_ == kDeviceStateSpeaking) {
+                if (listening_mode_ == kListeningModeManualStop) {
+                    SetDeviceState(kDeviceStateIdle);
+                } else {
+                    SetDeviceState(kDeviceStateListening);
+                }
+            }
+        });
+    });
+    message_dispatcher_.RegisterView("tts", "sentence_start", [this](const MessageView& message) {
+        if (message.text.data() != nullptr) {
+            ESP_LOGI(TAG, "<< %.*s", (int)message.text.size(), message.text.data());
+            Schedule([text = std::string(message.text)]() {
+                Board::GetInstance().GetDisplay()->SetChatMessage("assistant", text.c_str());
+            });
+        }
+    });
+    // Other states of tts, such as sentence_end, need no handling
+    message_dispatcher_.RegisterView("tts", [](const MessageView& message) {});
+    message_dispatcher_.RegisterView("stt", [this](const MessageView& message) {
+        if (message.text.data() != nullptr) {
+            ESP_LOGI(TAG, ">> %.*s", (int)message.text.size(), message.text.data());
+            Schedule([this, text = std::string(message.text)]() {
+                if (!text.empty()) {
+                    wake_word_unconfirmed_ = false;
+                }
+                Board::GetInstance().GetDisplay()->SetChatMessage("user", text.c_str());
+            });
+        }
+    });
+    message_dispatcher_.RegisterView("llm", [this](const MessageView& message) {
+        if (message.emotion.data() != nullptr) {
+            Schedule([emotion = std::string(message.emotion)]() {
+                Board::GetInstance().GetDisplay()->SetEmotion(emotion.c_str());
+            });
+        }
+    });
+    message_dispatcher_.RegisterView("mcp", [](const MessageView& message) {
+        if (message.payload != nullptr) {
+            McpServer::GetInstance().ParseMessage(message.payload);
+        }
+    });
+    message_dispatcher_.Register("system", [this](const cJSON* root) {
+        auto command = cJSON_GetObjectItem(root, "command");
+        if (cJSON_IsString(command)) {
+            ESP_LOGI(TAG, "System command: %s", command->valuestring);
+            if (strcmp(command->valuestring, "reboot") == 0) {
+                // Do a reboot if user requests a OTA update
+                Schedule([this]() {
+                    Reboot();
+                });
+            } else {
+                ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+            }
+        }
+    });
+    message_dispatcher_.Register("alert", [this](const cJSON* root) {
+        auto status = cJSON_GetObjectItem(root, "status");
+        auto message = cJSON_GetObjectItem(root, "message");
+        auto emotion = cJSON_GetObjectItem(root, "emotion");
+        if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
+            Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::P3_VIBRATION);
+        } else {
+            ESP_LOGW(TAG, "Alert command requires status, message and emotion");
+        }
+    });
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+    message_dispatcher_.Register("custom", [this](const cJSON* root) {
+        auto payload = cJSON_GetObjectItem(root, "payload");
+        if (!cJSON_IsObject(payload)) {
+            ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+            return;
+        }
+        char* payload_str = cJSON_PrintUnformatted(payload);
+        if (payload_str == nullptr) {
+            return;
+        }
+        ESP_LOGI(TAG, "Received custom message: %s", payload_str);
+        Schedule([message = std::string(payload_str)]() {
+            Board::GetInstance().GetDisplay()->SetChatMessage("system", message.c_str());
+        });
+        cJSON_free(payload_str);
+    });
+#endif
+}
+
+bool Application::RegisterMessageHandler(const char* type, MessageHandler handler) {
+    return message_dispatcher_.Register(type, handler);
+}
+
+bool Application::RegisterMessageHandler(const char* type, const char* state, MessageHandler handler) {
+    return message_dispatcher_.Register(type, state, handler);
+}
+
+std::string Application::GetBootProfileJson() {
+    std::string json;
+    JsonWriter writer(json);
+    boot_profiler_.WriteReport(writer, Board::GetInstance().GetBootReadyTargetMs());
+    return json;
+}
+
+std::string Application::GetMessageStatisticsJson() {
+    std::string json;
+    JsonWriter writer(json);
+    message_dispatcher_.WriteStatistics(writer);
+    return json;
+}
+
+std::string Application::GetChannelStatisticsJson() {
+    cJSON* root = cJSON_CreateObject();
+    cJSON* preopen = cJSON_CreateObject();
+    cJSON_AddNumberToObject(preopen, "attempts", preopen_statistics_.attempts);
+    cJSON_AddNumberToObject(preopen, "useful", preopen_statistics_.useful);
+    cJSON_AddNumberToObject(preopen, "wasted", preopen_statistics_.wasted);
+    cJSON_AddNumberToObject(preopen, "failed", preopen_statistics_.failed);
+    cJSON_AddNumberToObject(preopen, "skipped", preopen_statistics_.skipped);
+    cJSON_AddNumberToObject(preopen, "saved_connect_ms", preopen_statistics_.connect_ms);
+    cJSON_AddItemToObject(root, "preopen", preopen);
+    cJSON* keep_warm = cJSON_CreateObject();
+    cJSON_AddNumberToObject(keep_warm, "minutes", CONFIG_AUDIO_CHANNEL_KEEP_WARM_MINUTES);
+    cJSON_AddBoolToObject(keep_warm, "warm", channel_warm_);
+    cJSON_AddNumberToObject(keep_warm, "parked", keep_warm_statistics_.parked);
+    cJSON_AddNumberToObject(keep_warm, "reused", keep_warm_statistics_.reused);
+    cJSON_AddNumberToObject(keep_warm, "reopened", keep_warm_statistics_.reopened);
+    cJSON_AddNumberToObject(keep_warm, "expired", keep_warm_statistics_.expired);
+    cJSON_AddNumberToObject(keep_warm, "dropped", keep_warm_statistics_.dropped);
+    cJSON_AddNumberToObject(keep_warm, "saved_connect_ms", keep_warm_statistics_.connect_ms);
+    // Share of wakes on a parked channel that found it alive
+    uint32_t wakes = keep_warm_statistics_.reused + keep_warm_statistics_.reopened;
+    cJSON_AddNumberToObject(keep_warm, "reuse_rate", wakes > 0 ? (double)keep_warm_statistics_.reused / wakes : 0);
+    cJSON_AddItemToObject(root, "keep_warm", keep_warm);
+    if (protocol_) {
+        if (auto transport = protocol_->GetTransportStatistics()) {
+            cJSON_AddItemToObject(root, "transport", transport);
+        }
+    }
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
+
+std::string Application::GetSpeakerDirectionJson() {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddBoolToObject(root, "detected", speaker_direction_ >= 0);
+    if (speaker_direction_ >= 0) {
+        cJSON_AddNumberToObject(root, "azimuth", speaker_direction_);
+        cJSON_AddNumberToObject(root, "confidence", speaker_direction_confidence_);
+        cJSON_AddNumberToObject(root, "age_ms", (esp_timer_get_time() - speaker_direction_time_) / 1000);
+    }
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
+
+std::string Application::RunAudioSelfTest() {
+    if (device_state_ == kDeviceStateUpgrading || device_state_ == kDeviceStateAudioTesting) {
+        return "{\"success\": false, \"message\": \"Device is busy\"}";
+    }
+
+    LoopbackResult result;
+    bool success = audio_service_.RunSelfTest(result);
+
+    char message[64];
+    if (success) {
+        snprintf(message, sizeof(message), "%.0f ms / SNR %.0f dB", result.latency_ms, result.snr_db);
+    } else {
+        snprintf(message, sizeof(message), "Loopback not detected");
+    }
+    Schedule([message = std::string(message)]() {
+        auto display = Board::GetInstance().GetDisplay();
+        display->SetChatMessage("system", message.c_str());
+    });
+
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddBoolToObject(root, "success", success);
+    cJSON_AddNumberToObject(root, "latency_ms", result.latency_ms);
+    cJSON_AddNumberToObject(root, "correlation", result.correlation);
+    cJSON_AddNumberToObject(root, "snr_db", result.snr_db);
+    cJSON_AddNumberToObject(root, "noise_dbfs", result.noise_dbfs);
+    cJSON_AddNumberToObject(root, "peak_dbfs", result.peak_dbfs);
+    cJSON_AddNumberToObject(root, "clipped_samples", result.clipped_samples);
+    cJSON* response = cJSON_CreateArray();
+    for (int i = 0; i < LOOPBACK_BANDS; i++) {
+        cJSON* band = cJSON_CreateObject();
+        cJSON_AddNumberToObject(band, "hz", (int)result.band_hz[i]);
+        cJSON_AddNumberToObject(band, "gain_db", result.band_gain_db[i]);
+        cJSON_AddItemToArray(response, band);
+    }
+    cJSON_AddItemToObject(root, "frequency_response", response);
+
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
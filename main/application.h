@@ -11,11 +11,14 @@
 #include <deque>
 #include <vector>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
 #include "device_state_event.h"
+#include "message_dispatcher.h"
+#include "boot_profiler.h"
 
 #define MAIN_EVENT_SCHEDULE (1 << 0)
 #define MAIN_EVENT_SEND_AUDIO (1 << 1)
@@ -23,6 +26,31 @@
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
+#define MAIN_EVENT_AUDIO_READY (1 << 6)        // Kept set, the audio service is initialized
+#define MAIN_EVENT_TOOLS_READY (1 << 7)        // Kept set, the MCP common tools are registered
+#define MAIN_EVENT_PREOPEN_DONE (1 << 8)       // The pre-open task finished connecting
+
+#define CHANNEL_PREOPEN_BACKOFF_MS 30000       // After a wasted pre-open, doubled for each further one
+#define CHANNEL_PREOPEN_MAX_BACKOFF_MS 600000
+#define CHANNEL_KEEP_WARM_PING_SECONDS 30
+
+struct ChannelPreopenStatistics {
+    uint32_t attempts = 0;
+    uint32_t useful = 0;            // An interaction started on the pre-opened channel
+    uint32_t wasted = 0;            // Closed after the hold window, or by the server
+    uint32_t failed = 0;
+    uint32_t skipped = 0;           // Suppressed by the backoff
+    uint32_t connect_ms = 0;        // Total connect time taken off the wake path by useful pre-opens
+};
+
+struct ChannelKeepWarmStatistics {
+    uint32_t parked = 0;            // Conversations that ended with the channel kept open
+    uint32_t reused = 0;            // A conversation started on the warm channel
+    uint32_t reopened = 0;          // The warm channel was dead at wake, opened a new one
+    uint32_t expired = 0;           // Closed by the device after the keep-warm time
+    uint32_t dropped = 0;           // Closed by the server or the network while warm
+    uint32_t connect_ms = 0;        // Estimated connect time saved by reuse
+};
 
 enum AecMode {
     kAecOff,
@@ -59,7 +87,23 @@ public:
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
+    void PrepareForInteraction(AudioWarmUpReason reason);
+    std::string RunAudioSelfTest();
+    std::string GetSpeakerDirectionJson();
+    std::string GetChannelStatisticsJson();
+    // Writes the measured link quality of the audio channel as an object value, null without a protocol
+    void WriteLinkQuality(JsonWriter& writer);
+    // Writes the link quality as the field key of the current object, the field is left out without a protocol
+    void WriteLinkQualityField(JsonWriter& writer, const char* key);
     AudioService& GetAudioService() { return audio_service_; }
+    // nullptr unless CONFIG_USE_SESSION_RECORDER is enabled
+    SessionRecorder* session_recorder() { return session_recorder_.get(); }
+    // Boards and subsystems add or replace handlers of incoming messages, before or after Start
+    bool RegisterMessageHandler(const char* type, MessageHandler handler);
+    bool RegisterMessageHandler(const char* type, const char* state, MessageHandler handler);
+    std::string GetMessageStatisticsJson();
+    // Startup phases and the time-to-ready, see BootProfiler
+    std::string GetBootProfileJson();
 
 private:
     Application();
@@ -75,17 +119,60 @@ private:
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    MessageDispatcher message_dispatcher_;
+    BootProfiler boot_profiler_;
+    std::unique_ptr<SessionRecorder> session_recorder_;
 
     bool has_server_time_ = false;
     bool aborted_ = false;
+    bool wake_word_unconfirmed_ = false;  // No speech was recognized since the last wake word
     int clock_ticks_ = 0;
-    TaskHandle_t check_new_version_task_handle_ = nullptr;
+    int speaker_direction_ = -1;            // Azimuth from the beamformer, -1 until speech is located
+    float speaker_direction_confidence_ = 0;
+    int64_t speaker_direction_time_ = 0;
+
+    // Speculative audio channel opening, see PrepareForInteraction
+    std::atomic<bool> preopening_ = false;  // The pre-open task is connecting, read by the network error callback
+    volatile bool preopen_success_ = false;
+    int64_t preopen_start_time_ = 0;
+    AudioWarmUpReason preopen_reason_ = kAudioWarmUpReasonSpeechOnset;
+    bool channel_preopened_ = false;        // Opened speculatively and not used yet
+    uint32_t preopen_connect_ms_ = 0;
+    int64_t preopen_expire_time_ = 0;
+    int64_t preopen_backoff_until_ = 0;
+    int preopen_consecutive_wasted_ = 0;
+    ChannelPreopenStatistics preopen_statistics_;
+
+    // Audio channel kept open between conversations: parked by EndConversation, closed by ReleaseWarmChannel,
+    // reused or replaced in OpenAudioChannel and pinged from OnClockTimer
+    bool channel_warm_ = false;
+    uint32_t last_connect_ms_ = 0;
+    int64_t warm_expire_time_ = 0;
+    int64_t warm_next_ping_time_ = 0;
+    ChannelKeepWarmStatistics keep_warm_statistics_;
+    std::unique_ptr<Ota> ota_;
+    // The background version check found an upgrade or an activation, applied when the device is idle
+    bool version_check_pending_ = false;
 
     void OnWakeWordDetected();
     void CheckNewVersion(Ota& ota);
+    bool UpgradeOrActivate(Ota& ota);
+    void CheckNewVersionInBackground();
+    void ApplyPendingVersionCheck();
+    void InitializeAudio();
+    void InitializeTools();
+    void WaitForAudioReady();
     void ShowActivationCode(const std::string& code, const std::string& message);
     void OnClockTimer();
     void SetListeningMode(ListeningMode mode);
+    void PreopenAudioChannel(AudioWarmUpReason reason);
+    void FinishPreopen();
+    void ReleasePreopenedChannel();
+    bool OpenAudioChannel();
+    void EndConversation();
+    void ReleaseWarmChannel();
+    void ProbeLink();
+    void RegisterMessageHandlers();
 };
 
 #endif // _APPLICATION_H_
@@ -3,29 +3,120 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
+#include <algorithm>
 #include <driver/i2s_common.h>
 
 #define TAG "AudioCodec"
 
 AudioCodec::AudioCodec() {
+#if CONFIG_AUDIO_DMA_AUTO_TUNE
+    Settings settings("audio", false);
+    dma_desc_num_ = std::clamp(settings.GetInt("dma_desc_num", AUDIO_CODEC_DMA_DESC_NUM),
+        AUDIO_CODEC_DMA_DESC_NUM_MIN, AUDIO_CODEC_DMA_DESC_NUM_MAX);
+#endif
 }
 
 AudioCodec::~AudioCodec() {
 }
 
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
+    int64_t start_time = esp_timer_get_time();
+    /* The send queue also overflows while nothing is played, only count it while the stream is running */
+    uint32_t overflows = tx_queue_overflows_;
+    if (start_time - last_write_time_ < AUDIO_CODEC_STREAM_GAP_MS * 1000) {
+        uint32_t underruns = overflows - tx_queue_overflows_seen_;
+        statistics_.tx_underruns += underruns;
+        session_underruns_ += underruns;
+    }
+    tx_queue_overflows_seen_ = overflows;
+
     Write(data.data(), data.size());
+
+    last_write_time_ = esp_timer_get_time();
+    uint32_t elapsed_ms = (last_write_time_ - start_time) / 1000;
+    statistics_.max_write_ms = std::max(statistics_.max_write_ms, elapsed_ms);
+    if (output_sample_rate_ > 0) {
+        statistics_.played_ms += data.size() * 1000 / (output_sample_rate_ * output_channels_);
+    }
 }
 
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
+    int64_t now = esp_timer_get_time();
+    uint32_t overflows = rx_queue_overflows_;
+    if (now - last_read_time_ < AUDIO_CODEC_STREAM_GAP_MS * 1000) {
+        statistics_.rx_overruns += overflows - rx_queue_overflows_seen_;
+    }
+    rx_queue_overflows_seen_ = overflows;
+
     int samples = Read(data.data(), data.size());
+    last_read_time_ = esp_timer_get_time();
     if (samples > 0) {
         return true;
     }
     return false;
 }
 
+void AudioCodec::RegisterI2sCallbacks() {
+    /* Must be done before the channels are enabled */
+    if (tx_handle_ != nullptr) {
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_send_q_ovf = [](i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) -> bool {
+            ((AudioCodec*)user_ctx)->tx_queue_overflows_++;
+            return false;
+        };
+        if (i2s_channel_register_event_callback(tx_handle_, &callbacks, this) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to register I2S TX callbacks, underruns are not counted");
+        }
+    }
+    if (rx_handle_ != nullptr) {
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_recv_q_ovf = [](i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) -> bool {
+            ((AudioCodec*)user_ctx)->rx_queue_overflows_++;
+            return false;
+        };
+        if (i2s_channel_register_event_callback(rx_handle_, &callbacks, this) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to register I2S RX callbacks, overruns are not counted");
+        }
+    }
+}
+
+/*
+ * Deepen the DMA queue by two buffers after a session with underruns, and remember that the
+ * depth was too shallow. Shorten it by one buffer after a long time of clean playback,
+ * but never back to a depth that underran. A stored depth only takes effect after reboot, so
+ * both directions start from it: a clean session at the running depth must not undo a pending
+ * deepening, and no shortening is stored before the stored depth was tried.
+ */
+void AudioCodec::TuneDmaDepth() {
+#if CONFIG_AUDIO_DMA_AUTO_TUNE
+    uint32_t session_underruns = session_underruns_;
+    session_underruns_ = 0;
+    Settings settings("audio", true);
+    int floor = settings.GetInt("dma_desc_floor", AUDIO_CODEC_DMA_DESC_NUM_MIN);
+    int stored = settings.GetInt("dma_desc_num", dma_desc_num_);
+    bool pending = stored != dma_desc_num_;
+    int depth = stored;
+
+    if (session_underruns >= AUDIO_CODEC_DMA_TUNE_UNDERRUNS) {
+        clean_since_ms_ = statistics_.played_ms;
+        floor = std::max(floor, std::min(dma_desc_num_ + 1, AUDIO_CODEC_DMA_DESC_NUM_MAX));
+        depth = std::max(stored, std::min(dma_desc_num_ + 2, AUDIO_CODEC_DMA_DESC_NUM_MAX));
+        settings.SetInt("dma_desc_floor", floor);
+    } else if (session_underruns > 0) {
+        clean_since_ms_ = statistics_.played_ms;
+    } else if (!pending && statistics_.played_ms - clean_since_ms_ >= AUDIO_CODEC_DMA_TUNE_CLEAN_MS && dma_desc_num_ > floor) {
+        depth = dma_desc_num_ - 1;
+    }
+
+    if (depth != stored) {
+        ESP_LOGI(TAG, "DMA depth %d -> %d after %lu underruns, takes effect after reboot", dma_desc_num_, depth, session_underruns);
+        settings.SetInt("dma_desc_num", depth);
+    }
+#endif
+}
+
 void AudioCodec::Start() {
     Settings settings("audio", false);
     output_volume_ = settings.GetInt("output_volume", output_volume_);
@@ -34,6 +125,9 @@ void AudioCodec::Start() {
         output_volume_ = 10;
     }
 
+    RegisterI2sCallbacks();
+    ESP_LOGI(TAG, "DMA depth %d x %d frames, %d ms output latency", dma_desc_num_, AUDIO_CODEC_DMA_FRAME_NUM, dma_latency_ms());
+
     if (tx_handle_ != nullptr) {
         ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
     }
@@ -15,6 +15,19 @@
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
 #define AUDIO_CODEC_DEFAULT_MIC_GAIN 30.0
 
+#define AUDIO_CODEC_DMA_DESC_NUM_MIN 3
+#define AUDIO_CODEC_DMA_DESC_NUM_MAX 12
+#define AUDIO_CODEC_STREAM_GAP_MS 200       // Queue overflows are only glitches if the data flow stopped for less than this
+#define AUDIO_CODEC_DMA_TUNE_UNDERRUNS 3    // Underruns in one playback session that deepen the DMA queue
+#define AUDIO_CODEC_DMA_TUNE_CLEAN_MS (10 * 60 * 1000)  // Playback without underruns before the queue is shortened
+
+struct AudioCodecStatistics {
+    uint32_t tx_underruns = 0;          // The DMA ran dry during playback and played silence
+    uint32_t rx_overruns = 0;           // Microphone data was overwritten before it was read
+    uint32_t max_write_ms = 0;          // Longest time OutputData blocked
+    uint64_t played_ms = 0;
+};
+
 class AudioCodec {
 public:
     AudioCodec();
@@ -37,6 +50,12 @@ public:
     inline int output_volume() const { return output_volume_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    inline int dma_desc_num() const { return dma_desc_num_; }
+    // Audio buffered in the output DMA queue
+    inline int dma_latency_ms() const { return output_sample_rate_ > 0 ? dma_desc_num_ * AUDIO_CODEC_DMA_FRAME_NUM * 1000 / output_sample_rate_ : 0; }
+    inline const AudioCodecStatistics& statistics() const { return statistics_; }
+    // Call when playback stops, adjusts the DMA depth used from the next boot
+    void TuneDmaDepth();
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -51,9 +70,25 @@ protected:
     int input_channels_ = 1;
     int output_channels_ = 1;
     int output_volume_ = 70;
+    // Use this when creating the I2S channels, CONFIG_AUDIO_DMA_AUTO_TUNE loads the tuned value
+    int dma_desc_num_ = AUDIO_CODEC_DMA_DESC_NUM;
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
+
+private:
+    // Incremented by the I2S ISR
+    volatile uint32_t tx_queue_overflows_ = 0;
+    volatile uint32_t rx_queue_overflows_ = 0;
+    uint32_t tx_queue_overflows_seen_ = 0;
+    uint32_t rx_queue_overflows_seen_ = 0;
+    int64_t last_write_time_ = 0;
+    int64_t last_read_time_ = 0;
+    uint32_t session_underruns_ = 0;
+    uint64_t clean_since_ms_ = 0;       // played_ms at the last underrun
+    AudioCodecStatistics statistics_;
+
+    void RegisterI2sCallbacks();
 };
 
 #endif // _AUDIO_CODEC_H
@@ -1,10 +1,16 @@
 #include "audio_service.h"
 #include <esp_log.h>
+#include <cJSON.h>
+#include <cmath>
+#include <algorithm>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
 #else
 #include "processors/no_audio_processor.h"
+#if CONFIG_USE_BEAMFORMER
+#include "processors/beamformer_audio_processor.h"
+#endif
 #endif
 
 #if CONFIG_USE_AFE_WAKE_WORD
@@ -34,9 +40,17 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_->Start();
 
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
+    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(GetPreferredDecodeSampleRate(), 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_->SetComplexity(0);
+    // A codec rate Opus cannot decode to (e.g. 44100) is resampled from the start, SetDecodeSampleRate
+    // keeps this decoder for the first stream and for PlaySound
+    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
+        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+    }
+
+    output_limiter_.Configure(OutputLimiterConfig(), codec->output_sample_rate());
 
     if (codec->input_sample_rate() != 16000) {
         input_resampler_.Configure(codec->input_sample_rate(), 16000);
@@ -59,16 +73,18 @@ void AudioService::Initialize(AudioCodec* codec) {
     wake_word_ = nullptr;
 #endif
 
-    audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
-    });
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_ = std::make_unique<AudioDebugger>();
+#endif
 
-    audio_processor_->OnVadStateChange([this](bool speaking) {
-        voice_detected_ = speaking;
-        if (callbacks_.on_vad_change) {
-            callbacks_.on_vad_change(speaking);
-        }
-    });
+#if CONFIG_USE_AUDIO_FLIGHT_RECORDER
+    flight_recorder_ = std::make_unique<AudioFlightRecorder>(CONFIG_AUDIO_FLIGHT_RECORDER_SECONDS);
+    if (!flight_recorder_->Initialize()) {
+        flight_recorder_.reset();
+    }
+#endif
+
+    ConnectAudioProcessor();
 
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
@@ -152,8 +168,7 @@ void AudioService::Stop() {
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
     if (!codec_->input_enabled()) {
-        codec_->EnableInput(true);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        PowerUpInput(true);
     }
 
     if (codec_->input_sample_rate() != sample_rate) {
@@ -193,13 +208,14 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     last_input_time_ = std::chrono::steady_clock::now();
     debug_statistics_.input_count++;
 
-#if CONFIG_USE_AUDIO_DEBUGGER
-    // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
+    if (audio_debugger_) {
+        // 音频调试：发送原始音频数据
+        audio_debugger_->Feed(kAudioDebugTapMicRaw, data, sample_rate, codec_->input_channels());
+    }
+
+    if (flight_recorder_) {
+        flight_recorder_->Feed(kAudioRecorderTapMic, data, sample_rate, codec_->input_channels());
     }
-    audio_debugger_->Feed(data);
-#endif
 
     return true;
 }
@@ -207,7 +223,7 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 void AudioService::AudioInputTask() {
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
+            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_SELF_TEST_RUNNING,
             pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
@@ -215,7 +231,16 @@ void AudioService::AudioInputTask() {
         }
         if (audio_input_need_warmup_) {
             audio_input_need_warmup_ = false;
-            vTaskDelay(pdMS_TO_TICKS(120));
+            PowerUpInput(true);
+            vTaskDelay(pdMS_TO_TICKS(AUDIO_INPUT_WARMUP_MS));
+            continue;
+        }
+
+        /* The self test owns the microphone and the speaker until it is done */
+        if (bits & AS_EVENT_SELF_TEST_RUNNING) {
+            SelfTestLoopback();
+            xEventGroupClearBits(event_group_, AS_EVENT_SELF_TEST_RUNNING);
+            xEventGroupSetBits(event_group_, AS_EVENT_SELF_TEST_DONE);
             continue;
         }
 
@@ -248,6 +273,7 @@ void AudioService::AudioInputTask() {
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
                 if (ReadAudioData(data, 16000, samples)) {
+                    DetectSpeechOnset(data);
                     wake_word_->Feed(data);
                     continue;
                 }
@@ -287,8 +313,28 @@ void AudioService::AudioOutputTask() {
         lock.unlock();
 
         if (!codec_->output_enabled()) {
-            codec_->EnableOutput(true);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+            PowerUpOutput(true);
+        } else {
+            auto gap = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - last_output_time_).count();
+            if (gap > AUDIO_PLAYBACK_UNDERRUN_MIN_MS && gap < AUDIO_PLAYBACK_UNDERRUN_MAX_MS) {
+                debug_statistics_.playback_underruns++;
+                ESP_LOGW(TAG, "Playback underrun, gap %lld ms", gap);
+                if (flight_recorder_) {
+                    flight_recorder_->Snapshot("playback_underrun");
+                }
+            } else if (gap >= AUDIO_PLAYBACK_UNDERRUN_MAX_MS) {
+                /* A new stream, do not carry the gain of the previous one */
+                output_limiter_.Reset();
+            }
+        }
+        if (task->type != kAudioTaskTypeSelfTestPlayback) {
+            output_limiter_.Process(task->pcm);
+        }
+        if (flight_recorder_) {
+            flight_recorder_->Feed(kAudioRecorderTapPlayback, task->pcm, codec_->output_sample_rate());
+        }
+        if (audio_debugger_) {
+            audio_debugger_->Feed(kAudioDebugTapPlayback, task->pcm, codec_->output_sample_rate());
         }
         codec_->OutputData(task->pcm);
 
@@ -332,7 +378,12 @@ void AudioService::OpusCodecTask() {
             task->timestamp = packet->timestamp;
 
             SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
+            bool decoded = opus_decoder_->Decode(std::move(packet->payload), task->pcm);
+            AudioPacketPool::GetInstance().Release(std::move(packet));
+            if (decoded) {
+                if (audio_debugger_) {
+                    audio_debugger_->Feed(kAudioDebugTapDecoderOutput, task->pcm, opus_decoder_->sample_rate());
+                }
                 // Resample if the sample rate is different
                 if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
                     int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
@@ -346,6 +397,9 @@ void AudioService::OpusCodecTask() {
                 audio_queue_cv_.notify_all();
             } else {
                 ESP_LOGE(TAG, "Failed to decode audio");
+                if (flight_recorder_) {
+                    flight_recorder_->Snapshot("decode_failure");
+                }
                 lock.lock();
             }
             debug_statistics_.decode_count++;
@@ -358,10 +412,13 @@ void AudioService::OpusCodecTask() {
             audio_queue_cv_.notify_all();
             lock.unlock();
 
-            auto packet = std::make_unique<AudioStreamPacket>();
+            auto packet = AudioPacketPool::GetInstance().Acquire();
             packet->frame_duration = OPUS_FRAME_DURATION_MS;
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
+            if (audio_debugger_) {
+                audio_debugger_->Feed(kAudioDebugTapEncoderInput, task->pcm, 16000);
+            }
             if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
                 ESP_LOGE(TAG, "Failed to encode audio");
                 continue;
@@ -388,20 +445,51 @@ void AudioService::OpusCodecTask() {
 }
 
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+    /*
+     * Opus decodes a stream of any sample rate to any of its own rates,
+     * so the decoder outputs the codec rate directly and only the frame duration may change.
+     */
+    int decode_sample_rate = GetPreferredDecodeSampleRate();
+    if (opus_decoder_->sample_rate() == decode_sample_rate && opus_decoder_->duration_ms() == frame_duration) {
         return;
     }
 
     opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(decode_sample_rate, 1, frame_duration);
+    ESP_LOGI(TAG, "Decoder configured: stream %d Hz, output %d Hz, %d ms", sample_rate, decode_sample_rate, frame_duration);
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+    if (decode_sample_rate != codec_->output_sample_rate()) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", decode_sample_rate, codec_->output_sample_rate());
+        output_resampler_.Configure(decode_sample_rate, codec_->output_sample_rate());
     }
 }
 
+/*
+ * On a poor link the encoder switches to DTX, so the silence between words costs a few bytes
+ * per frame instead of a full frame. The Opus wrapper does not expose bitrate or in-band FEC.
+ */
+void AudioService::SetUplinkQuality(LinkQualityLevel level) {
+    if (level == uplink_quality_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Uplink quality %s -> %s", LinkQualityEstimator::LevelName(uplink_quality_),
+        LinkQualityEstimator::LevelName(level));
+    uplink_quality_ = level;
+    opus_encoder_->SetDtx(level == kLinkQualityPoor);
+}
+
+int AudioService::GetPreferredDecodeSampleRate() const {
+    // Rates supported by the Opus decoder, the nearest one above the codec rate avoids losing bandwidth
+    static const int kOpusSampleRates[] = { 8000, 12000, 16000, 24000, 48000 };
+    int output_sample_rate = codec_->output_sample_rate();
+    for (auto sample_rate : kOpusSampleRates) {
+        if (sample_rate >= output_sample_rate) {
+            return sample_rate;
+        }
+    }
+    return 48000;
+}
+
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
     auto task = std::make_unique<AudioTask>();
     task->type = type;
@@ -426,6 +514,9 @@ void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
+    if (xEventGroupGetBits(event_group_) & AS_EVENT_SELF_TEST_RUNNING) {
+        return false;
+    }
     std::unique_lock<std::mutex> lock(audio_queue_mutex_);
     if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
         if (wait) {
@@ -500,7 +591,9 @@ void AudioService::EnableVoiceProcessing(bool enable) {
 
         /* We should make sure no audio is playing */
         ResetDecoder();
-        audio_input_need_warmup_ = true;
+        /* Skip the warm up delay if the input was powered up ahead of time */
+        audio_input_need_warmup_ = !codec_->input_enabled() ||
+            std::chrono::steady_clock::now() - input_power_on_time_ < std::chrono::milliseconds(AUDIO_INPUT_WARMUP_MS);
         audio_processor_->Start();
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
@@ -570,8 +663,108 @@ void AudioService::ResetDecoder() {
     audio_queue_cv_.notify_all();
 }
 
+void AudioService::ConfigureOutputLimiter(const OutputLimiterConfig& config) {
+    output_limiter_.Configure(config, codec_->output_sample_rate());
+    ESP_LOGI(TAG, "Output limiter %s, threshold %.1f dBFS, latency %d samples, loudness normalization %s",
+        config.enabled ? "enabled" : "disabled", config.threshold_db, output_limiter_.latency_samples(),
+        config.normalize_loudness ? "on" : "off");
+}
+
+std::string AudioService::GetDiagnosticsJson() {
+    cJSON* root = cJSON_CreateObject();
+
+    auto& i2s_statistics = codec_->statistics();
+    cJSON* i2s = cJSON_CreateObject();
+    cJSON_AddNumberToObject(i2s, "underruns", i2s_statistics.tx_underruns);
+    cJSON_AddNumberToObject(i2s, "overruns", i2s_statistics.rx_overruns);
+    cJSON_AddNumberToObject(i2s, "max_write_ms", i2s_statistics.max_write_ms);
+    cJSON_AddNumberToObject(i2s, "played_ms", (double)i2s_statistics.played_ms);
+    cJSON_AddNumberToObject(i2s, "dma_desc_num", codec_->dma_desc_num());
+    cJSON_AddNumberToObject(i2s, "dma_frame_num", AUDIO_CODEC_DMA_FRAME_NUM);
+    cJSON_AddNumberToObject(i2s, "dma_latency_ms", codec_->dma_latency_ms());
+    cJSON_AddItemToObject(root, "i2s", i2s);
+
+    cJSON* pipeline = cJSON_CreateObject();
+    cJSON_AddNumberToObject(pipeline, "input_count", debug_statistics_.input_count);
+    cJSON_AddNumberToObject(pipeline, "encode_count", debug_statistics_.encode_count);
+    cJSON_AddNumberToObject(pipeline, "decode_count", debug_statistics_.decode_count);
+    cJSON_AddNumberToObject(pipeline, "playback_count", debug_statistics_.playback_count);
+    cJSON_AddNumberToObject(pipeline, "playback_underruns", debug_statistics_.playback_underruns);
+    cJSON_AddNumberToObject(pipeline, "packets_allocated", AudioPacketPool::GetInstance().allocated());
+    cJSON_AddNumberToObject(pipeline, "packets_reused", AudioPacketPool::GetInstance().reused());
+    cJSON_AddStringToObject(pipeline, "uplink_quality", LinkQualityEstimator::LevelName(uplink_quality_));
+    cJSON_AddItemToObject(root, "pipeline", pipeline);
+
+    cJSON* power = cJSON_CreateObject();
+    cJSON_AddNumberToObject(power, "input_cold_starts", power_statistics_.input_cold_starts);
+    cJSON_AddNumberToObject(power, "output_cold_starts", power_statistics_.output_cold_starts);
+    cJSON_AddNumberToObject(power, "max_cold_start_ms", power_statistics_.max_cold_start_ms);
+    cJSON_AddItemToObject(root, "power", power);
+
+    auto& limiter_statistics = output_limiter_.statistics();
+    cJSON* limiter = cJSON_CreateObject();
+    cJSON_AddNumberToObject(limiter, "limited_samples", (double)limiter_statistics.limited_samples);
+    cJSON_AddNumberToObject(limiter, "max_gain_reduction_db", limiter_statistics.max_gain_reduction_db);
+    cJSON_AddNumberToObject(limiter, "loudness_gain_db", limiter_statistics.loudness_gain_db);
+    cJSON_AddItemToObject(root, "limiter", limiter);
+
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
+
+void AudioService::ConnectAudioProcessor() {
+    audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
+        if (flight_recorder_) {
+            flight_recorder_->Feed(kAudioRecorderTapProcessed, data, 16000);
+        }
+        if (audio_debugger_) {
+            audio_debugger_->Feed(kAudioDebugTapAfeOutput, data, 16000);
+        }
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+    });
+
+    audio_processor_->OnVadStateChange([this](bool speaking) {
+        voice_detected_ = speaking;
+        if (callbacks_.on_vad_change) {
+            callbacks_.on_vad_change(speaking);
+        }
+    });
+}
+
+void AudioService::ConfigureBeamformer(const BeamformerConfig& config) {
+#if CONFIG_USE_BEAMFORMER
+    int mics = codec_->input_channels() - (codec_->input_reference() ? 1 : 0);
+    if (config.mic_count < 2 || mics < config.mic_count) {
+        return;
+    }
+    if (codec_->input_sample_rate() != 16000) {
+        ESP_LOGW(TAG, "Beamforming needs a 16kHz input, the input is %dHz", codec_->input_sample_rate());
+        return;
+    }
+
+    auto processor = std::make_unique<BeamformerAudioProcessor>(config);
+    processor->OnDirectionChange([this](int azimuth, float confidence) {
+        if (callbacks_.on_speaker_direction) {
+            callbacks_.on_speaker_direction(azimuth, confidence);
+        }
+    });
+    audio_processor_ = std::move(processor);
+    audio_processor_initialized_ = false;
+    beamforming_ = true;
+    ConnectAudioProcessor();
+#endif
+}
+
 void AudioService::CheckAndUpdateAudioPowerState() {
+    std::lock_guard<std::mutex> lock(audio_power_mutex_);
     auto now = std::chrono::steady_clock::now();
+    if (now < warm_hold_until_) {
+        return;
+    }
+
     auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
     auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
     if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
@@ -579,8 +772,189 @@ void AudioService::CheckAndUpdateAudioPowerState() {
     }
     if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
         codec_->EnableOutput(false);
+        codec_->TuneDmaDepth();
     }
     if (!codec_->input_enabled() && !codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
+        ESP_LOGI(TAG, "Audio powered down, cold starts: input %lu (%lu ms) output %lu (%lu ms), warm ups: input %lu output %lu",
+            power_statistics_.input_cold_starts, power_statistics_.input_cold_start_ms,
+            power_statistics_.output_cold_starts, power_statistics_.output_cold_start_ms,
+            power_statistics_.input_warm_ups, power_statistics_.output_warm_ups);
+        auto& i2s = codec_->statistics();
+        ESP_LOGI(TAG, "I2S: %lu underruns, %lu overruns, longest write %lu ms, DMA depth %d",
+            i2s.tx_underruns, i2s.rx_overruns, i2s.max_write_ms, codec_->dma_desc_num());
+        auto& limiter = output_limiter_.statistics();
+        ESP_LOGI(TAG, "Output limiter: %.1f%% samples limited, max gain reduction %.1f dB, loudness gain %.1f dB",
+            limiter.processed_samples > 0 ? limiter.limited_samples * 100.0f / limiter.processed_samples : 0.0f,
+            limiter.max_gain_reduction_db, limiter.loudness_gain_db);
+    }
+}
+
+void AudioService::PowerUpInput(bool on_demand) {
+    std::lock_guard<std::mutex> lock(audio_power_mutex_);
+    if (codec_->input_enabled()) {
+        return;
     }
-}
\ No newline at end of file
+
+    auto start_time = esp_timer_get_time();
+    codec_->EnableInput(true);
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    input_power_on_time_ = std::chrono::steady_clock::now();
+    last_input_time_ = input_power_on_time_;
+
+    if (on_demand) {
+        power_statistics_.input_cold_starts++;
+        power_statistics_.input_cold_start_ms += elapsed_ms;
+        power_statistics_.max_cold_start_ms = std::max(power_statistics_.max_cold_start_ms, elapsed_ms);
+        ESP_LOGI(TAG, "Audio input cold start took %lu ms", elapsed_ms);
+    } else {
+        power_statistics_.input_warm_ups++;
+    }
+    esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+}
+
+void AudioService::PowerUpOutput(bool on_demand) {
+    std::lock_guard<std::mutex> lock(audio_power_mutex_);
+    if (codec_->output_enabled()) {
+        return;
+    }
+
+    auto start_time = esp_timer_get_time();
+    codec_->EnableOutput(true);
+    uint32_t elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    last_output_time_ = std::chrono::steady_clock::now();
+
+    if (on_demand) {
+        power_statistics_.output_cold_starts++;
+        power_statistics_.output_cold_start_ms += elapsed_ms;
+        power_statistics_.max_cold_start_ms = std::max(power_statistics_.max_cold_start_ms, elapsed_ms);
+        ESP_LOGI(TAG, "Audio output cold start took %lu ms", elapsed_ms);
+    } else {
+        power_statistics_.output_warm_ups++;
+    }
+    esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+}
+
+void AudioService::WarmUp(AudioWarmUpReason reason) {
+    if (service_stopped_ || codec_ == nullptr) {
+        return;
+    }
+
+    ESP_LOGD(TAG, "Warm up audio, reason: %d", reason);
+    {
+        std::lock_guard<std::mutex> lock(audio_power_mutex_);
+        warm_hold_until_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(AUDIO_POWER_WARM_HOLD_MS);
+    }
+
+    // TTS only needs the speaker, other hints mean the user is about to talk
+    if (reason != kAudioWarmUpReasonTtsStart) {
+        PowerUpInput(false);
+    }
+    PowerUpOutput(false);
+}
+
+void AudioService::DetectSpeechOnset(const std::vector<int16_t>& data) {
+    // Only the first channel is the microphone, the second one may be the reference
+    int step = codec_->input_channels();
+    int64_t sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < data.size(); i += step) {
+        sum += (int32_t)data[i] * data[i];
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    int32_t rms = (int32_t)std::sqrt((double)sum / count);
+
+    // Track the noise floor: follow quickly downwards, slowly upwards
+    if (!noise_floor_initialized_ || rms < noise_floor_rms_) {
+        noise_floor_rms_ = rms;
+        noise_floor_initialized_ = true;
+    } else {
+        noise_floor_rms_ += (rms - noise_floor_rms_) / 64;
+    }
+
+    int32_t threshold = std::max<int32_t>(SPEECH_ONSET_MIN_RMS, noise_floor_rms_ * SPEECH_ONSET_RATIO);
+    if (!speech_onset_ && rms > threshold) {
+        speech_onset_ = true;
+        if (callbacks_.on_speech_onset) {
+            callbacks_.on_speech_onset();
+        }
+    } else if (speech_onset_ && rms < threshold / 2) {
+        speech_onset_ = false;
+    }
+}
+
+bool AudioService::RunSelfTest(LoopbackResult& result) {
+    if (service_stopped_ || (xEventGroupGetBits(event_group_) & AS_EVENT_SELF_TEST_RUNNING)) {
+        return false;
+    }
+
+    xEventGroupClearBits(event_group_, AS_EVENT_SELF_TEST_DONE);
+    xEventGroupSetBits(event_group_, AS_EVENT_SELF_TEST_RUNNING);
+    EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_SELF_TEST_DONE, pdTRUE, pdFALSE,
+        pdMS_TO_TICKS(AUDIO_SELF_TEST_TIMEOUT_MS));
+    if (!(bits & AS_EVENT_SELF_TEST_DONE)) {
+        ESP_LOGE(TAG, "Self test timeout");
+        return false;
+    }
+    result = self_test_result_;
+    return self_test_success_;
+}
+
+void AudioService::SelfTestLoopback() {
+    ESP_LOGI(TAG, "Running loopback self test");
+    ResetDecoder();
+    PowerUpInput(false);
+    PowerUpOutput(false);
+    vTaskDelay(pdMS_TO_TICKS(AUDIO_INPUT_WARMUP_MS));
+
+    const int sample_rate = 16000;
+    int channels = codec_->input_channels();
+    int frame_samples = sample_rate * 30 / 1000;
+    size_t preroll_samples = sample_rate * LOOPBACK_PREROLL_MS / 1000;
+    size_t total_samples = sample_rate * (LOOPBACK_PREROLL_MS + LOOPBACK_CHIRP_MS + LOOPBACK_TAIL_MS) / 1000;
+
+    std::vector<int16_t> recording;
+    recording.reserve(total_samples + frame_samples);
+    std::vector<int16_t> data;
+    size_t playback_offset = 0;
+    self_test_success_ = false;
+    while (recording.size() < total_samples) {
+        if (!ReadAudioData(data, sample_rate, frame_samples * channels)) {
+            ESP_LOGE(TAG, "Self test failed to read audio");
+            return;
+        }
+        // Only keep the microphone channel
+        for (size_t i = 0; i < data.size(); i += channels) {
+            recording.push_back(data[i]);
+        }
+
+        /* Queue the whole sweep once the pre-roll is recorded, the output task plays it while we keep recording */
+        if (playback_offset == 0 && recording.size() >= preroll_samples) {
+            playback_offset = recording.size();
+            auto chirp = LoopbackAnalyzer::GenerateChirp(codec_->output_sample_rate());
+            size_t chunk_samples = codec_->output_sample_rate() * OPUS_FRAME_DURATION_MS / 1000;
+            std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+            for (size_t offset = 0; offset < chirp.size(); offset += chunk_samples) {
+                auto task = std::make_unique<AudioTask>();
+                task->type = kAudioTaskTypeSelfTestPlayback;
+                task->timestamp = 0;
+                task->pcm.assign(chirp.begin() + offset, chirp.begin() + std::min(chirp.size(), offset + chunk_samples));
+                audio_playback_queue_.push_back(std::move(task));
+            }
+            audio_queue_cv_.notify_all();
+        }
+    }
+
+    auto start_time = esp_timer_get_time();
+    auto& result = self_test_result_;
+    self_test_success_ = LoopbackAnalyzer::Analyze(recording, sample_rate, playback_offset, result);
+    ESP_LOGI(TAG, "Self test %s: latency %.1f ms, correlation %.2f, SNR %.1f dB, noise %.1f dBFS, peak %.1f dBFS, clipped %lu, analysis %lld ms",
+        self_test_success_ ? "passed" : "failed", result.latency_ms, result.correlation, result.snr_db,
+        result.noise_dbfs, result.peak_dbfs, result.clipped_samples, (esp_timer_get_time() - start_time) / 1000);
+    for (int i = 0; i < LOOPBACK_BANDS; i++) {
+        ESP_LOGI(TAG, "Self test response %4.0f Hz: %+.1f dB", result.band_hz[i], result.band_gain_db[i]);
+    }
+}
@@ -19,7 +19,11 @@
 #include "audio_codec.h"
 #include "audio_processor.h"
 #include "processors/audio_debugger.h"
+#include "processors/audio_flight_recorder.h"
 #include "wake_word.h"
+#include "loopback_analyzer.h"
+#include "output_limiter.h"
+#include "beamformer.h"
 #include "protocol.h"
 
 
@@ -40,22 +44,47 @@
 #define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
+#define AUDIO_SELF_TEST_TIMEOUT_MS 5000
 #define MAX_TIMESTAMPS_IN_QUEUE 3
 
-#define AUDIO_POWER_TIMEOUT_MS 15000
+#define AUDIO_POWER_TIMEOUT_MS 5000
+#define AUDIO_POWER_WARM_HOLD_MS AUDIO_POWER_TIMEOUT_MS    // No longer than an on-demand power up, false hints cost no more
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
+#define AUDIO_INPUT_WARMUP_MS 120
+
+#define SPEECH_ONSET_MIN_RMS 300
+#define SPEECH_ONSET_RATIO 4
+
+// A gap in this range between two playback frames means the speaker ran dry in the middle of a stream
+#define AUDIO_PLAYBACK_UNDERRUN_MIN_MS 100
+#define AUDIO_PLAYBACK_UNDERRUN_MAX_MS 500
 
 
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_SELF_TEST_RUNNING          (1 << 4)
+#define AS_EVENT_SELF_TEST_DONE             (1 << 5)
+
+/*
+ * Hints that the user is about to interact with the device.
+ * The codec is powered up ahead of time so the first syllable is not clipped.
+ */
+enum AudioWarmUpReason {
+    kAudioWarmUpReasonSpeechOnset,
+    kAudioWarmUpReasonButton,
+    kAudioWarmUpReasonMotion,
+    kAudioWarmUpReasonTtsStart,
+};
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
     std::function<void(bool)> on_vad_change;
     std::function<void(void)> on_audio_testing_queue_full;
+    std::function<void(void)> on_speech_onset;
+    std::function<void(int azimuth, float confidence)> on_speaker_direction;
 };
 
 
@@ -63,6 +92,7 @@ enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
     kAudioTaskTypeDecodeToPlaybackQueue,
+    kAudioTaskTypeSelfTestPlayback,         // Played as is, the output limiter would reshape the test signal
 };
 
 struct AudioTask {
@@ -76,6 +106,17 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    uint32_t playback_underruns = 0;
+};
+
+struct AudioPowerStatistics {
+    uint32_t input_cold_starts = 0;     // Input powered up on demand by ReadAudioData
+    uint32_t output_cold_starts = 0;    // Output powered up on demand by AudioOutputTask
+    uint32_t input_warm_ups = 0;        // Input powered up ahead of time by WarmUp
+    uint32_t output_warm_ups = 0;       // Output powered up ahead of time by WarmUp
+    uint32_t input_cold_start_ms = 0;   // Accumulated time spent in on-demand input power up
+    uint32_t output_cold_start_ms = 0;  // Accumulated time spent in on-demand output power up
+    uint32_t max_cold_start_ms = 0;
 };
 
 class AudioService {
@@ -106,19 +147,39 @@ public:
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    void WarmUp(AudioWarmUpReason reason);
+    int GetPreferredDecodeSampleRate() const;
+    // Adapts the uplink encoding to the link measured by the protocol
+    void SetUplinkQuality(LinkQualityLevel level);
+    // Play a sweep and record it, blocks until the analysis is done
+    bool RunSelfTest(LoopbackResult& result);
+    // Call before Start()
+    void ConfigureOutputLimiter(const OutputLimiterConfig& config);
+    // Call before Start(), replaces the pass-through processor on multi-mic boards without the AFE
+    void ConfigureBeamformer(const BeamformerConfig& config);
+    bool IsBeamforming() const { return beamforming_; }
+    // I2S, pipeline, power and limiter counters
+    std::string GetDiagnosticsJson();
+    const OutputLimiterStatistics& output_limiter_statistics() const { return output_limiter_.statistics(); }
+    const AudioPowerStatistics& power_statistics() const { return power_statistics_; }
+    AudioFlightRecorder* flight_recorder() { return flight_recorder_.get(); }
 
 private:
     AudioCodec* codec_ = nullptr;
+    LinkQualityLevel uplink_quality_ = kLinkQualityUnknown;
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
+    std::unique_ptr<AudioFlightRecorder> flight_recorder_;
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
     std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
     OpusResampler input_resampler_;
     OpusResampler reference_resampler_;
     OpusResampler output_resampler_;
+    OutputLimiter output_limiter_;
     DebugStatistics debug_statistics_;
+    AudioPowerStatistics power_statistics_;
 
     EventGroupHandle_t event_group_;
 
@@ -141,10 +202,19 @@ private:
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
+    bool self_test_success_ = false;
+    bool beamforming_ = false;
+    LoopbackResult self_test_result_;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
+    std::mutex audio_power_mutex_;
     std::chrono::steady_clock::time_point last_input_time_;
     std::chrono::steady_clock::time_point last_output_time_;
+    std::chrono::steady_clock::time_point input_power_on_time_;
+    std::chrono::steady_clock::time_point warm_hold_until_;
+    int32_t noise_floor_rms_ = 0;
+    bool noise_floor_initialized_ = false;  // A silent input has a noise floor of 0
+    bool speech_onset_ = false;
 
     void AudioInputTask();
     void AudioOutputTask();
@@ -152,6 +222,11 @@ private:
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckAndUpdateAudioPowerState();
+    void PowerUpInput(bool on_demand);
+    void PowerUpOutput(bool on_demand);
+    void DetectSpeechOnset(const std::vector<int16_t>& data);
+    void SelfTestLoopback();
+    void ConnectAudioProcessor();
 };
 
 #endif
\ No newline at end of file
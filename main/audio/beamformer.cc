@@ -0,0 +1,206 @@
+#include "beamformer.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define COLLINEAR_TOLERANCE_MM2 25.0f
+#define NOISE_RISE_SHIFT 6                  // The noise floor rises by 1/64 of the difference per frame
+
+BeamformerConfig BeamformerConfig::Linear(int mic_count, float spacing_mm) {
+    BeamformerConfig config;
+    config.mic_count = std::min(mic_count, BEAMFORMER_MAX_MICS);
+    for (int i = 0; i < config.mic_count; i++) {
+        config.mic_x_mm[i] = spacing_mm * i;
+    }
+    return config;
+}
+
+BeamformerConfig BeamformerConfig::Circular(int mic_count, float radius_mm) {
+    BeamformerConfig config;
+    config.mic_count = std::min(mic_count, BEAMFORMER_MAX_MICS);
+    for (int i = 0; i < config.mic_count; i++) {
+        config.mic_x_mm[i] = radius_mm * std::cos(2 * M_PI * i / config.mic_count);
+        config.mic_y_mm[i] = radius_mm * std::sin(2 * M_PI * i / config.mic_count);
+    }
+    return config;
+}
+
+bool Beamformer::Configure(const BeamformerConfig& config, int sample_rate) {
+    config_ = config;
+    sample_rate_ = sample_rate;
+    directions_.assign(1, 0);
+    delays_.clear();
+    steering_ = 0;
+    if (config.mic_count < 2 || config.mic_count > BEAMFORMER_MAX_MICS) {
+        config_.mic_count = 0;
+        return false;
+    }
+
+    int mics = config.mic_count;
+    float dx = config.mic_x_mm[1] - config.mic_x_mm[0];
+    float dy = config.mic_y_mm[1] - config.mic_y_mm[0];
+    if (dx == 0 && dy == 0) {
+        config_.mic_count = 0;
+        return false;
+    }
+
+    /* A line array cannot tell front from back, so only half a circle is searched */
+    bool collinear = true;
+    for (int i = 2; i < mics; i++) {
+        float cross = dx * (config.mic_y_mm[i] - config.mic_y_mm[0]) - dy * (config.mic_x_mm[i] - config.mic_x_mm[0]);
+        if (std::fabs(cross) > COLLINEAR_TOLERANCE_MM2) {
+            collinear = false;
+        }
+    }
+    int first = collinear ? (int)std::lround(std::atan2(dy, dx) * 180 / M_PI) : 0;
+    int span = collinear ? 180 : 360 - BEAMFORMER_DOA_STEP_DEG;
+    directions_.clear();
+    for (int angle = 0; angle <= span; angle += BEAMFORMER_DOA_STEP_DEG) {
+        directions_.push_back(((first + angle) % 360 + 360) % 360);
+    }
+
+    /* Delay each mic so that a plane wave from the direction lines up with the mic it reaches last */
+    int32_t max_delay = 0;
+    delays_.resize(directions_.size() * mics);
+    for (size_t k = 0; k < directions_.size(); k++) {
+        float ux = std::cos(directions_[k] * M_PI / 180);
+        float uy = std::sin(directions_[k] * M_PI / 180);
+        float projection[BEAMFORMER_MAX_MICS];
+        float min_projection = 0;
+        for (int m = 0; m < mics; m++) {
+            projection[m] = (config.mic_x_mm[m] * ux + config.mic_y_mm[m] * uy) / 1000.0f;
+            min_projection = m == 0 ? projection[m] : std::min(min_projection, projection[m]);
+        }
+        for (int m = 0; m < mics; m++) {
+            float delay = (projection[m] - min_projection) / BEAMFORMER_SPEED_OF_SOUND * sample_rate;
+            delays_[k * mics + m] = (int32_t)std::lround(delay * 256);
+            max_delay = std::max(max_delay, delays_[k * mics + m]);
+        }
+    }
+    history_ = (max_delay >> 8) + 2;
+    // Start facing the middle of the search range, broadside for a line array
+    steering_ = directions_.size() / 2;
+    Reset();
+    return true;
+}
+
+void Beamformer::Reset() {
+    work_.assign(config_.mic_count, std::vector<int16_t>(history_, 0));
+    difference_.assign(config_.mic_count, std::vector<int16_t>());
+    candidate_ = steering_;
+    candidate_frames_ = 0;
+    noise_energy_ = 0;
+    confidence_ = 0;
+}
+
+// Sum of the mics steered to a direction, with linear interpolation of fractional delays
+void Beamformer::Steer(const std::vector<std::vector<int16_t>>& signals, size_t direction, size_t samples, int32_t* output) {
+    std::fill(output, output + samples, 0);
+    for (int m = 0; m < config_.mic_count; m++) {
+        int32_t delay = delays_[direction * config_.mic_count + m];
+        int32_t fraction = delay & 0xFF;
+        const int16_t* current = signals[m].data() + history_ - (delay >> 8);
+        const int16_t* previous = current - 1;
+        for (size_t n = 0; n < samples; n++) {
+            output[n] += (current[n] * (256 - fraction) + previous[n] * fraction) >> 8;
+        }
+    }
+}
+
+/* Steered response power: the direction whose beam collects the most high-passed energy */
+size_t Beamformer::SearchDirection(size_t samples, int64_t& best_energy, int64_t& worst_energy) {
+    size_t best = steering_;
+    best_energy = 0;
+    worst_energy = INT64_MAX;
+    for (size_t k = 0; k < directions_.size(); k++) {
+        Steer(difference_, k, samples, sum_.data());
+        int64_t energy = 0;
+        for (size_t n = 0; n < samples; n++) {
+            energy += (int64_t)sum_[n] * sum_[n];
+        }
+        if (energy > best_energy) {
+            best_energy = energy;
+            best = k;
+        }
+        worst_energy = std::min(worst_energy, energy);
+    }
+    return best;
+}
+
+void Beamformer::Process(const int16_t* input, size_t samples_per_channel, int channels, std::vector<int16_t>& output) {
+    size_t samples = samples_per_channel;
+    output.resize(samples);
+    if (!enabled() || channels < config_.mic_count) {
+        for (size_t n = 0; n < samples; n++) {
+            output[n] = input[n * channels];
+        }
+        return;
+    }
+
+    int mics = config_.mic_count;
+    for (int m = 0; m < mics; m++) {
+        auto& work = work_[m];
+        work.resize(history_ + samples);
+        for (size_t n = 0; n < samples; n++) {
+            work[history_ + n] = input[n * channels + m];
+        }
+        auto& difference = difference_[m];
+        difference.resize(work.size());
+        difference[0] = 0;
+        for (size_t n = 1; n < work.size(); n++) {
+            difference[n] = (int16_t)((work[n] - work[n - 1]) >> 1);
+        }
+    }
+    sum_.resize(samples);
+    statistics_.frames++;
+
+    /* Track the noise floor on the first mic, and only search the direction in frames well above it */
+    int64_t energy = 0;
+    for (size_t n = history_; n < history_ + samples; n++) {
+        energy += (int32_t)difference_[0][n] * difference_[0][n];
+    }
+    energy /= (int64_t)samples;
+    if (noise_energy_ == 0 || energy < noise_energy_) {
+        noise_energy_ = std::max(energy, (int64_t)1);
+    } else {
+        noise_energy_ += (energy - noise_energy_) >> NOISE_RISE_SHIFT;
+    }
+
+    size_t previous_steering = steering_;
+    if (energy > noise_energy_ * BEAMFORMER_DOA_MIN_SNR) {
+        statistics_.voiced_frames++;
+        int64_t best_energy, worst_energy;
+        size_t best = SearchDirection(samples, best_energy, worst_energy);
+        confidence_ = best_energy > 0 ? 1.0f - (float)worst_energy / best_energy : 0;
+        if (best == steering_) {
+            candidate_frames_ = 0;
+        } else if (best == candidate_ && ++candidate_frames_ >= BEAMFORMER_DOA_HOLD_FRAMES) {
+            steering_ = best;
+            candidate_frames_ = 0;
+            statistics_.direction_changes++;
+        } else if (best != candidate_) {
+            candidate_ = best;
+            candidate_frames_ = 1;
+        }
+    }
+
+    /* Cross-fade over the frame when the beam moves, a hard switch clicks */
+    Steer(work_, steering_, samples, sum_.data());
+    if (steering_ != previous_steering) {
+        previous_sum_.resize(samples);
+        Steer(work_, previous_steering, samples, previous_sum_.data());
+        for (size_t n = 0; n < samples; n++) {
+            int64_t weight = (int64_t)n * 65536 / samples;
+            sum_[n] = (int32_t)((sum_[n] * weight + previous_sum_[n] * (65536 - weight)) >> 16);
+        }
+    }
+    for (size_t n = 0; n < samples; n++) {
+        output[n] = (int16_t)std::clamp(sum_[n] / mics, (int32_t)-32768, (int32_t)32767);
+    }
+
+    for (int m = 0; m < mics; m++) {
+        auto& work = work_[m];
+        std::copy(work.end() - history_, work.end(), work.begin());
+        work.resize(history_);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef BEAMFORMER_H
+#define BEAMFORMER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Fixed point delay-and-sum beamformer with steered response power direction of arrival,
+ * for boards with several microphones that do not run the AFE.
+ * One instance per capture stream, Configure, Reset and Process must not run concurrently.
+ * direction() and confidence() are plain reads of the last result, for status reports.
+ */
+
+#define BEAMFORMER_MAX_MICS 4
+#define BEAMFORMER_SPEED_OF_SOUND 343.0f    // m/s
+#define BEAMFORMER_DOA_STEP_DEG 10
+#define BEAMFORMER_DOA_MIN_SNR 2            // Frame energy over the noise floor (3 dB) before the direction is updated
+#define BEAMFORMER_DOA_HOLD_FRAMES 2        // A new direction must win this many voiced frames before the beam moves
+
+struct BeamformerConfig {
+    int mic_count = 0;                      // Less than 2 disables the beamformer
+    // Microphone positions in mm, in the order of the input channels
+    float mic_x_mm[BEAMFORMER_MAX_MICS] = {};
+    float mic_y_mm[BEAMFORMER_MAX_MICS] = {};
+
+    // Microphones on the x axis, mic 0 at the origin
+    static BeamformerConfig Linear(int mic_count, float spacing_mm);
+    // Microphones on a circle, mic 0 on the x axis, counterclockwise
+    static BeamformerConfig Circular(int mic_count, float radius_mm);
+};
+
+struct BeamformerStatistics {
+    uint32_t frames = 0;
+    uint32_t voiced_frames = 0;
+    uint32_t direction_changes = 0;
+};
+
+class Beamformer {
+public:
+    // Returns false if the geometry is not usable
+    bool Configure(const BeamformerConfig& config, int sample_rate);
+    void Reset();
+    // input: interleaved, the first mic_count channels are the microphones; output: mono
+    void Process(const int16_t* input, size_t samples_per_channel, int channels, std::vector<int16_t>& output);
+
+    bool enabled() const { return config_.mic_count >= 2; }
+    // Azimuth in degrees counterclockwise from the x axis; linear arrays cover 0 - 180 only
+    int direction() const { return directions_[steering_]; }
+    // 0 - 1, how much the best direction stands out from the others in the last voiced frame
+    float confidence() const { return confidence_; }
+    const BeamformerStatistics& statistics() const { return statistics_; }
+
+private:
+    BeamformerConfig config_;
+    int sample_rate_ = 16000;
+    size_t history_ = 0;                    // Samples kept from the previous frame, covers the largest delay
+    std::vector<int> directions_;
+    std::vector<int32_t> delays_;           // Q8 samples, [direction * mic_count + mic]
+    std::vector<std::vector<int16_t>> work_;        // Per mic: history followed by the current frame
+    std::vector<std::vector<int16_t>> difference_;  // Per mic: first difference, used for the direction search
+    std::vector<int32_t> sum_;
+    std::vector<int32_t> previous_sum_;
+    size_t steering_ = 0;
+    size_t candidate_ = 0;
+    int candidate_frames_ = 0;
+    int64_t noise_energy_ = 0;
+    float confidence_ = 0;
+    BeamformerStatistics statistics_;
+
+    void Steer(const std::vector<std::vector<int16_t>>& signals, size_t direction, size_t samples, int32_t* output);
+    size_t SearchDirection(size_t samples, int64_t& best_energy, int64_t& worst_energy);
+};
+
+#endif // BEAMFORMER_H
@@ -0,0 +1,151 @@
+#include "loopback_analyzer.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define DECIMATION 4
+#define FADE_MS 10
+#define REFINE_RANGE (DECIMATION * 2)
+
+static double Energy(const int16_t* data, size_t size) {
+    double energy = 0;
+    for (size_t i = 0; i < size; i++) {
+        energy += (double)data[i] * data[i];
+    }
+    return energy;
+}
+
+static double Rms(const int16_t* data, size_t size) {
+    return size > 0 ? std::sqrt(Energy(data, size) / size) : 0;
+}
+
+static float ToDb(double ratio) {
+    return 20.0f * std::log10(std::max(ratio, 1e-9));
+}
+
+// Integer accumulation, double is emulated in software on the ESP32 family
+static double Correlate(const int16_t* a, const int16_t* b, size_t size) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return (double)sum;
+}
+
+// Sample index where the sweep passes the given frequency
+static size_t ChirpIndex(float frequency, size_t chirp_samples) {
+    double position = std::log(frequency / LOOPBACK_CHIRP_START_HZ) /
+        std::log((double)LOOPBACK_CHIRP_END_HZ / LOOPBACK_CHIRP_START_HZ);
+    return std::min(chirp_samples, (size_t)(std::max(position, 0.0) * chirp_samples));
+}
+
+std::vector<int16_t> LoopbackAnalyzer::GenerateChirp(int sample_rate) {
+    size_t samples = (size_t)sample_rate * LOOPBACK_CHIRP_MS / 1000;
+    size_t fade = (size_t)sample_rate * FADE_MS / 1000;
+    double duration = LOOPBACK_CHIRP_MS / 1000.0;
+    double k = std::log((double)LOOPBACK_CHIRP_END_HZ / LOOPBACK_CHIRP_START_HZ);
+
+    std::vector<int16_t> chirp(samples);
+    for (size_t i = 0; i < samples; i++) {
+        double t = (double)i / sample_rate;
+        double phase = 2 * M_PI * LOOPBACK_CHIRP_START_HZ * duration / k * (std::exp(t / duration * k) - 1);
+        double gain = 1.0;
+        if (i < fade) {
+            gain = 0.5 - 0.5 * std::cos(M_PI * i / fade);
+        } else if (i >= samples - fade) {
+            gain = 0.5 - 0.5 * std::cos(M_PI * (samples - 1 - i) / fade);
+        }
+        chirp[i] = (int16_t)(LOOPBACK_CHIRP_AMPLITUDE * gain * std::sin(phase));
+    }
+    return chirp;
+}
+
+bool LoopbackAnalyzer::Analyze(const std::vector<int16_t>& recording, int sample_rate, size_t playback_offset, LoopbackResult& result) {
+    result = LoopbackResult();
+    auto reference = GenerateChirp(sample_rate);
+    if (recording.size() < playback_offset + reference.size()) {
+        return false;
+    }
+
+    /* Level and clipping over the whole recording */
+    int peak = 0;
+    for (auto sample : recording) {
+        int magnitude = std::abs((int)sample);
+        peak = std::max(peak, magnitude);
+        if (magnitude >= LOOPBACK_CLIP_LEVEL) {
+            result.clipped_samples++;
+        }
+    }
+    result.peak_dbfs = ToDb(peak / 32768.0);
+
+    /* Coarse search on decimated signals, then refine at full rate around the best lag */
+    auto decimate = [](const std::vector<int16_t>& input) {
+        std::vector<int16_t> output(input.size() / DECIMATION);
+        for (size_t i = 0; i < output.size(); i++) {
+            int sum = 0;
+            for (int j = 0; j < DECIMATION; j++) {
+                sum += input[i * DECIMATION + j];
+            }
+            output[i] = (int16_t)(sum / DECIMATION);
+        }
+        return output;
+    };
+    auto recording_d = decimate(recording);
+    auto reference_d = decimate(reference);
+
+    size_t max_lag_d = recording_d.size() - reference_d.size();
+    size_t best_lag = 0;
+    double best = 0;
+    for (size_t lag = playback_offset / DECIMATION; lag <= max_lag_d; lag++) {
+        double c = std::fabs(Correlate(reference_d.data(), recording_d.data() + lag, reference_d.size()));
+        if (c > best) {
+            best = c;
+            best_lag = lag * DECIMATION;
+        }
+    }
+
+    size_t max_lag = recording.size() - reference.size();
+    size_t begin = best_lag > REFINE_RANGE ? best_lag - REFINE_RANGE : 0;
+    size_t end = std::min(max_lag, best_lag + REFINE_RANGE);
+    best = 0;
+    for (size_t lag = begin; lag <= end; lag++) {
+        double c = std::fabs(Correlate(reference.data(), recording.data() + lag, reference.size()));
+        if (c > best) {
+            best = c;
+            best_lag = lag;
+        }
+    }
+
+    const int16_t* captured = recording.data() + best_lag;
+    double reference_energy = Energy(reference.data(), reference.size());
+    double captured_energy = Energy(captured, reference.size());
+    result.correlation = (float)(best / std::sqrt(reference_energy * captured_energy + 1e-9));
+    result.latency_ms = ((float)best_lag - (float)playback_offset) * 1000.0f / sample_rate;
+    result.detected = result.correlation >= LOOPBACK_MIN_CORRELATION && best_lag >= playback_offset;
+
+    /* Noise floor from the pre-roll, skipping the first samples where the codec may still settle */
+    size_t noise_begin = playback_offset / 4;
+    double noise_rms = std::max(Rms(recording.data() + noise_begin, playback_offset - noise_begin), 1.0);
+    double signal_rms = Rms(captured, reference.size());
+    double clean_rms = std::sqrt(std::max(signal_rms * signal_rms - noise_rms * noise_rms, 1.0));
+    result.noise_dbfs = ToDb(noise_rms / 32768.0);
+    result.snr_db = ToDb(clean_rms / noise_rms);
+
+    /* Octave band response, using the time window where the sweep is inside each band */
+    float reference_gain = 0;
+    for (int band = 0; band < LOOPBACK_BANDS; band++) {
+        float low = LOOPBACK_CHIRP_START_HZ * (float)(1 << band);
+        float high = low * 2;
+        size_t a = ChirpIndex(low, reference.size());
+        size_t b = ChirpIndex(high, reference.size());
+        result.band_hz[band] = low * std::sqrt(2.0f);
+        result.band_gain_db[band] = ToDb(Rms(captured + a, b - a) / std::max(Rms(reference.data() + a, b - a), 1.0));
+        if (band == LOOPBACK_REFERENCE_BAND) {
+            reference_gain = result.band_gain_db[band];
+        }
+    }
+    for (int band = 0; band < LOOPBACK_BANDS; band++) {
+        result.band_gain_db[band] -= reference_gain;
+    }
+    return result.detected;
+}
@@ -0,0 +1,44 @@
+#ifndef LOOPBACK_ANALYZER_H
+#define LOOPBACK_ANALYZER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Speaker to microphone loopback measurement with an exponential sine sweep.
+ * GenerateChirp and Analyze keep no state and depend on their arguments only, so a recording
+ * saved from the device gives the same result when it is analyzed again on a PC.
+ */
+
+#define LOOPBACK_CHIRP_MS 1000
+#define LOOPBACK_CHIRP_START_HZ 200
+#define LOOPBACK_CHIRP_END_HZ 6400
+#define LOOPBACK_CHIRP_AMPLITUDE 12000
+#define LOOPBACK_PREROLL_MS 300     // Silence recorded before the sweep to measure the noise floor
+#define LOOPBACK_TAIL_MS 600        // Recording after the sweep, bounds the measurable latency
+#define LOOPBACK_BANDS 5            // Octave bands from LOOPBACK_CHIRP_START_HZ
+#define LOOPBACK_REFERENCE_BAND 2   // 800 - 1600 Hz, the response is relative to this band
+#define LOOPBACK_MIN_CORRELATION 0.2f
+#define LOOPBACK_CLIP_LEVEL 32000
+
+struct LoopbackResult {
+    bool detected = false;          // The sweep was found in the recording
+    float latency_ms = 0;           // From queueing the sweep for playback to capturing it
+    float correlation = 0;          // Normalized correlation peak, 0 - 1
+    float snr_db = 0;
+    float noise_dbfs = 0;
+    float peak_dbfs = 0;
+    uint32_t clipped_samples = 0;
+    float band_hz[LOOPBACK_BANDS] = {};         // Band center frequencies
+    float band_gain_db[LOOPBACK_BANDS] = {};    // Relative to LOOPBACK_REFERENCE_BAND
+};
+
+class LoopbackAnalyzer {
+public:
+    static std::vector<int16_t> GenerateChirp(int sample_rate);
+    // recording: mono, the sweep was queued for playback at sample playback_offset
+    static bool Analyze(const std::vector<int16_t>& recording, int sample_rate, size_t playback_offset, LoopbackResult& result);
+};
+
+#endif // LOOPBACK_ANALYZER_H
@@ -0,0 +1,141 @@
+#include "output_limiter.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define UNITY_GAIN_Q15 32768
+#define UNITY_GAIN_Q12 4096
+#define LOUDNESS_WINDOW_MS 100
+#define LOUDNESS_GATE_RMS 100           // About -50 dBFS, silence between sentences is ignored
+#define LOUDNESS_SMOOTHING 0.1f         // Per window, about one second time constant
+#define LOUDNESS_SLEW_DB 0.5f           // Per window
+
+
+OutputLimiter::OutputLimiter() {
+}
+
+void OutputLimiter::Configure(const OutputLimiterConfig& config, int sample_rate) {
+    config_ = config;
+    sample_rate_ = sample_rate;
+
+    // The delay line holds two blocks: the block being played and the one ahead of it
+    block_samples_ = std::max<size_t>(1, (size_t)sample_rate * config.lookahead_ms / 1000 / 2);
+    delay_.assign(block_samples_ * 2, 0);
+
+    float threshold = 32768.0f * std::pow(10.0f, config.threshold_db / 20.0f);
+    threshold_ = std::clamp((int32_t)threshold, (int32_t)1, (int32_t)32767);
+
+    float block_ms = block_samples_ * 1000.0f / sample_rate;
+    float release = 1.0f - std::exp(-block_ms / std::max(config.release_ms, 1));
+    release_q15_ = std::max((int32_t)(release * UNITY_GAIN_Q15), (int32_t)1);
+
+    loudness_window_ = (size_t)sample_rate * LOUDNESS_WINDOW_MS / 1000;
+    loudness_gain_ = UNITY_GAIN_Q12;
+    loudness_rms_ = 0;
+    min_gain_ = UNITY_GAIN_Q15;
+    statistics_ = OutputLimiterStatistics();
+    Reset();
+}
+
+void OutputLimiter::Reset() {
+    std::fill(delay_.begin(), delay_.end(), 0);
+    delay_position_ = 0;
+    block_count_ = 0;
+    block_peak_ = 0;
+    previous_block_gain_ = UNITY_GAIN_Q15;
+    gain_ = UNITY_GAIN_Q15;
+    gain_step_ = 0;
+    block_target_ = UNITY_GAIN_Q15;
+    loudness_count_ = 0;
+    loudness_energy_ = 0;
+}
+
+void OutputLimiter::Process(std::vector<int16_t>& pcm) {
+    if (!config_.enabled || delay_.empty()) {
+        return;
+    }
+
+    for (auto& sample : pcm) {
+        int32_t input = sample;
+        if (config_.normalize_loudness) {
+            loudness_energy_ += input * input;
+            input = (input * loudness_gain_) >> 12;
+            if (++loudness_count_ == loudness_window_) {
+                UpdateLoudness();
+            }
+        }
+
+        int32_t delayed = delay_[delay_position_];
+        delay_[delay_position_] = input;
+        if (++delay_position_ == delay_.size()) {
+            delay_position_ = 0;
+        }
+        int32_t magnitude = input < 0 ? -input : input;
+        if (magnitude > block_peak_) {
+            block_peak_ = magnitude;
+        }
+
+        int32_t output = (int32_t)(((int64_t)delayed * gain_) >> 15);
+        if (gain_ < UNITY_GAIN_Q15) {
+            statistics_.limited_samples++;
+        }
+        gain_ += gain_step_;
+        sample = (int16_t)std::clamp(output, (int32_t)-32768, (int32_t)32767);
+
+        if (++block_count_ == block_samples_) {
+            EndOfBlock();
+        }
+    }
+    statistics_.processed_samples += pcm.size();
+}
+
+/*
+ * Called when a new input block is complete. The next block to be played is the one before it,
+ * so the gain ramp for the played block targets the smaller gain of both blocks.
+ * The ramp starts at or below the played block's gain and ends at or below it, hence no overshoot.
+ */
+void OutputLimiter::EndOfBlock() {
+    block_count_ = 0;
+    gain_ = block_target_;
+
+    int32_t block_gain = UNITY_GAIN_Q15;
+    if (block_peak_ > threshold_) {
+        block_gain = (int32_t)(((int64_t)threshold_ << 15) / block_peak_);
+    }
+    block_peak_ = 0;
+
+    int32_t target = std::min(previous_block_gain_, block_gain);
+    previous_block_gain_ = block_gain;
+    if (target > gain_) {
+        int32_t step = (int32_t)(((int64_t)(target - gain_) * release_q15_) >> 15);
+        target = gain_ + std::max(step, (int32_t)1);
+    }
+
+    int32_t diff = target - gain_;
+    int32_t samples = (int32_t)block_samples_;
+    // Round the attack step down so that the ramp never ends above the target
+    gain_step_ = diff >= 0 ? diff / samples : -((-diff + samples - 1) / samples);
+    block_target_ = target;
+
+    if (target < min_gain_) {
+        min_gain_ = target;
+        statistics_.max_gain_reduction_db = -20.0f * std::log10((float)target / UNITY_GAIN_Q15);
+    }
+}
+
+void OutputLimiter::UpdateLoudness() {
+    float rms = std::sqrt((float)loudness_energy_ / loudness_count_);
+    loudness_energy_ = 0;
+    loudness_count_ = 0;
+    if (rms < LOUDNESS_GATE_RMS) {
+        return;
+    }
+
+    loudness_rms_ = loudness_rms_ == 0 ? rms : loudness_rms_ + (rms - loudness_rms_) * LOUDNESS_SMOOTHING;
+    float target = 32768.0f * std::pow(10.0f, config_.loudness_target_db / 20.0f);
+    float desired_db = std::clamp(20.0f * std::log10(target / loudness_rms_), config_.min_gain_db, config_.max_gain_db);
+    float gain_db = statistics_.loudness_gain_db;
+    gain_db += std::clamp(desired_db - gain_db, -LOUDNESS_SLEW_DB, LOUDNESS_SLEW_DB);
+    statistics_.loudness_gain_db = gain_db;
+    loudness_gain_ = (int32_t)(UNITY_GAIN_Q12 * std::pow(10.0f, gain_db / 20.0f));
+}
@@ -0,0 +1,75 @@
+#ifndef OUTPUT_LIMITER_H
+#define OUTPUT_LIMITER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Look-ahead peak limiter with an optional slow loudness normalizer for the playback path.
+ * The sample loop is fixed point (Q15 gain), floating point is only used once per control block.
+ * The state carries over between Process calls, so the frames of one stream may have any length;
+ * Reset before an unrelated stream, or the first samples come out with the gain of the last one.
+ */
+
+struct OutputLimiterConfig {
+    bool enabled = true;
+    float threshold_db = -1.0f;         // Output peak ceiling in dBFS
+    int lookahead_ms = 2;               // Added latency
+    int release_ms = 150;
+    bool normalize_loudness = false;
+    float loudness_target_db = -20.0f;  // RMS target in dBFS
+    float max_gain_db = 9.0f;           // Normalizer gain range
+    float min_gain_db = -9.0f;
+};
+
+struct OutputLimiterStatistics {
+    uint64_t processed_samples = 0;
+    uint64_t limited_samples = 0;       // Samples played with gain reduction
+    float max_gain_reduction_db = 0;
+    float loudness_gain_db = 0;         // Current normalizer gain
+};
+
+class OutputLimiter {
+public:
+    OutputLimiter();
+
+    void Configure(const OutputLimiterConfig& config, int sample_rate);
+    // In place, the output is delayed by latency_samples()
+    void Process(std::vector<int16_t>& pcm);
+    void Reset();
+
+    int sample_rate() const { return sample_rate_; }
+    int latency_samples() const { return (int)delay_.size(); }
+    const OutputLimiterStatistics& statistics() const { return statistics_; }
+
+private:
+    OutputLimiterConfig config_;
+    OutputLimiterStatistics statistics_;
+    int sample_rate_ = 0;
+    size_t block_samples_ = 0;          // Half of the look-ahead
+    int32_t threshold_ = 32767;
+    int32_t release_q15_ = 0;           // Fraction of the gap to the target gain recovered per block
+
+    std::vector<int32_t> delay_;
+    size_t delay_position_ = 0;
+    size_t block_count_ = 0;
+    int32_t block_peak_ = 0;
+    int32_t previous_block_gain_ = 32768;
+    int32_t gain_ = 32768;              // Q15
+    int32_t gain_step_ = 0;
+    int32_t block_target_ = 32768;
+    int32_t min_gain_ = 32768;
+
+    // Loudness normalizer, updated every loudness_window_ samples
+    int32_t loudness_gain_ = 4096;      // Q12
+    size_t loudness_window_ = 0;
+    size_t loudness_count_ = 0;
+    int64_t loudness_energy_ = 0;
+    float loudness_rms_ = 0;
+
+    void EndOfBlock();
+    void UpdateLoudness();
+};
+
+#endif // OUTPUT_LIMITER_H
@@ -3,11 +3,13 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #endif
 
 #define TAG "AudioDebugger"
@@ -20,16 +22,16 @@ AudioDebugger::AudioDebugger() {
         // 解析配置的服务器地址 "IP:PORT"
         std::string server_addr = CONFIG_AUDIO_DEBUG_UDP_SERVER;
         size_t colon_pos = server_addr.find(':');
-        
+
         if (colon_pos != std::string::npos) {
             std::string ip = server_addr.substr(0, colon_pos);
             int port = std::stoi(server_addr.substr(colon_pos + 1));
-            
+
             memset(&udp_server_addr_, 0, sizeof(udp_server_addr_));
             udp_server_addr_.sin_family = AF_INET;
             udp_server_addr_.sin_port = htons(port);
             inet_pton(AF_INET, ip.c_str(), &udp_server_addr_.sin_addr);
-            
+
             ESP_LOGI(TAG, "Initialized server address: %s", CONFIG_AUDIO_DEBUG_UDP_SERVER);
         } else {
             ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_AUDIO_DEBUG_UDP_SERVER);
@@ -39,6 +41,8 @@ AudioDebugger::AudioDebugger() {
     } else {
         ESP_LOGW(TAG, "Failed to create UDP socket: %d", errno);
     }
+    tokens_ = CONFIG_AUDIO_DEBUG_RATE_LIMIT_KBPS * 1024;
+    last_refill_time_ = esp_timer_get_time();
 #endif
 }
 
@@ -46,23 +50,79 @@ AudioDebugger::~AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
     if (udp_sockfd_ >= 0) {
         close(udp_sockfd_);
-        ESP_LOGI(TAG, "Closed UDP socket");
+        ESP_LOGI(TAG, "Closed UDP socket, sent %lu packets, dropped %lu packets", sent_packets_, dropped_packets_);
     }
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+bool AudioDebugger::ConsumeTokens(size_t bytes) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
-                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    // Token bucket with one second of burst
+    const int64_t rate = CONFIG_AUDIO_DEBUG_RATE_LIMIT_KBPS * 1024;
+    int64_t now = esp_timer_get_time();
+    tokens_ = std::min(rate, tokens_ + (now - last_refill_time_) * rate / 1000000);
+    last_refill_time_ = now;
+    if (tokens_ < (int64_t)bytes) {
+        return false;
+    }
+    tokens_ -= bytes;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AudioDebugger::Feed(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels) {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    if (udp_sockfd_ < 0 || data.empty()) {
+        return;
+    }
+
+    int64_t timestamp_us = esp_timer_get_time();
+    size_t total_samples = data.size() / channels;
+    size_t max_samples = AUDIO_DEBUG_MAX_PAYLOAD / (channels * sizeof(int16_t));
+    for (size_t offset = 0; offset < total_samples; offset += max_samples) {
+        size_t samples = std::min(max_samples, total_samples - offset);
+        size_t payload_size = samples * channels * sizeof(int16_t);
+
+        AudioDebugHeader header = {
+            .magic = {'A', 'D'},
+            .version = AUDIO_DEBUG_VERSION,
+            .tap = (uint8_t)tap,
+            .sequence = 0,
+            .timestamp_us = (uint64_t)(timestamp_us + (int64_t)offset * 1000000 / sample_rate),
+            .sample_rate = (uint32_t)sample_rate,
+            .samples = (uint16_t)samples,
+            .channels = (uint8_t)channels,
+            .reserved = 0,
+        };
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            header.sequence = sequences_[tap]++;
+            if (!ConsumeTokens(sizeof(header) + payload_size)) {
+                if (dropped_packets_++ % 100 == 0) {
+                    ESP_LOGW(TAG, "Rate limit exceeded, dropped %lu packets", dropped_packets_);
+                }
+                continue;
+            }
+        }
+
+        // Scatter-gather avoids copying the PCM into a packet buffer on the audio task stack
+        struct iovec iov[2] = {
+            { .iov_base = &header, .iov_len = sizeof(header) },
+            { .iov_base = (void*)(data.data() + offset * channels), .iov_len = payload_size },
+        };
+        struct msghdr msg = {};
+        msg.msg_name = &udp_server_addr_;
+        msg.msg_namelen = sizeof(udp_server_addr_);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        ssize_t sent = sendmsg(udp_sockfd_, &msg, MSG_DONTWAIT);
         if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
+            ESP_LOGD(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
         } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+            sent_packets_++;
         }
     }
 #endif
 }
-
- 
\ No newline at end of file
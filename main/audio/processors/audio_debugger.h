@@ -2,21 +2,61 @@
 #define AUDIO_DEBUGGER_H
 
 #include <vector>
+#include <mutex>
 #include <cstdint>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+/*
+ * Every UDP packet starts with an AudioDebugHeader followed by interleaved 16-bit PCM.
+ * Sequence numbers are counted per tap, including the packets dropped by the rate limiter,
+ * so the receiver (scripts/audio_debug_server.py) can tell losses from silence.
+ */
+
+#define AUDIO_DEBUG_VERSION 1
+#define AUDIO_DEBUG_MAX_PAYLOAD 1400
+
+enum AudioDebugTap {
+    kAudioDebugTapMicRaw,
+    kAudioDebugTapAfeOutput,
+    kAudioDebugTapEncoderInput,
+    kAudioDebugTapDecoderOutput,
+    kAudioDebugTapPlayback,
+    kAudioDebugTapCount,
+};
+
+struct __attribute__((packed)) AudioDebugHeader {
+    char magic[2];              // "AD"
+    uint8_t version;
+    uint8_t tap;
+    uint32_t sequence;
+    uint64_t timestamp_us;      // Time the first sample passed the tap
+    uint32_t sample_rate;
+    uint16_t samples;           // Samples per channel in this packet
+    uint8_t channels;
+    uint8_t reserved;
+};
+
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    void Feed(AudioDebugTap tap, const std::vector<int16_t>& data, int sample_rate, int channels = 1);
 
 private:
     int udp_sockfd_ = -1;
     struct sockaddr_in udp_server_addr_;
+
+    std::mutex mutex_;
+    uint32_t sequences_[kAudioDebugTapCount] = {};
+    int64_t tokens_ = 0;
+    int64_t last_refill_time_ = 0;
+    uint32_t sent_packets_ = 0;
+    uint32_t dropped_packets_ = 0;
+
+    bool ConsumeTokens(size_t bytes);
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -0,0 +1,402 @@
+#include "audio_flight_recorder.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <cJSON.h>
+#include <cstring>
+#include <algorithm>
+
+#include "board.h"
+#include "system_info.h"
+
+#define TAG "AudioFlightRecorder"
+
+#define UPLOAD_CHUNK_SIZE 4096
+
+static const int16_t kAdpcmStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t kAdpcmIndexTable[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const char* const kTapNames[kAudioRecorderTapCount] = {
+    "mic", "processed", "playback"
+};
+
+/* IMA ADPCM, 4 bits per sample */
+static inline uint8_t AdpcmEncodeSample(int16_t sample, int16_t& predictor, uint8_t& step_index) {
+    int step = kAdpcmStepTable[step_index];
+    int diff = sample - predictor;
+    uint8_t code = 0;
+    if (diff < 0) {
+        code = 8;
+        diff = -diff;
+    }
+
+    int delta = step >> 3;
+    if (diff >= step) {
+        code |= 4;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 2;
+        diff -= step;
+        delta += step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 1;
+        delta += step;
+    }
+
+    int value = predictor + ((code & 8) ? -delta : delta);
+    predictor = (int16_t)std::clamp(value, -32768, 32767);
+    step_index = (uint8_t)std::clamp(step_index + kAdpcmIndexTable[code], 0, 88);
+    return code;
+}
+
+AudioFlightRecorder::AudioFlightRecorder(int seconds) : seconds_(seconds) {
+}
+
+AudioFlightRecorder::~AudioFlightRecorder() {
+    if (snapshot_task_ != nullptr) {
+        vTaskDelete(snapshot_task_);
+    }
+    for (auto& ring : rings_) {
+        if (ring.buffer != nullptr) {
+            heap_caps_free(ring.buffer);
+        }
+    }
+    if (snapshot_ != nullptr) {
+        heap_caps_free(snapshot_);
+    }
+}
+
+bool AudioFlightRecorder::Initialize() {
+    size_t capacity = seconds_ * FLIGHT_RECORDER_BYTES_PER_SECOND;
+    for (auto& ring : rings_) {
+        ring.buffer = (uint8_t*)heap_caps_malloc(capacity, MALLOC_CAP_SPIRAM);
+        if (ring.buffer == nullptr) {
+            ESP_LOGW(TAG, "Failed to allocate %u bytes in PSRAM, flight recorder disabled", capacity);
+            for (auto& r : rings_) {
+                heap_caps_free(r.buffer);
+                r.buffer = nullptr;
+            }
+            return false;
+        }
+        ring.capacity = capacity;
+    }
+    // 60ms at 24kHz, avoids allocating in Feed for the common frame sizes
+    encode_buffer_.reserve(1024);
+
+    xTaskCreate([](void* arg) {
+        AudioFlightRecorder* recorder = (AudioFlightRecorder*)arg;
+        recorder->SnapshotTask();
+    }, "flight_snapshot", 3072, this, 1, &snapshot_task_);
+    ESP_LOGI(TAG, "Recording the last %d seconds of audio, %u bytes per tap", seconds_, capacity);
+    return true;
+}
+
+void AudioFlightRecorder::RingWrite(Ring& ring, const uint8_t* data, size_t size) {
+    size_t first = std::min(size, ring.capacity - ring.head);
+    memcpy(ring.buffer + ring.head, data, first);
+    if (size > first) {
+        memcpy(ring.buffer, data + first, size - first);
+    }
+    ring.head = (ring.head + size) % ring.capacity;
+    ring.used += size;
+}
+
+void AudioFlightRecorder::RingRead(const Ring& ring, size_t offset, uint8_t* data, size_t size) const {
+    size_t position = (ring.tail + offset) % ring.capacity;
+    size_t first = std::min(size, ring.capacity - position);
+    memcpy(data, ring.buffer + position, first);
+    if (size > first) {
+        memcpy(data + first, ring.buffer, size - first);
+    }
+}
+
+void AudioFlightRecorder::RingDropOldest(Ring& ring) {
+    FlightRecordHeader header;
+    RingRead(ring, 0, (uint8_t*)&header, sizeof(header));
+    size_t record_size = sizeof(header) + (header.samples + 1) / 2;
+    ring.tail = (ring.tail + record_size) % ring.capacity;
+    ring.used -= record_size;
+    ring.records--;
+}
+
+void AudioFlightRecorder::Feed(AudioRecorderTap tap, const std::vector<int16_t>& data, int sample_rate, int channels) {
+    size_t samples = std::min<size_t>(data.size() / channels, UINT16_MAX);
+    if (samples == 0) {
+        return;
+    }
+
+    // Never block the audio tasks, a snapshot in progress only costs a few records
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        statistics_.dropped_records++;
+        return;
+    }
+
+    auto& ring = rings_[tap];
+    if (ring.buffer == nullptr) {
+        return;
+    }
+
+    auto start_time = esp_timer_get_time();
+    FlightRecordHeader header = {
+        .tap = (uint8_t)tap,
+        .step_index = ring.step_index,
+        .predictor = ring.predictor,
+        .sample_rate = (uint16_t)sample_rate,
+        .samples = (uint16_t)samples,
+        .timestamp_ms = (uint32_t)(start_time / 1000),
+    };
+    size_t adpcm_size = (samples + 1) / 2;
+    size_t record_size = sizeof(header) + adpcm_size;
+    if (record_size > ring.capacity) {
+        statistics_.dropped_records++;
+        return;
+    }
+
+    encode_buffer_.resize(adpcm_size);
+    uint8_t* output = encode_buffer_.data();
+    for (size_t i = 0; i < samples; i++) {
+        uint8_t code = AdpcmEncodeSample(data[i * channels], ring.predictor, ring.step_index);
+        if (i & 1) {
+            output[i / 2] |= code << 4;
+        } else {
+            output[i / 2] = code;
+        }
+    }
+
+    while (ring.capacity - ring.used < record_size) {
+        RingDropOldest(ring);
+    }
+    RingWrite(ring, (const uint8_t*)&header, sizeof(header));
+    RingWrite(ring, output, adpcm_size);
+    ring.records++;
+
+    statistics_.recorded_samples += samples;
+    statistics_.feed_time_us += esp_timer_get_time() - start_time;
+}
+
+bool AudioFlightRecorder::Snapshot(const std::string& reason, bool force) {
+    if (snapshot_task_ == nullptr) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(request_mutex_);
+        int64_t now = esp_timer_get_time();
+        if (!force && (snapshot_pending_ || (last_snapshot_time_ != 0 &&
+            now - last_snapshot_time_ < FLIGHT_RECORDER_SNAPSHOT_INTERVAL_MS * 1000LL))) {
+            statistics_.suppressed_snapshots++;
+            ESP_LOGD(TAG, "Snapshot suppressed: %s", reason.c_str());
+            return false;
+        }
+        snapshot_pending_ = true;
+        pending_reason_ = reason;
+        pending_time_ = now;
+        last_snapshot_time_ = now;
+    }
+    xTaskNotifyGive(snapshot_task_);
+    return true;
+}
+
+void AudioFlightRecorder::SnapshotTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        std::string reason;
+        int64_t time;
+        {
+            std::lock_guard<std::mutex> lock(request_mutex_);
+            if (!snapshot_pending_) {
+                continue;
+            }
+            reason = std::move(pending_reason_);
+            time = pending_time_;
+            snapshot_pending_ = false;
+        }
+        TakeSnapshot(reason, time);
+    }
+}
+
+/*
+ * Feed only tries the lock, so the rings are copied one at a time and the allocation is made
+ * without the lock: the taps skip records only for the copy of one ring at a time.
+ */
+void AudioFlightRecorder::TakeSnapshot(const std::string& reason, int64_t time) {
+    int64_t start_time = esp_timer_get_time();
+    size_t ring_sizes[kAudioRecorderTapCount];
+    size_t size = sizeof(FlightSnapshotHeader) + reason.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int i = 0; i < kAudioRecorderTapCount; i++) {
+            ring_sizes[i] = rings_[i].used;
+            size += ring_sizes[i];
+        }
+    }
+
+    // Keep the previous snapshot if there is no memory for a new one
+    uint8_t* snapshot = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (snapshot == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for snapshot", size);
+        return;
+    }
+
+    uint8_t* p = snapshot + sizeof(FlightSnapshotHeader);
+    memcpy(p, reason.data(), reason.size());
+    p += reason.size();
+    uint32_t records = 0;
+    for (int i = 0; i < kAudioRecorderTapCount; i++) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        p += CopyRing(rings_[i], p, ring_sizes[i], records);
+    }
+
+    FlightSnapshotHeader header = {
+        .magic = {'X', 'Z', 'F', 'R'},
+        .version = FLIGHT_RECORDER_VERSION,
+        .tap_count = kAudioRecorderTapCount,
+        .reason_length = (uint16_t)reason.size(),
+        .timestamp_ms = (uint32_t)(time / 1000),
+        .records = records,
+    };
+    memcpy(snapshot, &header, sizeof(header));
+    size = p - snapshot;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (snapshot_ != nullptr) {
+        heap_caps_free(snapshot_);
+    }
+    snapshot_ = snapshot;
+    snapshot_size_ = size;
+    snapshot_reason_ = reason;
+    statistics_.snapshots++;
+    ESP_LOGW(TAG, "Snapshot saved (%s), %u bytes, %lu records, %lu ms after the anomaly, copy took %lu us",
+        reason.c_str(), size, records, (uint32_t)((start_time - time) / 1000), (uint32_t)(esp_timer_get_time() - start_time));
+}
+
+// Copies the newest whole records of the ring that fit in size bytes, the ring may have grown since it was measured
+size_t AudioFlightRecorder::CopyRing(const Ring& ring, uint8_t* data, size_t size, uint32_t& records) const {
+    size_t offset = 0;
+    uint32_t count = ring.records;
+    while (ring.used - offset > size) {
+        FlightRecordHeader header;
+        RingRead(ring, offset, (uint8_t*)&header, sizeof(header));
+        offset += sizeof(header) + (header.samples + 1) / 2;
+        count--;
+    }
+    RingRead(ring, offset, data, ring.used - offset);
+    records += count;
+    return ring.used - offset;
+}
+
+bool AudioFlightRecorder::Upload(const std::string& url, const std::string& token) {
+    // Take the snapshot out so that the audio tasks are not blocked during the upload
+    uint8_t* snapshot;
+    size_t snapshot_size;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        snapshot = snapshot_;
+        snapshot_size = snapshot_size_;
+        snapshot_ = nullptr;
+        snapshot_size_ = 0;
+    }
+    if (snapshot == nullptr) {
+        ESP_LOGW(TAG, "No snapshot to upload");
+        return false;
+    }
+
+    auto& board = Board::GetInstance();
+    auto http = board.GetNetwork()->CreateHttp(3);
+    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    http->SetHeader("Client-Id", board.GetUuid().c_str());
+    if (!token.empty()) {
+        http->SetHeader("Authorization", "Bearer " + token);
+    }
+    http->SetHeader("Content-Type", "application/octet-stream");
+    http->SetHeader("Transfer-Encoding", "chunked");
+
+    bool success = false;
+    if (http->Open("POST", url)) {
+        for (size_t offset = 0; offset < snapshot_size; offset += UPLOAD_CHUNK_SIZE) {
+            size_t size = std::min<size_t>(UPLOAD_CHUNK_SIZE, snapshot_size - offset);
+            http->Write((const char*)snapshot + offset, size);
+        }
+        http->Write("", 0);
+        success = http->GetStatusCode() == 200;
+        if (!success) {
+            ESP_LOGE(TAG, "Failed to upload snapshot, status code: %d", http->GetStatusCode());
+        }
+        http->Close();
+    } else {
+        ESP_LOGE(TAG, "Failed to connect to %s", url.c_str());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (success) {
+        statistics_.uploads++;
+        heap_caps_free(snapshot);
+    } else if (snapshot_ == nullptr) {
+        // Put it back so that it can be retried
+        snapshot_ = snapshot;
+        snapshot_size_ = snapshot_size;
+    } else {
+        heap_caps_free(snapshot);
+    }
+    return success;
+}
+
+std::string AudioFlightRecorder::GetStatusJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "seconds", seconds_);
+
+    cJSON* taps = cJSON_CreateObject();
+    for (int i = 0; i < kAudioRecorderTapCount; i++) {
+        cJSON* tap = cJSON_CreateObject();
+        cJSON_AddNumberToObject(tap, "records", rings_[i].records);
+        cJSON_AddNumberToObject(tap, "bytes", rings_[i].used);
+        cJSON_AddItemToObject(taps, kTapNames[i], tap);
+    }
+    cJSON_AddItemToObject(root, "taps", taps);
+
+    // Overhead in microseconds of CPU time per second of recorded audio (assuming 16kHz)
+    uint32_t overhead = 0;
+    if (statistics_.recorded_samples > 0) {
+        overhead = statistics_.feed_time_us * 16000 / statistics_.recorded_samples;
+    }
+    cJSON_AddNumberToObject(root, "overhead_us_per_second", overhead);
+    cJSON_AddNumberToObject(root, "dropped_records", statistics_.dropped_records.load());
+    cJSON_AddNumberToObject(root, "snapshots", statistics_.snapshots);
+    cJSON_AddNumberToObject(root, "suppressed_snapshots", statistics_.suppressed_snapshots);
+    cJSON_AddNumberToObject(root, "uploads", statistics_.uploads);
+    {
+        std::lock_guard<std::mutex> request_lock(request_mutex_);
+        cJSON_AddBoolToObject(root, "snapshot_pending", snapshot_pending_);
+    }
+    if (snapshot_ != nullptr) {
+        cJSON* snapshot = cJSON_CreateObject();
+        cJSON_AddStringToObject(snapshot, "reason", snapshot_reason_.c_str());
+        cJSON_AddNumberToObject(snapshot, "bytes", snapshot_size_);
+        cJSON_AddItemToObject(root, "snapshot", snapshot);
+    }
+
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
+}
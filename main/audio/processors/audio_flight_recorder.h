@@ -0,0 +1,114 @@
+#ifndef AUDIO_FLIGHT_RECORDER_H
+#define AUDIO_FLIGHT_RECORDER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Keeps the last few seconds of audio of each tap in a PSRAM ring, compressed with IMA ADPCM (4:1).
+ * When an anomaly happens, the rings are frozen into a snapshot that can be uploaded later.
+ *
+ * Snapshot layout (little endian):
+ *   FlightSnapshotHeader, reason (reason_length bytes), then FlightRecordHeader + ADPCM data records.
+ * scripts/flight_recorder_server.py receives uploaded snapshots and converts them to WAV files.
+ */
+
+#define FLIGHT_RECORDER_MAGIC "XZFR"
+#define FLIGHT_RECORDER_VERSION 1
+#define FLIGHT_RECORDER_BYTES_PER_SECOND 12000  // Enough for 24kHz mono ADPCM
+#define FLIGHT_RECORDER_SNAPSHOT_INTERVAL_MS 30000
+
+enum AudioRecorderTap {
+    kAudioRecorderTapMic,
+    kAudioRecorderTapProcessed,
+    kAudioRecorderTapPlayback,
+    kAudioRecorderTapCount,
+};
+
+struct __attribute__((packed)) FlightSnapshotHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t tap_count;
+    uint16_t reason_length;
+    uint32_t timestamp_ms;      // Time of the anomaly since boot
+    uint32_t records;
+};
+
+struct __attribute__((packed)) FlightRecordHeader {
+    uint8_t tap;
+    uint8_t step_index;         // ADPCM state at the first sample of this record
+    int16_t predictor;
+    uint16_t sample_rate;
+    uint16_t samples;
+    uint32_t timestamp_ms;
+};
+
+struct AudioFlightRecorderStatistics {
+    uint64_t feed_time_us = 0;          // Accumulated time spent in Feed, used to measure the overhead
+    uint64_t recorded_samples = 0;
+    std::atomic<uint32_t> dropped_records = 0;  // Records that could not be stored (too large or lock busy),
+                                                // counted by the audio tasks without the lock
+    uint32_t snapshots = 0;
+    uint32_t suppressed_snapshots = 0;  // Anomalies ignored because of FLIGHT_RECORDER_SNAPSHOT_INTERVAL_MS
+    uint32_t uploads = 0;
+};
+
+class AudioFlightRecorder {
+public:
+    AudioFlightRecorder(int seconds);
+    ~AudioFlightRecorder();
+
+    bool Initialize();
+    // Record the first channel of interleaved PCM data, never blocks the caller
+    void Feed(AudioRecorderTap tap, const std::vector<int16_t>& data, int sample_rate, int channels = 1);
+    // Freeze the rings into a snapshot, automatic anomalies are rate limited unless force is set.
+    // Only queues the request, the copy is made by a low priority task so the audio tasks are not held up
+    bool Snapshot(const std::string& reason, bool force = false);
+    bool Upload(const std::string& url, const std::string& token = "");
+    std::string GetStatusJson();
+    const AudioFlightRecorderStatistics& statistics() const { return statistics_; }
+
+private:
+    struct Ring {
+        uint8_t* buffer = nullptr;
+        size_t capacity = 0;
+        size_t head = 0;        // Write position
+        size_t tail = 0;        // Oldest record
+        size_t used = 0;
+        uint32_t records = 0;
+        int16_t predictor = 0;
+        uint8_t step_index = 0;
+    };
+
+    int seconds_;
+    std::mutex mutex_;
+    Ring rings_[kAudioRecorderTapCount];
+    std::vector<uint8_t> encode_buffer_;
+
+    uint8_t* snapshot_ = nullptr;
+    size_t snapshot_size_ = 0;
+    std::string snapshot_reason_;
+    AudioFlightRecorderStatistics statistics_;
+
+    // Snapshot requests, guarded by their own lock so that queuing never waits for a copy in progress
+    std::mutex request_mutex_;
+    bool snapshot_pending_ = false;
+    std::string pending_reason_;
+    int64_t pending_time_ = 0;
+    int64_t last_snapshot_time_ = 0;
+    TaskHandle_t snapshot_task_ = nullptr;
+
+    void SnapshotTask();
+    void TakeSnapshot(const std::string& reason, int64_t time);
+    void RingWrite(Ring& ring, const uint8_t* data, size_t size);
+    void RingRead(const Ring& ring, size_t offset, uint8_t* data, size_t size) const;
+    void RingDropOldest(Ring& ring);
+    size_t CopyRing(const Ring& ring, uint8_t* data, size_t size, uint32_t& records) const;
+};
+
+#endif // AUDIO_FLIGHT_RECORDER_H
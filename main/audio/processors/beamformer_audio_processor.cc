@@ -0,0 +1,87 @@
+#include "beamformer_audio_processor.h"
+#include <esp_log.h>
+
+#define TAG "BeamformerAudioProcessor"
+
+BeamformerAudioProcessor::BeamformerAudioProcessor(const BeamformerConfig& config) : config_(config) {
+}
+
+void BeamformerAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms) {
+    codec_ = codec;
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+
+    int mics = codec_->input_channels() - (codec_->input_reference() ? 1 : 0);
+    if (mics < config_.mic_count) {
+        ESP_LOGW(TAG, "Codec provides %d mics, %d configured, using the first channel only", mics, config_.mic_count);
+        config_.mic_count = 0;
+    }
+    if (beamformer_.Configure(config_, 16000)) {
+        ESP_LOGI(TAG, "Beamforming with %d mics", config_.mic_count);
+    }
+}
+
+void BeamformerAudioProcessor::Feed(std::vector<int16_t>&& data) {
+    if (!is_running_ || !output_callback_) {
+        return;
+    }
+
+    int channels = codec_->input_channels();
+    if (data.size() != frame_samples_ * channels) {
+        ESP_LOGE(TAG, "Feed data size is not equal to frame size, feed size: %u, frame size: %u", data.size(), frame_samples_ * channels);
+        return;
+    }
+
+    if (reset_pending_) {
+        reset_pending_ = false;
+        beamformer_.Reset();
+    }
+    std::vector<int16_t> output;
+    beamformer_.Process(data.data(), frame_samples_, channels, output);
+    if (beamformer_.enabled() && beamformer_.direction() != direction_) {
+        direction_ = beamformer_.direction();
+        ESP_LOGI(TAG, "Speaker direction %d, confidence %.2f", direction_, beamformer_.confidence());
+        if (direction_change_callback_) {
+            direction_change_callback_(direction_, beamformer_.confidence());
+        }
+    }
+    output_callback_(std::move(output));
+}
+
+void BeamformerAudioProcessor::Start() {
+    // The room may have changed since the last session, relearn the noise floor in the input task
+    reset_pending_ = true;
+    is_running_ = true;
+}
+
+void BeamformerAudioProcessor::Stop() {
+    is_running_ = false;
+}
+
+bool BeamformerAudioProcessor::IsRunning() {
+    return is_running_;
+}
+
+void BeamformerAudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+    output_callback_ = callback;
+}
+
+void BeamformerAudioProcessor::OnVadStateChange(std::function<void(bool speaking)> callback) {
+    vad_state_change_callback_ = callback;
+}
+
+void BeamformerAudioProcessor::OnDirectionChange(std::function<void(int azimuth, float confidence)> callback) {
+    direction_change_callback_ = callback;
+}
+
+size_t BeamformerAudioProcessor::GetFeedSize() {
+    if (!codec_) {
+        return 0;
+    }
+    return frame_samples_ * codec_->input_channels();
+}
+
+void BeamformerAudioProcessor::EnableDeviceAec(bool enable) {
+    if (enable) {
+        ESP_LOGE(TAG, "Device AEC is not supported");
+    }
+}
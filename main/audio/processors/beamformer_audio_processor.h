@@ -0,0 +1,43 @@
+#ifndef BEAMFORMER_AUDIO_PROCESSOR_H
+#define BEAMFORMER_AUDIO_PROCESSOR_H
+
+#include <vector>
+#include <functional>
+
+#include "audio_processor.h"
+#include "audio_codec.h"
+#include "beamformer.h"
+
+// Delay-and-sum beamforming for multi-mic boards that do not run the AFE
+class BeamformerAudioProcessor : public AudioProcessor {
+public:
+    BeamformerAudioProcessor(const BeamformerConfig& config);
+    ~BeamformerAudioProcessor() = default;
+
+    void Initialize(AudioCodec* codec, int frame_duration_ms) override;
+    void Feed(std::vector<int16_t>&& data) override;
+    void Start() override;
+    void Stop() override;
+    bool IsRunning() override;
+    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) override;
+    void OnVadStateChange(std::function<void(bool speaking)> callback) override;
+    size_t GetFeedSize() override;
+    void EnableDeviceAec(bool enable) override;
+
+    // Called from the audio input task when the beam turns toward a new direction
+    void OnDirectionChange(std::function<void(int azimuth, float confidence)> callback);
+
+private:
+    AudioCodec* codec_ = nullptr;
+    BeamformerConfig config_;
+    Beamformer beamformer_;
+    int frame_samples_ = 0;
+    int direction_ = -1;
+    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    std::function<void(bool speaking)> vad_state_change_callback_;
+    std::function<void(int azimuth, float confidence)> direction_change_callback_;
+    bool is_running_ = false;
+    bool reset_pending_ = false;
+};
+
+#endif
@@ -34,7 +34,7 @@ public:
         i2s_chan_config_t chan_cfg = {
             .id = I2S_NUM_0,
             .role = I2S_ROLE_MASTER,
-            .dma_desc_num = AUDIO_CODEC_DMA_DESC_NUM,
+            .dma_desc_num = dma_desc_num_,
             .dma_frame_num = AUDIO_CODEC_DMA_FRAME_NUM,
             .auto_clear_after_cb = true,
             .auto_clear_before_cb = false,
@@ -106,6 +106,9 @@ private:
     }
 
     void InitializeButtons() {
+        boot_button_.OnPressDown([this]() {
+            Application::GetInstance().PrepareForInteraction(kAudioWarmUpReasonButton);
+        });
         boot_button_.OnClick([this]() {
             auto& app = Application::GetInstance();
             if (app.GetDeviceState() == kDeviceStateStarting && !WifiStation::GetInstance().IsConnected()) {
@@ -184,6 +187,18 @@ public:
         return &audio_codec;
     }
 
+    virtual OutputLimiterConfig GetOutputLimiterConfig() override {
+        OutputLimiterConfig config;
+        config.threshold_db = AUDIO_OUTPUT_LIMITER_THRESHOLD_DB;
+        config.normalize_loudness = AUDIO_OUTPUT_LOUDNESS_NORMALIZE;
+        config.loudness_target_db = AUDIO_OUTPUT_LOUDNESS_TARGET_DB;
+        return config;
+    }
+
+    virtual int GetBootReadyTargetMs() override {
+        return BOOT_READY_TARGET_MS;
+    }
+
     virtual Display* GetDisplay() override {
         return display_;
     }
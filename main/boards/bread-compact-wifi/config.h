@@ -6,6 +6,14 @@
 #define AUDIO_INPUT_SAMPLE_RATE  16000
 #define AUDIO_OUTPUT_SAMPLE_RATE 24000
 
+// 播放限幅器，小喇叭在满幅时容易破音
+#define AUDIO_OUTPUT_LIMITER_THRESHOLD_DB  -3.0f
+#define AUDIO_OUTPUT_LOUDNESS_NORMALIZE    true
+#define AUDIO_OUTPUT_LOUDNESS_TARGET_DB    -20.0f
+
+// 开机到可对话的目标时间，见 CONFIG_BOOT_READY_TARGET_MS
+#define BOOT_READY_TARGET_MS  4000
+
 // 如果使用 Duplex I2S 模式，请注释下面一行
 #define AUDIO_I2S_METHOD_SIMPLEX
 
@@ -11,6 +11,8 @@
 #include "led/led.h"
 #include "backlight.h"
 #include "camera.h"
+#include "output_limiter.h"
+#include "beamformer.h"
 
 void* create_board();
 class AudioCodec;
@@ -42,6 +44,12 @@ public:
     virtual bool GetTemperature(float& esp32temp);
     virtual Display* GetDisplay();
     virtual Camera* GetCamera();
+    // 播放限幅器参数，板子可在 config.h 中定义后覆盖
+    virtual OutputLimiterConfig GetOutputLimiterConfig() { return OutputLimiterConfig(); }
+    // 麦克风阵列几何，未启用 AFE 的多麦克风板子覆盖后启用波束成形
+    virtual BeamformerConfig GetBeamformerConfig() { return BeamformerConfig(); }
+    // 开机到可对话的目标时间（毫秒），板子可在 config.h 中定义 BOOT_READY_TARGET_MS 后覆盖
+    virtual int GetBootReadyTargetMs() { return CONFIG_BOOT_READY_TARGET_MS; }
     virtual NetworkInterface* GetNetwork() = 0;
     virtual void StartNetwork() = 0;
     virtual const char* GetNetworkStateIcon() = 0;
@@ -135,60 +135,60 @@ std::string Ml307Board::GetDeviceStatusJson() {
      * }
      */
     auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
+    std::string json;
+    JsonWriter writer(json);
+    writer.BeginObject();
 
     // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
+    writer.Key("audio_speaker").BeginObject();
     auto audio_codec = board.GetAudioCodec();
     if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
+        writer.Field("volume", audio_codec->output_volume());
     }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
+    writer.EndObject();
 
     // Screen brightness
     auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
+    writer.Key("screen").BeginObject();
     if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
+        writer.Field("brightness", backlight->brightness());
     }
     auto display = board.GetDisplay();
     if (display && display->height() > 64) { // For LCD display only
-        cJSON_AddStringToObject(screen, "theme", display->GetTheme().c_str());
+        writer.Field("theme", display->GetTheme());
     }
-    cJSON_AddItemToObject(root, "screen", screen);
+    writer.EndObject();
 
     // Battery
     int battery_level = 0;
     bool charging = false;
     bool discharging = false;
     if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        cJSON* battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
+        writer.Key("battery").BeginObject();
+        writer.Field("level", battery_level);
+        writer.Field("charging", charging);
+        writer.EndObject();
     }
 
     // Network
-    auto network = cJSON_CreateObject();
-    cJSON_AddStringToObject(network, "type", "cellular");
-    cJSON_AddStringToObject(network, "carrier", modem_->GetCarrierName().c_str());
+    writer.Key("network").BeginObject();
+    writer.Field("type", "cellular");
+    writer.Field("carrier", modem_->GetCarrierName());
     int csq = modem_->GetCsq();
     if (csq == -1) {
-        cJSON_AddStringToObject(network, "signal", "unknown");
+        writer.Field("signal", "unknown");
     } else if (csq >= 0 && csq <= 14) {
-        cJSON_AddStringToObject(network, "signal", "very weak");
+        writer.Field("signal", "very weak");
     } else if (csq >= 15 && csq <= 19) {
-        cJSON_AddStringToObject(network, "signal", "weak");
+        writer.Field("signal", "weak");
     } else if (csq >= 20 && csq <= 24) {
-        cJSON_AddStringToObject(network, "signal", "medium");
+        writer.Field("signal", "medium");
     } else if (csq >= 25 && csq <= 31) {
-        cJSON_AddStringToObject(network, "signal", "strong");
+        writer.Field("signal", "strong");
     }
-    cJSON_AddItemToObject(root, "network", network);
+    Application::GetInstance().WriteLinkQualityField(writer, "link");
+    writer.EndObject();
 
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
+    writer.EndObject();
     return json;
 }
@@ -201,65 +201,65 @@ std::string WifiBoard::GetDeviceStatusJson() {
      * }
      */
     auto& board = Board::GetInstance();
-    auto root = cJSON_CreateObject();
+    std::string json;
+    JsonWriter writer(json);
+    writer.BeginObject();
 
     // Audio speaker
-    auto audio_speaker = cJSON_CreateObject();
+    writer.Key("audio_speaker").BeginObject();
     auto audio_codec = board.GetAudioCodec();
     if (audio_codec) {
-        cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
+        writer.Field("volume", audio_codec->output_volume());
     }
-    cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
+    writer.EndObject();
 
     // Screen brightness
     auto backlight = board.GetBacklight();
-    auto screen = cJSON_CreateObject();
+    writer.Key("screen").BeginObject();
     if (backlight) {
-        cJSON_AddNumberToObject(screen, "brightness", backlight->brightness());
+        writer.Field("brightness", backlight->brightness());
     }
     auto display = board.GetDisplay();
     if (display && display->height() > 64) { // For LCD display only
-        cJSON_AddStringToObject(screen, "theme", display->GetTheme().c_str());
+        writer.Field("theme", display->GetTheme());
     }
-    cJSON_AddItemToObject(root, "screen", screen);
+    writer.EndObject();
 
     // Battery
     int battery_level = 0;
     bool charging = false;
     bool discharging = false;
     if (board.GetBatteryLevel(battery_level, charging, discharging)) {
-        cJSON* battery = cJSON_CreateObject();
-        cJSON_AddNumberToObject(battery, "level", battery_level);
-        cJSON_AddBoolToObject(battery, "charging", charging);
-        cJSON_AddItemToObject(root, "battery", battery);
+        writer.Key("battery").BeginObject();
+        writer.Field("level", battery_level);
+        writer.Field("charging", charging);
+        writer.EndObject();
     }
 
     // Network
-    auto network = cJSON_CreateObject();
+    writer.Key("network").BeginObject();
     auto& wifi_station = WifiStation::GetInstance();
-    cJSON_AddStringToObject(network, "type", "wifi");
-    cJSON_AddStringToObject(network, "ssid", wifi_station.GetSsid().c_str());
+    writer.Field("type", "wifi");
+    writer.Field("ssid", wifi_station.GetSsid());
     int rssi = wifi_station.GetRssi();
     if (rssi >= -60) {
-        cJSON_AddStringToObject(network, "signal", "strong");
+        writer.Field("signal", "strong");
     } else if (rssi >= -70) {
-        cJSON_AddStringToObject(network, "signal", "medium");
+        writer.Field("signal", "medium");
     } else {
-        cJSON_AddStringToObject(network, "signal", "weak");
+        writer.Field("signal", "weak");
     }
-    cJSON_AddItemToObject(root, "network", network);
+    Application::GetInstance().WriteLinkQualityField(writer, "link");
+    writer.EndObject();
 
     // Chip
     float esp32temp = 0.0f;
     if (board.GetTemperature(esp32temp)) {
-        auto chip = cJSON_CreateObject();
-        cJSON_AddNumberToObject(chip, "temperature", esp32temp);
-        cJSON_AddItemToObject(root, "chip", chip);
+        writer.Key("chip").BeginObject();
+        writer.Field("temperature", esp32temp);
+        writer.EndObject();
     }
 
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string json(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
+    writer.EndObject();
     return json;
 }
@@ -7,6 +7,8 @@
 #define AUDIO_OUTPUT_SAMPLE_RATE 16000
 
 #define AUDIO_INPUT_REFERENCE CONFIG_USE_AUDIO_PROCESSOR
+// 两个麦克风的间距，未启用 AFE 时用于波束成形
+#define AUDIO_MIC_SPACING_MM  65
 
 #define AUDIO_I2S_GPIO_MCLK GPIO_NUM_2
 #define AUDIO_I2S_GPIO_WS GPIO_NUM_47
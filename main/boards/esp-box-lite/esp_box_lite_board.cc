@@ -237,6 +237,10 @@ public:
         return &audio_codec;
     }
 
+    virtual BeamformerConfig GetBeamformerConfig() override {
+        return BeamformerConfig::Linear(2, AUDIO_MIC_SPACING_MM);
+    }
+
     virtual Display* GetDisplay() override {
         return display_;
     }
@@ -0,0 +1,89 @@
+#include "boot_profiler.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+#define TAG "BootProfiler"
+
+void BootProfiler::Begin(const char* phase) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = phases_[count_ % BOOT_PROFILER_MAX_PHASES];
+    entry.name = phase;
+    strncpy(entry.task, pcTaskGetName(NULL), sizeof(entry.task) - 1);
+    entry.task[sizeof(entry.task) - 1] = '\0';
+    entry.begin_us = esp_timer_get_time();
+    entry.end_us = 0;
+    count_++;
+}
+
+void BootProfiler::End(const char* phase) {
+    int64_t now = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The latest running phase of the name, from the newest entry backwards
+    uint32_t size = count_ < BOOT_PROFILER_MAX_PHASES ? count_ : BOOT_PROFILER_MAX_PHASES;
+    for (uint32_t i = 1; i <= size; i++) {
+        auto& entry = phases_[(count_ - i) % BOOT_PROFILER_MAX_PHASES];
+        if (entry.end_us == 0 && strcmp(entry.name, phase) == 0) {
+            entry.end_us = now;
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "Phase %s was not started", phase);
+}
+
+void BootProfiler::MarkReady() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ready_us_ == 0) {
+        ready_us_ = esp_timer_get_time();
+    }
+}
+
+void BootProfiler::Log(int target_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t size = count_ < BOOT_PROFILER_MAX_PHASES ? count_ : BOOT_PROFILER_MAX_PHASES;
+    for (uint32_t i = count_ - size; i < count_; i++) {
+        auto& entry = phases_[i % BOOT_PROFILER_MAX_PHASES];
+        if (entry.end_us == 0) {
+            ESP_LOGI(TAG, "%-16s %6lld ms  running    [%s]", entry.name, entry.begin_us / 1000, entry.task);
+        } else {
+            ESP_LOGI(TAG, "%-16s %6lld ms  %6lld ms  [%s]", entry.name, entry.begin_us / 1000,
+                (entry.end_us - entry.begin_us) / 1000, entry.task);
+        }
+    }
+
+    int ready_ms = ready_us_ / 1000;
+    if (target_ms > 0 && ready_ms > target_ms) {
+        ESP_LOGW(TAG, "Ready at %d ms, over the target of %d ms", ready_ms, target_ms);
+    } else {
+        ESP_LOGI(TAG, "Ready at %d ms", ready_ms);
+    }
+}
+
+void BootProfiler::WriteReport(JsonWriter& writer, int target_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writer.BeginObject();
+    writer.Field("ready_ms", (int)(ready_us_ / 1000));
+    if (target_ms > 0) {
+        writer.Field("target_ms", target_ms);
+        writer.Field("target_met", ready_us_ > 0 && ready_us_ / 1000 <= target_ms);
+    }
+    writer.Key("phases").BeginArray();
+    uint32_t size = count_ < BOOT_PROFILER_MAX_PHASES ? count_ : BOOT_PROFILER_MAX_PHASES;
+    for (uint32_t i = count_ - size; i < count_; i++) {
+        auto& entry = phases_[i % BOOT_PROFILER_MAX_PHASES];
+        writer.BeginObject();
+        writer.Field("name", entry.name);
+        writer.Field("task", (const char*)entry.task);
+        writer.Field("begin_ms", (int)(entry.begin_us / 1000));
+        if (entry.end_us != 0) {
+            writer.Field("duration_ms", (int)((entry.end_us - entry.begin_us) / 1000));
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Field("dropped", count_ - size);
+    writer.EndObject();
+}
@@ -0,0 +1,43 @@
+#ifndef _BOOT_PROFILER_H_
+#define _BOOT_PROFILER_H_
+
+#include <cstdint>
+#include <mutex>
+
+#include "json_writer.h"
+
+#define BOOT_PROFILER_MAX_PHASES 16         // Ring size, the oldest phases are overwritten beyond it
+
+/*
+ * Records when each startup phase begins and ends, in esp_timer time (since the application
+ * started, the bootloader is not included). Phases may overlap and run on different tasks, a
+ * phase is identified by its name, which must be a string literal. Phases that run after the
+ * device is ready, such as the background version check, are recorded as well.
+ */
+class BootProfiler {
+public:
+    void Begin(const char* phase);
+    void End(const char* phase);
+    // The device is idle and can talk, the time-to-ready is measured up to here
+    void MarkReady();
+    int64_t ready_us() const { return ready_us_; }
+
+    // Logs the phases and compares the time-to-ready with the target, 0 for no target
+    void Log(int target_ms);
+    void WriteReport(JsonWriter& writer, int target_ms);
+
+private:
+    struct Phase {
+        const char* name = nullptr;
+        char task[16] = {};             // Copied, the task may be gone by the report
+        int64_t begin_us = 0;
+        int64_t end_us = 0;             // 0 while running
+    };
+
+    std::mutex mutex_;
+    Phase phases_[BOOT_PROFILER_MAX_PHASES];
+    uint32_t count_ = 0;                // Phases begun since boot, the ring holds the last ones
+    int64_t ready_us_ = 0;
+};
+
+#endif // _BOOT_PROFILER_H_
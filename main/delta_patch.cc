@@ -0,0 +1,258 @@
+#include "delta_patch.h"
+
+#include <algorithm>
+#include <cstring>
+
+DeltaPatcher::DeltaPatcher(DeltaSourceReader source, DeltaOutputWriter output, DeltaHeaderCallback on_header)
+    : source_(source), output_(output), on_header_(on_header) {
+}
+
+void DeltaPatcher::Reset() {
+    state_ = kStateHeader;
+    header_ = {};
+    header_received_ = 0;
+    varint_ = 0;
+    varint_shift_ = 0;
+    diff_remaining_ = 0;
+    extra_length_ = 0;
+    literal_remaining_ = 0;
+    extra_remaining_ = 0;
+    seek_ = 0;
+    source_offset_ = 0;
+    target_offset_ = 0;
+    output_size_ = 0;
+    error_.clear();
+}
+
+bool DeltaPatcher::Feed(const uint8_t* data, size_t size) {
+    const uint8_t* end = data + size;
+    while (true) {
+        switch (state_) {
+        case kStateHeader: {
+            size_t length = std::min(sizeof(header_) - header_received_, (size_t)(end - data));
+            memcpy((uint8_t*)&header_ + header_received_, data, length);
+            data += length;
+            header_received_ += length;
+            if (header_received_ < sizeof(header_)) {
+                return true;
+            }
+            if (memcmp(header_.magic, DELTA_PATCH_MAGIC, sizeof(header_.magic)) != 0) {
+                return Fail("Not a delta patch");
+            }
+            if (header_.version != DELTA_PATCH_VERSION) {
+                return Fail("Unsupported patch version " + std::to_string(header_.version));
+            }
+            if (on_header_ && !on_header_(header_)) {
+                return Fail("Patch does not apply to this firmware");
+            }
+            if (!NextBlockOrDone()) {
+                return false;
+            }
+            break;
+        }
+        case kStateDiffLength:
+            if (!ReadVarint(data, end, diff_remaining_)) {
+                return state_ != kStateError;
+            }
+            state_ = kStateExtraLength;
+            break;
+        case kStateExtraLength:
+            if (!ReadVarint(data, end, extra_length_)) {
+                return state_ != kStateError;
+            }
+            if (diff_remaining_ + extra_length_ > header_.target_size - target_offset_) {
+                return Fail("Block exceeds the target size");
+            }
+            state_ = kStateSeek;
+            break;
+        case kStateSeek: {
+            uint64_t zigzag;
+            if (!ReadVarint(data, end, zigzag)) {
+                return state_ != kStateError;
+            }
+            seek_ = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            extra_remaining_ = extra_length_;
+            if (diff_remaining_ > 0) {
+                state_ = kStateZeroCount;
+            } else if (!EndOfDiff()) {
+                return false;
+            }
+            break;
+        }
+        case kStateZeroCount: {
+            uint64_t zero_count;
+            if (!ReadVarint(data, end, zero_count)) {
+                return state_ != kStateError;
+            }
+            if (zero_count > diff_remaining_) {
+                return Fail("Zero run exceeds the diff length");
+            }
+            if (!CopySource(zero_count)) {
+                return false;
+            }
+            diff_remaining_ -= zero_count;
+            state_ = kStateLiteralCount;
+            break;
+        }
+        case kStateLiteralCount:
+            if (!ReadVarint(data, end, literal_remaining_)) {
+                return state_ != kStateError;
+            }
+            if (literal_remaining_ > diff_remaining_) {
+                return Fail("Literal run exceeds the diff length");
+            }
+            diff_remaining_ -= literal_remaining_;
+            state_ = kStateLiteral;
+            break;
+        case kStateLiteral: {
+            if (literal_remaining_ == 0) {
+                if (diff_remaining_ > 0) {
+                    state_ = kStateZeroCount;
+                } else if (!EndOfDiff()) {
+                    return false;
+                }
+                break;
+            }
+            if (data == end) {
+                return true;
+            }
+            size_t length = std::min<uint64_t>({literal_remaining_, (uint64_t)(end - data), DELTA_PATCH_SOURCE_BUFFER_SIZE});
+            if (!AddSource(data, length)) {
+                return false;
+            }
+            data += length;
+            literal_remaining_ -= length;
+            break;
+        }
+        case kStateExtra: {
+            if (extra_remaining_ == 0) {
+                source_offset_ += seek_;
+                if (!NextBlockOrDone()) {
+                    return false;
+                }
+                break;
+            }
+            if (data == end) {
+                return true;
+            }
+            size_t length = std::min<uint64_t>(extra_remaining_, end - data);
+            if (!Emit(data, length)) {
+                return false;
+            }
+            data += length;
+            extra_remaining_ -= length;
+            break;
+        }
+        case kStateDone:
+            if (data != end) {
+                return Fail("Data after the end of the patch");
+            }
+            return true;
+        case kStateError:
+            return false;
+        }
+    }
+}
+
+bool DeltaPatcher::Finish() {
+    if (state_ == kStateError) {
+        return false;
+    }
+    if (state_ != kStateDone) {
+        return Fail("Patch ended at " + std::to_string(target_offset_) + "/" + std::to_string(header_.target_size));
+    }
+    return true;
+}
+
+bool DeltaPatcher::ReadVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value) {
+    while (data < end) {
+        uint8_t byte = *data++;
+        if (varint_shift_ > 63) {
+            Fail("Malformed varint");
+            return false;
+        }
+        varint_ |= (uint64_t)(byte & 0x7F) << varint_shift_;
+        varint_shift_ += 7;
+        if ((byte & 0x80) == 0) {
+            value = varint_;
+            varint_ = 0;
+            varint_shift_ = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DeltaPatcher::CopySource(uint64_t length) {
+    while (length > 0) {
+        size_t chunk = std::min<uint64_t>(length, DELTA_PATCH_SOURCE_BUFFER_SIZE);
+        if (!AddSource(nullptr, chunk)) {
+            return false;
+        }
+        length -= chunk;
+    }
+    return true;
+}
+
+bool DeltaPatcher::AddSource(const uint8_t* diff, size_t length) {
+    if (source_offset_ < 0 || source_offset_ + length > header_.source_size) {
+        return Fail("Source offset out of range: " + std::to_string(source_offset_));
+    }
+    if (!source_(source_offset_, source_buffer_, length)) {
+        return Fail("Failed to read the source");
+    }
+    if (diff != nullptr) {
+        for (size_t i = 0; i < length; i++) {
+            source_buffer_[i] += diff[i];
+        }
+    }
+    source_offset_ += length;
+    return Emit(source_buffer_, length);
+}
+
+bool DeltaPatcher::Emit(const uint8_t* data, size_t length) {
+    target_offset_ += length;
+    while (length > 0) {
+        size_t chunk = std::min(length, sizeof(output_buffer_) - output_size_);
+        memcpy(output_buffer_ + output_size_, data, chunk);
+        output_size_ += chunk;
+        data += chunk;
+        length -= chunk;
+        if (output_size_ == sizeof(output_buffer_) && !Flush()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeltaPatcher::Flush() {
+    if (output_size_ > 0 && !output_(output_buffer_, output_size_)) {
+        return Fail("Failed to write the output");
+    }
+    output_size_ = 0;
+    return true;
+}
+
+bool DeltaPatcher::EndOfDiff() {
+    if (extra_remaining_ > 0) {
+        state_ = kStateExtra;
+        return true;
+    }
+    source_offset_ += seek_;
+    return NextBlockOrDone();
+}
+
+bool DeltaPatcher::NextBlockOrDone() {
+    if (target_offset_ == header_.target_size) {
+        state_ = kStateDone;
+        return Flush();
+    }
+    state_ = kStateDiffLength;
+    return true;
+}
+
+bool DeltaPatcher::Fail(const std::string& message) {
+    error_ = message;
+    state_ = kStateError;
+    return false;
+}
@@ -0,0 +1,106 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+/*
+ * Delta firmware patch, in the style of bsdiff: the target image is rebuilt from the source image (the running
+ * firmware) and a list of blocks, each of them
+ *   varint diff_length, varint extra_length, zigzag varint seek
+ *   diff data:  runs of (varint zero_count, varint literal_count, literal_count bytes) until diff_length bytes,
+ *               added byte by byte to the source at the current position (zero_count bytes copied unchanged)
+ *   extra data: extra_length bytes copied as they are
+ * after which the source position moves by seek. The patch starts with DeltaPatchHeader (little endian).
+ *
+ * The zero runs stand in for the bzip2 stage of bsdiff, so that the device needs no decompressor. The patcher
+ * takes the patch in chunks of any size and reads the source at random offsets through a callback, its memory
+ * use is bounded by the buffers below. Nothing is written past a malformed block, but the blocks written
+ * before it stay written, so the caller discards the target image on any failure.
+ */
+
+#define DELTA_PATCH_MAGIC "XZDP"
+#define DELTA_PATCH_VERSION 1
+#define DELTA_PATCH_SOURCE_BUFFER_SIZE 512
+#define DELTA_PATCH_OUTPUT_BUFFER_SIZE 4096
+
+struct __attribute__((packed)) DeltaPatchHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    uint32_t source_size;
+    uint32_t target_size;
+    uint8_t source_sha256[32];
+    uint8_t target_sha256[32];
+};
+
+// Reads size bytes of the source image at offset
+using DeltaSourceReader = std::function<bool(size_t offset, uint8_t* data, size_t size)>;
+// Receives the target image in order
+using DeltaOutputWriter = std::function<bool(const uint8_t* data, size_t size)>;
+// Called once the header is complete, before anything is written, for example to check the source digest
+using DeltaHeaderCallback = std::function<bool(const DeltaPatchHeader& header)>;
+
+class DeltaPatcher {
+public:
+    DeltaPatcher(DeltaSourceReader source, DeltaOutputWriter output, DeltaHeaderCallback on_header = nullptr);
+
+    void Reset();
+    // Returns false on a malformed patch or a failed callback, see error()
+    bool Feed(const uint8_t* data, size_t size);
+    // Flushes the output, returns false unless the whole target image was produced
+    bool Finish();
+
+    const DeltaPatchHeader& header() const { return header_; }
+    size_t target_offset() const { return target_offset_; }
+    const std::string& error() const { return error_; }
+
+private:
+    enum State {
+        kStateHeader,
+        kStateDiffLength,
+        kStateExtraLength,
+        kStateSeek,
+        kStateZeroCount,
+        kStateLiteralCount,
+        kStateLiteral,
+        kStateExtra,
+        kStateDone,
+        kStateError,
+    };
+
+    DeltaSourceReader source_;
+    DeltaOutputWriter output_;
+    DeltaHeaderCallback on_header_;
+
+    State state_ = kStateHeader;
+    DeltaPatchHeader header_ = {};
+    size_t header_received_ = 0;
+    uint64_t varint_ = 0;
+    int varint_shift_ = 0;
+    uint64_t diff_remaining_ = 0;
+    uint64_t extra_length_ = 0;
+    uint64_t literal_remaining_ = 0;
+    uint64_t extra_remaining_ = 0;
+    int64_t seek_ = 0;
+    int64_t source_offset_ = 0;
+    size_t target_offset_ = 0;
+    std::string error_;
+
+    uint8_t source_buffer_[DELTA_PATCH_SOURCE_BUFFER_SIZE];
+    uint8_t output_buffer_[DELTA_PATCH_OUTPUT_BUFFER_SIZE];
+    size_t output_size_ = 0;
+
+    bool ReadVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value);
+    bool CopySource(uint64_t length);
+    bool AddSource(const uint8_t* diff, size_t length);
+    bool Emit(const uint8_t* data, size_t length);
+    bool Flush();
+    bool EndOfDiff();
+    bool NextBlockOrDone();
+    bool Fail(const std::string& message);
+};
+
+#endif // DELTA_PATCH_H
@@ -0,0 +1,147 @@
+#include "json_writer.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+void JsonWriter::Separator() {
+    if (after_key_) {
+        after_key_ = false;
+        return;
+    }
+    if (depth_ > 0 && depth_ <= JSON_WRITER_MAX_DEPTH) {
+        uint32_t bit = 1u << (depth_ - 1);
+        if (has_members_ & bit) {
+            output_.push_back(',');
+        }
+        has_members_ |= bit;
+    }
+}
+
+void JsonWriter::Open(char bracket) {
+    Separator();
+    output_.push_back(bracket);
+    depth_++;
+    if (depth_ <= JSON_WRITER_MAX_DEPTH) {
+        has_members_ &= ~(1u << (depth_ - 1));
+    }
+}
+
+void JsonWriter::Close(char bracket) {
+    output_.push_back(bracket);
+    if (depth_ > 0) {
+        depth_--;
+    }
+}
+
+JsonWriter& JsonWriter::BeginObject() {
+    Open('{');
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject() {
+    Close('}');
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray() {
+    Open('[');
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndArray() {
+    Close(']');
+    return *this;
+}
+
+JsonWriter& JsonWriter::Key(std::string_view key) {
+    Separator();
+    AppendEscaped(key);
+    output_.push_back(':');
+    after_key_ = true;
+    return *this;
+}
+
+void JsonWriter::AppendEscaped(std::string_view value) {
+    static const char kHex[] = "0123456789abcdef";
+    output_.push_back('"');
+    size_t run = 0;
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        // Copy the run of plain characters before the one to escape in one go
+        output_.append(value.data() + run, i - run);
+        run = i + 1;
+        output_.push_back('\\');
+        switch (c) {
+            case '"': output_.push_back('"'); break;
+            case '\\': output_.push_back('\\'); break;
+            case '\b': output_.push_back('b'); break;
+            case '\f': output_.push_back('f'); break;
+            case '\n': output_.push_back('n'); break;
+            case '\r': output_.push_back('r'); break;
+            case '\t': output_.push_back('t'); break;
+            default:
+                output_.append("u00");
+                output_.push_back(kHex[c >> 4]);
+                output_.push_back(kHex[c & 0xf]);
+                break;
+        }
+    }
+    output_.append(value.data() + run, value.size() - run);
+    output_.push_back('"');
+}
+
+JsonWriter& JsonWriter::String(std::string_view value) {
+    Separator();
+    AppendEscaped(value);
+    return *this;
+}
+
+JsonWriter& JsonWriter::Int(int64_t value) {
+    Separator();
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+    output_.append(buffer, length);
+    return *this;
+}
+
+// As print_number of cJSON: integers as such, else 15 digits unless 17 are needed to read back the same value
+JsonWriter& JsonWriter::Number(double value) {
+    Separator();
+    char buffer[32];
+    int length;
+    if (std::isnan(value) || std::isinf(value)) {
+        length = snprintf(buffer, sizeof(buffer), "null");
+    } else if (std::fabs(value) <= INT32_MAX && value == (double)(int)value) {
+        length = snprintf(buffer, sizeof(buffer), "%d", (int)value);
+    } else {
+        length = snprintf(buffer, sizeof(buffer), "%1.15g", value);
+        if (strtod(buffer, nullptr) != value) {
+            length = snprintf(buffer, sizeof(buffer), "%1.17g", value);
+        }
+    }
+    output_.append(buffer, length);
+    return *this;
+}
+
+JsonWriter& JsonWriter::Bool(bool value) {
+    Separator();
+    output_.append(value ? "true" : "false");
+    return *this;
+}
+
+JsonWriter& JsonWriter::Null() {
+    Separator();
+    output_.append("null");
+    return *this;
+}
+
+JsonWriter& JsonWriter::Raw(std::string_view json) {
+    Separator();
+    output_.append(json.data(), json.size());
+    return *this;
+}
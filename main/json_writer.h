@@ -0,0 +1,70 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+ * Writes compact JSON straight into a caller owned string, with the same escaping and number
+ * format as cJSON_PrintUnformatted. Nested values are written in place, so a message costs no
+ * tree and no intermediate strings, and a string that is cleared and reused stops allocating.
+ * The structure is not validated: the caller pairs every Begin with its End and writes a Key
+ * before each value in an object, as cJSON would have built it.
+ */
+
+#define JSON_WRITER_MAX_DEPTH 32
+
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& output) : output_(output) {}
+
+    JsonWriter& BeginObject();
+    JsonWriter& EndObject();
+    JsonWriter& BeginArray();
+    JsonWriter& EndArray();
+    JsonWriter& Key(std::string_view key);
+
+    JsonWriter& String(std::string_view value);
+    JsonWriter& Int(int64_t value);
+    JsonWriter& Number(double value);
+    JsonWriter& Bool(bool value);
+    JsonWriter& Null();
+    // A value that is JSON already, written as is
+    JsonWriter& Raw(std::string_view json);
+
+    // Key and value of an object member
+    template <typename T>
+    JsonWriter& Field(std::string_view key, const T& value) {
+        Key(key);
+        return Value(value);
+    }
+
+    std::string& output() { return output_; }
+
+private:
+    std::string& output_;
+    int depth_ = 0;
+    uint32_t has_members_ = 0;              // Bit n: the container at depth n has a member already
+    bool after_key_ = false;
+
+    void Separator();
+    void Open(char bracket);
+    void Close(char bracket);
+    void AppendEscaped(std::string_view value);
+
+    JsonWriter& Value(std::string_view value) { return String(value); }
+    JsonWriter& Value(const std::string& value) { return String(value); }
+    JsonWriter& Value(const char* value) { return String(value); }
+    JsonWriter& Value(bool value) { return Bool(value); }
+    JsonWriter& Value(int value) { return Int(value); }
+    JsonWriter& Value(unsigned int value) { return Int(value); }
+    JsonWriter& Value(long value) { return Int(value); }
+    JsonWriter& Value(unsigned long value) { return Int((int64_t)value); }
+    JsonWriter& Value(long long value) { return Int(value); }
+    JsonWriter& Value(unsigned long long value) { return Int((int64_t)value); }
+    JsonWriter& Value(float value) { return Number(value); }
+    JsonWriter& Value(double value) { return Number(value); }
+};
+
+#endif // JSON_WRITER_H
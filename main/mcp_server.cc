@@ -13,6 +13,7 @@
 #include "application.h"
 #include "display.h"
 #include "board.h"
+#include "mqtt_protocol.h"
 
 #define TAG "MCP"
 
@@ -103,6 +104,159 @@ void McpServer::AddCommonTools() {
             });
     }
 
+    AddTool("self.audio.self_test",
+        "Run the speaker to microphone loopback self test. The device plays a short sweep and records it.\n"
+        "Use this tool when the user asks to check the speaker or the microphone.\n"
+        "Return:\n"
+        "  A JSON object with the latency, signal to noise ratio, clipping and frequency response (relative to 1kHz).",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().RunAudioSelfTest();
+        });
+
+    AddTool("self.audio.get_diagnostics",
+        "Get the audio diagnostics: I2S underruns and overruns, DMA buffer depth and latency, pipeline counters and limiter metrics.\n"
+        "Use this tool when the user reports stuttering, crackling or delayed audio.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetAudioService().GetDiagnosticsJson();
+        });
+
+    AddTool("self.network.get_channel_statistics",
+        "Get the audio channel connection statistics, such as how often a speculatively opened channel was used or wasted.\n"
+        "Use this tool when the user asks why the device responds slowly.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetChannelStatisticsJson();
+        });
+
+    AddTool("self.system.get_message_statistics",
+        "Get how many messages of each type the device received from the server and how long it took to handle them.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetMessageStatisticsJson();
+        });
+
+    AddTool("self.system.get_boot_profile",
+        "Get how long each startup phase took (board, network, audio, OTA config, protocol) and the time until the device was ready.\n"
+        "Use this tool when the user asks why the device starts slowly.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetBootProfileJson();
+        });
+
+    AddTool("self.network.get_link_quality",
+        "Get the measured quality of the link to the server: round trip time, jitter and loss of ping probes.\n"
+        "Use this tool when the user asks about the network quality or why the voice is choppy.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            std::string json;
+            JsonWriter writer(json);
+            Application::GetInstance().WriteLinkQuality(writer);
+            return json;
+        });
+
+    AddTool("self.network.benchmark_audio_crypto",
+        "Measure how fast the device encrypts audio frames for the MQTT + UDP audio channel.\n"
+        "Use this tool only when the user asks to benchmark the audio encryption.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return MqttProtocol::BenchmarkAudioCrypto();
+        });
+
+    if (Application::GetInstance().GetAudioService().IsBeamforming()) {
+        AddTool("self.audio.get_speaker_direction",
+            "Get the direction of the person speaking, estimated by the microphone array.\n"
+            "Use this tool before turning the device or the robot toward the user.\n"
+            "Return:\n"
+            "  A JSON object with `azimuth` in degrees counterclockwise from the microphone array axis "
+            "(90 is straight ahead for a two-mic board), `confidence` from 0 to 1, and `age_ms` since the last speech.",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                return Application::GetInstance().GetSpeakerDirectionJson();
+            });
+    }
+
+    auto flight_recorder = Application::GetInstance().GetAudioService().flight_recorder();
+    if (flight_recorder) {
+        AddTool("self.audio_recorder.report_issue",
+            "Save the last seconds of microphone and speaker audio for diagnostics.\n"
+            "Use this tool when the user reports an audio problem (e.g. you cannot hear me clearly, the voice is choppy, you woke up by mistake).\n"
+            "Args:\n"
+            "  `description`: A short description of the problem.\n"
+            "Return:\n"
+            "  A JSON object that provides the recorder status.",
+            PropertyList({
+                Property("description", kPropertyTypeString)
+            }),
+            [flight_recorder](const PropertyList& properties) -> ReturnValue {
+                auto description = properties["description"].value<std::string>();
+                flight_recorder->Snapshot("user_report: " + description, true);
+                return flight_recorder->GetStatusJson();
+            });
+
+        AddTool("self.audio_recorder.upload",
+            "Upload the saved audio snapshot to the diagnostics server.\n"
+            "Args:\n"
+            "  `url`: The URL to POST the snapshot to.\n"
+            "  `token`: Optional bearer token.",
+            PropertyList({
+                Property("url", kPropertyTypeString),
+                Property("token", kPropertyTypeString, std::string(""))
+            }),
+            [flight_recorder](const PropertyList& properties) -> ReturnValue {
+                auto url = properties["url"].value<std::string>();
+                auto token = properties["token"].value<std::string>();
+                return flight_recorder->Upload(url, token);
+            });
+    }
+
+    auto session_recorder = Application::GetInstance().session_recorder();
+    if (session_recorder) {
+        AddTool("self.session_recorder.record",
+            "Start or stop capturing the messages and audio exchanged with the server, for replaying the session later.\n"
+            "Starting discards the previous capture.\n"
+            "Args:\n"
+            "  `recording`: true to start, false to stop.\n"
+            "Return:\n"
+            "  A JSON object that provides the recorder status.",
+            PropertyList({
+                Property("recording", kPropertyTypeBoolean)
+            }),
+            [session_recorder](const PropertyList& properties) -> ReturnValue {
+                if (properties["recording"].value<bool>()) {
+                    session_recorder->Start();
+                } else {
+                    session_recorder->Stop();
+                }
+                return session_recorder->GetStatusJson();
+            });
+
+        AddTool("self.session_recorder.save",
+            "Save the session capture to a file, such as /sdcard/session.xzsc.",
+            PropertyList({
+                Property("path", kPropertyTypeString)
+            }),
+            [session_recorder](const PropertyList& properties) -> ReturnValue {
+                return session_recorder->Save(properties["path"].value<std::string>());
+            });
+
+        AddTool("self.session_recorder.upload",
+            "Upload the session capture to the diagnostics server.\n"
+            "Args:\n"
+            "  `url`: The URL to POST the capture to.\n"
+            "  `token`: Optional bearer token.",
+            PropertyList({
+                Property("url", kPropertyTypeString),
+                Property("token", kPropertyTypeString, std::string(""))
+            }),
+            [session_recorder](const PropertyList& properties) -> ReturnValue {
+                auto url = properties["url"].value<std::string>();
+                auto token = properties["token"].value<std::string>();
+                return session_recorder->Upload(url, token);
+            });
+    }
+
     // Restore the original tools list to the end of the tools list
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
 }
@@ -193,9 +347,18 @@ void McpServer::ParseMessage(const cJSON* json) {
             }
         }
         auto app_desc = esp_app_get_description();
-        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
-        message += app_desc->version;
-        message += "\"}}";
+        std::string message;
+        JsonWriter writer(message);
+        writer.BeginObject();
+        writer.Field("protocolVersion", "2024-11-05");
+        writer.Key("capabilities").BeginObject();
+        writer.Key("tools").BeginObject().EndObject();
+        writer.EndObject();
+        writer.Key("serverInfo").BeginObject();
+        writer.Field("name", BOARD_NAME);
+        writer.Field("version", app_desc->version);
+        writer.EndObject();
+        writer.EndObject();
         ReplyResult(id_int, message);
     } else if (method_str == "tools/list") {
         std::string cursor_str = "";
@@ -237,31 +400,53 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
 }
 
+void McpServer::BeginReply(JsonWriter& writer, int id) {
+    writer.BeginObject();
+    writer.Field("jsonrpc", "2.0");
+    writer.Field("id", id);
+}
+
 void McpServer::ReplyResult(int id, const std::string& result) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id) + ",\"result\":";
-    payload += result;
-    payload += "}";
+    std::string payload;
+    payload.reserve(result.size() + 40);
+    JsonWriter writer(payload);
+    BeginReply(writer, id);
+    writer.Key("result").Raw(result);
+    writer.EndObject();
     Application::GetInstance().SendMcpMessage(payload);
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id);
-    payload += ",\"error\":{\"message\":\"";
-    payload += message;
-    payload += "\"}}";
+    std::string payload;
+    JsonWriter writer(payload);
+    BeginReply(writer, id);
+    writer.Key("error").BeginObject();
+    writer.Field("message", message);
+    writer.EndObject();
+    writer.EndObject();
     Application::GetInstance().SendMcpMessage(payload);
 }
 
+/*
+ * The tools are written straight into the reply, a tool that does not fit in the page
+ * is cut off again and becomes the cursor of the next page.
+ */
 void McpServer::GetToolsList(int id, const std::string& cursor) {
     const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
-    
+    std::string payload;
+    payload.reserve(max_payload_size + 64);
+    JsonWriter writer(payload);
+    BeginReply(writer, id);
+    writer.Key("result");
+    size_t result_start = payload.size();
+    writer.BeginObject();
+    writer.Key("tools").BeginArray();
+
     bool found_cursor = cursor.empty();
     auto it = tools_.begin();
     std::string next_cursor = "";
-    
+    int tool_count = 0;
+
     while (it != tools_.end()) {
         // 如果我们还没有找到起始位置，继续搜索
         if (!found_cursor) {
@@ -272,37 +457,34 @@ void McpServer::GetToolsList(int id, const std::string& cursor) {
                 continue;
             }
         }
-        
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+
+        // 添加tool后检查大小
+        size_t length = payload.size();
+        (*it)->to_json(writer);
+        if (payload.size() - result_start + 30 > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
+            payload.resize(length);
             next_cursor = (*it)->name();
             break;
         }
-        
-        json += tool_json;
+        tool_count++;
         ++it;
     }
-    
-    if (json.back() == ',') {
-        json.pop_back();
-    }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+
+    if (tool_count == 0 && !tools_.empty()) {
         // 如果没有添加任何tool，返回错误
         ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
         ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
         return;
     }
 
-    if (next_cursor.empty()) {
-        json += "]}";
-    } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+    writer.EndArray();
+    if (!next_cursor.empty()) {
+        writer.Field("nextCursor", next_cursor);
     }
-    
-    ReplyResult(id, json);
+    writer.EndObject();
+    writer.EndObject();
+    Application::GetInstance().SendMcpMessage(payload);
 }
 
 void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, int stack_size) {
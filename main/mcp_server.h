@@ -12,6 +12,8 @@
 
 #include <cJSON.h>
 
+#include "json_writer.h"
+
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string>;
 
@@ -86,38 +88,38 @@ public:
         value_ = value;
     }
 
-    std::string to_json() const {
-        cJSON *json = cJSON_CreateObject();
-        
+    void to_json(JsonWriter& writer) const {
+        writer.BeginObject();
         if (type_ == kPropertyTypeBoolean) {
-            cJSON_AddStringToObject(json, "type", "boolean");
+            writer.Field("type", "boolean");
             if (has_default_value_) {
-                cJSON_AddBoolToObject(json, "default", value<bool>());
+                writer.Field("default", value<bool>());
             }
         } else if (type_ == kPropertyTypeInteger) {
-            cJSON_AddStringToObject(json, "type", "integer");
+            writer.Field("type", "integer");
             if (has_default_value_) {
-                cJSON_AddNumberToObject(json, "default", value<int>());
+                writer.Field("default", value<int>());
             }
             if (min_value_.has_value()) {
-                cJSON_AddNumberToObject(json, "minimum", min_value_.value());
+                writer.Field("minimum", min_value_.value());
             }
             if (max_value_.has_value()) {
-                cJSON_AddNumberToObject(json, "maximum", max_value_.value());
+                writer.Field("maximum", max_value_.value());
             }
         } else if (type_ == kPropertyTypeString) {
-            cJSON_AddStringToObject(json, "type", "string");
+            writer.Field("type", "string");
             if (has_default_value_) {
-                cJSON_AddStringToObject(json, "default", value<std::string>().c_str());
+                writer.Field("default", value<std::string>());
             }
         }
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        writer.EndObject();
+    }
+
+    std::string to_json() const {
+        std::string json;
+        JsonWriter writer(json);
+        to_json(writer);
+        return json;
     }
 };
 
@@ -143,6 +145,8 @@ public:
 
     auto begin() { return properties_.begin(); }
     auto end() { return properties_.end(); }
+    auto begin() const { return properties_.begin(); }
+    auto end() const { return properties_.end(); }
 
     std::vector<std::string> GetRequired() const {
         std::vector<std::string> required;
@@ -154,20 +158,20 @@ public:
         return required;
     }
 
-    std::string to_json() const {
-        cJSON *json = cJSON_CreateObject();
-        
+    void to_json(JsonWriter& writer) const {
+        writer.BeginObject();
         for (const auto& property : properties_) {
-            cJSON *prop_json = cJSON_Parse(property.to_json().c_str());
-            cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+            writer.Key(property.name());
+            property.to_json(writer);
         }
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        writer.EndObject();
+    }
+
+    std::string to_json() const {
+        std::string json;
+        JsonWriter writer(json);
+        to_json(writer);
+        return json;
     }
 };
 
@@ -192,60 +196,62 @@ public:
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
 
-    std::string to_json() const {
-        std::vector<std::string> required = properties_.GetRequired();
-        
-        cJSON *json = cJSON_CreateObject();
-        cJSON_AddStringToObject(json, "name", name_.c_str());
-        cJSON_AddStringToObject(json, "description", description_.c_str());
-        
-        cJSON *input_schema = cJSON_CreateObject();
-        cJSON_AddStringToObject(input_schema, "type", "object");
-        
-        cJSON *properties = cJSON_Parse(properties_.to_json().c_str());
-        cJSON_AddItemToObject(input_schema, "properties", properties);
-        
-        if (!required.empty()) {
-            cJSON *required_array = cJSON_CreateArray();
-            for (const auto& property : required) {
-                cJSON_AddItemToArray(required_array, cJSON_CreateString(property.c_str()));
+    void to_json(JsonWriter& writer) const {
+        writer.BeginObject();
+        writer.Field("name", name_);
+        writer.Field("description", description_);
+
+        writer.Key("inputSchema").BeginObject();
+        writer.Field("type", "object");
+        writer.Key("properties");
+        properties_.to_json(writer);
+
+        bool has_required = false;
+        for (const auto& property : properties_) {
+            if (property.has_default_value()) {
+                continue;
+            }
+            if (!has_required) {
+                writer.Key("required").BeginArray();
+                has_required = true;
             }
-            cJSON_AddItemToObject(input_schema, "required", required_array);
+            writer.String(property.name());
         }
-        
-        cJSON_AddItemToObject(json, "inputSchema", input_schema);
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        if (has_required) {
+            writer.EndArray();
+        }
+        writer.EndObject();
+        writer.EndObject();
+    }
+
+    std::string to_json() const {
+        std::string json;
+        JsonWriter writer(json);
+        to_json(writer);
+        return json;
     }
 
     std::string Call(const PropertyList& properties) {
         ReturnValue return_value = callback_(properties);
         // 返回结果
-        cJSON* result = cJSON_CreateObject();
-        cJSON* content = cJSON_CreateArray();
-        cJSON* text = cJSON_CreateObject();
-        cJSON_AddStringToObject(text, "type", "text");
+        std::string result;
+        JsonWriter writer(result);
+        writer.BeginObject();
+        writer.Key("content").BeginArray();
+        writer.BeginObject();
+        writer.Field("type", "text");
         if (std::holds_alternative<std::string>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+            writer.Field("text", std::get<std::string>(return_value));
         } else if (std::holds_alternative<bool>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+            writer.Field("text", std::get<bool>(return_value) ? "true" : "false");
         } else if (std::holds_alternative<int>(return_value)) {
-            cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+            writer.Field("text", std::to_string(std::get<int>(return_value)));
         }
-        cJSON_AddItemToArray(content, text);
-        cJSON_AddItemToObject(result, "content", content);
-        cJSON_AddBoolToObject(result, "isError", false);
-
-        auto json_str = cJSON_PrintUnformatted(result);
-        std::string result_str(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(result);
-        return result_str;
+        writer.EndObject();
+        writer.EndArray();
+        writer.Field("isError", false);
+        writer.EndObject();
+        return result;
     }
 };
 
@@ -268,6 +274,7 @@ private:
 
     void ParseCapabilities(const cJSON* capabilities);
 
+    void BeginReply(JsonWriter& writer, int id);
     void ReplyResult(int id, const std::string& result);
     void ReplyError(int id, const std::string& message);
 
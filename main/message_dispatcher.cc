@@ -0,0 +1,170 @@
+#include "message_dispatcher.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+#define TAG "MessageDispatcher"
+
+// FNV-1a, the state is hashed after a separator so "tts" + "start" differs from "ttss" + "tart"
+uint32_t MessageDispatcher::Hash(std::string_view type, std::string_view state) {
+    uint32_t hash = 2166136261u;
+    for (char c : type) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    if (!state.empty()) {
+        hash = (hash ^ '.') * 16777619u;
+        for (char c : state) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+MessageDispatcher::Slot* MessageDispatcher::Find(uint32_t hash, std::string_view type, std::string_view state) {
+    for (int i = 0; i < MESSAGE_DISPATCH_SLOTS; i++) {
+        auto& slot = slots_[(hash + i) & (MESSAGE_DISPATCH_SLOTS - 1)];
+        if (!slot.used) {
+            return nullptr;
+        }
+        if (slot.hash == hash && slot.type == type && slot.state == state) {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+// The handler of the type and state, else the one of the type alone
+MessageDispatcher::Slot* MessageDispatcher::Find(std::string_view type, std::string_view state) {
+    Slot* slot = nullptr;
+    if (!state.empty()) {
+        slot = Find(Hash(type, state), type, state);
+    }
+    if (slot == nullptr) {
+        slot = Find(Hash(type, {}), type, {});
+    }
+    return slot;
+}
+
+bool MessageDispatcher::Register(const char* type, MessageHandler handler) {
+    return Register(type, nullptr, handler, nullptr);
+}
+
+bool MessageDispatcher::Register(const char* type, const char* state, MessageHandler handler) {
+    return Register(type, state, handler, nullptr);
+}
+
+bool MessageDispatcher::RegisterView(const char* type, MessageViewHandler handler) {
+    return Register(type, nullptr, nullptr, handler);
+}
+
+bool MessageDispatcher::RegisterView(const char* type, const char* state, MessageViewHandler handler) {
+    return Register(type, state, nullptr, handler);
+}
+
+bool MessageDispatcher::Register(const char* type, const char* state, MessageHandler handler, MessageViewHandler view_handler) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string_view state_view = state ? state : "";
+    uint32_t hash = Hash(type, state_view);
+    auto slot = Find(hash, type, state_view);
+    if (slot != nullptr) {
+        slot->handler = handler;
+        slot->view_handler = view_handler;
+        return true;
+    }
+    for (int i = 0; i < MESSAGE_DISPATCH_SLOTS; i++) {
+        auto& free_slot = slots_[(hash + i) & (MESSAGE_DISPATCH_SLOTS - 1)];
+        if (!free_slot.used) {
+            free_slot.used = true;
+            free_slot.hash = hash;
+            free_slot.type = type;
+            free_slot.state = state_view;
+            free_slot.handler = handler;
+            free_slot.view_handler = view_handler;
+            return true;
+        }
+    }
+    ESP_LOGE(TAG, "No slot left for message type %s", type);
+    return false;
+}
+
+static std::string_view StringMember(const cJSON* root, const char* name) {
+    auto item = cJSON_GetObjectItem(root, name);
+    return cJSON_IsString(item) ? std::string_view(item->valuestring) : std::string_view();
+}
+
+bool MessageDispatcher::Dispatch(const cJSON* root) {
+    auto type = StringMember(root, "type");
+    if (type.data() == nullptr) {
+        return false;
+    }
+
+    auto state = StringMember(root, "state");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot* slot = Find(type, state);
+    if (slot == nullptr) {
+        unhandled_++;
+        return false;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    if (slot->view_handler != nullptr) {
+        MessageView message;
+        message.type = type;
+        message.state = state;
+        message.text = StringMember(root, "text");
+        message.emotion = StringMember(root, "emotion");
+        auto payload = cJSON_GetObjectItem(root, "payload");
+        message.payload = cJSON_IsObject(payload) ? payload : nullptr;
+        slot->view_handler(message);
+    } else {
+        slot->handler(root);
+    }
+    Account(*slot, start_time);
+    return true;
+}
+
+bool MessageDispatcher::Dispatch(const MessageView& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Slot* slot = Find(message.type, message.state);
+    if (slot == nullptr || slot->view_handler == nullptr) {
+        return false;
+    }
+    int64_t start_time = esp_timer_get_time();
+    slot->view_handler(message);
+    Account(*slot, start_time);
+    return true;
+}
+
+void MessageDispatcher::Account(Slot& slot, int64_t start_time) {
+    uint32_t elapsed_us = esp_timer_get_time() - start_time;
+    slot.count++;
+    slot.total_us += elapsed_us;
+    if (elapsed_us > slot.max_us) {
+        slot.max_us = elapsed_us;
+    }
+}
+
+void MessageDispatcher::WriteStatistics(JsonWriter& writer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writer.BeginObject();
+    writer.Key("handlers").BeginArray();
+    for (auto& slot : slots_) {
+        if (!slot.used) {
+            continue;
+        }
+        writer.BeginObject();
+        writer.Field("type", slot.type);
+        if (!slot.state.empty()) {
+            writer.Field("state", slot.state);
+        }
+        writer.Field("count", slot.count);
+        writer.Field("average_us", slot.count ? (uint32_t)(slot.total_us / slot.count) : 0);
+        writer.Field("max_us", slot.max_us);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Field("unhandled", unhandled_);
+    writer.EndObject();
+}
@@ -0,0 +1,67 @@
+#ifndef _MESSAGE_DISPATCHER_H_
+#define _MESSAGE_DISPATCHER_H_
+
+#include <cJSON.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "json_writer.h"
+#include "protocol.h"
+
+#define MESSAGE_DISPATCH_SLOTS 64           // Power of two, keep it at least twice the number of handlers
+
+using MessageHandler = std::function<void(const cJSON* root)>;
+using MessageViewHandler = std::function<void(const MessageView& message)>;
+
+/*
+ * Routes incoming JSON messages to handlers by "type", and optionally "state", through an open
+ * addressing hash table, so the cost does not grow with the number of message types and no
+ * string is allocated per message. The handler borrows the tree only for the duration of the call.
+ * A view handler serves the frequent messages: it gets a CBOR message without a tree being built,
+ * and a JSON message as views into its tree.
+ */
+class MessageDispatcher {
+public:
+    // Replaces the handler of the type. Returns false when the table is full
+    bool Register(const char* type, MessageHandler handler);
+    // Handles the messages of the type with this state, the handler of the type alone gets the others
+    bool Register(const char* type, const char* state, MessageHandler handler);
+    // As Register, for a handler that reads only the members of MessageView
+    bool RegisterView(const char* type, MessageViewHandler handler);
+    bool RegisterView(const char* type, const char* state, MessageViewHandler handler);
+    // Returns false when the message has no type or no handler is registered for it
+    bool Dispatch(const cJSON* root);
+    // Returns false when no view handler is registered for the message, it is left to the tree path
+    bool Dispatch(const MessageView& message);
+    // Per handler counts and handling times as an object value
+    void WriteStatistics(JsonWriter& writer);
+
+private:
+    struct Slot {
+        uint32_t hash = 0;
+        bool used = false;
+        std::string type;
+        std::string state;
+        MessageHandler handler;
+        MessageViewHandler view_handler;
+        uint32_t count = 0;
+        uint64_t total_us = 0;
+        uint32_t max_us = 0;
+    };
+
+    // Handlers run with the lock held, they must not register handlers
+    std::mutex mutex_;
+    Slot slots_[MESSAGE_DISPATCH_SLOTS];
+    uint32_t unhandled_ = 0;
+
+    // An empty state stands for the handler of the type alone
+    static uint32_t Hash(std::string_view type, std::string_view state);
+    Slot* Find(uint32_t hash, std::string_view type, std::string_view state);
+    Slot* Find(std::string_view type, std::string_view state);
+    bool Register(const char* type, const char* state, MessageHandler handler, MessageViewHandler view_handler);
+    void Account(Slot& slot, int64_t start_time);
+};
+
+#endif // _MESSAGE_DISPATCHER_H_
@@ -10,11 +10,16 @@
 #include <esp_app_format.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <spi_flash_mmu.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
 
 #include <cstring>
+#include <cstdio>
+#include <strings.h>
 #include <vector>
 #include <sstream>
 #include <algorithm>
@@ -87,28 +92,146 @@ bool Ota::CheckVersion() {
 
     auto http = SetupHttp();
 
+    // The server answers 304 when the response is the same as the cached one
+    std::string cached_data;
+    {
+        Settings settings(OTA_CACHE_NAMESPACE, false);
+        if (settings.GetString("version") == current_version_) {
+            std::string etag = settings.GetString("etag");
+            cached_data = settings.GetString("response");
+            if (!etag.empty() && !cached_data.empty()) {
+                http->SetHeader("If-None-Match", etag);
+            }
+        }
+    }
+
     std::string data = board.GetJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
     http->SetContent(std::move(data));
 
+    int64_t start_time = esp_timer_get_time();
     if (!http->Open(method, url)) {
         ESP_LOGE(TAG, "Failed to open HTTP connection");
         return false;
     }
 
     auto status_code = http->GetStatusCode();
+    if (status_code == 304 && !cached_data.empty()) {
+        std::string date = http->GetResponseHeader("Date");
+        http->Close();
+        ESP_LOGI(TAG, "Check version response not modified (%lld ms)", (esp_timer_get_time() - start_time) / 1000);
+        if (!ParseCheckVersionResponse(cached_data, true)) {
+            return false;
+        }
+        // The cached server_time is stale, the Date header is the server time of this response
+        SetTimeFromHttpDate(date);
+        return true;
+    }
     if (status_code != 200) {
         ESP_LOGE(TAG, "Failed to check version, status code: %d", status_code);
         return false;
     }
 
+    std::string etag = http->GetResponseHeader("ETag");
     data = http->ReadAll();
     http->Close();
+    ESP_LOGI(TAG, "Check version response: %u bytes (%lld ms)", data.length(), (esp_timer_get_time() - start_time) / 1000);
 
-    // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
-    // Parse the JSON response and check if the version is newer
-    // If it is, set has_new_version_ to true and store the new version and URL
-    
+    if (!ParseCheckVersionResponse(data, false)) {
+        return false;
+    }
+    SaveCachedResponse(data, etag);
+    return true;
+}
+
+bool Ota::LoadCachedResponse() {
+    current_version_ = esp_app_get_description()->version;
+
+    // A new image must pass a real version check before it is marked valid
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        return false;
+    }
+
+    std::string data;
+    {
+        Settings settings(OTA_CACHE_NAMESPACE, false);
+        if (settings.GetString("version") != current_version_) {
+            return false;
+        }
+        data = settings.GetString("response");
+    }
+    if (data.empty() || !ParseCheckVersionResponse(data, true)) {
+        return false;
+    }
+    // Firmware and time are left to the version check in the background
+    has_new_version_ = false;
+    if (has_activation_code_ || has_activation_challenge_) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Loaded the cached check version response (%u bytes)", data.length());
+    return has_mqtt_config_ || has_websocket_config_;
+}
+
+void Ota::SaveCachedResponse(const std::string& data, const std::string& etag) {
+    Settings settings(OTA_CACHE_NAMESPACE, true);
+    // The activation must be shown on the next boot, and long responses do not fit in NVS
+    if (has_activation_code_ || has_activation_challenge_ || data.length() > OTA_CACHE_MAX_RESPONSE_SIZE) {
+        settings.EraseAll();
+        return;
+    }
+    // Written only when changed, to spare the flash
+    if (settings.GetString("response") != data) {
+        settings.SetString("response", data);
+    }
+    if (settings.GetString("etag") != etag) {
+        settings.SetString("etag", etag);
+    }
+    if (settings.GetString("version") != current_version_) {
+        settings.SetString("version", current_version_);
+    }
+}
+
+// Date: Sun, 06 Nov 1994 08:49:37 GMT
+void Ota::SetTimeFromHttpDate(const std::string& date) {
+    static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    int day, year, hour, minute, second;
+    char month_name[4] = {0};
+    if (sscanf(date.c_str(), "%*3s, %d %3s %d %d:%d:%d", &day, month_name, &year, &hour, &minute, &second) != 6) {
+        ESP_LOGW(TAG, "Invalid Date header: %s", date.c_str());
+        return;
+    }
+    int month = 0;
+    while (month < 12 && strcmp(months[month], month_name) != 0) {
+        month++;
+    }
+    if (month == 12) {
+        ESP_LOGW(TAG, "Invalid Date header: %s", date.c_str());
+        return;
+    }
+
+    // Days since 1970-01-01 of the proleptic Gregorian calendar
+    int y = year - (month < 2 ? 1 : 0);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int year_of_era = y - era * 400;
+    int day_of_year = (153 * (month < 2 ? month + 10 : month - 2) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = (int64_t)era * 146097 + day_of_era - 719468;
+
+    // Local time, the same as server_time with its timezone_offset
+    struct timeval tv;
+    tv.tv_sec = (time_t)(days * 86400 + hour * 3600 + minute * 60 + second + timezone_offset_ * 60);
+    tv.tv_usec = 0;
+    settimeofday(&tv, NULL);
+    has_server_time_ = true;
+}
+
+/*
+ * Response: { "firmware": { "version": "1.0.0", "url": "http://" }, "mqtt": { ... }, ... }
+ * A cached response does not set the time, its server_time is stale
+ */
+bool Ota::ParseCheckVersionResponse(const std::string& data, bool cached) {
     cJSON *root = cJSON_Parse(data.c_str());
     if (root == NULL) {
         ESP_LOGE(TAG, "Failed to parse JSON response");
@@ -186,8 +309,9 @@ bool Ota::CheckVersion() {
     if (cJSON_IsObject(server_time)) {
         cJSON *timestamp = cJSON_GetObjectItem(server_time, "timestamp");
         cJSON *timezone_offset = cJSON_GetObjectItem(server_time, "timezone_offset");
+        timezone_offset_ = cJSON_IsNumber(timezone_offset) ? timezone_offset->valueint : 0;
         
-        if (cJSON_IsNumber(timestamp)) {
+        if (cJSON_IsNumber(timestamp) && !cached) {
             // 设置系统时间
             struct timeval tv;
             double ts = timestamp->valuedouble;
@@ -217,6 +341,12 @@ bool Ota::CheckVersion() {
         if (cJSON_IsString(url)) {
             firmware_url_ = url->valuestring;
         }
+        // Optional digest of the whole image, checked after the (possibly resumed) download
+        cJSON *sha256 = cJSON_GetObjectItem(firmware, "sha256");
+        firmware_sha256_ = cJSON_IsString(sha256) ? sha256->valuestring : "";
+        // Optional patch against the running firmware (scripts/delta_patch), the full image is the fallback
+        cJSON *delta_url = cJSON_GetObjectItem(firmware, "delta_url");
+        firmware_delta_url_ = cJSON_IsString(delta_url) ? delta_url->valuestring : "";
 
         if (cJSON_IsString(version) && cJSON_IsString(url)) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
@@ -260,119 +390,477 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url) {
-    ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
-    auto update_partition = esp_ota_get_next_update_partition(NULL);
-    if (update_partition == NULL) {
+bool Ota::Upgrade(const std::string& firmware_url, bool delta) {
+    ESP_LOGI(TAG, "Upgrading firmware from %s%s", firmware_url.c_str(), delta ? " (delta)" : "");
+    update_partition_ = esp_ota_get_next_update_partition(NULL);
+    if (update_partition_ == NULL) {
         ESP_LOGE(TAG, "Failed to get update partition");
         return false;
     }
 
-    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
+    ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition_->label, update_partition_->address);
+    upgrade_url_ = firmware_url;
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
+    // Large buffers amortize the TLS record and read call overhead, prefer PSRAM to keep the internal RAM free.
+    // Whole flash sectors, so that the written part always ends on a sector boundary
+    upgrade_statistics_ = OtaUpgradeStatistics();
+    upgrade_statistics_.delta = delta;
+    upgrade_statistics_.buffer_size = (CONFIG_OTA_DOWNLOAD_BUFFER_KB * 1024 + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    uint8_t* buffers[OTA_PIPELINE_BUFFER_COUNT] = {};
+    for (int i = 0; i < OTA_PIPELINE_BUFFER_COUNT; i++) {
+        buffers[i] = (uint8_t*)heap_caps_malloc(upgrade_statistics_.buffer_size, MALLOC_CAP_SPIRAM);
+        if (buffers[i] == nullptr) {
+            buffers[i] = (uint8_t*)heap_caps_malloc(upgrade_statistics_.buffer_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        }
+        if (buffers[i] == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate %u bytes for the download buffer", upgrade_statistics_.buffer_size);
+            for (int j = 0; j < i; j++) {
+                heap_caps_free(buffers[j]);
+            }
+            return false;
+        }
+    }
+
+    free_buffers_ = xQueueCreate(OTA_PIPELINE_BUFFER_COUNT, sizeof(OtaBuffer));
+    // One more entry for the end of stream marker
+    filled_buffers_ = xQueueCreate(OTA_PIPELINE_BUFFER_COUNT + 1, sizeof(OtaBuffer));
+    flash_writer_event_group_ = xEventGroupCreate();
+    for (int i = 0; i < OTA_PIPELINE_BUFFER_COUNT; i++) {
+        OtaBuffer buffer = { buffers[i], 0 };
+        xQueueSend(free_buffers_, &buffer, 0);
+    }
+
+    mbedtls_sha256_init(&sha256_);
+    if (delta) {
+        // A patch is applied from the start each time, and it overwrites what a checkpoint refers to
+        ClearCheckpoint();
+        RestartDownload();
+        auto running_partition = esp_ota_get_running_partition();
+        delta_patcher_ = std::make_unique<DeltaPatcher>([running_partition](size_t offset, uint8_t* data, size_t size) {
+            return esp_partition_read(running_partition, offset, data, size) == ESP_OK;
+        }, [this](const uint8_t* data, size_t size) {
+            return WriteFlash(data, size) == ESP_OK;
+        }, [this](const DeltaPatchHeader& header) {
+            return CheckDeltaSource(header);
+        });
+    } else {
+        LoadCheckpoint(buffers[0]);
+    }
+    auto start_time = esp_timer_get_time();
+    esp_err_t err = ESP_FAIL;
+    for (int attempt = 0; attempt < OTA_MAX_DOWNLOAD_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            ESP_LOGW(TAG, "Download interrupted at %u/%u, retrying in %d ms", write_offset_, firmware_size_, OTA_RETRY_DELAY_MS);
+            vTaskDelay(pdMS_TO_TICKS(OTA_RETRY_DELAY_MS));
+            if (delta_patcher_) {
+                RestartDownload();
+                delta_patcher_->Reset();
+            }
+        }
+        err = DownloadFirmware();
+        if (err != ESP_FAIL) {
+            break;
+        }
+    }
+    upgrade_statistics_.elapsed_us = esp_timer_get_time() - start_time;
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256_, digest);
+    mbedtls_sha256_free(&sha256_);
+    uint8_t delta_target_sha256[sizeof(digest)];
+    if (delta_patcher_) {
+        memcpy(delta_target_sha256, delta_patcher_->header().target_sha256, sizeof(delta_target_sha256));
+        delta_patcher_.reset();
+    }
+    vQueueDelete(free_buffers_);
+    vQueueDelete(filled_buffers_);
+    vEventGroupDelete(flash_writer_event_group_);
+    free_buffers_ = nullptr;
+    filled_buffers_ = nullptr;
+    flash_writer_event_group_ = nullptr;
+    for (int i = 0; i < OTA_PIPELINE_BUFFER_COUNT; i++) {
+        heap_caps_free(buffers[i]);
+    }
+
+    if (err != ESP_OK) {
+        // Network errors keep the written part for the next upgrade, anything else starts over
+        if (!delta && err == ESP_FAIL && write_offset_ > 0) {
+            SaveCheckpoint();
+        } else {
+            ClearCheckpoint();
+        }
         return false;
     }
+    ClearCheckpoint();
+
+    auto& stats = upgrade_statistics_;
+    ESP_LOGI(TAG, "Downloaded %u bytes in %lld ms (%lld KB/s), network %lld ms, flash %lld ms, "
+        "reader stall %lld ms (flash bound), writer stall %lld ms (network bound), resumed %d times (%u bytes saved)",
+        stats.total_bytes, stats.elapsed_us / 1000, stats.total_bytes * 1000000LL / std::max<int64_t>(stats.elapsed_us, 1) / 1024,
+        stats.network_us / 1000, stats.flash_us / 1000, stats.reader_stall_us / 1000, stats.writer_stall_us / 1000,
+        stats.resume_count, stats.resumed_bytes);
+    if (delta) {
+        ESP_LOGI(TAG, "Delta patch of %u bytes for a %u byte image", firmware_size_, write_offset_);
+        if (memcmp(digest, delta_target_sha256, sizeof(digest)) != 0) {
+            ESP_LOGE(TAG, "SHA-256 of the patched image mismatch");
+            return false;
+        }
+    }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
+    if (!firmware_sha256_.empty()) {
+        char hex[sizeof(digest) * 2 + 1];
+        for (size_t i = 0; i < sizeof(digest); i++) {
+            snprintf(hex + i * 2, 3, "%02x", digest[i]);
+        }
+        if (strcasecmp(hex, firmware_sha256_.c_str()) != 0) {
+            ESP_LOGE(TAG, "SHA-256 mismatch, expected %s, got %s", firmware_sha256_.c_str(), hex);
+            return false;
+        }
+        ESP_LOGI(TAG, "SHA-256 verified: %s", hex);
+    }
+
+    // Validates the image (and its signature with secure boot) before switching to it
+    err = esp_ota_set_boot_partition(update_partition_);
+    if (err != ESP_OK) {
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
+        } else {
+            ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+        }
         return false;
     }
 
+    ESP_LOGI(TAG, "Firmware upgrade successful");
+    return true;
+}
+
+/*
+ * Downloads the firmware from write_offset_ with a Range request. The calling task reads into the free buffers,
+ * while the flash writer task writes the filled ones, so that the network receive and the flash erase / write overlap.
+ * Returns ESP_FAIL for the network errors, which can be retried from write_offset_.
+ */
+esp_err_t Ota::DownloadFirmware() {
+    auto& stats = upgrade_statistics_;
+    size_t offset = write_offset_;
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    if (offset > 0) {
+        http->SetHeader("Range", "bytes=" + std::to_string(offset) + "-");
+    }
+    if (!http->Open("GET", upgrade_url_)) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection");
+        return ESP_FAIL;
+    }
+
+    auto status_code = http->GetStatusCode();
     size_t content_length = http->GetBodyLength();
+    if (status_code == 206 && offset > 0) {
+        if (firmware_size_ != 0 && offset + content_length != firmware_size_) {
+            // Another file behind the same URL
+            ESP_LOGW(TAG, "Firmware size changed from %u to %u, restarting the download", firmware_size_, offset + content_length);
+            http->Close();
+            RestartDownload();
+            return DownloadFirmware();
+        }
+        ESP_LOGI(TAG, "Resuming download at %u bytes", offset);
+        stats.resume_count++;
+        stats.resumed_bytes += offset;
+    } else if (status_code == 200) {
+        if (offset > 0) {
+            ESP_LOGW(TAG, "Range is not supported by the server, restarting the download");
+            RestartDownload();
+            offset = 0;
+        }
+    } else {
+        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", status_code);
+        return ESP_FAIL;
+    }
+
     if (content_length == 0) {
         ESP_LOGE(TAG, "Failed to get content length");
-        return false;
+        return ESP_FAIL;
+    }
+    firmware_size_ = offset + content_length;
+    if (firmware_size_ > update_partition_->size) {
+        ESP_LOGE(TAG, "Firmware size %u exceeds the partition size %lu", firmware_size_, update_partition_->size);
+        return ESP_ERR_INVALID_SIZE;
     }
 
-    char buffer[512];
-    size_t total_read = 0, recent_read = 0;
+    esp_err_t err = ESP_OK;
+    bool writer_started = false;
+    bool end_of_stream = false;
+    size_t downloaded = offset, recent_read = 0;
     auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
+    flash_write_error_ = ESP_OK;
+
+    while (!end_of_stream) {
+        OtaBuffer buffer;
+        auto wait_start = esp_timer_get_time();
+        xQueueReceive(free_buffers_, &buffer, portMAX_DELAY);
+        stats.reader_stall_us += esp_timer_get_time() - wait_start;
+        if (flash_write_error_ != ESP_OK) {
+            xQueueSend(free_buffers_, &buffer, 0);
+            break;
         }
 
-        // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
-            if (upgrade_callback_) {
-                upgrade_callback_(progress, recent_read);
+        buffer.size = 0;
+        while (buffer.size < stats.buffer_size) {
+            auto read_start = esp_timer_get_time();
+            int ret = http->Read((char*)buffer.data + buffer.size, stats.buffer_size - buffer.size);
+            stats.network_us += esp_timer_get_time() - read_start;
+            if (ret < 0) {
+                ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+                err = ESP_FAIL;
+                break;
             }
-            last_calc_time = esp_timer_get_time();
-            recent_read = 0;
-        }
 
-        if (ret == 0) {
-            break;
+            // Calculate speed and progress every second
+            buffer.size += ret;
+            downloaded += ret;
+            recent_read += ret;
+            stats.total_bytes += ret;
+            end_of_stream = ret == 0;
+            if (esp_timer_get_time() - last_calc_time >= 1000000 || end_of_stream) {
+                size_t progress = downloaded * 100 / firmware_size_;
+                ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, downloaded, firmware_size_, recent_read);
+                if (upgrade_callback_) {
+                    upgrade_callback_(progress, recent_read);
+                }
+                last_calc_time = esp_timer_get_time();
+                recent_read = 0;
+            }
+            if (end_of_stream) {
+                // A connection closed early is a network error, the checkpoint must stay on a sector boundary
+                if (downloaded < firmware_size_) {
+                    ESP_LOGE(TAG, "Connection closed at %u/%u", downloaded, firmware_size_);
+                    err = ESP_FAIL;
+                }
+                break;
+            }
         }
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+        // The image header is checked once, at the beginning of the firmware. A patch is checked against its source
+        if (err == ESP_OK && !writer_started && offset == 0 && !delta_patcher_) {
+            if (buffer.size < sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+                ESP_LOGE(TAG, "Firmware is too small: %u bytes", buffer.size);
+                err = ESP_ERR_INVALID_SIZE;
+            } else {
                 esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
+                memcpy(&new_app_info, buffer.data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
                 ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
 
                 auto current_version = esp_app_get_description()->version;
                 if (memcmp(new_app_info.version, current_version, sizeof(new_app_info.version)) == 0) {
                     ESP_LOGE(TAG, "Firmware version is the same, skipping upgrade");
-                    return false;
+                    err = ESP_ERR_INVALID_VERSION;
                 }
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    return false;
-                }
-
-                image_header_checked = true;
-                std::string().swap(image_header);
             }
         }
-        auto err = esp_ota_write(update_handle, buffer, ret);
+        // A partly filled buffer is dropped on errors, so that the written part ends on a buffer boundary
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
-            return false;
+            xQueueSend(free_buffers_, &buffer, 0);
+            break;
+        }
+
+        if (!writer_started) {
+            xTaskCreate([](void* arg) {
+                Ota* ota = (Ota*)arg;
+                ota->FlashWriterTask();
+                vTaskDelete(NULL);
+            }, "ota_flash_writer", 4096 + 2048, this, 5, NULL);
+            writer_started = true;
+        }
+
+        if (buffer.size > 0) {
+            xQueueSend(filled_buffers_, &buffer, portMAX_DELAY);
+        } else {
+            xQueueSend(free_buffers_, &buffer, 0);
         }
     }
     http->Close();
 
-    esp_err_t err = esp_ota_end(update_handle);
-    if (err != ESP_OK) {
-        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
-            ESP_LOGE(TAG, "Image validation failed, image is corrupted");
-        } else {
-            ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+    if (writer_started) {
+        // The end of stream marker, the writer drains the queue before it exits
+        OtaBuffer end = { nullptr, 0 };
+        xQueueSend(filled_buffers_, &end, portMAX_DELAY);
+        xEventGroupWaitBits(flash_writer_event_group_, OTA_FLASH_WRITER_DONE_EVENT, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
+    if (flash_write_error_ != ESP_OK) {
+        return flash_write_error_;
+    }
+    if (err == ESP_OK && delta_patcher_ && !delta_patcher_->Finish()) {
+        ESP_LOGE(TAG, "Patch ended early: %s", delta_patcher_->error().c_str());
+        return ESP_FAIL;
+    }
+    if (err == ESP_OK && !delta_patcher_ && write_offset_ != firmware_size_) {
+        ESP_LOGE(TAG, "Download ended at %u/%u", write_offset_, firmware_size_);
+        return ESP_FAIL;
+    }
+    return err;
+}
+
+void Ota::FlashWriterTask() {
+    auto& stats = upgrade_statistics_;
+    while (true) {
+        OtaBuffer buffer;
+        auto wait_start = esp_timer_get_time();
+        xQueueReceive(filled_buffers_, &buffer, portMAX_DELAY);
+        stats.writer_stall_us += esp_timer_get_time() - wait_start;
+        if (buffer.data == nullptr) {
+            break;
         }
-        return false;
+
+        // After an error the buffers are only recycled, the reader stops at the next free buffer
+        if (flash_write_error_ == ESP_OK) {
+            auto write_start = esp_timer_get_time();
+            esp_err_t err;
+            if (delta_patcher_) {
+                err = delta_patcher_->Feed(buffer.data, buffer.size) ? ESP_OK : ESP_ERR_INVALID_RESPONSE;
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "Failed to apply the patch: %s", delta_patcher_->error().c_str());
+                }
+            } else {
+                err = WriteFlash(buffer.data, buffer.size);
+            }
+            stats.flash_us += esp_timer_get_time() - write_start;
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+                flash_write_error_ = err;
+            } else if (!delta_patcher_ && write_offset_ - checkpoint_offset_ >= CONFIG_OTA_CHECKPOINT_KB * 1024) {
+                SaveCheckpoint();
+            }
+        }
+        xQueueSend(free_buffers_, &buffer, portMAX_DELAY);
+    }
+    xEventGroupSetBits(flash_writer_event_group_, OTA_FLASH_WRITER_DONE_EVENT);
+}
+
+esp_err_t Ota::WriteFlash(const uint8_t* data, size_t size) {
+    size_t end = write_offset_ + size;
+    if (end > update_partition_->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Erase just ahead of the data, so that a resumed download keeps the written part
+    if (end > erased_offset_) {
+        size_t erase_end = std::min<size_t>((end + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE, update_partition_->size);
+        auto err = esp_partition_erase_range(update_partition_, erased_offset_, erase_end - erased_offset_);
+        if (err != ESP_OK) {
+            return err;
+        }
+        erased_offset_ = erase_end;
     }
 
-    err = esp_ota_set_boot_partition(update_partition);
+    auto err = esp_partition_write(update_partition_, write_offset_, data, size);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+        return err;
+    }
+    mbedtls_sha256_update(&sha256_, data, size);
+    write_offset_ = end;
+    return ESP_OK;
+}
+
+// The patch must have been made from the image that is running, byte for byte
+bool Ota::CheckDeltaSource(const DeltaPatchHeader& header) {
+    auto running_partition = esp_ota_get_running_partition();
+    if (header.source_size > running_partition->size || header.target_size > update_partition_->size) {
+        ESP_LOGE(TAG, "Patch sizes do not fit the partitions: %lu -> %lu", header.source_size, header.target_size);
         return false;
     }
 
-    ESP_LOGI(TAG, "Firmware upgrade successful");
+    std::vector<uint8_t> buffer(SPI_FLASH_SEC_SIZE);
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    bool success = true;
+    for (size_t position = 0; position < header.source_size;) {
+        size_t length = std::min<size_t>(buffer.size(), header.source_size - position);
+        if (esp_partition_read(running_partition, position, buffer.data(), length) != ESP_OK) {
+            success = false;
+            break;
+        }
+        mbedtls_sha256_update(&sha256, buffer.data(), length);
+        position += length;
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+    if (!success || memcmp(digest, header.source_sha256, sizeof(digest)) != 0) {
+        ESP_LOGW(TAG, "Patch is not for the running firmware");
+        return false;
+    }
     return true;
 }
 
+void Ota::RestartDownload() {
+    write_offset_ = 0;
+    erased_offset_ = 0;
+    checkpoint_offset_ = 0;
+    firmware_size_ = 0;
+    mbedtls_sha256_starts(&sha256_, 0);
+}
+
+/*
+ * Continues the download of the same firmware from the last checkpoint. The written part is read back from the
+ * flash to restore the SHA-256 state, which also makes sure it is still there.
+ */
+void Ota::LoadCheckpoint(uint8_t* buffer) {
+    RestartDownload();
+
+    Settings settings(OTA_CHECKPOINT_NAMESPACE, false);
+    size_t offset = settings.GetInt("offset");
+    size_t size = settings.GetInt("size");
+    if (offset == 0) {
+        return;
+    }
+    if (settings.GetString("url") != upgrade_url_ || settings.GetString("sha256") != firmware_sha256_ ||
+        settings.GetString("partition") != update_partition_->label || offset % SPI_FLASH_SEC_SIZE != 0 || offset >= size) {
+        ESP_LOGI(TAG, "Checkpoint is for another firmware, starting from the beginning");
+        return;
+    }
+
+    for (size_t position = 0; position < offset;) {
+        size_t length = std::min(upgrade_statistics_.buffer_size, offset - position);
+        if (esp_partition_read(update_partition_, position, buffer, length) != ESP_OK) {
+            ESP_LOGW(TAG, "Failed to read back the checkpoint, starting from the beginning");
+            RestartDownload();
+            return;
+        }
+        mbedtls_sha256_update(&sha256_, buffer, length);
+        position += length;
+    }
+    write_offset_ = offset;
+    erased_offset_ = offset;
+    checkpoint_offset_ = offset;
+    firmware_size_ = size;
+    ESP_LOGI(TAG, "Checkpoint found at %u/%u", offset, size);
+}
+
+void Ota::SaveCheckpoint() {
+    Settings settings(OTA_CHECKPOINT_NAMESPACE, true);
+    settings.SetString("url", upgrade_url_);
+    settings.SetString("sha256", firmware_sha256_);
+    settings.SetString("partition", update_partition_->label);
+    settings.SetInt("size", firmware_size_);
+    settings.SetInt("offset", write_offset_);
+    checkpoint_offset_ = write_offset_;
+}
+
+void Ota::ClearCheckpoint() {
+    Settings settings(OTA_CHECKPOINT_NAMESPACE, true);
+    settings.EraseAll();
+    checkpoint_offset_ = 0;
+}
+
 bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
     upgrade_callback_ = callback;
-    return Upgrade(firmware_url_);
+    if (!firmware_delta_url_.empty()) {
+        if (Upgrade(firmware_delta_url_, true)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Delta upgrade failed, falling back to the full image");
+    }
+    return Upgrade(firmware_url_, false);
 }
 
 std::vector<int> Ota::ParseVersion(const std::string& version) {
@@ -3,9 +3,41 @@
 
 #include <functional>
 #include <string>
+#include <memory>
+#include <atomic>
 
 #include <esp_err.h>
+#include <esp_ota_ops.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/event_groups.h>
+#include <mbedtls/sha256.h>
 #include "board.h"
+#include "delta_patch.h"
+
+// The firmware is downloaded into these buffers while the flash writer task drains the filled ones
+#define OTA_PIPELINE_BUFFER_COUNT 2
+#define OTA_FLASH_WRITER_DONE_EVENT (1 << 0)
+// An interrupted download is continued with a Range request, the checkpoint keeps it for the next upgrade
+#define OTA_MAX_DOWNLOAD_ATTEMPTS 3
+#define OTA_RETRY_DELAY_MS 3000
+#define OTA_CHECKPOINT_NAMESPACE "ota_checkpoint"
+// The last good CheckVersion response, so that the protocol can start before the version check, see LoadCachedResponse
+#define OTA_CACHE_NAMESPACE "ota_cache"
+#define OTA_CACHE_MAX_RESPONSE_SIZE 3900    // NVS strings are limited to 4000 bytes
+
+struct OtaUpgradeStatistics {
+    bool delta = false;             // A patch against the running firmware was downloaded
+    size_t total_bytes = 0;         // Bytes downloaded, in all attempts
+    size_t buffer_size = 0;
+    int resume_count = 0;
+    size_t resumed_bytes = 0;       // Bytes not downloaded again thanks to the resumes
+    int64_t elapsed_us = 0;
+    int64_t network_us = 0;         // Time spent in Http::Read
+    int64_t flash_us = 0;           // Time spent erasing and writing the flash
+    int64_t reader_stall_us = 0;    // Network reader waiting for a free buffer, flash bound
+    int64_t writer_stall_us = 0;    // Flash writer waiting for a filled buffer, network bound
+};
 
 class Ota {
 public:
@@ -13,6 +45,8 @@ public:
     ~Ota();
 
     bool CheckVersion();
+    // Loads the protocol config from the cached response of this firmware version, without the network
+    bool LoadCachedResponse();
     esp_err_t Activate();
     bool HasActivationChallenge() { return has_activation_challenge_; }
     bool HasNewVersion() { return has_new_version_; }
@@ -28,6 +62,7 @@ public:
     const std::string& GetActivationMessage() const { return activation_message_; }
     const std::string& GetActivationCode() const { return activation_code_; }
     std::string GetCheckVersionUrl();
+    const OtaUpgradeStatistics& GetUpgradeStatistics() const { return upgrade_statistics_; }
 
 private:
     std::string activation_message_;
@@ -42,11 +77,43 @@ private:
     std::string current_version_;
     std::string firmware_version_;
     std::string firmware_url_;
+    std::string firmware_sha256_;
+    std::string firmware_delta_url_;
     std::string activation_challenge_;
     std::string serial_number_;
     int activation_timeout_ms_ = 30000;
+    int timezone_offset_ = 0;       // Minutes, from the last server_time section
+
+    struct OtaBuffer {
+        uint8_t* data;
+        size_t size;
+    };
+    QueueHandle_t free_buffers_ = nullptr;
+    QueueHandle_t filled_buffers_ = nullptr;
+    EventGroupHandle_t flash_writer_event_group_ = nullptr;
+    std::atomic<esp_err_t> flash_write_error_ = ESP_OK;
+    OtaUpgradeStatistics upgrade_statistics_;
+    std::string upgrade_url_;
+    const esp_partition_t* update_partition_ = nullptr;
+    size_t firmware_size_ = 0;
+    size_t write_offset_ = 0;       // Bytes written to the update partition
+    size_t erased_offset_ = 0;      // End of the erased part of the update partition
+    size_t checkpoint_offset_ = 0;
+    mbedtls_sha256_context sha256_;
+    std::unique_ptr<DeltaPatcher> delta_patcher_;
 
-    bool Upgrade(const std::string& firmware_url);
+    bool ParseCheckVersionResponse(const std::string& data, bool cached);
+    void SaveCachedResponse(const std::string& data, const std::string& etag);
+    void SetTimeFromHttpDate(const std::string& date);
+    bool Upgrade(const std::string& firmware_url, bool delta);
+    esp_err_t DownloadFirmware();
+    void FlashWriterTask();
+    esp_err_t WriteFlash(const uint8_t* data, size_t size);
+    bool CheckDeltaSource(const DeltaPatchHeader& header);
+    void RestartDownload();
+    void LoadCheckpoint(uint8_t* buffer);
+    void SaveCheckpoint();
+    void ClearCheckpoint();
     std::function<void(int progress, size_t speed)> upgrade_callback_;
     std::vector<int> ParseVersion(const std::string& version);
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
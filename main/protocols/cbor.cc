@@ -0,0 +1,754 @@
+#include "cbor.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define CBOR_MAX_NUMBER_LENGTH 40           // Longer JSON numbers are rejected
+
+void CborWriter::WriteHead(uint8_t major, uint64_t value) {
+    major <<= 5;
+    if (value < 24) {
+        output_.push_back((char)(major | value));
+    } else if (value <= UINT8_MAX) {
+        output_.push_back((char)(major | 24));
+        output_.push_back((char)value);
+    } else if (value <= UINT16_MAX) {
+        output_.push_back((char)(major | 25));
+        output_.push_back((char)(value >> 8));
+        output_.push_back((char)value);
+    } else if (value <= UINT32_MAX) {
+        output_.push_back((char)(major | 26));
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            output_.push_back((char)(value >> shift));
+        }
+    } else {
+        output_.push_back((char)(major | 27));
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            output_.push_back((char)(value >> shift));
+        }
+    }
+}
+
+CborWriter& CborWriter::Text(std::string_view text) {
+    WriteHead(3, text.size());
+    output_.append(text.data(), text.size());
+    return *this;
+}
+
+CborWriter& CborWriter::Integer(int64_t value) {
+    if (value >= 0) {
+        WriteHead(0, (uint64_t)value);
+    } else {
+        WriteHead(1, (uint64_t)(-(value + 1)));
+    }
+    return *this;
+}
+
+CborWriter& CborWriter::Number(double value) {
+    if (std::isnan(value)) {
+        // The canonical half precision NaN
+        output_.push_back((char)0xf9);
+        output_.push_back((char)0x7e);
+        output_.push_back((char)0x00);
+        return *this;
+    }
+    if (value == std::trunc(value) && value >= -9223372036854775808.0 && value < 9223372036854775808.0) {
+        return Integer((int64_t)value);
+    }
+    float single = (float)value;
+    if ((double)single == value || std::isinf(value)) {
+        uint32_t bits;
+        memcpy(&bits, &single, sizeof(bits));
+        output_.push_back((char)0xfa);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            output_.push_back((char)(bits >> shift));
+        }
+        return *this;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    output_.push_back((char)0xfb);
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        output_.push_back((char)(bits >> shift));
+    }
+    return *this;
+}
+
+bool CborReader::ReadArgument(uint8_t info, uint64_t& value) {
+    if (info < 24) {
+        value = info;
+        return true;
+    }
+    if (info > 27) {
+        return Fail();
+    }
+    size_t length = (size_t)1 << (info - 24);
+    if (size_ - offset_ < length) {
+        return Fail();
+    }
+    value = 0;
+    for (size_t i = 0; i < length; i++) {
+        value = (value << 8) | data_[offset_++];
+    }
+    return true;
+}
+
+static double DecodeHalf(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    double value;
+    if (exponent == 0) {
+        value = std::ldexp(mantissa, -24);
+    } else if (exponent != 31) {
+        value = std::ldexp(mantissa + 1024, exponent - 25);
+    } else {
+        value = mantissa == 0 ? INFINITY : NAN;
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
+bool CborReader::Next(CborItem& item) {
+    bool tagged = false;
+    while (offset_ < size_) {
+        uint8_t initial = data_[offset_++];
+        uint8_t major = initial >> 5;
+        uint8_t info = initial & 0x1f;
+        item = CborItem();
+
+        if (major == 7) {
+            uint64_t bits;
+            switch (info) {
+                case 20:
+                case 21:
+                    item.type = kCborBool;
+                    item.boolean = info == 21;
+                    return true;
+                case 22:
+                case 23:                    // undefined has no JSON counterpart
+                    item.type = kCborNull;
+                    return true;
+                case 25:
+                case 26:
+                case 27:
+                    if (!ReadArgument(info, bits)) {
+                        return false;
+                    }
+                    item.type = kCborDouble;
+                    if (info == 25) {
+                        item.number = DecodeHalf((uint16_t)bits);
+                    } else if (info == 26) {
+                        uint32_t single_bits = (uint32_t)bits;
+                        float single;
+                        memcpy(&single, &single_bits, sizeof(single));
+                        item.number = single;
+                    } else {
+                        memcpy(&item.number, &bits, sizeof(item.number));
+                    }
+                    return true;
+                case 31:
+                    item.type = kCborBreak;
+                    return true;
+                default:
+                    return Fail();
+            }
+        }
+
+        if (info == 31) {
+            // Indefinite length strings would need to be joined, they are not used by the schema
+            if (major != 4 && major != 5) {
+                return Fail();
+            }
+            item.type = major == 4 ? kCborArray : kCborMap;
+            item.indefinite = true;
+            return true;
+        }
+
+        uint64_t value;
+        if (!ReadArgument(info, value)) {
+            return false;
+        }
+        size_t remaining = size_ - offset_;
+        switch (major) {
+            case 0:
+                if (value > INT64_MAX) {
+                    item.type = kCborDouble;
+                    item.number = (double)value;
+                } else {
+                    item.type = kCborInteger;
+                    item.integer = (int64_t)value;
+                    item.number = (double)item.integer;
+                }
+                return true;
+            case 1:
+                if (value > INT64_MAX) {
+                    item.type = kCborDouble;
+                    item.number = -1.0 - (double)value;
+                } else {
+                    item.type = kCborInteger;
+                    item.integer = -1 - (int64_t)value;
+                    item.number = (double)item.integer;
+                }
+                return true;
+            case 2:
+            case 3:
+                if (value > remaining) {
+                    return Fail();
+                }
+                item.type = major == 2 ? kCborBytes : kCborText;
+                item.string = std::string_view((const char*)data_ + offset_, (size_t)value);
+                offset_ += (size_t)value;
+                return true;
+            case 4:
+            case 5:
+                // Every element takes at least one byte, larger counts cannot be valid
+                if (value > remaining || (major == 5 && value > remaining / 2)) {
+                    return Fail();
+                }
+                item.type = major == 4 ? kCborArray : kCborMap;
+                item.count = value;
+                return true;
+            default:
+                // A tag, the tagged item is read as is
+                tagged = true;
+                continue;
+        }
+    }
+    return tagged ? Fail() : false;
+}
+
+static bool SkipItem(CborReader& reader, const CborItem& item, int depth) {
+    if (item.type != kCborMap && item.type != kCborArray) {
+        return true;
+    }
+    if (depth >= CBOR_MAX_DEPTH) {
+        return false;
+    }
+    CborItem child;
+    if (item.indefinite) {
+        while (reader.Next(child)) {
+            if (child.type == kCborBreak) {
+                return true;
+            }
+            if (!SkipItem(reader, child, depth + 1)) {
+                return false;
+            }
+        }
+        return false;
+    }
+    uint64_t items = item.type == kCborMap ? item.count * 2 : item.count;
+    for (uint64_t i = 0; i < items; i++) {
+        if (!reader.Next(child) || child.type == kCborBreak || !SkipItem(reader, child, depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CborReader::Skip(const CborItem& item) {
+    if (!SkipItem(*this, item, 0)) {
+        return Fail();
+    }
+    return true;
+}
+
+namespace {
+
+class JsonTranscoder {
+public:
+    JsonTranscoder(std::string_view json, std::string& output) : p_(json.data()), end_(json.data() + json.size()), writer_(output) {}
+
+    bool Run() {
+        SkipSpace();
+        if (!Value(0)) {
+            return false;
+        }
+        SkipSpace();
+        return p_ == end_;
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+    CborWriter writer_;
+
+    void SkipSpace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+            p_++;
+        }
+    }
+
+    bool Literal(const char* literal) {
+        size_t length = strlen(literal);
+        if ((size_t)(end_ - p_) < length || memcmp(p_, literal, length) != 0) {
+            return false;
+        }
+        p_ += length;
+        return true;
+    }
+
+    bool Value(int depth) {
+        if (p_ >= end_) {
+            return false;
+        }
+        switch (*p_) {
+            case '{':
+                return Object(depth);
+            case '[':
+                return Array(depth);
+            case '"':
+                return String();
+            case 't':
+                writer_.Bool(true);
+                return Literal("true");
+            case 'f':
+                writer_.Bool(false);
+                return Literal("false");
+            case 'n':
+                writer_.Null();
+                return Literal("null");
+            default:
+                return Number();
+        }
+    }
+
+    bool Object(int depth) {
+        if (depth >= CBOR_MAX_DEPTH) {
+            return false;
+        }
+        p_++;
+        writer_.BeginMap();
+        SkipSpace();
+        if (p_ < end_ && *p_ == '}') {
+            p_++;
+            writer_.End();
+            return true;
+        }
+        while (true) {
+            SkipSpace();
+            if (p_ >= end_ || *p_ != '"' || !String()) {
+                return false;
+            }
+            SkipSpace();
+            if (p_ >= end_ || *p_++ != ':') {
+                return false;
+            }
+            SkipSpace();
+            if (!Value(depth + 1)) {
+                return false;
+            }
+            SkipSpace();
+            if (p_ >= end_) {
+                return false;
+            }
+            char c = *p_++;
+            if (c == '}') {
+                writer_.End();
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+        }
+    }
+
+    bool Array(int depth) {
+        if (depth >= CBOR_MAX_DEPTH) {
+            return false;
+        }
+        p_++;
+        writer_.BeginArray();
+        SkipSpace();
+        if (p_ < end_ && *p_ == ']') {
+            p_++;
+            writer_.End();
+            return true;
+        }
+        while (true) {
+            SkipSpace();
+            if (!Value(depth + 1)) {
+                return false;
+            }
+            SkipSpace();
+            if (p_ >= end_) {
+                return false;
+            }
+            char c = *p_++;
+            if (c == ']') {
+                writer_.End();
+                return true;
+            }
+            if (c != ',') {
+                return false;
+            }
+        }
+    }
+
+    static int HexDigit(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static bool ReadHex4(const char* p, const char* end, uint32_t& value) {
+        if (end - p < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            int digit = HexDigit(p[i]);
+            if (digit < 0) {
+                return false;
+            }
+            value = (value << 4) | digit;
+        }
+        return true;
+    }
+
+    // Decodes the escape at p (after the backslash), returns the code point and the escape length
+    static bool Escape(const char* p, const char* end, uint32_t& code_point, int& length) {
+        if (p >= end) {
+            return false;
+        }
+        length = 1;
+        switch (*p) {
+            case '"': code_point = '"'; return true;
+            case '\\': code_point = '\\'; return true;
+            case '/': code_point = '/'; return true;
+            case 'b': code_point = '\b'; return true;
+            case 'f': code_point = '\f'; return true;
+            case 'n': code_point = '\n'; return true;
+            case 'r': code_point = '\r'; return true;
+            case 't': code_point = '\t'; return true;
+            case 'u':
+                break;
+            default:
+                return false;
+        }
+        if (!ReadHex4(p + 1, end, code_point)) {
+            return false;
+        }
+        length = 5;
+        if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+            return false;
+        }
+        if (code_point >= 0xd800 && code_point <= 0xdbff) {
+            uint32_t low;
+            if (end - p < 11 || p[5] != '\\' || p[6] != 'u' || !ReadHex4(p + 7, end, low) ||
+                low < 0xdc00 || low > 0xdfff) {
+                return false;
+            }
+            code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            length = 11;
+        }
+        return true;
+    }
+
+    static int Utf8Length(uint32_t code_point) {
+        return code_point < 0x80 ? 1 : code_point < 0x800 ? 2 : code_point < 0x10000 ? 3 : 4;
+    }
+
+    static void AppendUtf8(std::string& output, uint32_t code_point) {
+        if (code_point < 0x80) {
+            output.push_back((char)code_point);
+        } else if (code_point < 0x800) {
+            output.push_back((char)(0xc0 | (code_point >> 6)));
+            output.push_back((char)(0x80 | (code_point & 0x3f)));
+        } else if (code_point < 0x10000) {
+            output.push_back((char)(0xe0 | (code_point >> 12)));
+            output.push_back((char)(0x80 | ((code_point >> 6) & 0x3f)));
+            output.push_back((char)(0x80 | (code_point & 0x3f)));
+        } else {
+            output.push_back((char)(0xf0 | (code_point >> 18)));
+            output.push_back((char)(0x80 | ((code_point >> 12) & 0x3f)));
+            output.push_back((char)(0x80 | ((code_point >> 6) & 0x3f)));
+            output.push_back((char)(0x80 | (code_point & 0x3f)));
+        }
+    }
+
+    /*
+     * A definite length string needs its size before the content, so the escapes are
+     * measured in a first pass and decoded straight into the output in the second.
+     */
+    bool String() {
+        const char* start = ++p_;
+        size_t size = 0;
+        const char* p = start;
+        while (true) {
+            if (p >= end_ || (uint8_t)*p < 0x20) {
+                return false;
+            }
+            if (*p == '"') {
+                break;
+            }
+            if (*p == '\\') {
+                uint32_t code_point;
+                int length;
+                if (!Escape(p + 1, end_, code_point, length)) {
+                    return false;
+                }
+                size += Utf8Length(code_point);
+                p += 1 + length;
+            } else {
+                size++;
+                p++;
+            }
+        }
+
+        writer_.TextHead(size);
+        std::string& output = writer_.output();
+        while (p_ < p) {
+            const char* run = p_;
+            while (p_ < p && *p_ != '\\') {
+                p_++;
+            }
+            output.append(run, p_ - run);
+            if (p_ < p) {
+                uint32_t code_point;
+                int length;
+                Escape(p_ + 1, end_, code_point, length);
+                AppendUtf8(output, code_point);
+                p_ += 1 + length;
+            }
+        }
+        p_++;
+        return true;
+    }
+
+    bool Number() {
+        const char* start = p_;
+        bool integer = true;
+        if (p_ < end_ && *p_ == '-') {
+            p_++;
+        }
+        if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+            return false;
+        }
+        if (*p_ == '0') {
+            p_++;
+        } else {
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+                p_++;
+            }
+        }
+        if (p_ < end_ && *p_ == '.') {
+            integer = false;
+            p_++;
+            if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+                return false;
+            }
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+                p_++;
+            }
+        }
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+            integer = false;
+            p_++;
+            if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+                p_++;
+            }
+            if (p_ >= end_ || *p_ < '0' || *p_ > '9') {
+                return false;
+            }
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+                p_++;
+            }
+        }
+
+        // The input is not terminated, the number is copied for strtoll / strtod
+        char buffer[CBOR_MAX_NUMBER_LENGTH];
+        size_t length = p_ - start;
+        if (length >= sizeof(buffer)) {
+            return false;
+        }
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        if (integer) {
+            errno = 0;
+            long long value = strtoll(buffer, nullptr, 10);
+            if (errno == 0) {
+                writer_.Integer(value);
+                return true;
+            }
+        }
+        writer_.Number(strtod(buffer, nullptr));
+        return true;
+    }
+
+};
+
+}  // namespace
+
+bool CborFromJson(std::string_view json, std::string& output) {
+    JsonTranscoder transcoder(json, output);
+    return transcoder.Run();
+}
+
+CborWriter& CborWriter::Raw(std::string_view json) {
+    size_t size = output_.size();
+    if (!CborFromJson(json, output_)) {
+        output_.resize(size);
+        Null();
+    }
+    return *this;
+}
+
+static void AppendJsonString(std::string& output, std::string_view text) {
+    static const char kHex[] = "0123456789abcdef";
+    output.push_back('"');
+    for (char c : text) {
+        switch (c) {
+            case '"': output.append("\\\""); break;
+            case '\\': output.append("\\\\"); break;
+            case '\b': output.append("\\b"); break;
+            case '\f': output.append("\\f"); break;
+            case '\n': output.append("\\n"); break;
+            case '\r': output.append("\\r"); break;
+            case '\t': output.append("\\t"); break;
+            default:
+                if ((uint8_t)c < 0x20) {
+                    output.append("\\u00");
+                    output.push_back(kHex[(uint8_t)c >> 4]);
+                    output.push_back(kHex[c & 0xf]);
+                } else {
+                    output.push_back(c);
+                }
+        }
+    }
+    output.push_back('"');
+}
+
+// The shortest form that reads back as the same double
+static void AppendJsonNumber(std::string& output, double value) {
+    if (!std::isfinite(value)) {
+        output.append("null");
+        return;
+    }
+    char buffer[32];
+    if (value == std::trunc(value) && std::fabs(value) < 9007199254740992.0) {
+        // Exact integers, also the ones that came as floats, are written without an exponent
+        snprintf(buffer, sizeof(buffer), "%.0f", value);
+        output.append(buffer);
+        return;
+    }
+    for (int precision = 1; precision <= 17; precision++) {
+        snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (strtod(buffer, nullptr) == value) {
+            break;
+        }
+    }
+    output.append(buffer);
+}
+
+static bool WriteJson(CborReader& reader, const CborItem& item, std::string& output, int depth) {
+    char buffer[24];
+    switch (item.type) {
+        case kCborInteger:
+            snprintf(buffer, sizeof(buffer), "%lld", (long long)item.integer);
+            output.append(buffer);
+            return true;
+        case kCborDouble:
+            AppendJsonNumber(output, item.number);
+            return true;
+        case kCborText:
+            AppendJsonString(output, item.string);
+            return true;
+        case kCborBool:
+            output.append(item.boolean ? "true" : "false");
+            return true;
+        case kCborNull:
+            output.append("null");
+            return true;
+        case kCborMap:
+        case kCborArray:
+            break;
+        default:
+            // Byte strings have no JSON form and are not used by the schema
+            return false;
+    }
+    if (depth >= CBOR_MAX_DEPTH) {
+        return false;
+    }
+
+    bool map = item.type == kCborMap;
+    output.push_back(map ? '{' : '[');
+    CborItem child;
+    for (uint64_t i = 0; item.indefinite || i < item.count; i++) {
+        if (!reader.Next(child)) {
+            return false;
+        }
+        if (child.type == kCborBreak) {
+            if (!item.indefinite) {
+                return false;
+            }
+            break;
+        }
+        if (i > 0) {
+            output.push_back(',');
+        }
+        if (map) {
+            if (child.type != kCborText) {
+                return false;
+            }
+            AppendJsonString(output, child.string);
+            output.push_back(':');
+            if (!reader.Next(child) || child.type == kCborBreak) {
+                return false;
+            }
+        }
+        if (!WriteJson(reader, child, output, depth + 1)) {
+            return false;
+        }
+    }
+    output.push_back(map ? '}' : ']');
+    return true;
+}
+
+bool CborToJson(const uint8_t* data, size_t size, std::string& output) {
+    CborReader reader(data, size);
+    CborItem item;
+    if (!reader.Next(item) || !WriteJson(reader, item, output, 0)) {
+        return false;
+    }
+    return reader.AtEnd();
+}
+
+bool CborReadMessage(const uint8_t* data, size_t size, CborMessage& message) {
+    message = CborMessage();
+    CborReader reader(data, size);
+    CborItem map;
+    if (!reader.Next(map) || map.type != kCborMap) {
+        return false;
+    }
+    CborItem key;
+    CborItem value;
+    for (uint64_t i = 0; map.indefinite || i < map.count; i++) {
+        if (!reader.Next(key) || (key.type == kCborBreak && !map.indefinite)) {
+            return false;
+        }
+        if (key.type == kCborBreak) {
+            break;
+        }
+        size_t value_offset = reader.offset();
+        if (key.type != kCborText || !reader.Next(value) || value.type == kCborBreak || !reader.Skip(value)) {
+            return false;
+        }
+        if (key.string == "payload") {
+            message.payload = std::string_view((const char*)data + value_offset, reader.offset() - value_offset);
+        } else if (value.type != kCborText) {
+            continue;
+        } else if (key.string == "type") {
+            message.type = value.string;
+        } else if (key.string == "state") {
+            message.state = value.string;
+        } else if (key.string == "text") {
+            message.text = value.string;
+        } else if (key.string == "emotion") {
+            message.emotion = value.string;
+        }
+    }
+    return reader.AtEnd();
+}
@@ -0,0 +1,151 @@
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/*
+ * Minimal CBOR (RFC 8949) for the control channel: the same messages as the JSON path, with
+ * the same keys and values, in a smaller binary form. The writer appends to a caller owned
+ * string and the reader returns strings as views into the input, so neither allocates.
+ * The reader accepts any well formed item; the JSON conversion rejects byte strings and maps
+ * with non-text keys, which JSON cannot carry.
+ */
+
+#define CBOR_MAX_DEPTH 16                   // Nesting of maps and arrays
+
+enum CborType {
+    kCborInvalid,
+    kCborInteger,
+    kCborDouble,
+    kCborText,
+    kCborBytes,
+    kCborBool,
+    kCborNull,
+    kCborMap,
+    kCborArray,
+    kCborBreak,                             // End of an indefinite length map or array
+};
+
+struct CborItem {
+    CborType type = kCborInvalid;
+    int64_t integer = 0;
+    double number = 0;                      // Also set for integers
+    bool boolean = false;
+    std::string_view string;                // Text or bytes, points into the input
+    uint64_t count = 0;                     // Entries of a map or elements of an array
+    bool indefinite = false;                // The map or array ends with a break
+};
+
+class CborWriter {
+public:
+    explicit CborWriter(std::string& output) : output_(output) {}
+
+    // Indefinite length, closed by End
+    CborWriter& BeginMap() { output_.push_back((char)0xbf); return *this; }
+    CborWriter& BeginArray() { output_.push_back((char)0x9f); return *this; }
+    CborWriter& BeginMap(uint64_t count) { WriteHead(5, count); return *this; }
+    CborWriter& BeginArray(uint64_t count) { WriteHead(4, count); return *this; }
+    CborWriter& End() { output_.push_back((char)0xff); return *this; }
+
+    CborWriter& Text(std::string_view text);
+    // Writes the head of a text string, the caller appends size bytes
+    void TextHead(size_t size) { WriteHead(3, size); }
+    CborWriter& Integer(int64_t value);
+    // Written as an integer when it is one, else as the shortest float that keeps the value
+    CborWriter& Number(double value);
+    CborWriter& Bool(bool value) { output_.push_back(value ? (char)0xf5 : (char)0xf4); return *this; }
+    CborWriter& Null() { output_.push_back((char)0xf6); return *this; }
+
+    /*
+     * The interface of JsonWriter, so a message is built once by code that takes either writer.
+     * Objects and arrays are indefinite, which gives the bytes CborFromJson gives for the JSON
+     * that JsonWriter writes from the same calls.
+     */
+    CborWriter& BeginObject() { return BeginMap(); }
+    CborWriter& EndObject() { return End(); }
+    CborWriter& EndArray() { return End(); }
+    CborWriter& Key(std::string_view key) { return Text(key); }
+    CborWriter& String(std::string_view value) { return Text(value); }
+    CborWriter& Int(int64_t value) { return Integer(value); }
+    // A value that is JSON already, transcoded in place; written as null if it is not valid JSON
+    CborWriter& Raw(std::string_view json);
+
+    template <typename T>
+    CborWriter& Field(std::string_view key, const T& value) {
+        Key(key);
+        return Value(value);
+    }
+
+    std::string& output() { return output_; }
+
+private:
+    std::string& output_;
+
+    void WriteHead(uint8_t major, uint64_t value);
+
+    CborWriter& Value(std::string_view value) { return Text(value); }
+    CborWriter& Value(const std::string& value) { return Text(value); }
+    CborWriter& Value(const char* value) { return Text(value); }
+    CborWriter& Value(bool value) { return Bool(value); }
+    CborWriter& Value(int value) { return Integer(value); }
+    CborWriter& Value(unsigned int value) { return Integer(value); }
+    CborWriter& Value(long value) { return Integer(value); }
+    CborWriter& Value(unsigned long value) { return Integer((int64_t)value); }
+    CborWriter& Value(long long value) { return Integer(value); }
+    CborWriter& Value(unsigned long long value) { return Integer((int64_t)value); }
+    CborWriter& Value(float value) { return Number(value); }
+    CborWriter& Value(double value) { return Number(value); }
+};
+
+class CborReader {
+public:
+    CborReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    // Reads the next item, tags are skipped. Returns false at the end of the input or on an error
+    bool Next(CborItem& item);
+    // Skips the item just read, including the content of a map or array
+    bool Skip(const CborItem& item);
+
+    bool error() const { return error_; }
+    size_t offset() const { return offset_; }
+    bool AtEnd() const { return offset_ == size_; }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_ = 0;
+    bool error_ = false;
+
+    bool ReadArgument(uint8_t info, uint64_t& value);
+    bool Fail() { error_ = true; return false; }
+};
+
+// Transcodes a JSON text into CBOR without building a tree, maps and arrays get indefinite lengths
+bool CborFromJson(std::string_view json, std::string& output);
+// Writes the CBOR item as compact JSON, the keys of maps must be text
+bool CborToJson(const uint8_t* data, size_t size, std::string& output);
+
+/*
+ * The members of a control message that the frequent messages need, as views into the input.
+ * A member that is missing or not text has a null data(), payload spans the encoded item.
+ */
+struct CborMessage {
+    std::string_view type;
+    std::string_view state;
+    std::string_view text;
+    std::string_view emotion;
+    std::string_view payload;
+};
+
+// Reads the top level map of a control message without building a tree, other members are skipped
+bool CborReadMessage(const uint8_t* data, size_t size, CborMessage& message);
+
+// A control message is a map, a JSON text starts with '{'
+inline bool CborIsMap(uint8_t first_byte) {
+    return (first_byte >> 5) == 5;
+}
+
+#endif // CBOR_H
@@ -0,0 +1,136 @@
+#include "link_quality.h"
+
+#include <cmath>
+#include <algorithm>
+
+#define RTT_SMOOTHING 0.125f                // As TCP's SRTT
+#define JITTER_SMOOTHING 0.0625f            // As RTP's interarrival jitter
+#define LOSS_SMOOTHING 0.125f
+
+// Thresholds for a conversation to stay fluent, a poor link gets the smallest uplink
+#define FAIR_RTT_MS 250
+#define FAIR_JITTER_MS 80
+#define FAIR_LOSS_PERCENT 3
+#define POOR_RTT_MS 600
+#define POOR_JITTER_MS 200
+#define POOR_LOSS_PERCENT 10
+
+void LinkQualityEstimator::Reset() {
+    for (auto& probe : probes_) {
+        probe.pending = false;
+    }
+    previous_rtt_ms_ = 0;
+    rtt_ = 0;
+    jitter_ = 0;
+    loss_ = 0;
+    level_ = kLinkQualityUnknown;
+    candidate_ = kLinkQualityUnknown;
+    candidate_count_ = 0;
+    statistics_ = LinkQualityStatistics();
+}
+
+uint32_t LinkQualityEstimator::OnProbeSent(uint32_t now_ms) {
+    Update(now_ms);
+    // Reuse the oldest slot if every probe is still waiting
+    Probe* slot = &probes_[0];
+    for (auto& probe : probes_) {
+        if (!probe.pending) {
+            slot = &probe;
+            break;
+        }
+        if (probe.sent_ms - slot->sent_ms > 0x80000000u) {
+            slot = &probe;
+        }
+    }
+    if (slot->pending) {
+        OnProbeLost();
+    }
+    slot->id = next_id_++;
+    slot->sent_ms = now_ms;
+    slot->pending = true;
+    statistics_.probes_sent++;
+    return slot->id;
+}
+
+void LinkQualityEstimator::OnProbeAnswered(uint32_t id, uint32_t now_ms) {
+    for (auto& probe : probes_) {
+        if (!probe.pending || probe.id != id) {
+            continue;
+        }
+        probe.pending = false;
+        uint32_t rtt_ms = now_ms - probe.sent_ms;
+        statistics_.probes_answered++;
+        if (statistics_.probes_answered == 1) {
+            rtt_ = rtt_ms;
+            statistics_.min_rtt_ms = rtt_ms;
+        } else {
+            rtt_ += (rtt_ms - rtt_) * RTT_SMOOTHING;
+            jitter_ += (std::fabs((float)rtt_ms - previous_rtt_ms_) - jitter_) * JITTER_SMOOTHING;
+            statistics_.min_rtt_ms = std::min(statistics_.min_rtt_ms, rtt_ms);
+        }
+        previous_rtt_ms_ = rtt_ms;
+        loss_ -= loss_ * LOSS_SMOOTHING;
+        UpdateLevel();
+        return;
+    }
+    // Answered after it was counted as lost, the round trip is too long to be useful
+}
+
+void LinkQualityEstimator::Update(uint32_t now_ms) {
+    for (auto& probe : probes_) {
+        if (probe.pending && now_ms - probe.sent_ms >= LINK_PROBE_TIMEOUT_MS) {
+            probe.pending = false;
+            OnProbeLost();
+        }
+    }
+}
+
+void LinkQualityEstimator::OnProbeLost() {
+    statistics_.probes_lost++;
+    // Until the server answers once, it may just not know the probe
+    if (statistics_.probes_answered == 0) {
+        return;
+    }
+    loss_ += (1.0f - loss_) * LOSS_SMOOTHING;
+    UpdateLevel();
+}
+
+void LinkQualityEstimator::UpdateLevel() {
+    statistics_.rtt_ms = (uint32_t)rtt_;
+    statistics_.jitter_ms = (uint32_t)jitter_;
+    statistics_.loss_percent = loss_ * 100;
+
+    LinkQualityLevel level = kLinkQualityGood;
+    if (rtt_ >= POOR_RTT_MS || jitter_ >= POOR_JITTER_MS || statistics_.loss_percent >= POOR_LOSS_PERCENT) {
+        level = kLinkQualityPoor;
+    } else if (rtt_ >= FAIR_RTT_MS || jitter_ >= FAIR_JITTER_MS || statistics_.loss_percent >= FAIR_LOSS_PERCENT) {
+        level = kLinkQualityFair;
+    }
+
+    if (level == level_) {
+        candidate_count_ = 0;
+        return;
+    }
+    if (level != candidate_) {
+        candidate_ = level;
+        candidate_count_ = 0;
+    }
+    // The first measurement is taken as is, later changes need to be confirmed
+    if (++candidate_count_ >= LINK_QUALITY_HOLD_PROBES || level_ == kLinkQualityUnknown) {
+        level_ = level;
+        candidate_count_ = 0;
+    }
+}
+
+const char* LinkQualityEstimator::LevelName(LinkQualityLevel level) {
+    switch (level) {
+        case kLinkQualityGood:
+            return "good";
+        case kLinkQualityFair:
+            return "fair";
+        case kLinkQualityPoor:
+            return "poor";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef LINK_QUALITY_H
+#define LINK_QUALITY_H
+
+#include <cstdint>
+
+/*
+ * Estimates round trip time, jitter and loss of the control channel from ping / pong probes.
+ * Times are milliseconds of a monotonic clock and may wrap at 32 bits. The estimator is not
+ * thread safe, Protocol calls it under link_quality_mutex_.
+ */
+
+#define LINK_PROBE_INTERVAL_SECONDS 2       // While a conversation is running
+#define LINK_PROBE_TIMEOUT_MS 3000          // An unanswered probe counts as lost after this
+#define LINK_PROBE_MAX_OUTSTANDING 4
+#define LINK_QUALITY_HOLD_PROBES 2          // A new level must be seen this many times in a row
+
+enum LinkQualityLevel {
+    kLinkQualityUnknown,                    // No probe answered yet, the server may not support pong
+    kLinkQualityGood,
+    kLinkQualityFair,
+    kLinkQualityPoor,
+};
+
+struct LinkQualityStatistics {
+    uint32_t probes_sent = 0;
+    uint32_t probes_answered = 0;
+    uint32_t probes_lost = 0;
+    uint32_t rtt_ms = 0;                    // Smoothed
+    uint32_t min_rtt_ms = 0;
+    uint32_t jitter_ms = 0;                 // Smoothed difference between consecutive round trips
+    float loss_percent = 0;                 // Smoothed over about the last 8 probes
+};
+
+class LinkQualityEstimator {
+public:
+    void Reset();
+    // Returns the id to put in the probe
+    uint32_t OnProbeSent(uint32_t now_ms);
+    void OnProbeAnswered(uint32_t id, uint32_t now_ms);
+    // Counts the probes that were not answered in time as lost
+    void Update(uint32_t now_ms);
+
+    LinkQualityLevel level() const { return level_; }
+    const LinkQualityStatistics& statistics() const { return statistics_; }
+    static const char* LevelName(LinkQualityLevel level);
+
+private:
+    struct Probe {
+        uint32_t id = 0;
+        uint32_t sent_ms = 0;
+        bool pending = false;
+    };
+    Probe probes_[LINK_PROBE_MAX_OUTSTANDING];
+    uint32_t next_id_ = 1;
+    uint32_t previous_rtt_ms_ = 0;
+    float rtt_ = 0;
+    float jitter_ = 0;
+    float loss_ = 0;
+    LinkQualityLevel level_ = kLinkQualityUnknown;
+    LinkQualityLevel candidate_ = kLinkQualityUnknown;
+    int candidate_count_ = 0;
+    LinkQualityStatistics statistics_;
+
+    void OnProbeLost();
+    void UpdateLevel();
+};
+
+#endif // LINK_QUALITY_H
@@ -4,18 +4,47 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
+#include "cbor.h"
 
 #define TAG "MQTT"
 
 MqttProtocol::MqttProtocol() {
     event_group_handle_ = xEventGroupCreate();
+    mbedtls_aes_init(&aes_ctx_);
+    udp_send_buffer_.reserve(MQTT_UDP_MAX_PACKET_SIZE);
+    reorder_window_.Configure(CONFIG_MQTT_UDP_REORDER_PACKETS, CONFIG_MQTT_UDP_REORDER_MAX_WAIT_MS);
+    release_audio_ = [this](std::unique_ptr<AudioStreamPacket> packet) {
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(std::move(packet));
+        }
+    };
+
+    // The gap at the end of a burst has no later packet to expire it in Push
+    esp_timer_create_args_t reorder_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (MqttProtocol*)arg;
+            std::lock_guard<std::mutex> lock(protocol->reorder_mutex_);
+            protocol->reorder_window_.Expire(esp_timer_get_time() / 1000, protocol->release_audio_);
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "reorder_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&reorder_timer_args, &reorder_timer_handle_);
 }
 
 MqttProtocol::~MqttProtocol() {
     ESP_LOGI(TAG, "MqttProtocol deinit");
+    esp_timer_stop(reorder_timer_handle_);
+    esp_timer_delete(reorder_timer_handle_);
+    mbedtls_aes_free(&aes_ctx_);
     vEventGroupDelete(event_group_handle_);
 }
 
@@ -54,10 +83,32 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
-            ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
-            return;
+        // A CBOR control message is a map, a JSON one starts with '{'
+        cJSON* root;
+        if (!payload.empty() && CborIsMap(payload[0])) {
+            // The frequent messages are handled from views into the payload, the others get a tree
+            CborMessage message;
+            if (CborReadMessage((const uint8_t*)payload.data(), payload.size(), message) &&
+                message.type != "hello" && message.type != "goodbye" && message.type != "pong") {
+                if (message.type == "tts" && message.state == "stop") {
+                    FlushReorderWindow();
+                }
+                if (DispatchCborMessage(message)) {
+                    last_incoming_time_ = std::chrono::steady_clock::now();
+                    return;
+                }
+            }
+            root = ParseCbor((const uint8_t*)payload.data(), payload.size());
+            if (root == nullptr) {
+                ESP_LOGE(TAG, "Failed to parse CBOR message, size: %u", payload.size());
+                return;
+            }
+        } else {
+            root = cJSON_Parse(payload.c_str());
+            if (root == nullptr) {
+                ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
+                return;
+            }
         }
         cJSON* type = cJSON_GetObjectItem(root, "type");
         if (!cJSON_IsString(type)) {
@@ -76,6 +127,14 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
                     CloseAudioChannel();
                 });
             }
+        } else if (strcmp(type->valuestring, "tts") == 0 && on_incoming_json_ != nullptr) {
+            auto state = cJSON_GetObjectItem(root, "state");
+            if (cJSON_IsString(state) && strcmp(state->valuestring, "stop") == 0) {
+                FlushReorderWindow();
+            }
+            on_incoming_json_(root);
+        } else if (strcmp(type->valuestring, "pong") == 0) {
+            OnPong(root);
         } else if (on_incoming_json_ != nullptr) {
             on_incoming_json_(root);
         }
@@ -103,10 +162,19 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
+// The tail of the speech must not wait for a packet that will not come
+void MqttProtocol::FlushReorderWindow() {
+    std::lock_guard<std::mutex> lock(reorder_mutex_);
+    reorder_window_.Flush(release_audio_);
+}
+
 bool MqttProtocol::SendText(const std::string& text) {
     if (publish_topic_.empty()) {
         return false;
     }
+    if (session_recorder_ != nullptr) {
+        session_recorder_->RecordText(kSessionRecordOutgoingText, text);
+    }
     if (!mqtt_->Publish(publish_topic_, text)) {
         ESP_LOGE(TAG, "Failed to publish message: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
@@ -115,33 +183,112 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
+// The CBOR is published as is, MQTT needs no header to tell it from JSON
+bool MqttProtocol::SendCbor(std::string& message) {
+    if (publish_topic_.empty()) {
+        return false;
+    }
+    if (!mqtt_->Publish(publish_topic_, message)) {
+        ESP_LOGE(TAG, "Failed to publish CBOR message, size: %u", message.size());
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return false;
     }
+    if (session_recorder_ != nullptr) {
+        session_recorder_->RecordAudio(kSessionRecordOutgoingAudio, *packet);
+    }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+    bool encrypted = EncryptAudio(&aes_ctx_, aes_nonce_, ++local_sequence_, *packet, udp_send_buffer_);
+    AudioPacketPool::GetInstance().Release(std::move(packet));
+    if (!encrypted) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    return udp_->Send(udp_send_buffer_) > 0;
+}
 
+/*
+ * Writes the nonce and the ciphertext into output. The output keeps its capacity between
+ * packets and the counter block lives on the stack, so nothing is allocated per frame.
+ * mbedtls uses the AES peripheral when CONFIG_MBEDTLS_HARDWARE_AES is enabled.
+ */
+bool MqttProtocol::EncryptAudio(mbedtls_aes_context* aes_ctx, const std::string& aes_nonce, uint32_t sequence,
+    const AudioStreamPacket& packet, std::string& output) {
+    size_t payload_size = packet.payload.size();
+    if (aes_nonce.size() != MQTT_UDP_NONCE_SIZE || payload_size > UINT16_MAX) {
+        return false;
+    }
+    output.resize(MQTT_UDP_NONCE_SIZE + payload_size);
+    auto nonce = (uint8_t*)output.data();
+    memcpy(nonce, aes_nonce.data(), MQTT_UDP_NONCE_SIZE);
+    *(uint16_t*)&nonce[2] = htons(payload_size);
+    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
+    *(uint32_t*)&nonce[12] = htonl(sequence);
+
+    // The counter block is advanced by mbedtls, the nonce in the packet must stay as sent
+    uint8_t counter[MQTT_UDP_NONCE_SIZE];
+    memcpy(counter, nonce, MQTT_UDP_NONCE_SIZE);
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
-        return false;
+    return mbedtls_aes_crypt_ctr(aes_ctx, payload_size, &nc_off, counter, stream_block,
+        packet.payload.data(), nonce + MQTT_UDP_NONCE_SIZE) == 0;
+}
+
+std::string MqttProtocol::BenchmarkAudioCrypto() {
+    const int kFrames = 1000;
+    const size_t kFrameSizes[] = { 40, 120, 400 };     // Silence, speech and music Opus frames
+
+    mbedtls_aes_context aes_ctx;
+    mbedtls_aes_init(&aes_ctx);
+    uint8_t key[16];
+    esp_fill_random(key, sizeof(key));
+    mbedtls_aes_setkey_enc(&aes_ctx, key, 128);
+    std::string nonce(MQTT_UDP_NONCE_SIZE, 0);
+    nonce[0] = 0x01;
+    std::string output;
+    output.reserve(MQTT_UDP_MAX_PACKET_SIZE);
+    AudioStreamPacket packet;
+
+    cJSON* root = cJSON_CreateObject();
+#if CONFIG_MBEDTLS_HARDWARE_AES
+    cJSON_AddBoolToObject(root, "hardware_aes", true);
+#else
+    cJSON_AddBoolToObject(root, "hardware_aes", false);
+#endif
+    cJSON* results = cJSON_CreateArray();
+    for (auto frame_size : kFrameSizes) {
+        packet.payload.assign(frame_size, 0x5A);
+        int64_t start_time = esp_timer_get_time();
+        for (int i = 0; i < kFrames; i++) {
+            EncryptAudio(&aes_ctx, nonce, i, packet, output);
+        }
+        int64_t elapsed_us = std::max<int64_t>(esp_timer_get_time() - start_time, 1);
+        cJSON* result = cJSON_CreateObject();
+        cJSON_AddNumberToObject(result, "frame_size", frame_size);
+        cJSON_AddNumberToObject(result, "us_per_frame", (double)elapsed_us / kFrames);
+        cJSON_AddNumberToObject(result, "kbytes_per_second", (double)frame_size * kFrames * 1000 / elapsed_us);
+        cJSON_AddItemToArray(results, result);
+        ESP_LOGI(TAG, "AES-CTR %u byte frames: %.1f us per frame", frame_size, (double)elapsed_us / kFrames);
     }
+    cJSON_AddItemToObject(root, "results", results);
+    mbedtls_aes_free(&aes_ctx);
 
-    return udp_->Send(encrypted) > 0;
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string json(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return json;
 }
 
 void MqttProtocol::CloseAudioChannel() {
+    esp_timer_stop(reorder_timer_handle_);
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
         udp_.reset();
@@ -167,6 +314,8 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    ResetLinkQuality();
+    control_cbor_ = false;
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 
@@ -192,7 +341,7 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < MQTT_UDP_NONCE_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -202,20 +351,15 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
 
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        // mbedtls advances the counter block, so it is copied out of the received data
+        uint8_t nonce[MQTT_UDP_NONCE_SIZE];
+        memcpy(nonce, data.data(), MQTT_UDP_NONCE_SIZE);
+        auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
+        auto packet = AudioPacketPool::GetInstance().Acquire(decrypted_size);
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
@@ -225,15 +369,22 @@ bool MqttProtocol::OpenAudioChannel() {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
             return;
         }
-        if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
+        {
+            // Duplicates and replays are dropped here, reordered packets are released in sequence
+            std::lock_guard<std::mutex> lock(reorder_mutex_);
+            reorder_window_.Push(sequence, std::move(packet), esp_timer_get_time() / 1000, release_audio_);
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
 
+    if (reorder_window_.depth() > 0) {
+        // Half the wait, so that a gap is given up at most max_wait_ms * 1.5 after it opened
+        esp_timer_stop(reorder_timer_handle_);
+        esp_timer_start_periodic(reorder_timer_handle_, CONFIG_MQTT_UDP_REORDER_MAX_WAIT_MS * 1000 / 2);
+    }
+
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
@@ -242,26 +393,30 @@ bool MqttProtocol::OpenAudioChannel() {
 
 std::string MqttProtocol::GetHelloMessage() {
     // 发送 hello 消息申请 UDP 通道
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "hello");
-    cJSON_AddNumberToObject(root, "version", 3);
-    cJSON_AddStringToObject(root, "transport", "udp");
-    cJSON* features = cJSON_CreateObject();
+    std::string message;
+    JsonWriter writer(message);
+    writer.BeginObject();
+    writer.Field("type", "hello");
+    writer.Field("version", 3);
+    writer.Field("transport", "udp");
+    writer.Key("features").BeginObject();
 #if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
+    writer.Field("aec", true);
 #endif
-    cJSON_AddBoolToObject(features, "mcp", true);
-    cJSON_AddItemToObject(root, "features", features);
-    cJSON* audio_params = cJSON_CreateObject();
-    cJSON_AddStringToObject(audio_params, "format", "opus");
-    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
-    cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
-    cJSON_AddItemToObject(root, "audio_params", audio_params);
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string message(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
+    writer.Field("mcp", true);
+#if CONFIG_CONTROL_CHANNEL_CBOR
+    writer.Field("cbor", true);
+#endif
+    writer.EndObject();
+    writer.Key("audio_params").BeginObject();
+    writer.Field("format", "opus");
+    writer.Field("sample_rate", 16000);
+    writer.Field("channels", 1);
+    writer.Field("frame_duration", OPUS_FRAME_DURATION_MS);
+    WriteDownlinkAudioParams(writer, Application::GetInstance().GetAudioService().GetPreferredDecodeSampleRate(),
+        OPUS_FRAME_DURATION_MS);
+    writer.EndObject();
+    writer.EndObject();
     return message;
 }
 
@@ -278,6 +433,11 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+#if CONFIG_CONTROL_CHANNEL_CBOR
+    control_cbor_ = cJSON_IsTrue(cJSON_GetObjectItem(cJSON_GetObjectItem(root, "features"), "cbor"));
+    ESP_LOGI(TAG, "CBOR control messages: %s", control_cbor_ ? "on" : "off");
+#endif
+
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -304,10 +464,12 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
     aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
-    remote_sequence_ = 0;
+    {
+        std::lock_guard<std::mutex> lock(reorder_mutex_);
+        reorder_window_.Reset();
+    }
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -333,3 +495,18 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
 bool MqttProtocol::IsAudioChannelOpened() const {
     return udp_ != nullptr && !error_occurred_ && !IsTimeout();
 }
+
+cJSON* MqttProtocol::GetTransportStatistics() {
+    std::lock_guard<std::mutex> lock(reorder_mutex_);
+    auto& statistics = reorder_window_.statistics();
+    cJSON* udp = cJSON_CreateObject();
+    cJSON_AddNumberToObject(udp, "reorder_depth", reorder_window_.depth());
+    cJSON_AddNumberToObject(udp, "received", statistics.received);
+    cJSON_AddNumberToObject(udp, "released", statistics.released);
+    cJSON_AddNumberToObject(udp, "reordered", statistics.reordered);
+    cJSON_AddNumberToObject(udp, "duplicate", statistics.duplicate);
+    cJSON_AddNumberToObject(udp, "late", statistics.late);
+    cJSON_AddNumberToObject(udp, "lost", statistics.lost);
+    cJSON_AddNumberToObject(udp, "resynced", statistics.resynced);
+    return udp;
+}
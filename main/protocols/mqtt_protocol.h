@@ -3,12 +3,14 @@
 
 
 #include "protocol.h"
+#include "reorder_window.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
 #include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
 
 #include <functional>
 #include <string>
@@ -19,6 +21,8 @@
 #define MQTT_RECONNECT_INTERVAL_MS 10000
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define MQTT_UDP_NONCE_SIZE 16
+#define MQTT_UDP_MAX_PACKET_SIZE 1500
 
 class MqttProtocol : public Protocol {
 public:
@@ -30,6 +34,10 @@ public:
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
+    cJSON* GetTransportStatistics() override;
+
+    // Encrypts frames the way SendAudio does and returns the throughput as JSON
+    static std::string BenchmarkAudioCrypto();
 
 private:
     EventGroupHandle_t event_group_handle_;
@@ -44,13 +52,22 @@ private:
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
-    uint32_t remote_sequence_;
+    std::mutex reorder_mutex_;
+    ReorderWindow<AudioStreamPacket> reorder_window_;
+    ReorderWindow<AudioStreamPacket>::Output release_audio_;
+    esp_timer_handle_t reorder_timer_handle_ = nullptr;     // Expires the held packets while the channel is open
+    std::string udp_send_buffer_;       // Nonce followed by the ciphertext, reused for every packet
 
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
+    static bool EncryptAudio(mbedtls_aes_context* aes_ctx, const std::string& aes_nonce, uint32_t sequence,
+        const AudioStreamPacket& packet, std::string& output);
+
+    void FlushReorderWindow();
 
     bool SendText(const std::string& text) override;
+    bool SendCbor(std::string& message) override;
     std::string GetHelloMessage();
 };
 
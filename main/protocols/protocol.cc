@@ -1,27 +1,108 @@
 #include "protocol.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define TAG "Protocol"
 
+std::unique_ptr<AudioStreamPacket> AudioPacketPool::Acquire(size_t capacity) {
+    std::unique_ptr<AudioStreamPacket> packet;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_packets_.empty()) {
+            packet = std::move(free_packets_.back());
+            free_packets_.pop_back();
+            reused_++;
+        } else {
+            allocated_++;
+        }
+    }
+    if (packet == nullptr) {
+        packet = std::make_unique<AudioStreamPacket>();
+    }
+    packet->payload.reserve(capacity + AUDIO_PACKET_HEADROOM);
+    return packet;
+}
+
+void AudioPacketPool::Release(std::unique_ptr<AudioStreamPacket> packet) {
+    if (packet == nullptr) {
+        return;
+    }
+    packet->payload.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_packets_.size() < AUDIO_PACKET_POOL_SIZE) {
+        free_packets_.push_back(std::move(packet));
+    }
+}
+
+/*
+ * Without a session recorder the callbacks are stored as given. With one, they are wrapped to
+ * capture the event first, the transports record what they send in SendText and SendAudio.
+ */
 void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
-    on_incoming_json_ = callback;
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_incoming_json_ = callback;
+        return;
+    }
+    on_incoming_json_ = [this, callback](const cJSON* root) {
+        session_recorder_->RecordJson(kSessionRecordIncomingJson, root);
+        callback(root);
+    };
+}
+
+void Protocol::OnIncomingMessage(std::function<bool(const MessageView& message)> callback) {
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_incoming_message_ = callback;
+        return;
+    }
+    // While recording, the messages take the tree path so the recorder captures them as JSON
+    on_incoming_message_ = [this, callback](const MessageView& message) {
+        return !session_recorder_->IsRecording() && callback(message);
+    };
 }
 
 void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
-    on_incoming_audio_ = callback;
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_incoming_audio_ = callback;
+        return;
+    }
+    on_incoming_audio_ = [this, callback](std::unique_ptr<AudioStreamPacket> packet) {
+        session_recorder_->RecordAudio(kSessionRecordIncomingAudio, *packet);
+        callback(std::move(packet));
+    };
 }
 
 void Protocol::OnAudioChannelOpened(std::function<void()> callback) {
-    on_audio_channel_opened_ = callback;
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_audio_channel_opened_ = callback;
+        return;
+    }
+    on_audio_channel_opened_ = [this, callback]() {
+        session_recorder_->RecordChannelOpened(session_id_, server_sample_rate_, server_frame_duration_);
+        callback();
+    };
 }
 
 void Protocol::OnAudioChannelClosed(std::function<void()> callback) {
-    on_audio_channel_closed_ = callback;
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_audio_channel_closed_ = callback;
+        return;
+    }
+    on_audio_channel_closed_ = [this, callback]() {
+        session_recorder_->RecordEvent(kSessionRecordChannelClosed);
+        callback();
+    };
 }
 
 void Protocol::OnNetworkError(std::function<void(const std::string& message)> callback) {
-    on_network_error_ = callback;
+    if (session_recorder_ == nullptr || callback == nullptr) {
+        on_network_error_ = callback;
+        return;
+    }
+    on_network_error_ = [this, callback](const std::string& message) {
+        session_recorder_->RecordEvent(kSessionRecordNetworkError, message);
+        callback(message);
+    };
 }
 
 void Protocol::SetError(const std::string& message) {
@@ -31,43 +112,213 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
+cJSON* Protocol::GetTransportStatistics() {
+    return nullptr;
+}
+
+bool Protocol::FlushAudio() {
+    return true;
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
-    if (reason == kAbortReasonWakeWordDetected) {
-        message += ",\"reason\":\"wake_word_detected\"";
-    }
-    message += "}";
-    SendText(message);
+    SendMessage("abort", [reason](auto& writer) {
+        if (reason == kAbortReasonWakeWordDetected) {
+            writer.Field("reason", "wake_word_detected");
+        }
+    });
 }
 
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
-    std::string json = "{\"session_id\":\"" + session_id_ + 
-                      "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
-    SendText(json);
+    SendMessage("listen", [&wake_word](auto& writer) {
+        writer.Field("state", "detect");
+        writer.Field("text", wake_word);
+    });
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\"";
-    message += ",\"type\":\"listen\",\"state\":\"start\"";
-    if (mode == kListeningModeRealtime) {
-        message += ",\"mode\":\"realtime\"";
-    } else if (mode == kListeningModeAutoStop) {
-        message += ",\"mode\":\"auto\"";
-    } else {
-        message += ",\"mode\":\"manual\"";
-    }
-    message += "}";
-    SendText(message);
+    SendMessage("listen", [mode](auto& writer) {
+        writer.Field("state", "start");
+        if (mode == kListeningModeRealtime) {
+            writer.Field("mode", "realtime");
+        } else if (mode == kListeningModeAutoStop) {
+            writer.Field("mode", "auto");
+        } else {
+            writer.Field("mode", "manual");
+        }
+    });
 }
 
 void Protocol::SendStopListening() {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
-    SendText(message);
+    SendMessage("listen", [](auto& writer) {
+        writer.Field("state", "stop");
+    });
 }
 
 void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+    // The payload is JSON already, it is copied or transcoded once into the message
+    SendMessage("mcp", [&payload](auto& writer) {
+        writer.Key("payload").Raw(payload);
+    }, payload.size());
+}
+
+void Protocol::SendPing() {
+    uint32_t id;
+    {
+        std::lock_guard<std::mutex> lock(link_quality_mutex_);
+        id = link_quality_.OnProbeSent(esp_timer_get_time() / 1000);
+    }
+    SendMessage("ping", [id](auto& writer) {
+        writer.Field("id", id);
+    });
+}
+
+// The session recorder keeps the JSON form, so the message is converted only while recording
+bool Protocol::SendCborMessage() {
+    size_t header_size = CborHeaderSize();
+    if (session_recorder_ != nullptr && session_recorder_->IsRecording()) {
+        std::string text;
+        if (CborToJson((const uint8_t*)cbor_message_.data() + header_size, cbor_message_.size() - header_size, text)) {
+            session_recorder_->RecordText(kSessionRecordOutgoingText, text);
+        }
+    }
+    return SendCbor(cbor_message_);
+}
+
+void Protocol::OnPong(const cJSON* root) {
+    auto id = cJSON_GetObjectItem(root, "id");
+    if (!cJSON_IsNumber(id)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(link_quality_mutex_);
+    link_quality_.OnProbeAnswered((uint32_t)id->valuedouble, esp_timer_get_time() / 1000);
+}
+
+void Protocol::ResetLinkQuality() {
+    std::lock_guard<std::mutex> lock(link_quality_mutex_);
+    link_quality_.Reset();
+}
+
+LinkQualityLevel Protocol::link_quality() {
+    std::lock_guard<std::mutex> lock(link_quality_mutex_);
+    link_quality_.Update(esp_timer_get_time() / 1000);
+    return link_quality_.level();
+}
+
+LinkQualityStatistics Protocol::link_quality_statistics() {
+    std::lock_guard<std::mutex> lock(link_quality_mutex_);
+    return link_quality_.statistics();
+}
+
+void Protocol::WriteLinkQuality(JsonWriter& writer) {
+    std::lock_guard<std::mutex> lock(link_quality_mutex_);
+    auto& statistics = link_quality_.statistics();
+    writer.BeginObject();
+    writer.Field("level", LinkQualityEstimator::LevelName(link_quality_.level()));
+    writer.Field("rtt_ms", statistics.rtt_ms);
+    writer.Field("min_rtt_ms", statistics.min_rtt_ms);
+    writer.Field("jitter_ms", statistics.jitter_ms);
+    writer.Field("loss_percent", statistics.loss_percent);
+    writer.Field("probes_sent", statistics.probes_sent);
+    writer.Field("probes_answered", statistics.probes_answered);
+    writer.EndObject();
+}
+
+/*
+ * Strings in the input are not terminated, they go through one scratch buffer that keeps its
+ * capacity for the whole message, so the only allocations are the nodes of the tree.
+ */
+static cJSON* CborToCjson(CborReader& reader, const CborItem& item, std::string& scratch, int depth) {
+    switch (item.type) {
+        case kCborInteger:
+        case kCborDouble:
+            return cJSON_CreateNumber(item.number);
+        case kCborText:
+            scratch.assign(item.string.data(), item.string.size());
+            return cJSON_CreateString(scratch.c_str());
+        case kCborBool:
+            return cJSON_CreateBool(item.boolean);
+        case kCborNull:
+            return cJSON_CreateNull();
+        case kCborMap:
+        case kCborArray:
+            break;
+        default:
+            return nullptr;
+    }
+    if (depth >= CBOR_MAX_DEPTH) {
+        return nullptr;
+    }
+
+    bool map = item.type == kCborMap;
+    cJSON* container = map ? cJSON_CreateObject() : cJSON_CreateArray();
+    CborItem child;
+    for (uint64_t i = 0; item.indefinite || i < item.count; i++) {
+        if (!reader.Next(child) || (child.type == kCborBreak && !item.indefinite)) {
+            cJSON_Delete(container);
+            return nullptr;
+        }
+        if (child.type == kCborBreak) {
+            break;
+        }
+        std::string_view key;
+        if (map) {
+            key = child.string;
+            if (child.type != kCborText || !reader.Next(child) || child.type == kCborBreak) {
+                cJSON_Delete(container);
+                return nullptr;
+            }
+        }
+        cJSON* value = CborToCjson(reader, child, scratch, depth + 1);
+        if (value == nullptr) {
+            cJSON_Delete(container);
+            return nullptr;
+        }
+        if (map) {
+            scratch.assign(key.data(), key.size());
+            cJSON_AddItemToObject(container, scratch.c_str(), value);
+        } else {
+            cJSON_AddItemToArray(container, value);
+        }
+    }
+    return container;
+}
+
+cJSON* Protocol::ParseCbor(const uint8_t* data, size_t size) {
+    CborReader reader(data, size);
+    CborItem item;
+    if (!reader.Next(item) || item.type != kCborMap) {
+        return nullptr;
+    }
+    std::string scratch;
+    cJSON* root = CborToCjson(reader, item, scratch, 0);
+    if (root != nullptr && !reader.AtEnd()) {
+        cJSON_Delete(root);
+        return nullptr;
+    }
+    return root;
+}
+
+/*
+ * The views point into the received message, only the payload of an mcp message becomes a
+ * tree, the one the MCP server parses.
+ */
+bool Protocol::DispatchCborMessage(const CborMessage& message) {
+    if (on_incoming_message_ == nullptr || message.type.data() == nullptr) {
+        return false;
+    }
+    MessageView view;
+    view.type = message.type;
+    view.state = message.state;
+    view.text = message.text;
+    view.emotion = message.emotion;
+    cJSON* payload = nullptr;
+    if (!message.payload.empty()) {
+        payload = ParseCbor((const uint8_t*)message.payload.data(), message.payload.size());
+        view.payload = payload;
+    }
+    bool handled = on_incoming_message_(view);
+    cJSON_Delete(payload);
+    return handled;
 }
 
 bool Protocol::IsTimeout() const {
@@ -80,3 +331,37 @@ bool Protocol::IsTimeout() const {
     }
     return timeout;
 }
+
+/*
+ * Tell the server which downlink formats the device plays best.
+ * The server keeps choosing the downlink format and replies it in its own audio_params,
+ * servers that do not know this field keep using their default.
+ */
+void Protocol::WriteDownlinkAudioParams(JsonWriter& writer, int preferred_sample_rate, int preferred_frame_duration) const {
+    static const int kOpusSampleRates[] = { 48000, 24000, 16000, 12000, 8000 };
+    static const int kFrameDurations[] = { 20, 40, 60, 120 };
+
+    writer.Key("downlink").BeginObject();
+    writer.Field("sample_rate", preferred_sample_rate);
+    writer.Field("frame_duration", preferred_frame_duration);
+
+    // Accepted values, the preferred one first
+    writer.Key("sample_rates").BeginArray();
+    writer.Int(preferred_sample_rate);
+    for (auto sample_rate : kOpusSampleRates) {
+        if (sample_rate != preferred_sample_rate) {
+            writer.Int(sample_rate);
+        }
+    }
+    writer.EndArray();
+
+    writer.Key("frame_durations").BeginArray();
+    writer.Int(preferred_frame_duration);
+    for (auto frame_duration : kFrameDurations) {
+        if (frame_duration != preferred_frame_duration) {
+            writer.Int(frame_duration);
+        }
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
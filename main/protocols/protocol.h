@@ -6,6 +6,16 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+#include <mutex>
+
+#include "link_quality.h"
+#include "json_writer.h"
+#include "cbor.h"
+#include "session_recorder.h"
+
+#define AUDIO_PACKET_HEADROOM 16        // Spare capacity for the largest binary header, sizeof(BinaryProtocol2)
+#define AUDIO_PACKET_POOL_SIZE 16       // Free packets kept for reuse
 
 struct AudioStreamPacket {
     int sample_rate = 0;
@@ -14,9 +24,38 @@ struct AudioStreamPacket {
     std::vector<uint8_t> payload;
 };
 
+/*
+ * Recycles audio packets together with their payload capacity, so the encode, send, receive
+ * and decode paths do not allocate per frame once the stream is running.
+ */
+class AudioPacketPool {
+public:
+    static AudioPacketPool& GetInstance() {
+        static AudioPacketPool instance;
+        return instance;
+    }
+    AudioPacketPool(const AudioPacketPool&) = delete;
+    AudioPacketPool& operator=(const AudioPacketPool&) = delete;
+
+    // The payload is empty, with room for at least capacity bytes plus AUDIO_PACKET_HEADROOM
+    std::unique_ptr<AudioStreamPacket> Acquire(size_t capacity = 0);
+    void Release(std::unique_ptr<AudioStreamPacket> packet);
+
+    uint32_t allocated() const { return allocated_; }
+    uint32_t reused() const { return reused_; }
+
+private:
+    AudioPacketPool() = default;
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> free_packets_;
+    uint32_t allocated_ = 0;
+    uint32_t reused_ = 0;
+};
+
 struct BinaryProtocol2 {
     uint16_t version;
-    uint16_t type;          // Message type (0: OPUS, 1: JSON)
+    uint16_t type;          // Message type (0: OPUS, 1: JSON, 3: CBOR)
     uint32_t reserved;      // Reserved for future use
     uint32_t timestamp;     // Timestamp in milliseconds (used for server-side AEC)
     uint32_t payload_size;  // Payload size in bytes
@@ -24,12 +63,38 @@ struct BinaryProtocol2 {
 } __attribute__((packed));
 
 struct BinaryProtocol3 {
-    uint8_t type;
+    uint8_t type;           // 0: OPUS, 3: CBOR control message
     uint8_t reserved;
     uint16_t payload_size;
     uint8_t payload[];
 } __attribute__((packed));
 
+// Uplink batch of several Opus frames in one binary message, negotiated with the audio_batch feature
+struct BinaryProtocol4 {
+    uint8_t type;           // 2: batched OPUS
+    uint8_t frame_count;
+    uint16_t payload_size;  // Size of all the frames
+    uint8_t payload[];      // frame_count times BinaryProtocol4Frame
+} __attribute__((packed));
+
+struct BinaryProtocol4Frame {
+    uint32_t timestamp;
+    uint16_t size;
+    uint8_t data[];
+} __attribute__((packed));
+
+/*
+ * Members of a received control message as views, valid for the duration of the callback.
+ * A member that is missing or not a string has a null data().
+ */
+struct MessageView {
+    std::string_view type;
+    std::string_view state;
+    std::string_view text;
+    std::string_view emotion;
+    const cJSON* payload = nullptr;     // The payload member when it is an object
+};
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -54,26 +119,41 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    LinkQualityLevel link_quality();
+    LinkQualityStatistics link_quality_statistics();
+    // Writes the link quality for diagnostics as an object value
+    void WriteLinkQuality(JsonWriter& writer);
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    // Gets the CBOR messages as views before a tree is built for them, returns false to get the tree instead
+    void OnIncomingMessage(std::function<bool(const MessageView& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
+    // Captures the traffic of this protocol while the recorder is recording, set before the callbacks
+    void SetSessionRecorder(SessionRecorder* recorder) { session_recorder_ = recorder; }
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
     virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // Sends the audio held back for batching, if any
+    virtual bool FlushAudio();
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendMcpMessage(const std::string& message);
+    // Keeps an idle channel alive and probes the link, the server may answer with a pong echoing the id
+    virtual void SendPing();
+    // Transport counters for diagnostics, the caller owns the returned object; nullptr if there are none
+    virtual cJSON* GetTransportStatistics();
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<bool(const MessageView& message)> on_incoming_message_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -84,10 +164,61 @@ protected:
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    std::mutex link_quality_mutex_;
+    LinkQualityEstimator link_quality_;
+    bool control_cbor_ = false;     // Control messages are sent as CBOR, negotiated with the cbor feature
+    SessionRecorder* session_recorder_ = nullptr;
+    std::mutex cbor_mutex_;
+    std::string cbor_message_;      // Header and CBOR of the message being sent, reused for every message
 
     virtual bool SendText(const std::string& text) = 0;
+    // Room the transport keeps before the CBOR of a message for its header
+    virtual size_t CborHeaderSize() const { return 0; }
+    // Fills the header and sends the message, only transports that negotiate the cbor feature have one
+    virtual bool SendCbor(std::string& message) { return false; }
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void OnPong(const cJSON* root);
+    // Builds the same tree cJSON_Parse gives for the JSON form of the message, nullptr if it is invalid
+    static cJSON* ParseCbor(const uint8_t* data, size_t size);
+    // Hands the message to the message callback, false if it did not take it and the tree is needed
+    bool DispatchCborMessage(const CborMessage& message);
+    void ResetLinkQuality();
+    // Writes the downlink member of the hello audio_params
+    void WriteDownlinkAudioParams(JsonWriter& writer, int preferred_sample_rate, int preferred_frame_duration) const;
+
+    /*
+     * Sends a control message with the session id and type, fields writes the other members
+     * through a JsonWriter or, once the cbor feature is negotiated, a CborWriter, so the message
+     * is encoded once in the form that goes on the wire.
+     */
+    template <typename Fields>
+    bool SendMessage(const char* type, Fields fields, size_t size_hint = 0) {
+        if (!control_cbor_) {
+            std::string message;
+            message.reserve(size_hint + session_id_.size() + 48);
+            JsonWriter writer(message);
+            WriteMessage(writer, type, fields);
+            return SendText(message);
+        }
+        std::lock_guard<std::mutex> lock(cbor_mutex_);
+        cbor_message_.assign(CborHeaderSize(), '\0');
+        CborWriter writer(cbor_message_);
+        WriteMessage(writer, type, fields);
+        return SendCborMessage();
+    }
+
+private:
+    template <typename Writer, typename Fields>
+    void WriteMessage(Writer& writer, const char* type, Fields& fields) const {
+        writer.BeginObject();
+        writer.Field("session_id", session_id_);
+        writer.Field("type", type);
+        fields(writer);
+        writer.EndObject();
+    }
+    // Records and sends cbor_message_, with cbor_mutex_ held
+    bool SendCborMessage();
 };
 
 #endif // PROTOCOL_H
@@ -0,0 +1,191 @@
+#ifndef REORDER_WINDOW_H
+#define REORDER_WINDOW_H
+
+#include <cstdint>
+#include <memory>
+#include <functional>
+
+/*
+ * Receive window for sequenced datagrams: a 64 bit replay bitmap drops duplicates and packets
+ * that are too old, and up to REORDER_WINDOW_MAX_DEPTH packets after a gap are held so that
+ * a packet arriving a little late is still released in order.
+ * Not thread safe, the caller serializes the calls. The output callback runs inside Push, Expire
+ * and Flush, so it must not call back into the window.
+ */
+
+#define REORDER_WINDOW_MAX_DEPTH 16
+#define REORDER_WINDOW_SLOTS (REORDER_WINDOW_MAX_DEPTH + 1)   // The packet being waited for and the ones held behind it
+#define REORDER_WINDOW_REPLAY_BITS 64
+#define REORDER_WINDOW_RESYNC_GAP 1024     // A jump further ahead is a new stream, e.g. the sender restarted
+
+struct ReorderWindowStatistics {
+    uint32_t received = 0;
+    uint32_t released = 0;
+    uint32_t reordered = 0;         // Arrived after a later packet and still released in order
+    uint32_t duplicate = 0;         // Already seen, dropped
+    uint32_t late = 0;              // Its turn was skipped already or too old for the bitmap, dropped
+    uint32_t lost = 0;              // Skipped after waiting
+    uint32_t resynced = 0;          // Jumps beyond REORDER_WINDOW_RESYNC_GAP, restarted at the new sequence
+};
+
+template <typename T>
+class ReorderWindow {
+public:
+    using Output = std::function<void(std::unique_ptr<T> packet)>;
+
+    // depth 0 releases every new packet at once, with the replay check only
+    void Configure(int depth, uint32_t max_wait_ms) {
+        depth_ = depth < 0 ? 0 : (depth > REORDER_WINDOW_MAX_DEPTH ? REORDER_WINDOW_MAX_DEPTH : depth);
+        max_wait_ms_ = max_wait_ms;
+        Reset();
+    }
+
+    void Reset() {
+        for (auto& slot : slots_) {
+            slot.reset();
+        }
+        started_ = false;
+        highest_ = 0;
+        replay_bitmap_ = 0;
+        next_ = 0;
+        held_ = 0;
+        hold_start_ms_ = 0;
+        statistics_ = ReorderWindowStatistics();
+    }
+
+    void Push(uint32_t sequence, std::unique_ptr<T> packet, uint32_t now_ms, const Output& output) {
+        statistics_.received++;
+        bool out_of_order = false;
+        if (started_ && (int32_t)(sequence - highest_) > REORDER_WINDOW_RESYNC_GAP) {
+            // Nothing before the jump is worth waiting for, and the gap is not counted as lost
+            Flush(output);
+            started_ = false;
+            statistics_.resynced++;
+        }
+        if (!started_) {
+            started_ = true;
+            highest_ = sequence;
+            replay_bitmap_ = 1;
+            next_ = sequence;
+        } else {
+            int32_t ahead = (int32_t)(sequence - highest_);
+            if (ahead > 0) {
+                replay_bitmap_ = ahead >= REORDER_WINDOW_REPLAY_BITS ? 0 : replay_bitmap_ << ahead;
+                replay_bitmap_ |= 1;
+                highest_ = sequence;
+            } else if (-ahead >= REORDER_WINDOW_REPLAY_BITS) {
+                statistics_.late++;
+                return;
+            } else if (replay_bitmap_ & (1ULL << -ahead)) {
+                statistics_.duplicate++;
+                return;
+            } else {
+                replay_bitmap_ |= 1ULL << -ahead;
+                out_of_order = true;
+            }
+        }
+
+        int32_t offset = (int32_t)(sequence - next_);
+        if (offset < 0) {
+            statistics_.late++;
+            return;
+        }
+        if (out_of_order) {
+            statistics_.reordered++;
+        }
+        if (offset > depth_) {
+            // Too far ahead to wait for the gap, give up on the missing packets
+            Skip(sequence - depth_, output);
+            offset = (int32_t)(sequence - next_);
+        }
+        if (offset == 0) {
+            Release(std::move(packet), output);
+            Drain(output);
+            // The packets still held wait behind a newer gap
+            hold_start_ms_ = now_ms;
+        } else {
+            auto& slot = slots_[sequence % REORDER_WINDOW_SLOTS];
+            if (slot == nullptr) {
+                if (held_++ == 0) {
+                    hold_start_ms_ = now_ms;
+                }
+            }
+            slot = std::move(packet);
+        }
+        Expire(now_ms, output);
+    }
+
+    // Releases the held packets when the oldest gap is older than max_wait_ms, call it periodically
+    void Expire(uint32_t now_ms, const Output& output) {
+        if (held_ > 0 && now_ms - hold_start_ms_ >= max_wait_ms_) {
+            Flush(output);
+        }
+    }
+
+    // Releases all the held packets, the gaps are counted as lost
+    void Flush(const Output& output) {
+        while (held_ > 0) {
+            if (slots_[next_ % REORDER_WINDOW_SLOTS] == nullptr) {
+                statistics_.lost++;
+                next_++;
+            }
+            Drain(output);
+        }
+    }
+
+    int depth() const { return depth_; }
+    const ReorderWindowStatistics& statistics() const { return statistics_; }
+
+private:
+    int depth_ = 0;
+    uint32_t max_wait_ms_ = 0;
+    bool started_ = false;
+    uint32_t highest_ = 0;
+    uint64_t replay_bitmap_ = 0;    // Bit n: highest_ - n was received
+    uint32_t next_ = 0;             // Sequence to release next
+    int held_ = 0;
+    uint32_t hold_start_ms_ = 0;
+    std::unique_ptr<T> slots_[REORDER_WINDOW_SLOTS];
+    ReorderWindowStatistics statistics_;
+
+    void Release(std::unique_ptr<T> packet, const Output& output) {
+        statistics_.released++;
+        next_++;
+        output(std::move(packet));
+    }
+
+    // Releases the held packets that are next in order
+    void Drain(const Output& output) {
+        while (held_ > 0) {
+            auto& slot = slots_[next_ % REORDER_WINDOW_SLOTS];
+            if (slot == nullptr) {
+                break;
+            }
+            held_--;
+            Release(std::move(slot), output);
+        }
+    }
+
+    // Moves the release point up to sequence, releasing what is held on the way
+    void Skip(uint32_t sequence, const Output& output) {
+        if ((int32_t)(sequence - next_) > REORDER_WINDOW_SLOTS) {
+            // The held packets are all within the slots, the rest of the gap is lost in one step
+            Flush(output);
+            statistics_.lost += sequence - next_;
+            next_ = sequence;
+        }
+        while ((int32_t)(sequence - next_) > 0) {
+            auto& slot = slots_[next_ % REORDER_WINDOW_SLOTS];
+            if (slot != nullptr) {
+                held_--;
+                Release(std::move(slot), output);
+            } else {
+                statistics_.lost++;
+                next_++;
+            }
+        }
+        Drain(output);
+    }
+};
+
+#endif // REORDER_WINDOW_H
@@ -0,0 +1,257 @@
+#include "replay_protocol.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstdio>
+#include <algorithm>
+
+#define TAG "Replay"
+
+ReplayProtocol::ReplayProtocol(const std::string& path, int speed_percent) : path_(path), speed_percent_(speed_percent) {
+    event_group_handle_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT);
+}
+
+ReplayProtocol::~ReplayProtocol() {
+    stop_ = true;
+    xEventGroupWaitBits(event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+    vEventGroupDelete(event_group_handle_);
+}
+
+bool ReplayProtocol::Start() {
+    FILE* file = fopen(path_.c_str(), "rb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", path_.c_str());
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    capture_.resize(size > 0 ? size : 0);
+    bool read = fread(capture_.data(), 1, capture_.size(), file) == capture_.size();
+    fclose(file);
+
+    SessionCaptureHeader header;
+    std::string_view info;
+    SessionCaptureReader reader((const uint8_t*)capture_.data(), capture_.size());
+    if (!read || !reader.ReadHeader(header, info)) {
+        ESP_LOGE(TAG, "Invalid session capture %s", path_.c_str());
+        capture_.clear();
+        return false;
+    }
+    cursor_ = reader.offset();
+    ESP_LOGI(TAG, "Replaying %s (%u bytes, speed %d%%): %.*s", path_.c_str(), (unsigned)capture_.size(),
+        speed_percent_, (int)info.size(), info.data());
+    return true;
+}
+
+bool ReplayProtocol::SendText(const std::string& text) {
+    if (!opened_) {
+        return false;
+    }
+    statistics_.sent_texts++;
+    ESP_LOGD(TAG, "Sent: %s", text.c_str());
+    return true;
+}
+
+bool ReplayProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    AudioPacketPool::GetInstance().Release(std::move(packet));
+    if (!opened_) {
+        return false;
+    }
+    statistics_.sent_audio++;
+    return true;
+}
+
+bool ReplayProtocol::IsAudioChannelOpened() const {
+    return opened_;
+}
+
+bool ReplayProtocol::OpenAudioChannel() {
+    if (opened_) {
+        CloseAudioChannel();
+    }
+    // A previous replay that was stopped must have left before the cursor is used again
+    xEventGroupWaitBits(event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+
+    // Skip to the next recorded channel, the records in between belong to no channel
+    SessionCaptureReader reader((const uint8_t*)capture_.data() + cursor_, capture_.size() - cursor_);
+    SessionRecord record;
+    bool found = false;
+    while (reader.Next(record)) {
+        if (record.type == kSessionRecordChannelOpened) {
+            found = true;
+            break;
+        }
+    }
+    cursor_ += reader.offset();
+    if (!found) {
+        ESP_LOGW(TAG, "No more channels to replay");
+        SetError("Replay finished");
+        return false;
+    }
+
+    auto root = cJSON_ParseWithLength(record.payload.data(), record.payload.size());
+    if (root != nullptr) {
+        auto session_id = cJSON_GetObjectItem(root, "session_id");
+        if (cJSON_IsString(session_id)) {
+            session_id_ = session_id->valuestring;
+        }
+        auto sample_rate = cJSON_GetObjectItem(root, "sample_rate");
+        if (cJSON_IsNumber(sample_rate)) {
+            server_sample_rate_ = sample_rate->valueint;
+        }
+        auto frame_duration = cJSON_GetObjectItem(root, "frame_duration");
+        if (cJSON_IsNumber(frame_duration)) {
+            server_frame_duration_ = frame_duration->valueint;
+        }
+        cJSON_Delete(root);
+    }
+    channel_time_ms_ = record.time_ms;
+    statistics_.channels++;
+    error_occurred_ = false;
+    stop_ = false;
+    opened_ = true;
+    ESP_LOGI(TAG, "Replaying channel %lu, session %s", (unsigned long)statistics_.channels, session_id_.c_str());
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+
+    xEventGroupClearBits(event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT);
+    xTaskCreate([](void* arg) {
+        auto protocol = (ReplayProtocol*)arg;
+        protocol->ReplayTask();
+        protocol->task_handle_ = nullptr;
+        xEventGroupSetBits(protocol->event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT);
+        vTaskDelete(NULL);
+    }, "session_replay", 4096, this, 5, &task_handle_);
+    return true;
+}
+
+void ReplayProtocol::CloseAudioChannel() {
+    stop_ = true;
+    // The replay task may close the channel from a callback, it must not wait for itself
+    if (xTaskGetCurrentTaskHandle() != task_handle_) {
+        xEventGroupWaitBits(event_group_handle_, REPLAY_PROTOCOL_TASK_IDLE_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+    CloseChannel();
+}
+
+void ReplayProtocol::CloseChannel() {
+    if (opened_.exchange(false) && on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
+
+// Returns false if the replay was stopped while waiting
+bool ReplayProtocol::WaitUntil(int64_t time_us) {
+    while (!stop_) {
+        int64_t remaining_ms = (time_us - esp_timer_get_time()) / 1000;
+        if (remaining_ms <= 0) {
+            return true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(std::min<int64_t>(remaining_ms, REPLAY_PROTOCOL_WAIT_SLICE_MS)));
+    }
+    return false;
+}
+
+void ReplayProtocol::ReplayTask() {
+    int64_t start_time = esp_timer_get_time();
+    SessionCaptureReader reader((const uint8_t*)capture_.data() + cursor_, capture_.size() - cursor_);
+    SessionRecord record;
+    size_t consumed = 0;
+    bool closed = false;
+    while (!closed && reader.Next(record)) {
+        if (record.type == kSessionRecordChannelOpened) {
+            // The next channel is replayed by the next OpenAudioChannel
+            break;
+        }
+        consumed = reader.offset();
+
+        int64_t due_time = start_time;
+        if (speed_percent_ > 0) {
+            due_time += (int64_t)(record.time_ms - channel_time_ms_) * 1000 * 100 / speed_percent_;
+        }
+        if (!WaitUntil(due_time)) {
+            break;
+        }
+        uint32_t late_ms = (esp_timer_get_time() - due_time) / 1000;
+        if (late_ms > statistics_.max_late_ms) {
+            statistics_.max_late_ms = late_ms;
+        }
+
+        switch (record.type) {
+        case kSessionRecordIncomingJson: {
+            statistics_.incoming_json++;
+            auto root = cJSON_ParseWithLength(record.payload.data(), record.payload.size());
+            if (root == nullptr) {
+                ESP_LOGE(TAG, "Invalid recorded message: %.*s", (int)record.payload.size(), record.payload.data());
+                break;
+            }
+            if (on_incoming_json_ != nullptr) {
+                on_incoming_json_(root);
+            }
+            cJSON_Delete(root);
+            break;
+        }
+        case kSessionRecordIncomingAudio: {
+            statistics_.incoming_audio++;
+            if (on_incoming_audio_ != nullptr) {
+                auto packet = AudioPacketPool::GetInstance().Acquire(record.payload.size());
+                packet->sample_rate = record.audio.sample_rate;
+                packet->frame_duration = record.audio.frame_duration;
+                packet->timestamp = record.audio.timestamp;
+                packet->payload.assign(record.payload.begin(), record.payload.end());
+                on_incoming_audio_(std::move(packet));
+            }
+            break;
+        }
+        case kSessionRecordOutgoingText:
+            statistics_.expected_texts++;
+            break;
+        case kSessionRecordOutgoingAudio:
+            statistics_.expected_audio++;
+            break;
+        case kSessionRecordNetworkError:
+            opened_ = false;
+            SetError(std::string(record.payload));
+            closed = true;
+            break;
+        case kSessionRecordChannelClosed:
+            closed = true;
+            break;
+        default:
+            break;
+        }
+    }
+    if (reader.error()) {
+        ESP_LOGE(TAG, "Truncated session capture at offset %u", (unsigned)(cursor_ + reader.offset()));
+    }
+    cursor_ += consumed;
+
+    ESP_LOGI(TAG, "Channel replayed: %lu/%lu texts and %lu/%lu audio packets sent as recorded, max late %lu ms",
+        (unsigned long)statistics_.sent_texts, (unsigned long)statistics_.expected_texts,
+        (unsigned long)statistics_.sent_audio, (unsigned long)statistics_.expected_audio,
+        (unsigned long)statistics_.max_late_ms);
+    if (!stop_) {
+        // Ended by the recording, not by CloseAudioChannel, which closes the channel itself
+        CloseChannel();
+    }
+}
+
+cJSON* ReplayProtocol::GetTransportStatistics() {
+    cJSON* replay = cJSON_CreateObject();
+    cJSON_AddStringToObject(replay, "path", path_.c_str());
+    cJSON_AddNumberToObject(replay, "speed_percent", speed_percent_);
+    cJSON_AddNumberToObject(replay, "position", cursor_);
+    cJSON_AddNumberToObject(replay, "size", capture_.size());
+    cJSON_AddNumberToObject(replay, "channels", statistics_.channels);
+    cJSON_AddNumberToObject(replay, "incoming_json", statistics_.incoming_json);
+    cJSON_AddNumberToObject(replay, "incoming_audio", statistics_.incoming_audio);
+    cJSON_AddNumberToObject(replay, "expected_texts", statistics_.expected_texts);
+    cJSON_AddNumberToObject(replay, "sent_texts", statistics_.sent_texts);
+    cJSON_AddNumberToObject(replay, "expected_audio", statistics_.expected_audio);
+    cJSON_AddNumberToObject(replay, "sent_audio", statistics_.sent_audio);
+    cJSON_AddNumberToObject(replay, "max_late_ms", statistics_.max_late_ms);
+    return replay;
+}
@@ -0,0 +1,62 @@
+#ifndef REPLAY_PROTOCOL_H
+#define REPLAY_PROTOCOL_H
+
+#include "protocol.h"
+#include "session_capture.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+#include <atomic>
+
+#define REPLAY_PROTOCOL_TASK_IDLE_EVENT (1 << 0)
+#define REPLAY_PROTOCOL_WAIT_SLICE_MS 50        // How often a waiting replay checks for CloseAudioChannel
+
+struct ReplayStatistics {
+    uint32_t channels = 0;
+    uint32_t incoming_json = 0;
+    uint32_t incoming_audio = 0;
+    uint32_t expected_texts = 0;        // Sent in the recorded session
+    uint32_t expected_audio = 0;
+    uint32_t sent_texts = 0;            // Sent by the device during the replay
+    uint32_t sent_audio = 0;
+    uint32_t max_late_ms = 0;           // Largest delay of an event behind its scheduled time
+};
+
+/*
+ * Plays a session capture back instead of talking to a server. Each OpenAudioChannel replays
+ * the next recorded audio channel: the incoming messages and audio are delivered at the recorded
+ * times, scaled by the speed, and what the device sends is counted and compared with the recording.
+ */
+class ReplayProtocol : public Protocol {
+public:
+    // speed_percent 100 replays at the recorded pace, 400 four times faster, 0 without waiting
+    ReplayProtocol(const std::string& path, int speed_percent);
+    ~ReplayProtocol();
+
+    bool Start() override;
+    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool OpenAudioChannel() override;
+    void CloseAudioChannel() override;
+    bool IsAudioChannelOpened() const override;
+    cJSON* GetTransportStatistics() override;
+
+private:
+    std::string path_;
+    int speed_percent_;
+    std::string capture_;
+    size_t cursor_ = 0;                 // Offset of the next record to replay
+    uint32_t channel_time_ms_ = 0;      // Recorded time of the channel being replayed
+    std::atomic<bool> opened_ = false;
+    std::atomic<bool> stop_ = false;
+    EventGroupHandle_t event_group_handle_;
+    TaskHandle_t task_handle_ = nullptr;
+    ReplayStatistics statistics_;
+
+    void ReplayTask();
+    bool WaitUntil(int64_t time_us);
+    void CloseChannel();
+    bool SendText(const std::string& text) override;
+};
+
+#endif // REPLAY_PROTOCOL_H
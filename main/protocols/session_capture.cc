@@ -0,0 +1,105 @@
+#include "session_capture.h"
+
+#include <cstring>
+
+bool SessionCaptureWriter::Begin(std::string_view info, uint32_t start_time_ms) {
+    if (info.size() > UINT16_MAX || sizeof(SessionCaptureHeader) + info.size() > max_size_) {
+        return false;
+    }
+    SessionCaptureHeader header;
+    memcpy(header.magic, SESSION_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = SESSION_CAPTURE_VERSION;
+    header.reserved = 0;
+    header.info_length = info.size();
+    header.start_time_ms = start_time_ms;
+    output_.clear();
+    output_.append((const char*)&header, sizeof(header));
+    output_.append(info.data(), info.size());
+    return true;
+}
+
+bool SessionCaptureWriter::Append(SessionRecordType type, uint32_t time_ms, std::string_view payload) {
+    if (payload.size() > UINT16_MAX || output_.size() + sizeof(SessionRecordHeader) + payload.size() > max_size_) {
+        return false;
+    }
+    SessionRecordHeader header = { (uint8_t)type, 0, (uint16_t)payload.size(), time_ms };
+    output_.append((const char*)&header, sizeof(header));
+    output_.append(payload.data(), payload.size());
+    return true;
+}
+
+bool SessionCaptureWriter::AppendAudio(SessionRecordType type, uint32_t time_ms, const SessionAudioInfo& audio,
+    const uint8_t* data, size_t size) {
+    size_t payload_size = sizeof(audio) + size;
+    if (payload_size > UINT16_MAX || output_.size() + sizeof(SessionRecordHeader) + payload_size > max_size_) {
+        return false;
+    }
+    SessionRecordHeader header = { (uint8_t)type, 0, (uint16_t)payload_size, time_ms };
+    output_.append((const char*)&header, sizeof(header));
+    output_.append((const char*)&audio, sizeof(audio));
+    output_.append((const char*)data, size);
+    return true;
+}
+
+bool SessionCaptureReader::ReadHeader(SessionCaptureHeader& header, std::string_view& info) {
+    if (size_ < sizeof(header)) {
+        error_ = true;
+        return false;
+    }
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, SESSION_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SESSION_CAPTURE_VERSION || sizeof(header) + header.info_length > size_) {
+        error_ = true;
+        return false;
+    }
+    info = std::string_view((const char*)data_ + sizeof(header), header.info_length);
+    offset_ = sizeof(header) + header.info_length;
+    return true;
+}
+
+bool SessionCaptureReader::Next(SessionRecord& record) {
+    if (error_ || offset_ == size_) {
+        return false;
+    }
+    SessionRecordHeader header;
+    if (size_ - offset_ < sizeof(header)) {
+        error_ = true;
+        return false;
+    }
+    memcpy(&header, data_ + offset_, sizeof(header));
+    if (size_ - offset_ - sizeof(header) < header.size) {
+        error_ = true;
+        return false;
+    }
+    const uint8_t* payload = data_ + offset_ + sizeof(header);
+    size_t payload_size = header.size;
+    offset_ += sizeof(header) + header.size;
+
+    record.type = (SessionRecordType)header.type;
+    record.time_ms = header.time_ms;
+    record.audio = {};
+    if (header.type == kSessionRecordIncomingAudio || header.type == kSessionRecordOutgoingAudio) {
+        if (payload_size < sizeof(SessionAudioInfo)) {
+            error_ = true;
+            return false;
+        }
+        memcpy(&record.audio, payload, sizeof(SessionAudioInfo));
+        payload += sizeof(SessionAudioInfo);
+        payload_size -= sizeof(SessionAudioInfo);
+    }
+    record.payload = std::string_view((const char*)payload, payload_size);
+    return true;
+}
+
+const char* SessionRecordTypeName(SessionRecordType type) {
+    switch (type) {
+        case kSessionRecordIncomingJson: return "incoming_json";
+        case kSessionRecordIncomingAudio: return "incoming_audio";
+        case kSessionRecordOutgoingText: return "outgoing_text";
+        case kSessionRecordOutgoingAudio: return "outgoing_audio";
+        case kSessionRecordChannelOpened: return "channel_opened";
+        case kSessionRecordChannelClosed: return "channel_closed";
+        case kSessionRecordNetworkError: return "network_error";
+    }
+    return "unknown";
+}
@@ -0,0 +1,98 @@
+#ifndef SESSION_CAPTURE_H
+#define SESSION_CAPTURE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/*
+ * Binary capture of what a protocol received and sent, for replaying a session later.
+ *
+ * Capture layout (little endian):
+ *   SessionCaptureHeader, info (info_length bytes of JSON), then SessionRecordHeader + payload records.
+ * Audio records start with SessionAudioInfo, followed by the Opus frame.
+ * The writer never grows the capture beyond its size limit and never leaves a partial record,
+ * so a capture cut short by the limit still reads back up to its last record.
+ */
+
+#define SESSION_CAPTURE_MAGIC "XZSC"
+#define SESSION_CAPTURE_VERSION 1
+
+enum SessionRecordType {
+    kSessionRecordIncomingJson = 1,
+    kSessionRecordIncomingAudio = 2,
+    kSessionRecordOutgoingText = 3,
+    kSessionRecordOutgoingAudio = 4,
+    kSessionRecordChannelOpened = 5,        // JSON with session_id, sample_rate and frame_duration
+    kSessionRecordChannelClosed = 6,
+    kSessionRecordNetworkError = 7,         // The error message
+};
+
+struct __attribute__((packed)) SessionCaptureHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t info_length;
+    uint32_t start_time_ms;                 // Time of the first record since boot
+};
+
+struct __attribute__((packed)) SessionRecordHeader {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t size;                          // Payload size
+    uint32_t time_ms;                       // Since start_time_ms
+};
+
+struct __attribute__((packed)) SessionAudioInfo {
+    uint16_t sample_rate;
+    uint8_t frame_duration;
+    uint8_t reserved;
+    uint32_t timestamp;
+};
+
+struct SessionRecord {
+    SessionRecordType type = kSessionRecordIncomingJson;
+    uint32_t time_ms = 0;
+    std::string_view payload;               // Points into the capture, the Opus frame for audio records
+    SessionAudioInfo audio = {};
+};
+
+class SessionCaptureWriter {
+public:
+    // Appends to output, which never grows beyond max_size
+    SessionCaptureWriter(std::string& output, size_t max_size) : output_(output), max_size_(max_size) {}
+
+    bool Begin(std::string_view info, uint32_t start_time_ms);
+    // Returns false when the record does not fit, the capture stays valid
+    bool Append(SessionRecordType type, uint32_t time_ms, std::string_view payload);
+    bool AppendAudio(SessionRecordType type, uint32_t time_ms, const SessionAudioInfo& audio,
+        const uint8_t* data, size_t size);
+
+private:
+    std::string& output_;
+    size_t max_size_;
+};
+
+class SessionCaptureReader {
+public:
+    SessionCaptureReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    // Must be called first, info points into the capture
+    bool ReadHeader(SessionCaptureHeader& header, std::string_view& info);
+    // Returns false at the end of the capture or on a truncated record
+    bool Next(SessionRecord& record);
+
+    bool error() const { return error_; }
+    size_t offset() const { return offset_; }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_ = 0;
+    bool error_ = false;
+};
+
+const char* SessionRecordTypeName(SessionRecordType type);
+
+#endif // SESSION_CAPTURE_H
@@ -0,0 +1,208 @@
+#include "session_recorder.h"
+#include "protocol.h"
+#include "json_writer.h"
+#include "board.h"
+#include "system_info.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_app_desc.h>
+#include <cstdio>
+#include <algorithm>
+
+#define TAG "SessionRecorder"
+
+#define UPLOAD_CHUNK_SIZE 4096
+
+SessionRecorder::SessionRecorder(size_t max_size) : max_size_(max_size), writer_(capture_, max_size) {
+}
+
+uint32_t SessionRecorder::Now() const {
+    return (esp_timer_get_time() - start_time_) / 1000;
+}
+
+bool SessionRecorder::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string info;
+    JsonWriter info_writer(info);
+    info_writer.BeginObject();
+    info_writer.Field("board", BOARD_NAME);
+    info_writer.Field("version", esp_app_get_description()->version);
+    info_writer.Field("mac_address", SystemInfo::GetMacAddress());
+    info_writer.EndObject();
+
+    capture_.reserve(max_size_);
+    start_time_ = esp_timer_get_time();
+    if (!writer_.Begin(info, start_time_ / 1000)) {
+        ESP_LOGE(TAG, "Failed to start the capture");
+        return false;
+    }
+    statistics_.records = 0;
+    statistics_.dropped_records = 0;
+    recording_ = true;
+    ESP_LOGI(TAG, "Recording started, up to %u bytes", (unsigned)max_size_);
+    return true;
+}
+
+void SessionRecorder::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_) {
+        recording_ = false;
+        ESP_LOGI(TAG, "Recording stopped, %u records in %u bytes", (unsigned)statistics_.records, (unsigned)capture_.size());
+    }
+}
+
+void SessionRecorder::Appended(bool success) {
+    if (success) {
+        statistics_.records++;
+        return;
+    }
+    // Keep the capture consistent up to here, a session with a gap would not replay correctly
+    statistics_.dropped_records++;
+    recording_ = false;
+    ESP_LOGW(TAG, "Capture full, recording stopped at %u records", (unsigned)statistics_.records);
+}
+
+void SessionRecorder::RecordJson(SessionRecordType type, const cJSON* root) {
+    if (!recording_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!recording_) {
+        return;
+    }
+    if (cJSON_PrintPreallocated((cJSON*)root, json_buffer_, sizeof(json_buffer_), false)) {
+        Appended(writer_.Append(type, Now(), json_buffer_));
+        return;
+    }
+    char* json = cJSON_PrintUnformatted(root);
+    if (json != nullptr) {
+        Appended(writer_.Append(type, Now(), json));
+        cJSON_free(json);
+    }
+}
+
+void SessionRecorder::RecordText(SessionRecordType type, const std::string& text) {
+    if (!recording_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_) {
+        Appended(writer_.Append(type, Now(), text));
+    }
+}
+
+void SessionRecorder::RecordAudio(SessionRecordType type, const AudioStreamPacket& packet) {
+    if (!recording_) {
+        return;
+    }
+    SessionAudioInfo audio = {};
+    audio.sample_rate = packet.sample_rate;
+    audio.frame_duration = packet.frame_duration;
+    audio.timestamp = packet.timestamp;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (recording_) {
+        Appended(writer_.AppendAudio(type, Now(), audio, packet.payload.data(), packet.payload.size()));
+    }
+}
+
+void SessionRecorder::RecordChannelOpened(const std::string& session_id, int sample_rate, int frame_duration) {
+    if (!recording_) {
+        return;
+    }
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject();
+    writer.Field("session_id", session_id);
+    writer.Field("sample_rate", sample_rate);
+    writer.Field("frame_duration", frame_duration);
+    writer.EndObject();
+    RecordEvent(kSessionRecordChannelOpened, payload);
+}
+
+void SessionRecorder::RecordEvent(SessionRecordType type, const std::string& payload) {
+    RecordText(type, payload);
+}
+
+bool SessionRecorder::Save(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capture_.empty()) {
+        ESP_LOGW(TAG, "No capture to save");
+        return false;
+    }
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        ESP_LOGE(TAG, "Failed to open %s", path.c_str());
+        return false;
+    }
+    bool success = fwrite(capture_.data(), 1, capture_.size(), file) == capture_.size();
+    success = fclose(file) == 0 && success;
+    if (success) {
+        statistics_.saves++;
+        ESP_LOGI(TAG, "Saved %u bytes to %s", (unsigned)capture_.size(), path.c_str());
+    } else {
+        ESP_LOGE(TAG, "Failed to write %s", path.c_str());
+    }
+    return success;
+}
+
+bool SessionRecorder::Upload(const std::string& url, const std::string& token) {
+    // Upload a copy so that the protocol is not blocked while recording continues
+    std::string capture;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capture = capture_;
+    }
+    if (capture.empty()) {
+        ESP_LOGW(TAG, "No capture to upload");
+        return false;
+    }
+
+    auto& board = Board::GetInstance();
+    auto http = board.GetNetwork()->CreateHttp(3);
+    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+    http->SetHeader("Client-Id", board.GetUuid().c_str());
+    if (!token.empty()) {
+        http->SetHeader("Authorization", "Bearer " + token);
+    }
+    http->SetHeader("Content-Type", "application/octet-stream");
+    http->SetHeader("Transfer-Encoding", "chunked");
+
+    bool success = false;
+    if (http->Open("POST", url)) {
+        for (size_t offset = 0; offset < capture.size(); offset += UPLOAD_CHUNK_SIZE) {
+            size_t size = std::min<size_t>(UPLOAD_CHUNK_SIZE, capture.size() - offset);
+            http->Write(capture.data() + offset, size);
+        }
+        http->Write("", 0);
+        success = http->GetStatusCode() == 200;
+        if (!success) {
+            ESP_LOGE(TAG, "Failed to upload capture, status code: %d", http->GetStatusCode());
+        }
+        http->Close();
+    } else {
+        ESP_LOGE(TAG, "Failed to connect to %s", url.c_str());
+    }
+
+    if (success) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        statistics_.uploads++;
+    }
+    return success;
+}
+
+std::string SessionRecorder::GetStatusJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string json;
+    JsonWriter writer(json);
+    writer.BeginObject();
+    writer.Field("recording", (bool)recording_);
+    writer.Field("bytes", capture_.size());
+    writer.Field("max_bytes", max_size_);
+    writer.Field("records", statistics_.records);
+    writer.Field("dropped_records", statistics_.dropped_records);
+    writer.Field("saves", statistics_.saves);
+    writer.Field("uploads", statistics_.uploads);
+    writer.EndObject();
+    return json;
+}
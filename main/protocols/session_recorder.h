@@ -0,0 +1,62 @@
+#ifndef SESSION_RECORDER_H
+#define SESSION_RECORDER_H
+
+#include <cJSON.h>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include "session_capture.h"
+
+struct AudioStreamPacket;
+
+#define SESSION_RECORDER_JSON_BUFFER_SIZE 2048  // Incoming messages are printed here, larger ones are allocated
+
+struct SessionRecorderStatistics {
+    uint32_t records = 0;
+    uint32_t dropped_records = 0;       // Records that did not fit, the recording stops at the first one
+    uint32_t saves = 0;
+    uint32_t uploads = 0;
+};
+
+/*
+ * Captures what the protocol received and sent with timestamps, see session_capture.h for the
+ * format. The protocol calls the Record methods only while a recorder is attached, and they
+ * return at once when the recording is stopped. The capture can be saved to a file, such as
+ * one on the SD card or a mounted flash partition, or uploaded to a host.
+ */
+class SessionRecorder {
+public:
+    SessionRecorder(size_t max_size);
+
+    // Discards the previous capture
+    bool Start();
+    void Stop();
+    bool IsRecording() const { return recording_; }
+
+    void RecordJson(SessionRecordType type, const cJSON* root);
+    void RecordText(SessionRecordType type, const std::string& text);
+    void RecordAudio(SessionRecordType type, const AudioStreamPacket& packet);
+    void RecordChannelOpened(const std::string& session_id, int sample_rate, int frame_duration);
+    void RecordEvent(SessionRecordType type, const std::string& payload = "");
+
+    bool Save(const std::string& path);
+    bool Upload(const std::string& url, const std::string& token = "");
+    std::string GetStatusJson();
+
+private:
+    size_t max_size_;
+    std::mutex mutex_;
+    std::atomic<bool> recording_ = false;
+    std::string capture_;
+    SessionCaptureWriter writer_;
+    int64_t start_time_ = 0;
+    char json_buffer_[SESSION_RECORDER_JSON_BUFFER_SIZE];
+    SessionRecorderStatistics statistics_;
+
+    uint32_t Now() const;
+    void Appended(bool success);
+};
+
+#endif // SESSION_RECORDER_H
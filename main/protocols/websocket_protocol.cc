@@ -7,16 +7,35 @@
 #include <cstring>
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
+#include "cbor.h"
 
 #define TAG "WS"
 
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+
+    // Sends a batch that is not filled in time, e.g. when the encoder stops at the end of listening
+    esp_timer_create_args_t batch_timer_args = {
+        .callback = [](void* arg) {
+            auto protocol = (WebsocketProtocol*)arg;
+            Application::GetInstance().Schedule([protocol]() {
+                protocol->FlushAudioIfDue();
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "ws_batch_timer",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&batch_timer_args, &batch_timer_handle_);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    esp_timer_stop(batch_timer_handle_);
+    esp_timer_delete(batch_timer_handle_);
     vEventGroupDelete(event_group_handle_);
 }
 
@@ -29,38 +48,124 @@ bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+    if (session_recorder_ != nullptr) {
+        session_recorder_->RecordAudio(kSessionRecordOutgoingAudio, *packet);
+    }
 
+    if (audio_batch_) {
+        return BatchAudio(std::move(packet));
+    }
+
+    /*
+     * The header is written in front of the payload in the same buffer, which is sent as is.
+     * Pooled packets keep AUDIO_PACKET_HEADROOM spare capacity, so the insert only moves the payload.
+     */
+    auto& buffer = packet->payload;
+    size_t payload_size = buffer.size();
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        buffer.insert(buffer.begin(), sizeof(BinaryProtocol2), 0);
+        auto bp2 = (BinaryProtocol2*)buffer.data();
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        bp2->payload_size = htonl(payload_size);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        buffer.insert(buffer.begin(), sizeof(BinaryProtocol3), 0);
+        auto bp3 = (BinaryProtocol3*)buffer.data();
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(payload_size);
+    }
+
+    bool success = websocket_->Send(buffer.data(), buffer.size(), true);
+    AudioPacketPool::GetInstance().Release(std::move(packet));
+    return success;
+}
+
+/*
+ * Appends the frame to the pending batch, which is sent when it is full, when it holds
+ * CONFIG_WEBSOCKET_AUDIO_BATCH_MS of audio, when the batch timer expires, or by FlushAudio
+ * at the end of speech and before a control message.
+ */
+bool WebsocketProtocol::BatchAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    size_t frame_size = sizeof(BinaryProtocol4Frame) + packet->payload.size();
+    if (batch_frames_ > 0 && batch_buffer_.size() + frame_size > WEBSOCKET_AUDIO_BATCH_MAX_BYTES) {
+        if (!FlushAudio()) {
+            return false;
+        }
+    }
+    if (batch_frames_ == 0) {
+        batch_buffer_.resize(sizeof(BinaryProtocol4));
+        batch_start_time_ = esp_timer_get_time();
+        esp_timer_stop(batch_timer_handle_);
+        esp_timer_start_once(batch_timer_handle_, GetBatchMs() * 1000);
+    }
+
+    size_t offset = batch_buffer_.size();
+    batch_buffer_.resize(offset + frame_size);
+    auto frame = (BinaryProtocol4Frame*)(batch_buffer_.data() + offset);
+    frame->timestamp = htonl(packet->timestamp);
+    frame->size = htons(packet->payload.size());
+    memcpy(frame->data, packet->payload.data(), packet->payload.size());
+    batch_frames_++;
+    AudioPacketPool::GetInstance().Release(std::move(packet));
+
+    // Frames drained from a backlog arrive together, so both the audio held and the wall time count
+    int batch_ms = GetBatchMs();
+    int audio_ms = batch_frames_ * OPUS_FRAME_DURATION_MS;
+    int64_t wait_ms = (esp_timer_get_time() - batch_start_time_) / 1000;
+    if (audio_ms >= batch_ms || wait_ms >= batch_ms ||
+        batch_frames_ >= WEBSOCKET_AUDIO_BATCH_MAX_FRAMES) {
+        return FlushAudio();
+    }
+    return true;
+}
+
+// On a poor link fewer, larger messages get through better than a steady stream of small ones
+int WebsocketProtocol::GetBatchMs() {
+    return link_quality() == kLinkQualityPoor ? CONFIG_WEBSOCKET_AUDIO_BATCH_MS * 2 : CONFIG_WEBSOCKET_AUDIO_BATCH_MS;
+}
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+// Runs in the main loop, the timer may belong to a batch that has been sent already
+void WebsocketProtocol::FlushAudioIfDue() {
+    if (batch_frames_ == 0) {
+        return;
+    }
+    int64_t wait_ms = (esp_timer_get_time() - batch_start_time_) / 1000;
+    if (wait_ms >= GetBatchMs()) {
+        FlushAudio();
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        esp_timer_stop(batch_timer_handle_);
+        esp_timer_start_once(batch_timer_handle_, (GetBatchMs() - wait_ms) * 1000);
     }
 }
 
+bool WebsocketProtocol::FlushAudio() {
+    if (batch_frames_ == 0) {
+        return true;
+    }
+    auto bp4 = (BinaryProtocol4*)batch_buffer_.data();
+    bp4->type = 2;
+    bp4->frame_count = batch_frames_;
+    bp4->payload_size = htons(batch_buffer_.size() - sizeof(BinaryProtocol4));
+    batch_frames_ = 0;
+    esp_timer_stop(batch_timer_handle_);
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+    return websocket_->Send(batch_buffer_.data(), batch_buffer_.size(), true);
+}
+
 bool WebsocketProtocol::SendText(const std::string& text) {
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+    // Keep the order of audio and control messages
+    FlushAudio();
+    if (session_recorder_ != nullptr) {
+        session_recorder_->RecordText(kSessionRecordOutgoingText, text);
+    }
 
     if (!websocket_->Send(text)) {
         ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
@@ -71,6 +176,47 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+size_t WebsocketProtocol::CborHeaderSize() const {
+    return version_ == 2 ? sizeof(BinaryProtocol2) : sizeof(BinaryProtocol3);
+}
+
+// Binary message with the header of the protocol version, a message the header cannot describe goes as JSON
+bool WebsocketProtocol::SendCbor(std::string& message) {
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+    // Keep the order of audio and control messages
+    FlushAudio();
+
+    size_t header_size = CborHeaderSize();
+    size_t payload_size = message.size() - header_size;
+    if (version_ == 3 && payload_size > UINT16_MAX) {
+        std::string text;
+        if (!CborToJson((const uint8_t*)message.data() + header_size, payload_size, text) || !websocket_->Send(text)) {
+            ESP_LOGE(TAG, "Failed to send large message, size: %u", payload_size);
+            SetError(Lang::Strings::SERVER_ERROR);
+            return false;
+        }
+        return true;
+    }
+    if (version_ == 2) {
+        auto bp2 = (BinaryProtocol2*)message.data();
+        bp2->version = htons(version_);
+        bp2->type = htons(3);
+        bp2->payload_size = htonl(payload_size);
+    } else {
+        auto bp3 = (BinaryProtocol3*)message.data();
+        bp3->type = 3;
+        bp3->payload_size = htons(payload_size);
+    }
+    if (!websocket_->Send(message.data(), message.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send CBOR message, size: %u", payload_size);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
     return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
@@ -89,6 +235,10 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    ResetLinkQuality();
+    audio_batch_ = false;
+    control_cbor_ = false;
+    batch_frames_ = 0;
 
     auto network = Board::GetInstance().GetNetwork();
     websocket_ = network->CreateWebSocket(1);
@@ -109,54 +259,55 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
-        if (binary) {
+        const uint8_t* cbor;
+        size_t cbor_size;
+        if (binary && IsCborMessage(data, len, cbor, cbor_size)) {
+            // The frequent messages are handled from views into the data, the others get a tree
+            CborMessage message;
+            if (!CborReadMessage(cbor, cbor_size, message)) {
+                ESP_LOGE(TAG, "Invalid CBOR message, size: %u", len);
+            } else if (message.type == "hello" || message.type == "pong" || !DispatchCborMessage(message)) {
+                auto root = ParseCbor(cbor, cbor_size);
+                if (!HandleJson(root)) {
+                    ESP_LOGE(TAG, "Missing message type in CBOR message");
+                }
+                cJSON_Delete(root);
+            }
+        } else if (binary) {
             if (on_incoming_audio_ != nullptr) {
+                // The payload is copied once, from the receive buffer into a pooled packet
+                auto payload = (const uint8_t*)data;
+                size_t payload_size = len;
+                uint32_t timestamp = 0;
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    if (len < sizeof(BinaryProtocol2) || ntohl(bp2->payload_size) > len - sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    timestamp = ntohl(bp2->timestamp);
+                    payload = bp2->payload;
+                    payload_size = ntohl(bp2->payload_size);
                 } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    if (len < sizeof(BinaryProtocol3) || ntohs(bp3->payload_size) > len - sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    payload = bp3->payload;
+                    payload_size = ntohs(bp3->payload_size);
                 }
+                auto packet = AudioPacketPool::GetInstance().Acquire(payload_size);
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                packet->timestamp = timestamp;
+                packet->payload.assign(payload, payload + payload_size);
+                on_incoming_audio_(std::move(packet));
             }
         } else {
             // Parse JSON data
             auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
-                } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
-                }
-            } else {
+            if (!HandleJson(root)) {
                 ESP_LOGE(TAG, "Missing message type, data: %s", data);
             }
             cJSON_Delete(root);
@@ -199,28 +350,76 @@ bool WebsocketProtocol::OpenAudioChannel() {
     return true;
 }
 
+bool WebsocketProtocol::HandleJson(const cJSON* root) {
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (!cJSON_IsString(type)) {
+        return false;
+    }
+    if (strcmp(type->valuestring, "hello") == 0) {
+        ParseServerHello(root);
+    } else if (strcmp(type->valuestring, "pong") == 0) {
+        OnPong(root);
+    } else {
+        if (on_incoming_json_ != nullptr) {
+            on_incoming_json_(root);
+        }
+    }
+    return true;
+}
+
+// CBOR control messages are binary messages of type 3, version 1 has no header to tell them from audio
+bool WebsocketProtocol::IsCborMessage(const char* data, size_t len, const uint8_t*& payload, size_t& payload_size) const {
+    if (version_ == 2) {
+        auto bp2 = (const BinaryProtocol2*)data;
+        if (len < sizeof(BinaryProtocol2) || ntohs(bp2->type) != 3 || ntohl(bp2->payload_size) > len - sizeof(BinaryProtocol2)) {
+            return false;
+        }
+        payload = bp2->payload;
+        payload_size = ntohl(bp2->payload_size);
+        return true;
+    } else if (version_ == 3) {
+        auto bp3 = (const BinaryProtocol3*)data;
+        if (len < sizeof(BinaryProtocol3) || bp3->type != 3 || ntohs(bp3->payload_size) > len - sizeof(BinaryProtocol3)) {
+            return false;
+        }
+        payload = bp3->payload;
+        payload_size = ntohs(bp3->payload_size);
+        return true;
+    }
+    return false;
+}
+
 std::string WebsocketProtocol::GetHelloMessage() {
     // keys: message type, version, audio_params (format, sample_rate, channels)
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "type", "hello");
-    cJSON_AddNumberToObject(root, "version", version_);
-    cJSON* features = cJSON_CreateObject();
+    std::string message;
+    JsonWriter writer(message);
+    writer.BeginObject();
+    writer.Field("type", "hello");
+    writer.Field("version", version_);
+    writer.Key("features").BeginObject();
 #if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
+    writer.Field("aec", true);
+#endif
+    writer.Field("mcp", true);
+#if CONFIG_WEBSOCKET_AUDIO_BATCH_MS > 0
+    writer.Field("audio_batch", true);
+#endif
+#if CONFIG_CONTROL_CHANNEL_CBOR
+    if (version_ >= 2) {
+        writer.Field("cbor", true);
+    }
 #endif
-    cJSON_AddBoolToObject(features, "mcp", true);
-    cJSON_AddItemToObject(root, "features", features);
-    cJSON_AddStringToObject(root, "transport", "websocket");
-    cJSON* audio_params = cJSON_CreateObject();
-    cJSON_AddStringToObject(audio_params, "format", "opus");
-    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
-    cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
-    cJSON_AddItemToObject(root, "audio_params", audio_params);
-    auto json_str = cJSON_PrintUnformatted(root);
-    std::string message(json_str);
-    cJSON_free(json_str);
-    cJSON_Delete(root);
+    writer.EndObject();
+    writer.Field("transport", "websocket");
+    writer.Key("audio_params").BeginObject();
+    writer.Field("format", "opus");
+    writer.Field("sample_rate", 16000);
+    writer.Field("channels", 1);
+    writer.Field("frame_duration", OPUS_FRAME_DURATION_MS);
+    WriteDownlinkAudioParams(writer, Application::GetInstance().GetAudioService().GetPreferredDecodeSampleRate(),
+        OPUS_FRAME_DURATION_MS);
+    writer.EndObject();
+    writer.EndObject();
     return message;
 }
 
@@ -249,5 +448,17 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         }
     }
 
+    auto features = cJSON_GetObjectItem(root, "features");
+#if CONFIG_WEBSOCKET_AUDIO_BATCH_MS > 0
+    // Servers that do not know the feature keep receiving one frame per message
+    audio_batch_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "audio_batch"));
+    ESP_LOGI(TAG, "Uplink audio batching: %s", audio_batch_ ? "on" : "off");
+#endif
+
+#if CONFIG_CONTROL_CHANNEL_CBOR
+    control_cbor_ = version_ >= 2 && cJSON_IsTrue(cJSON_GetObjectItem(features, "cbor"));
+    ESP_LOGI(TAG, "CBOR control messages: %s", control_cbor_ ? "on" : "off");
+#endif
+
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
@@ -7,8 +7,11 @@
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <esp_timer.h>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_AUDIO_BATCH_MAX_BYTES 1400   // One TCP segment on a typical MTU
+#define WEBSOCKET_AUDIO_BATCH_MAX_FRAMES 16
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -17,6 +20,7 @@ public:
 
     bool Start() override;
     bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool FlushAudio() override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -26,8 +30,22 @@ private:
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
 
+    // Uplink batching, enabled when the server hello accepts the audio_batch feature
+    bool audio_batch_ = false;
+    std::vector<uint8_t> batch_buffer_;
+    int batch_frames_ = 0;
+    int64_t batch_start_time_ = 0;
+    esp_timer_handle_t batch_timer_handle_ = nullptr;
+
     void ParseServerHello(const cJSON* root);
+    bool HandleJson(const cJSON* root);
+    bool IsCborMessage(const char* data, size_t len, const uint8_t*& payload, size_t& payload_size) const;
+    bool BatchAudio(std::unique_ptr<AudioStreamPacket> packet);
+    int GetBatchMs();
+    void FlushAudioIfDue();
     bool SendText(const std::string& text) override;
+    size_t CborHeaderSize() const override;
+    bool SendCbor(std::string& message) override;
     std::string GetHelloMessage();
 };
 
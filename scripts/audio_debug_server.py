@@ -1,54 +1,204 @@
 import socket
+import struct
 import wave
 import argparse
+import os
+
+import numpy as np
 
 
 '''
-  Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Receive the framed audio debugger stream (see main/audio/processors/audio_debugger.h).
+  Each UDP packet carries a header (tap id, sequence, timestamp) followed by 16-bit PCM.
+
+  On exit the streams are reassembled:
+    - one WAV file per tap with all channels
+    - aligned.wav, a multichannel WAV with the first channel of every tap on a common 16kHz timeline
+    - a report of packet loss per tap and the latency between stages (by cross-correlation)
+
+  The raw packets are also saved to capture.adbg, so they can be analyzed again with --analyze.
 '''
-def main(samplerate, channels):
-    # Create a UDP socket
-    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
 
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
+HEADER = struct.Struct("<2sBBIQIHBB")
+TAP_NAMES = ["mic_raw", "afe_output", "encoder_input", "decoder_output", "playback"]
+ALIGNED_SAMPLE_RATE = 16000
+# Timestamps are taken when a frame passes the tap, so they jitter by a few milliseconds
+CONTINUITY_TOLERANCE_US = 20000
+LATENCY_PAIRS = [
+    ("mic_raw", "afe_output"),
+    ("afe_output", "encoder_input"),
+    ("decoder_output", "playback"),
+    ("playback", "mic_raw"),
+]
+MAX_LATENCY_MS = 1000
+
+
+def parse_packet(packet):
+    if len(packet) < HEADER.size:
+        return None
+    magic, version, tap, sequence, timestamp_us, sample_rate, samples, channels, _ = HEADER.unpack_from(packet, 0)
+    if magic != b"AD" or version != 1:
+        return None
+    pcm = np.frombuffer(packet[HEADER.size:HEADER.size + samples * channels * 2], dtype="<i2")
+    return {
+        "tap": tap,
+        "sequence": sequence,
+        "timestamp_us": timestamp_us,
+        "sample_rate": sample_rate,
+        "channels": channels,
+        "pcm": pcm.reshape(-1, channels),
+    }
+
+
+def reassemble(packets, t0_us):
+    """Place the packets of one tap on a timeline starting at t0_us, filling losses with silence."""
+    packets = sorted(packets, key=lambda p: p["sequence"])
+    sample_rate = packets[0]["sample_rate"]
+    channels = packets[0]["channels"]
+    chunks = []
+    position = None
+    last_sequence = None
+    lost = 0
+    for p in packets:
+        if last_sequence is not None:
+            lost += p["sequence"] - last_sequence - 1
+        expected = position
+        actual = (p["timestamp_us"] - t0_us) * sample_rate // 1000000
+        if expected is None or p["sequence"] != last_sequence + 1 or \
+                abs(actual - expected) * 1000000 // sample_rate > CONTINUITY_TOLERANCE_US:
+            if expected is not None and actual > expected:
+                chunks.append(np.zeros((actual - expected, channels), dtype=np.int16))
+            elif expected is None and actual > 0:
+                chunks.append(np.zeros((actual, channels), dtype=np.int16))
+            position = max(actual, expected or 0)
+        chunks.append(p["pcm"])
+        position += len(p["pcm"])
+        last_sequence = p["sequence"]
+    return sample_rate, np.concatenate(chunks), lost
+
+
+def resample(data, from_rate, to_rate):
+    if from_rate == to_rate:
+        return data.astype(np.float64)
+    duration = len(data) / from_rate
+    x_new = np.arange(int(duration * to_rate)) / to_rate
+    x_old = np.arange(len(data)) / from_rate
+    return np.interp(x_new, x_old, data.astype(np.float64))
+
+
+def estimate_latency(a, b, sample_rate):
+    """Return the delay of b relative to a in milliseconds, and the normalized correlation peak."""
+    length = min(len(a), len(b))
+    if length == 0 or not a[:length].any() or not b[:length].any():
+        return None, 0.0
+    a = a[:length] - a[:length].mean()
+    b = b[:length] - b[:length].mean()
+    n = 1 << (2 * length - 1).bit_length()
+    corr = np.fft.irfft(np.fft.rfft(b, n) * np.conj(np.fft.rfft(a, n)), n)
+    max_lag = min(length - 1, MAX_LATENCY_MS * sample_rate // 1000)
+    # Only positive lags: b is a later stage than a
+    lag = int(np.argmax(corr[:max_lag + 1]))
+    peak = corr[lag] / (np.sqrt(np.dot(a, a) * np.dot(b, b)) + 1e-9)
+    return lag * 1000.0 / sample_rate, float(peak)
+
+
+def write_wav(filename, data, sample_rate):
+    with wave.open(filename, "wb") as wav_file:
+        wav_file.setnchannels(data.shape[1])
+        wav_file.setsampwidth(2)
+        wav_file.setframerate(sample_rate)
+        wav_file.writeframes(data.astype("<i2").tobytes())
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
 
+def analyze(packets, output_dir):
+    if not packets:
+        print("No packets received")
+        return
+    os.makedirs(output_dir, exist_ok=True)
+    t0_us = min(p["timestamp_us"] for p in packets)
+
+    tracks = {}
+    for tap in sorted(set(p["tap"] for p in packets)):
+        name = TAP_NAMES[tap] if tap < len(TAP_NAMES) else f"tap{tap}"
+        tap_packets = [p for p in packets if p["tap"] == tap]
+        sample_rate, data, lost = reassemble(tap_packets, t0_us)
+        write_wav(os.path.join(output_dir, f"{name}.wav"), data, sample_rate)
+        tracks[name] = resample(data[:, 0], sample_rate, ALIGNED_SAMPLE_RATE)
+        total = len(tap_packets) + lost
+        print(f"{name:15s} {sample_rate:6d} Hz {data.shape[1]} ch, {len(tap_packets)} packets, "
+              f"{lost} lost ({lost * 100.0 / total:.1f}%)")
+
+    length = max(len(t) for t in tracks.values())
+    aligned = np.zeros((length, len(tracks)), dtype=np.int16)
+    for i, track in enumerate(tracks.values()):
+        aligned[:len(track), i] = np.clip(track, -32768, 32767)
+    write_wav(os.path.join(output_dir, "aligned.wav"), aligned, ALIGNED_SAMPLE_RATE)
+    print(f"aligned.wav channels: {', '.join(tracks.keys())}")
+
+    print("Stage latency:")
+    for a, b in LATENCY_PAIRS:
+        if a in tracks and b in tracks:
+            latency, peak = estimate_latency(tracks[a], tracks[b], ALIGNED_SAMPLE_RATE)
+            if latency is None:
+                print(f"  {a} -> {b}: no signal")
+            else:
+                print(f"  {a} -> {b}: {latency:.1f} ms (correlation {peak:.2f})")
+
+
+def read_capture(filename):
+    packets = []
+    with open(filename, "rb") as f:
+        while True:
+            size = f.read(2)
+            if len(size) < 2:
+                break
+            packet = parse_packet(f.read(struct.unpack("<H", size)[0]))
+            if packet:
+                packets.append(packet)
+    return packets
+
+
+def main(port, output_dir):
+    # Create a UDP socket
+    server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server_socket.bind(('0.0.0.0', port))
+    os.makedirs(output_dir, exist_ok=True)
+    capture_file = open(os.path.join(output_dir, "capture.adbg"), "wb")
+
+    print(f"Start receiving audio from 0.0.0.0:{port}, press Ctrl+C to stop...")
+    packets = []
     try:
         while True:
-            # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            message, address = server_socket.recvfrom(2048)
+            packet = parse_packet(message)
+            if packet is None:
+                print(f"Ignored {len(message)} bytes from {address}, not an audio debugger packet")
+                continue
+            capture_file.write(struct.pack("<H", len(message)) + message)
+            packets.append(packet)
+            if len(packets) % 500 == 0:
+                print(f"Received {len(packets)} packets")
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
-        # Close files and socket
-        wav_file.close()
+        capture_file.close()
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
+        analyze(packets, output_dir)
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频调试数据接收器，按通道重组为WAV文件并计算各阶段延迟')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='UDP端口 (默认: 8000)')
+    parser.add_argument('--output', '-o', default='audio_debug',
+                        help='输出目录 (默认: audio_debug)')
+    parser.add_argument('--analyze', '-a', default=None,
+                        help='分析已保存的 capture.adbg 文件，不启动接收')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    if args.analyze:
+        analyze(read_capture(args.analyze), args.output)
+    else:
+        main(args.port, args.output)
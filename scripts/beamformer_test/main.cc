@@ -0,0 +1,301 @@
+/*
+ * Host test of the multi-mic beamformer, see README.md
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "beamformer.h"
+
+#define SAMPLE_RATE 16000
+#define FRAME_SAMPLES 960               // 60ms, the same frame size as the device
+#define FIXTURE_SECONDS 4
+#define SINC_TAPS 32
+
+struct Recording {
+    int channels = 0;
+    int sample_rate = SAMPLE_RATE;
+    std::vector<int16_t> data;          // Interleaved
+};
+
+static bool ReadWav(const char* filename, Recording& recording) {
+    FILE* file = fopen(filename, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+    char riff[12];
+    if (fread(riff, 1, 12, file) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s is not a WAV file\n", filename);
+        fclose(file);
+        return false;
+    }
+    int bits = 0;
+    char id[4];
+    uint32_t size;
+    while (fread(id, 1, 4, file) == 4 && fread(&size, 4, 1, file) == 1) {
+        if (memcmp(id, "fmt ", 4) == 0) {
+            std::vector<uint8_t> fmt(size);
+            fread(fmt.data(), 1, size, file);
+            recording.channels = fmt[2] | (fmt[3] << 8);
+            recording.sample_rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+            bits = fmt[14] | (fmt[15] << 8);
+        } else if (memcmp(id, "data", 4) == 0) {
+            if (bits != 16 || recording.channels == 0) {
+                fprintf(stderr, "Only 16-bit PCM is supported\n");
+                break;
+            }
+            recording.data.resize(size / 2);
+            fread(recording.data.data(), 2, recording.data.size(), file);
+            fclose(file);
+            return true;
+        } else {
+            fseek(file, size + (size & 1), SEEK_CUR);
+        }
+    }
+    fclose(file);
+    return false;
+}
+
+static bool WriteWav(const char* filename, const std::vector<int16_t>& data, int channels, int sample_rate) {
+    FILE* file = fopen(filename, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint32_t data_size = data.size() * 2;
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1, channel_count = channels, block_align = channels * 2, bits = 16;
+    uint32_t byte_rate = sample_rate * block_align;
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channel_count, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+    fwrite(data.data(), 2, data.size(), file);
+    fclose(file);
+    return true;
+}
+
+// Speech-like source: harmonics of a gliding pitch plus noise, with a syllable envelope
+static std::vector<float> GenerateSpeech(size_t samples, std::mt19937& rng) {
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::vector<float> speech(samples);
+    double phase = 0;
+    for (size_t i = 0; i < samples; i++) {
+        double t = (double)i / SAMPLE_RATE;
+        double pitch = 140 + 40 * std::sin(2 * M_PI * 0.7 * t);
+        phase += 2 * M_PI * pitch / SAMPLE_RATE;
+        float voiced = 0;
+        for (int h = 1; h <= 20; h++) {
+            voiced += std::sin(h * phase) / h;
+        }
+        float envelope = std::pow(std::fabs(std::sin(M_PI * 3 * t)), 1.5f);
+        speech[i] = envelope * (4000 * voiced + 1500 * noise(rng));
+    }
+    return speech;
+}
+
+// Windowed sinc fractional delay, much more accurate than the linear interpolation under test
+static float DelayedSample(const std::vector<float>& signal, double position) {
+    long center = (long)std::floor(position);
+    double sum = 0;
+    for (long i = center - SINC_TAPS / 2 + 1; i <= center + SINC_TAPS / 2; i++) {
+        if (i < 0 || i >= (long)signal.size()) {
+            continue;
+        }
+        double x = position - i;
+        double sinc = std::fabs(x) < 1e-9 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+        double window = 0.5 + 0.5 * std::cos(M_PI * x / (SINC_TAPS / 2));
+        sum += signal[i] * sinc * window;
+    }
+    return (float)sum;
+}
+
+/* Far field source at an azimuth plus independent noise on each mic */
+static Recording GenerateFixture(const BeamformerConfig& config, int azimuth, float snr_db, unsigned seed,
+    std::vector<float>* clean = nullptr) {
+    std::mt19937 rng(seed);
+    size_t samples = SAMPLE_RATE * FIXTURE_SECONDS;
+    auto speech = GenerateSpeech(samples, rng);
+    double speech_power = 0;
+    for (auto s : speech) {
+        speech_power += (double)s * s;
+    }
+    speech_power /= samples;
+    std::normal_distribution<float> noise(0.0f, std::sqrt(speech_power / std::pow(10.0, snr_db / 10)));
+
+    Recording recording;
+    recording.channels = config.mic_count;
+    recording.data.resize(samples * config.mic_count);
+    double ux = std::cos(azimuth * M_PI / 180), uy = std::sin(azimuth * M_PI / 180);
+    for (int m = 0; m < config.mic_count; m++) {
+        // Mics closer to the source hear it earlier
+        double advance = (config.mic_x_mm[m] * ux + config.mic_y_mm[m] * uy) / 1000.0 / BEAMFORMER_SPEED_OF_SOUND * SAMPLE_RATE;
+        for (size_t i = 0; i < samples; i++) {
+            float value = DelayedSample(speech, i + advance) + noise(rng);
+            recording.data[i * config.mic_count + m] = (int16_t)std::fmax(-32768, std::fmin(32767, value));
+        }
+    }
+    if (clean != nullptr) {
+        *clean = speech;
+    }
+    return recording;
+}
+
+struct RunResult {
+    int direction = 0;
+    float confidence = 0;
+    std::vector<int16_t> output;
+    double us_per_second = 0;
+    BeamformerStatistics statistics;
+};
+
+static RunResult Run(const BeamformerConfig& config, const Recording& recording, bool verbose) {
+    Beamformer beamformer;
+    beamformer.Configure(config, recording.sample_rate);
+    RunResult result;
+    size_t total = recording.data.size() / recording.channels;
+    std::vector<int16_t> frame_output;
+    clock_t start = clock();
+    for (size_t offset = 0; offset + FRAME_SAMPLES <= total; offset += FRAME_SAMPLES) {
+        beamformer.Process(recording.data.data() + offset * recording.channels, FRAME_SAMPLES, recording.channels, frame_output);
+        result.output.insert(result.output.end(), frame_output.begin(), frame_output.end());
+        if (verbose) {
+            printf("%6.2fs  direction %3d  confidence %.2f\n", (double)offset / recording.sample_rate,
+                beamformer.direction(), beamformer.confidence());
+        }
+    }
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    result.us_per_second = elapsed * 1e6 * recording.sample_rate / std::max<size_t>(total, 1);
+    result.direction = beamformer.direction();
+    result.confidence = beamformer.confidence();
+    result.statistics = beamformer.statistics();
+    return result;
+}
+
+// SNR of a signal against the clean source, after finding the best gain and alignment
+static double MeasureSnr(const std::vector<int16_t>& signal, int stride, const std::vector<float>& clean) {
+    size_t samples = std::min(signal.size() / stride, clean.size());
+    double best = -1e9;
+    for (int lag = -4; lag <= 8; lag++) {
+        double sc = 0, cc = 0, ss = 0;
+        for (size_t i = SAMPLE_RATE / 2; i < samples - 8; i++) {
+            double s = signal[i * stride];
+            double c = clean[i - lag];
+            sc += s * c;
+            cc += c * c;
+            ss += s * s;
+        }
+        double gain = sc / cc;
+        double residual = ss - gain * sc;
+        best = std::max(best, 10 * std::log10(gain * gain * cc / std::max(residual, 1.0)));
+    }
+    return best;
+}
+
+static int AngleError(int a, int b, bool half_circle) {
+    int error = std::abs(a - b) % 360;
+    error = std::min(error, 360 - error);
+    if (half_circle) {
+        // A line array sees the mirror image of the source across its axis
+        int mirrored = std::abs((360 - a) % 360 - b) % 360;
+        error = std::min(error, std::min(mirrored, 360 - mirrored));
+    }
+    return error;
+}
+
+static int SelfTest(const char* fixture_dir) {
+    struct Array {
+        const char* name;
+        BeamformerConfig config;
+        bool half_circle;
+        int max_error;                  // Degrees, two mics resolve poorly near the array axis
+        std::vector<int> azimuths;
+    };
+    std::vector<Array> arrays = {
+        {"linear2_65mm", BeamformerConfig::Linear(2, 65), true, 25, {0, 30, 60, 90, 120, 150, 180}},
+        {"linear4_40mm", BeamformerConfig::Linear(4, 40), true, 15, {0, 30, 60, 90, 120, 150, 180}},
+        {"circular4_32mm", BeamformerConfig::Circular(4, 32), false, 15, {0, 45, 90, 160, 200, 270, 330}},
+    };
+
+    int failures = 0;
+    printf("%-16s %8s %8s %6s %8s %8s %8s %10s\n", "array", "azimuth", "found", "conf", "snr_in", "snr_out", "voiced", "us/s");
+    for (auto& array : arrays) {
+        for (size_t i = 0; i < array.azimuths.size(); i++) {
+            int azimuth = array.azimuths[i];
+            std::vector<float> clean;
+            auto recording = GenerateFixture(array.config, azimuth, 5.0f, 100 + i, &clean);
+            if (fixture_dir != nullptr) {
+                std::string filename = std::string(fixture_dir) + "/" + array.name + "_" + std::to_string(azimuth) + ".wav";
+                WriteWav(filename.c_str(), recording.data, recording.channels, recording.sample_rate);
+            }
+            auto result = Run(array.config, recording, false);
+            double snr_in = MeasureSnr(recording.data, recording.channels, clean);
+            double snr_out = MeasureSnr(result.output, 1, clean);
+            int error = AngleError(azimuth, result.direction, array.half_circle);
+            bool ok = error <= array.max_error && snr_out > snr_in;
+            printf("%-16s %8d %8d %6.2f %7.1f  %7.1f  %8lu %10.0f %s\n", array.name, azimuth, result.direction,
+                result.confidence, snr_in, snr_out, (unsigned long)result.statistics.voiced_frames,
+                result.us_per_second, ok ? "" : "FAIL");
+            if (!ok) {
+                failures++;
+            }
+        }
+    }
+    printf("%s\n", failures == 0 ? "All passed" : "Failed");
+    return failures == 0 ? 0 : 1;
+}
+
+static void Usage(const char* name) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s [--fixtures dir]                                  run the synthetic test, optionally saving the fixtures\n", name);
+    fprintf(stderr, "  %s --linear mics spacing_mm input.wav [output.wav]   process a multi-channel recording\n", name);
+    fprintf(stderr, "  %s --circular mics radius_mm input.wav [output.wav]\n", name);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        return SelfTest(nullptr);
+    }
+    if (argc == 3 && strcmp(argv[1], "--fixtures") == 0) {
+        return SelfTest(argv[2]);
+    }
+    if (argc >= 5 && (strcmp(argv[1], "--linear") == 0 || strcmp(argv[1], "--circular") == 0)) {
+        int mics = atoi(argv[2]);
+        float size = atof(argv[3]);
+        auto config = strcmp(argv[1], "--linear") == 0 ? BeamformerConfig::Linear(mics, size) : BeamformerConfig::Circular(mics, size);
+        Recording recording;
+        if (!ReadWav(argv[4], recording)) {
+            return 1;
+        }
+        if (recording.channels < config.mic_count) {
+            fprintf(stderr, "The recording has %d channels, %d mics expected\n", recording.channels, config.mic_count);
+            return 1;
+        }
+        auto result = Run(config, recording, true);
+        printf("Final direction %d, %lu direction changes in %lu voiced frames, %.0f us per second of audio\n",
+            result.direction, (unsigned long)result.statistics.direction_changes,
+            (unsigned long)result.statistics.voiced_frames, result.us_per_second);
+        if (argc >= 6 && !WriteWav(argv[5], result.output, 1, recording.sample_rate)) {
+            fprintf(stderr, "Failed to write %s\n", argv[5]);
+            return 1;
+        }
+        return 0;
+    }
+    Usage(argv[0]);
+    return 1;
+}
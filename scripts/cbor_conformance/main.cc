@@ -0,0 +1,394 @@
+/*
+ * Host conformance test of the CBOR control channel encoding against the JSON path, see README.md
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cbor.h"
+#include "host_test.h"
+#include "json_writer.h"
+
+static std::string FromHex(const char* hex) {
+    std::string bytes;
+    for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+        char digits[3] = { hex[i], hex[i + 1], 0 };
+        bytes.push_back((char)strtoul(digits, nullptr, 16));
+    }
+    return bytes;
+}
+
+static std::string ToHex(const std::string& bytes) {
+    std::string hex;
+    char digits[3];
+    for (unsigned char c : bytes) {
+        snprintf(digits, sizeof(digits), "%02x", c);
+        hex += digits;
+    }
+    return hex;
+}
+
+static HostTest test(64);
+
+static bool Decode(const std::string& cbor, std::string& json) {
+    json.clear();
+    return CborToJson((const uint8_t*)cbor.data(), cbor.size(), json);
+}
+
+// Encoding examples of RFC 8949 appendix A that use the preferred serialization of this writer
+static void EncodeVectors() {
+    struct Vector {
+        int64_t value;
+        const char* hex;
+    };
+    const Vector integers[] = {
+        { 0, "00" }, { 1, "01" }, { 10, "0a" }, { 23, "17" }, { 24, "1818" }, { 25, "1819" },
+        { 100, "1864" }, { 1000, "1903e8" }, { 1000000, "1a000f4240" }, { 1000000000000, "1b000000e8d4a51000" },
+        { -1, "20" }, { -10, "29" }, { -100, "3863" }, { -1000, "3903e7" },
+    };
+    for (auto& vector : integers) {
+        std::string output;
+        CborWriter(output).Integer(vector.value);
+        test.Check("encode " + std::to_string(vector.value), ToHex(output) == vector.hex);
+    }
+
+    std::string output;
+    CborWriter writer(output);
+    writer.Number(1.1);
+    test.Check("encode 1.1", ToHex(output) == "fb3ff199999999999a");
+    output.clear();
+    writer.Number(100000.0);
+    test.Check("encode 100000.0 as an integer", ToHex(output) == "1a000186a0");
+    output.clear();
+    writer.Number(-4.1);
+    test.Check("encode -4.1", ToHex(output) == "fbc010666666666666");
+    output.clear();
+    writer.Text("\xe6\xb0\xb4");
+    test.Check("encode \"\\u6c34\"", ToHex(output) == "63e6b0b4");
+    output.clear();
+    writer.BeginMap(2);
+    writer.Text("a");
+    writer.Integer(1);
+    writer.Text("b");
+    writer.BeginArray(2);
+    writer.Integer(2);
+    writer.Integer(3);
+    test.Check("encode {\"a\": 1, \"b\": [2, 3]}", ToHex(output) == "a26161016162820203");
+}
+
+// Decoding examples of RFC 8949 appendix A, including the forms this writer never produces
+static void DecodeVectors() {
+    struct Vector {
+        const char* hex;
+        const char* json;
+    };
+    const Vector vectors[] = {
+        { "1bffffffffffffffff", "1.8446744073709552e+19" },
+        { "3bffffffffffffffff", "-1.8446744073709552e+19" },
+        { "f90000", "0" },
+        { "f98000", "-0" },
+        { "f93c00", "1" },
+        { "f93e00", "1.5" },
+        { "f97bff", "65504" },
+        { "f90001", "5.9604644775390625e-08" },
+        { "f9c400", "-4" },
+        { "fa47c35000", "100000" },
+        { "fa7f7fffff", "3.4028234663852886e+38" },
+        { "fb7e37e43c8800759c", "1e+300" },
+        { "f97c00", "null" },
+        { "f97e00", "null" },
+        { "f4", "false" },
+        { "f5", "true" },
+        { "f6", "null" },
+        { "f7", "null" },
+        { "c074323031332d30332d32315432303a30343a30305a", "\"2013-03-21T20:04:00Z\"" },
+        { "c11a514b67b0", "1363896240" },
+        { "60", "\"\"" },
+        { "6449455446", "\"IETF\"" },
+        { "62225c", "\"\\\"\\\\\"" },
+        { "62c3bc", "\"\xc3\xbc\"" },
+        { "64f0908591", "\"\xf0\x90\x85\x91\"" },
+        { "80", "[]" },
+        { "83010203", "[1,2,3]" },
+        { "8301820203820405", "[1,[2,3],[4,5]]" },
+        { "a0", "{}" },
+        { "a26161016162820203", "{\"a\":1,\"b\":[2,3]}" },
+        { "826161a161626163", "[\"a\",{\"b\":\"c\"}]" },
+        { "9fff", "[]" },
+        { "9f018202039f0405ffff", "[1,[2,3],[4,5]]" },
+        { "83018202039f0405ff", "[1,[2,3],[4,5]]" },
+        { "bf61610161629f0203ffff", "{\"a\":1,\"b\":[2,3]}" },
+        { "bf6346756ef563416d7421ff", "{\"Fun\":true,\"Amt\":-2}" },
+    };
+    for (auto& vector : vectors) {
+        std::string json;
+        bool decoded = Decode(FromHex(vector.hex), json);
+        test.Check(std::string("decode ") + vector.hex, decoded && json == vector.json);
+    }
+}
+
+/*
+ * Messages as the JSON path builds them (protocol.cc, mcp_server.cc) and as servers send them,
+ * in the compact form of cJSON_PrintUnformatted. The CBOR path must carry the same keys and values.
+ */
+static const char* kControlMessages[] = {
+    "{\"type\":\"hello\",\"version\":3,\"features\":{\"mcp\":true,\"cbor\":true},\"transport\":\"websocket\","
+        "\"audio_params\":{\"format\":\"opus\",\"sample_rate\":16000,\"channels\":1,\"frame_duration\":60}}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"listen\",\"state\":\"start\",\"mode\":\"auto\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"\xe4\xbd\xa0\xe5\xa5\xbd\xe5\xb0\x8f\xe6\x99\xba\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"listen\",\"state\":\"stop\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"abort\",\"reason\":\"wake_word_detected\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"ping\",\"id\":4294967295}",
+    "{\"type\":\"pong\",\"id\":12}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"stt\",\"text\":\"\xe4\xbb\x8a\xe5\xa4\xa9\xe5\xa4\xa9\xe6\xb0\x94\xe6\x80\x8e\xe4\xb9\x88\xe6\xa0\xb7\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"llm\",\"emotion\":\"happy\",\"text\":\"\xf0\x9f\x98\x80\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"He said \\\"hi\\\"\\n\\tand left\\\\\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"tts\",\"state\":\"stop\"}",
+    "{\"type\":\"system\",\"command\":\"reboot\"}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"mcp\",\"payload\":{\"jsonrpc\":\"2.0\",\"method\":\"tools/call\","
+        "\"params\":{\"name\":\"self.audio_speaker.set_volume\",\"arguments\":{\"volume\":-0.5,\"fade\":1.25e-07}},\"id\":1}}",
+    "{\"session_id\":\"a1b2c3d4\",\"type\":\"mcp\",\"payload\":{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":{\"tools\":["
+        "{\"name\":\"self.get_device_status\",\"description\":\"Provides the real-time information of the device\","
+        "\"inputSchema\":{\"type\":\"object\",\"properties\":{}}},"
+        "{\"name\":\"self.audio_speaker.set_volume\",\"description\":\"Set the volume of the audio speaker.\","
+        "\"inputSchema\":{\"type\":\"object\",\"properties\":{\"volume\":{\"type\":\"integer\",\"minimum\":0,\"maximum\":100}},"
+        "\"required\":[\"volume\"]}}],\"nextCursor\":null}}}",
+    "{\"type\":\"custom\",\"payload\":{\"list\":[[],{},[null,false,true,0,-1,1.5,[[[]]]]]}}",
+};
+
+static void ControlMessages() {
+    size_t json_bytes = 0;
+    size_t cbor_bytes = 0;
+    for (auto message : kControlMessages) {
+        std::string cbor;
+        std::string json;
+        bool encoded = CborFromJson(message, cbor);
+        bool decoded = encoded && Decode(cbor, json);
+        std::string name = message;
+        name = "round trip " + name.substr(0, 50);
+        if (!test.Check(name, decoded && json == message)) {
+            printf("  expected %s\n  got      %s\n  cbor     %s\n", message, json.c_str(), ToHex(cbor).c_str());
+        }
+        json_bytes += strlen(message);
+        cbor_bytes += cbor.size();
+    }
+    printf("\n%zu control messages: JSON %zu bytes, CBOR %zu bytes (%.0f%%)\n\n", sizeof(kControlMessages) / sizeof(kControlMessages[0]),
+        json_bytes, cbor_bytes, 100.0 * cbor_bytes / json_bytes);
+}
+
+// JSON forms that are not canonical still carry the same values
+static void Normalization() {
+    struct Vector {
+        const char* input;
+        const char* json;
+    };
+    const Vector vectors[] = {
+        { " { \"a\" : [ 1 , 2 ] ,\n\t\"b\" : null } ", "{\"a\":[1,2],\"b\":null}" },
+        { "{\"e\":\"\\u00e9\\u6c34\\ud83d\\ude00\\/\"}", "{\"e\":\"\xc3\xa9\xe6\xb0\xb4\xf0\x9f\x98\x80/\"}" },
+        { "{\"c\":\"\\u0001\\b\\f\"}", "{\"c\":\"\\u0001\\b\\f\"}" },
+        { "[1.0,1e2,-0,2.5E-3,9223372036854775807,-9223372036854775808,9223372036854775808]",
+            "[1,100,0,0.0025,9223372036854775807,-9223372036854775808,9.223372036854776e+18]" },
+        { "[0.1,3.4028234663852886e+38,1e-320]", "[0.1,3.4028234663852886e+38,1e-320]" },
+    };
+    for (auto& vector : vectors) {
+        std::string cbor;
+        std::string json;
+        bool converted = CborFromJson(vector.input, cbor) && Decode(cbor, json);
+        if (!test.Check(std::string("normalize ") + vector.input, converted && json == vector.json)) {
+            printf("  got %s\n", json.c_str());
+        }
+    }
+}
+
+static void Malformed() {
+    const char* bad_json[] = {
+        "", "{", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "[1,]", "[01]", "[1.]", "[.5]", "[1e]", "[-]", "{a:1}",
+        "\"\\x\"", "\"\\ud800\"", "\"\\udc00\"", "\"\\u12\"", "\"tab\tin string\"", "[true false]", "[nul]",
+        "{} {}", "[[[[[[[[[[[[[[[[[[1]]]]]]]]]]]]]]]]]",
+    };
+    for (auto json : bad_json) {
+        std::string cbor;
+        test.Check(std::string("reject JSON ") + json, !CborFromJson(json, cbor));
+    }
+
+    const char* bad_cbor[] = {
+        "",                 // Nothing
+        "18",               // Argument missing
+        "1c",               // Reserved additional information
+        "62e6",             // String shorter than its head
+        "83010203ff",       // Trailing data
+        "8301",             // Missing elements
+        "a16161",           // Missing value
+        "a10101",           // Integer key
+        "bf616101",         // Missing break
+        "ff",               // Lone break
+        "820fff",           // Break inside a definite array
+        "5f4101ff",         // Indefinite byte string
+        "7f6161ff",         // Indefinite text string
+        "4101",             // Byte string
+        "f800",             // Simple value
+        "c0",               // Tag without an item
+        "9bffffffffffffffff00",  // Count larger than the input
+        "818181818181818181818181818181818100",  // Deeper than CBOR_MAX_DEPTH
+    };
+    for (auto hex : bad_cbor) {
+        std::string json;
+        test.Check(std::string("reject CBOR ") + hex, !Decode(FromHex(hex), json));
+    }
+
+    // Every truncation of a valid message is rejected without reading past the end
+    std::string cbor;
+    CborFromJson(kControlMessages[sizeof(kControlMessages) / sizeof(kControlMessages[0]) - 2], cbor);
+    bool truncations = true;
+    for (size_t size = 0; size < cbor.size(); size++) {
+        std::string json;
+        std::string truncated = cbor.substr(0, size);
+        truncations &= !CborToJson((const uint8_t*)truncated.data(), truncated.size(), json);
+    }
+    test.Check("reject every truncation of tools/list", truncations);
+}
+
+static void Reader() {
+    // The dispatch reads the type without building a tree
+    std::string cbor;
+    CborFromJson("{\"session_id\":\"x\",\"payload\":{\"type\":\"nested\"},\"type\":\"tts\",\"state\":\"stop\"}", cbor);
+    CborReader reader((const uint8_t*)cbor.data(), cbor.size());
+    CborItem item;
+    std::string type;
+    reader.Next(item);
+    while (reader.Next(item) && item.type != kCborBreak) {
+        std::string key(item.string);
+        CborItem value;
+        if (!reader.Next(value)) {
+            break;
+        }
+        if (key == "type" && value.type == kCborText) {
+            type = std::string(value.string);
+        } else {
+            reader.Skip(value);
+        }
+    }
+    test.Check("reader finds the type and skips nested maps", type == "tts" && reader.AtEnd() && !reader.error());
+}
+
+static void Message() {
+    // The frequent messages are dispatched from views, the payload is kept encoded
+    std::string cbor;
+    CborFromJson("{\"session_id\":\"x\",\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"\u4f60\u597d\","
+        "\"emotion\":1,\"payload\":{\"a\":[1,{\"b\":null}]}}", cbor);
+    CborMessage message;
+    bool read = CborReadMessage((const uint8_t*)cbor.data(), cbor.size(), message);
+    std::string payload;
+    CborToJson((const uint8_t*)message.payload.data(), message.payload.size(), payload);
+    test.Check("message members are views into the input", read && message.type == "tts"
+        && message.state == "sentence_start" && message.text == "\u4f60\u597d" && payload == "{\"a\":[1,{\"b\":null}]}");
+    test.Check("a member that is not text is missing", message.emotion.data() == nullptr);
+
+    cbor.clear();
+    CborFromJson("{\"type\":\"stt\",\"text\":\"\"}", cbor);
+    read = CborReadMessage((const uint8_t*)cbor.data(), cbor.size(), message);
+    test.Check("an empty text is present", read && message.text.data() != nullptr && message.text.empty()
+        && message.state.data() == nullptr && message.payload.empty());
+
+    cbor.pop_back();
+    test.Check("reject a message without its break", !CborReadMessage((const uint8_t*)cbor.data(), cbor.size(), message));
+    cbor = FromHex("a1016474797065");
+    test.Check("reject a message with an integer key", !CborReadMessage((const uint8_t*)cbor.data(), cbor.size(), message));
+}
+
+// The messages of Protocol, written once through either writer
+template <typename Writer>
+static void WriteMessages(Writer& writer) {
+    writer.BeginArray();
+    writer.BeginObject();
+    writer.Field("session_id", std::string("a1b2"));
+    writer.Field("type", "listen");
+    writer.Field("state", "detect");
+    writer.Field("text", "\xe4\xbd\xa0\xe5\xa5\xbd \"quoted\"\n");
+    writer.EndObject();
+    writer.BeginObject();
+    writer.Field("type", "ping");
+    writer.Field("id", 4000000000u);
+    writer.Field("offset", -12);
+    writer.Field("ratio", 0.1);
+    writer.Field("whole", 3.0);
+    writer.Field("ok", true);
+    writer.Key("none").Null();
+    writer.EndObject();
+    writer.BeginObject();
+    writer.Field("type", "mcp");
+    writer.Key("payload").Raw("{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":{\"content\":[{\"type\":\"text\",\"text\":\"true\"}],\"isError\":false}}");
+    writer.EndObject();
+    writer.BeginArray();
+    writer.Int(48000);
+    writer.Number(-2.5);
+    writer.String("");
+    writer.EndArray();
+    writer.EndArray();
+}
+
+static void Writer() {
+    std::string json;
+    JsonWriter json_writer(json);
+    WriteMessages(json_writer);
+    std::string cbor;
+    CborWriter cbor_writer(cbor);
+    WriteMessages(cbor_writer);
+    std::string transcoded;
+    bool converted = CborFromJson(json, transcoded);
+    test.Check("writer gives the bytes of the transcoded JSON", converted && cbor == transcoded);
+
+    std::string decoded;
+    test.Check("writer output decodes to the JSON writer output", Decode(cbor, decoded) && decoded == json);
+
+    cbor.clear();
+    cbor_writer.BeginObject().Key("payload").Raw("{\"a\":").EndObject();
+    test.Check("writer turns invalid raw JSON into null", Decode(cbor, decoded) && decoded == "{\"payload\":null}");
+}
+
+static int SelfTest() {
+    EncodeVectors();
+    DecodeVectors();
+    ControlMessages();
+    Normalization();
+    Malformed();
+    Reader();
+    Message();
+    Writer();
+    return test.Finish();
+}
+
+static void Usage(const char* program) {
+    fprintf(stderr, "Usage: %s\n", program);
+    fprintf(stderr, "       %s --encode JSON    Print the CBOR of a control message as hex\n", program);
+    fprintf(stderr, "       %s --decode HEX     Print the JSON of a CBOR message\n", program);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        return SelfTest();
+    }
+    if (argc == 3 && strcmp(argv[1], "--encode") == 0) {
+        std::string cbor;
+        if (!CborFromJson(argv[2], cbor)) {
+            fprintf(stderr, "Invalid JSON\n");
+            return 1;
+        }
+        printf("%s\n%zu bytes, JSON %zu bytes\n", ToHex(cbor).c_str(), cbor.size(), strlen(argv[2]));
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "--decode") == 0) {
+        std::string json;
+        if (!Decode(FromHex(argv[2]), json)) {
+            fprintf(stderr, "Invalid CBOR\n");
+            return 1;
+        }
+        printf("%s\n", json.c_str());
+        return 0;
+    }
+    Usage(argv[0]);
+    return 1;
+}
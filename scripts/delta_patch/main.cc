@@ -0,0 +1,607 @@
+/*
+ * Generates and applies delta firmware patches (main/delta_patch.h), see README.md
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include "delta_patch.h"
+
+static std::vector<uint8_t> Sha256(const uint8_t* data, size_t size) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    std::vector<uint8_t> message(data, data + size);
+    message.push_back(0x80);
+    while (message.size() % 64 != 56) {
+        message.push_back(0);
+    }
+    for (int i = 7; i >= 0; i--) {
+        message.push_back((uint8_t)(((uint64_t)size * 8) >> (i * 8)));
+    }
+
+    for (size_t block = 0; block < message.size(); block += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = &message[block + i * 4];
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    std::vector<uint8_t> digest;
+    for (int i = 0; i < 8; i++) {
+        for (int j = 3; j >= 0; j--) {
+            digest.push_back((uint8_t)(h[i] >> (j * 8)));
+        }
+    }
+    return digest;
+}
+
+static std::string Hex(const uint8_t* data, size_t size) {
+    std::string hex;
+    char buffer[3];
+    for (size_t i = 0; i < size; i++) {
+        snprintf(buffer, sizeof(buffer), "%02x", data[i]);
+        hex += buffer;
+    }
+    return hex;
+}
+
+// ----- Suffix sorting and matching, as in bsdiff 4 (Larsson and Sadakane qsufsort) -----
+
+static void Split(int64_t* I, int64_t* V, int64_t start, int64_t len, int64_t h) {
+    int64_t i, j, k, x, jj, kk;
+    if (len < 16) {
+        for (k = start; k < start + len; k += j) {
+            j = 1;
+            x = V[I[k] + h];
+            for (i = 1; k + i < start + len; i++) {
+                if (V[I[k + i] + h] < x) {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+                if (V[I[k + i] + h] == x) {
+                    std::swap(I[k + j], I[k + i]);
+                    j++;
+                }
+            }
+            for (i = 0; i < j; i++) {
+                V[I[k + i]] = k + j - 1;
+            }
+            if (j == 1) {
+                I[k] = -1;
+            }
+        }
+        return;
+    }
+
+    x = V[I[start + len / 2] + h];
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++) {
+        if (V[I[i] + h] < x) {
+            jj++;
+        }
+        if (V[I[i] + h] == x) {
+            kk++;
+        }
+    }
+    jj += start;
+    kk += jj;
+
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj) {
+        if (V[I[i] + h] < x) {
+            i++;
+        } else if (V[I[i] + h] == x) {
+            std::swap(I[i], I[jj + j]);
+            j++;
+        } else {
+            std::swap(I[i], I[kk + k]);
+            k++;
+        }
+    }
+    while (jj + j < kk) {
+        if (V[I[jj + j] + h] == x) {
+            j++;
+        } else {
+            std::swap(I[jj + j], I[kk + k]);
+            k++;
+        }
+    }
+
+    if (jj > start) {
+        Split(I, V, start, jj - start, h);
+    }
+    for (i = 0; i < kk - jj; i++) {
+        V[I[jj + i]] = kk - 1;
+    }
+    if (jj == kk - 1) {
+        I[jj] = -1;
+    }
+    if (start + len > kk) {
+        Split(I, V, kk, start + len - kk, h);
+    }
+}
+
+static std::vector<int64_t> SuffixArray(const uint8_t* old, int64_t old_size) {
+    std::vector<int64_t> I(old_size + 1), V(old_size + 1);
+    int64_t buckets[256] = {};
+    for (int64_t i = 0; i < old_size; i++) {
+        buckets[old[i]]++;
+    }
+    for (int i = 1; i < 256; i++) {
+        buckets[i] += buckets[i - 1];
+    }
+    for (int i = 255; i > 0; i--) {
+        buckets[i] = buckets[i - 1];
+    }
+    buckets[0] = 0;
+
+    for (int64_t i = 0; i < old_size; i++) {
+        I[++buckets[old[i]]] = i;
+    }
+    I[0] = old_size;
+    for (int64_t i = 0; i < old_size; i++) {
+        V[i] = buckets[old[i]];
+    }
+    V[old_size] = 0;
+    for (int i = 1; i < 256; i++) {
+        if (buckets[i] == buckets[i - 1] + 1) {
+            I[buckets[i]] = -1;
+        }
+    }
+    I[0] = -1;
+
+    for (int64_t h = 1; I[0] != -(old_size + 1); h += h) {
+        int64_t len = 0, i = 0;
+        while (i < old_size + 1) {
+            if (I[i] < 0) {
+                len -= I[i];
+                i -= I[i];
+            } else {
+                if (len) {
+                    I[i - len] = -len;
+                }
+                len = V[I[i]] + 1 - i;
+                Split(I.data(), V.data(), i, len, h);
+                i += len;
+                len = 0;
+            }
+        }
+        if (len) {
+            I[i - len] = -len;
+        }
+    }
+
+    for (int64_t i = 0; i < old_size + 1; i++) {
+        I[V[i]] = i;
+    }
+    return I;
+}
+
+static int64_t MatchLength(const uint8_t* old, int64_t old_size, const uint8_t* target, int64_t target_size) {
+    int64_t i = 0;
+    while (i < old_size && i < target_size && old[i] == target[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int64_t Search(const std::vector<int64_t>& I, const uint8_t* old, int64_t old_size,
+    const uint8_t* target, int64_t target_size, int64_t start, int64_t end, int64_t& position) {
+    while (end - start >= 2) {
+        int64_t middle = start + (end - start) / 2;
+        if (memcmp(old + I[middle], target, std::min(old_size - I[middle], target_size)) < 0) {
+            start = middle;
+        } else {
+            end = middle;
+        }
+    }
+    int64_t x = MatchLength(old + I[start], old_size - I[start], target, target_size);
+    int64_t y = MatchLength(old + I[end], old_size - I[end], target, target_size);
+    if (x > y) {
+        position = I[start];
+        return x;
+    }
+    position = I[end];
+    return y;
+}
+
+// ----- Patch writer -----
+
+static void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+// Diff bytes as runs of zeros and literals, zero runs shorter than this stay in the literals
+#define MIN_ZERO_RUN 4
+
+static void PutDiff(std::vector<uint8_t>& out, const uint8_t* diff, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        size_t zeros = 0;
+        while (i < length && diff[i] == 0) {
+            zeros++;
+            i++;
+        }
+        size_t start = i;
+        while (i < length) {
+            if (diff[i] != 0) {
+                i++;
+                continue;
+            }
+            size_t run = 0;
+            while (i + run < length && diff[i + run] == 0) {
+                run++;
+            }
+            if (run >= MIN_ZERO_RUN || i + run == length) {
+                break;
+            }
+            i += run;
+        }
+        PutVarint(out, zeros);
+        PutVarint(out, i - start);
+        out.insert(out.end(), diff + start, diff + i);
+    }
+}
+
+static std::vector<uint8_t> CreatePatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& target) {
+    std::vector<uint8_t> patch(sizeof(DeltaPatchHeader));
+    DeltaPatchHeader header = {};
+    memcpy(header.magic, DELTA_PATCH_MAGIC, sizeof(header.magic));
+    header.version = DELTA_PATCH_VERSION;
+    header.source_size = source.size();
+    header.target_size = target.size();
+    auto source_digest = Sha256(source.data(), source.size());
+    auto target_digest = Sha256(target.data(), target.size());
+    memcpy(header.source_sha256, source_digest.data(), sizeof(header.source_sha256));
+    memcpy(header.target_sha256, target_digest.data(), sizeof(header.target_sha256));
+    memcpy(patch.data(), &header, sizeof(header));
+
+    const uint8_t* old = source.data();
+    const uint8_t* target_data = target.data();
+    int64_t old_size = source.size(), target_size = target.size();
+    auto I = SuffixArray(old, old_size);
+    std::vector<uint8_t> diff;
+
+    int64_t scan = 0, len = 0, position = 0;
+    int64_t last_scan = 0, last_position = 0, last_offset = 0;
+    while (scan < target_size) {
+        int64_t old_score = 0;
+        int64_t scsc;
+        for (scsc = scan += len; scan < target_size; scan++) {
+            len = Search(I, old, old_size, target_data + scan, target_size - scan, 0, old_size, position);
+            for (; scsc < scan + len; scsc++) {
+                if (scsc + last_offset < old_size && old[scsc + last_offset] == target_data[scsc]) {
+                    old_score++;
+                }
+            }
+            if ((len == old_score && len != 0) || len > old_score + 8) {
+                break;
+            }
+            if (scan + last_offset < old_size && old[scan + last_offset] == target_data[scan]) {
+                old_score--;
+            }
+        }
+
+        if (len != old_score || scan == target_size) {
+            // Extend the previous match forward and the new one backward, as far as they mostly match
+            int64_t s = 0, best = 0, length_forward = 0;
+            for (int64_t i = 0; last_scan + i < scan && last_position + i < old_size;) {
+                if (old[last_position + i] == target_data[last_scan + i]) {
+                    s++;
+                }
+                i++;
+                if (s * 2 - i > best * 2 - length_forward) {
+                    best = s;
+                    length_forward = i;
+                }
+            }
+
+            int64_t length_backward = 0;
+            if (scan < target_size) {
+                s = 0;
+                best = 0;
+                for (int64_t i = 1; scan >= last_scan + i && position >= i; i++) {
+                    if (old[position - i] == target_data[scan - i]) {
+                        s++;
+                    }
+                    if (s * 2 - i > best * 2 - length_backward) {
+                        best = s;
+                        length_backward = i;
+                    }
+                }
+            }
+
+            if (last_scan + length_forward > scan - length_backward) {
+                int64_t overlap = (last_scan + length_forward) - (scan - length_backward);
+                s = 0;
+                best = 0;
+                int64_t length_split = 0;
+                for (int64_t i = 0; i < overlap; i++) {
+                    if (target_data[last_scan + length_forward - overlap + i] == old[last_position + length_forward - overlap + i]) {
+                        s++;
+                    }
+                    if (target_data[scan - length_backward + i] == old[position - length_backward + i]) {
+                        s--;
+                    }
+                    if (s > best) {
+                        best = s;
+                        length_split = i + 1;
+                    }
+                }
+                length_forward += length_split - overlap;
+                length_backward -= length_split;
+            }
+
+            diff.resize(length_forward);
+            for (int64_t i = 0; i < length_forward; i++) {
+                diff[i] = target_data[last_scan + i] - old[last_position + i];
+            }
+            int64_t extra_length = (scan - length_backward) - (last_scan + length_forward);
+            int64_t seek = (position - length_backward) - (last_position + length_forward);
+            PutVarint(patch, length_forward);
+            PutVarint(patch, extra_length);
+            PutVarint(patch, ((uint64_t)seek << 1) ^ (uint64_t)(seek >> 63));
+            PutDiff(patch, diff.data(), diff.size());
+            patch.insert(patch.end(), target_data + last_scan + length_forward, target_data + last_scan + length_forward + extra_length);
+
+            last_scan = scan - length_backward;
+            last_position = position - length_backward;
+            last_offset = position - scan;
+        }
+    }
+    return patch;
+}
+
+// Applies the patch as the device does, fed in chunks of chunk_size bytes (random sizes up to it if random is set)
+static bool ApplyPatch(const std::vector<uint8_t>& source, const std::vector<uint8_t>& patch, std::vector<uint8_t>& target,
+    std::string& error, size_t chunk_size = 4096, std::mt19937* random = nullptr) {
+    target.clear();
+    DeltaPatcher patcher([&](size_t offset, uint8_t* data, size_t size) {
+        if (offset + size > source.size()) {
+            return false;
+        }
+        memcpy(data, source.data() + offset, size);
+        return true;
+    }, [&](const uint8_t* data, size_t size) {
+        target.insert(target.end(), data, data + size);
+        return true;
+    }, [&](const DeltaPatchHeader& header) {
+        return header.source_size == source.size() &&
+            Sha256(source.data(), source.size()) == std::vector<uint8_t>(header.source_sha256, header.source_sha256 + 32);
+    });
+
+    bool success = true;
+    for (size_t offset = 0; success && offset < patch.size();) {
+        size_t size = random ? 1 + (*random)() % chunk_size : chunk_size;
+        size = std::min(size, patch.size() - offset);
+        success = patcher.Feed(patch.data() + offset, size);
+        offset += size;
+    }
+    success = success && patcher.Finish();
+    if (success) {
+        auto digest = Sha256(target.data(), target.size());
+        if (memcmp(digest.data(), patcher.header().target_sha256, digest.size()) != 0) {
+            error = "Target SHA-256 mismatch";
+            return false;
+        }
+    }
+    error = patcher.error();
+    return success;
+}
+
+static bool ReadFile(const char* path, std::vector<uint8_t>& data) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    uint8_t buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool WriteFile(const char* path, const std::vector<uint8_t>& data) {
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return false;
+    }
+    bool success = fwrite(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    return success;
+}
+
+static int failures = 0;
+
+static void Check(bool condition, const char* description) {
+    if (!condition) {
+        printf("FAIL: %s\n", description);
+        failures++;
+    }
+}
+
+/*
+ * A firmware like pair of images: code with 32 bit pointers into itself, then a build where a function grew
+ * in the middle (shifting and relocating everything after it), a few constants changed and a block was added.
+ */
+static void BuildImages(std::mt19937& random, size_t size, std::vector<uint8_t>& source, std::vector<uint8_t>& target) {
+    const uint32_t base = 0x42000000;
+    source.resize(size);
+    for (size_t i = 0; i < size; i += 4) {
+        uint32_t word = random() % 8 == 0 ? base + (random() % size & ~3u) : (uint32_t)(random() % 256) * 0x01010101u ^ (uint32_t)random();
+        memcpy(&source[i], &word, std::min<size_t>(4, size - i));
+    }
+
+    size_t insert_at = size / 3 & ~3u;
+    size_t insert_size = 1024;
+    target.assign(source.begin(), source.begin() + insert_at);
+    for (size_t i = 0; i < insert_size; i++) {
+        target.push_back(random());
+    }
+    target.insert(target.end(), source.begin() + insert_at, source.end());
+    for (size_t i = 0; i + 4 <= target.size(); i += 4) {
+        uint32_t word;
+        memcpy(&word, &target[i], 4);
+        if (word >= base + insert_at && word < base + size) {
+            word += insert_size;
+            memcpy(&target[i], &word, 4);
+        }
+    }
+    for (int i = 0; i < 20; i++) {
+        target[random() % target.size()] ^= 0x5A;
+    }
+    for (size_t i = 0; i < 4096; i++) {
+        target.push_back(random());
+    }
+}
+
+static void SelfTest() {
+    std::mt19937 random(1);
+
+    // Round trip of a firmware like change, fed in random chunks
+    std::vector<uint8_t> source, target, output;
+    BuildImages(random, 256 * 1024, source, target);
+    auto patch = CreatePatch(source, target);
+    std::string error;
+    Check(ApplyPatch(source, patch, output, error, 4096, &random) && output == target, "round trip");
+    Check(ApplyPatch(source, patch, output, error, 1) && output == target, "byte by byte");
+    Check(patch.size() < target.size() / 10, "patch is small");
+    printf("target %zu bytes, patch %zu bytes (%.1f%%)\n", target.size(), patch.size(), patch.size() * 100.0 / target.size());
+
+    // Edge cases of the generator
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>> pairs = {
+        { {}, {} },
+        { {}, { 1, 2, 3 } },
+        { { 1, 2, 3 }, {} },
+        { std::vector<uint8_t>(5000, 0xFF), std::vector<uint8_t>(7000, 0xFF) },
+        { source, source },
+        { target, source },
+    };
+    for (auto& pair : pairs) {
+        auto p = CreatePatch(pair.first, pair.second);
+        Check(ApplyPatch(pair.first, p, output, error, 333) && output == pair.second, "edge case round trip");
+    }
+
+    // The patch only applies to its source
+    std::vector<uint8_t> other = source;
+    other[100] ^= 1;
+    Check(!ApplyPatch(other, patch, output, error) && output.empty(), "wrong source rejected before any output");
+
+    // Malformed patches fail cleanly, never read or write out of range
+    std::vector<uint8_t> truncated(patch.begin(), patch.begin() + patch.size() / 2);
+    Check(!ApplyPatch(source, truncated, output, error) && output.size() <= target.size(), "truncated patch");
+    std::vector<uint8_t> bad_magic = patch;
+    bad_magic[0] = 'Y';
+    Check(!ApplyPatch(source, bad_magic, output, error), "bad magic");
+    std::vector<uint8_t> trailing = patch;
+    trailing.push_back(0);
+    Check(!ApplyPatch(source, trailing, output, error), "trailing data");
+    for (int i = 0; i < 200; i++) {
+        std::vector<uint8_t> corrupted = patch;
+        size_t position = sizeof(DeltaPatchHeader) + random() % (patch.size() - sizeof(DeltaPatchHeader));
+        corrupted[position] = random();
+        bool success = ApplyPatch(source, corrupted, output, error, 1000, &random);
+        Check(output.size() <= target.size(), "corrupted patch output bounds");
+        Check(!success || output == target, "corrupted patch passed the target digest");
+    }
+
+    // Generation speed on a firmware sized image
+    std::vector<uint8_t> large_source, large_target;
+    BuildImages(random, 2 * 1024 * 1024, large_source, large_target);
+    auto start = std::chrono::steady_clock::now();
+    auto large_patch = CreatePatch(large_source, large_target);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    Check(ApplyPatch(large_source, large_patch, output, error) && output == large_target, "large round trip");
+    printf("target %zu bytes, patch %zu bytes (%.1f%%), generated in %lld ms\n", large_target.size(), large_patch.size(),
+        large_patch.size() * 100.0 / large_target.size(), (long long)elapsed);
+}
+
+static void PrintInfo(const std::vector<uint8_t>& patch) {
+    DeltaPatchHeader header;
+    if (patch.size() < sizeof(header)) {
+        printf("Not a delta patch\n");
+        return;
+    }
+    memcpy(&header, patch.data(), sizeof(header));
+    printf("version %u, patch %zu bytes\n", header.version, patch.size());
+    printf("source  %u bytes, sha256 %s\n", (unsigned)header.source_size, Hex(header.source_sha256, 32).c_str());
+    printf("target  %u bytes, sha256 %s\n", (unsigned)header.target_size, Hex(header.target_sha256, 32).c_str());
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        SelfTest();
+        printf(failures ? "%d checks failed\n" : "All checks passed\n", failures);
+        return failures ? 1 : 0;
+    }
+
+    std::string command = argv[1];
+    std::vector<uint8_t> a, b;
+    if (command == "diff" && argc == 5 && ReadFile(argv[2], a) && ReadFile(argv[3], b)) {
+        auto patch = CreatePatch(a, b);
+        if (!WriteFile(argv[4], patch)) {
+            return 1;
+        }
+        printf("target %zu bytes, patch %zu bytes (%.1f%%)\n", b.size(), patch.size(), patch.size() * 100.0 / std::max<size_t>(b.size(), 1));
+        return 0;
+    }
+    if (command == "apply" && argc == 5 && ReadFile(argv[2], a) && ReadFile(argv[3], b)) {
+        std::vector<uint8_t> target;
+        std::string error;
+        if (!ApplyPatch(a, b, target, error)) {
+            fprintf(stderr, "Failed to apply the patch: %s\n", error.c_str());
+            return 1;
+        }
+        return WriteFile(argv[4], target) ? 0 : 1;
+    }
+    if (command == "info" && argc == 3 && ReadFile(argv[2], a)) {
+        PrintInfo(a);
+        return 0;
+    }
+    fprintf(stderr, "Usage: %s diff old.bin new.bin patch.xzdp\n"
+                    "       %s apply old.bin patch.xzdp new.bin\n"
+                    "       %s info patch.xzdp\n", argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,136 @@
+import argparse
+import os
+import struct
+import time
+import wave
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+'''
+  Receive and decode audio flight recorder snapshots (see main/audio/processors/audio_flight_recorder.h).
+
+  Decode a saved snapshot into one WAV file per tap:
+    python flight_recorder_server.py decode snapshot.xzfr
+  Run an HTTP server for `self.audio_recorder.upload` and decode every upload:
+    python flight_recorder_server.py serve --port 8080
+'''
+
+TAP_NAMES = ["mic", "processed", "playback"]
+SNAPSHOT_HEADER = struct.Struct("<4sBBHII")
+RECORD_HEADER = struct.Struct("<BBhHHI")
+
+STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+]
+INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def adpcm_decode(data, samples, predictor, step_index):
+    pcm = bytearray()
+    for i in range(samples):
+        code = (data[i // 2] >> 4) & 0x0F if i & 1 else data[i // 2] & 0x0F
+        step = STEP_TABLE[step_index]
+        delta = step >> 3
+        if code & 4:
+            delta += step
+        if code & 2:
+            delta += step >> 1
+        if code & 1:
+            delta += step >> 2
+        predictor = predictor - delta if code & 8 else predictor + delta
+        predictor = max(-32768, min(32767, predictor))
+        step_index = max(0, min(88, step_index + INDEX_TABLE[code]))
+        pcm += struct.pack("<h", predictor)
+    return bytes(pcm)
+
+
+def decode_snapshot(data, output_dir):
+    magic, version, tap_count, reason_length, timestamp_ms, records = SNAPSHOT_HEADER.unpack_from(data, 0)
+    if magic != b"XZFR" or version != 1:
+        raise ValueError("Not a flight recorder snapshot")
+    offset = SNAPSHOT_HEADER.size
+    reason = data[offset:offset + reason_length].decode("utf-8", errors="replace")
+    offset += reason_length
+    print(f"Snapshot at {timestamp_ms} ms, reason: {reason}, {records} records")
+
+    # Gaps between records (codec powered down, tap not running) are filled with silence
+    taps = {}
+    while offset + RECORD_HEADER.size <= len(data):
+        tap, step_index, predictor, sample_rate, samples, record_ms = RECORD_HEADER.unpack_from(data, offset)
+        offset += RECORD_HEADER.size
+        size = (samples + 1) // 2
+        pcm = adpcm_decode(data[offset:offset + size], samples, predictor, step_index)
+        offset += size
+
+        state = taps.setdefault(tap, {"sample_rate": sample_rate, "pcm": bytearray(), "start_ms": record_ms, "end_ms": record_ms})
+        expected_ms = state["end_ms"]
+        if record_ms > expected_ms + 20 and state["pcm"]:
+            state["pcm"] += bytes(2 * ((record_ms - expected_ms) * state["sample_rate"] // 1000))
+        state["pcm"] += pcm
+        state["end_ms"] = record_ms + samples * 1000 // sample_rate
+
+    os.makedirs(output_dir, exist_ok=True)
+    for tap, state in taps.items():
+        name = TAP_NAMES[tap] if tap < len(TAP_NAMES) else f"tap{tap}"
+        filename = os.path.join(output_dir, f"{name}.wav")
+        with wave.open(filename, "wb") as wav_file:
+            wav_file.setnchannels(1)
+            wav_file.setsampwidth(2)
+            wav_file.setframerate(state["sample_rate"])
+            wav_file.writeframes(bytes(state["pcm"]))
+        print(f"  {filename}: {state['start_ms']} - {state['end_ms']} ms, {state['sample_rate']} Hz")
+
+
+class UploadHandler(BaseHTTPRequestHandler):
+    def do_POST(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            body = bytearray()
+            while True:
+                size = int(self.rfile.readline().strip(), 16)
+                if size == 0:
+                    self.rfile.readline()
+                    break
+                body += self.rfile.read(size)
+                self.rfile.readline()
+        else:
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+        device_id = self.headers.get("Device-Id", "unknown").replace(":", "")
+        name = f"{device_id}_{time.strftime('%Y%m%d_%H%M%S')}"
+        with open(f"{name}.xzfr", "wb") as f:
+            f.write(body)
+        try:
+            decode_snapshot(bytes(body), name)
+            self.send_response(200)
+        except ValueError as e:
+            print(e)
+            self.send_response(400)
+        self.end_headers()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='音频飞行记录仪快照接收与解码工具')
+    subparsers = parser.add_subparsers(dest="command", required=True)
+    decode_parser = subparsers.add_parser("decode", help="解码快照文件为 WAV")
+    decode_parser.add_argument("snapshot", help="快照文件")
+    decode_parser.add_argument("--output", "-o", default=None, help="输出目录 (默认: 快照文件名)")
+    serve_parser = subparsers.add_parser("serve", help="启动 HTTP 服务器接收上传的快照")
+    serve_parser.add_argument("--port", "-p", type=int, default=8080, help="端口 (默认: 8080)")
+    args = parser.parse_args()
+
+    if args.command == "decode":
+        with open(args.snapshot, "rb") as f:
+            data = f.read()
+        decode_snapshot(data, args.output or os.path.splitext(args.snapshot)[0])
+    else:
+        print(f"Waiting for snapshots on 0.0.0.0:{args.port}...")
+        HTTPServer(("0.0.0.0", args.port), UploadHandler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,34 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <cstdio>
+#include <string>
+
+/*
+ * Check list shared by the host tests under scripts/: each check prints one "ok" / "FAILED" line,
+ * and Finish prints the summary and returns the exit status, non-zero if any check failed.
+ */
+class HostTest {
+public:
+    explicit HostTest(int name_width = 48) : name_width_(name_width) {}
+
+    // Returns the condition, so that a failed check can print details
+    bool Check(const std::string& name, bool condition) {
+        printf("%-*s %s\n", name_width_, name.c_str(), condition ? "ok" : "FAILED");
+        passed_ = passed_ && condition;
+        return condition;
+    }
+
+    bool passed() const { return passed_; }
+
+    int Finish() const {
+        printf("\n%s\n", passed_ ? "All tests passed" : "Some tests FAILED");
+        return passed_ ? 0 : 1;
+    }
+
+private:
+    int name_width_;
+    bool passed_ = true;
+};
+
+#endif // HOST_TEST_H
@@ -0,0 +1,219 @@
+/*
+ * Host benchmark of JsonWriter against the cJSON path it replaced for MCP tools/list, see README.md
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+
+#include "json_writer.h"
+#include "mcp_server.h"
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static void* CountingMalloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+/*
+ * The previous implementation: every property and property list is printed and parsed
+ * again to be nested into its parent.
+ */
+static std::string LegacyPropertyJson(const Property& property) {
+    cJSON* json = cJSON_CreateObject();
+    if (property.type() == kPropertyTypeBoolean) {
+        cJSON_AddStringToObject(json, "type", "boolean");
+        if (property.has_default_value()) {
+            cJSON_AddBoolToObject(json, "default", property.value<bool>());
+        }
+    } else if (property.type() == kPropertyTypeInteger) {
+        cJSON_AddStringToObject(json, "type", "integer");
+        if (property.has_default_value()) {
+            cJSON_AddNumberToObject(json, "default", property.value<int>());
+        }
+        if (property.has_range()) {
+            cJSON_AddNumberToObject(json, "minimum", property.min_value());
+            cJSON_AddNumberToObject(json, "maximum", property.max_value());
+        }
+    } else if (property.type() == kPropertyTypeString) {
+        cJSON_AddStringToObject(json, "type", "string");
+        if (property.has_default_value()) {
+            cJSON_AddStringToObject(json, "default", property.value<std::string>().c_str());
+        }
+    }
+    char* json_str = cJSON_PrintUnformatted(json);
+    std::string result(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return result;
+}
+
+static std::string LegacyPropertyListJson(PropertyList& properties) {
+    cJSON* json = cJSON_CreateObject();
+    for (const auto& property : properties) {
+        cJSON* prop_json = cJSON_Parse(LegacyPropertyJson(property).c_str());
+        cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+    }
+    char* json_str = cJSON_PrintUnformatted(json);
+    std::string result(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return result;
+}
+
+static std::string LegacyToolJson(const McpTool& tool) {
+    PropertyList properties = tool.properties();
+    std::vector<std::string> required = properties.GetRequired();
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", tool.name().c_str());
+    cJSON_AddStringToObject(json, "description", tool.description().c_str());
+    cJSON* input_schema = cJSON_CreateObject();
+    cJSON_AddStringToObject(input_schema, "type", "object");
+    cJSON* properties_json = cJSON_Parse(LegacyPropertyListJson(properties).c_str());
+    cJSON_AddItemToObject(input_schema, "properties", properties_json);
+    if (!required.empty()) {
+        cJSON* required_array = cJSON_CreateArray();
+        for (const auto& property : required) {
+            cJSON_AddItemToArray(required_array, cJSON_CreateString(property.c_str()));
+        }
+        cJSON_AddItemToObject(input_schema, "required", required_array);
+    }
+    cJSON_AddItemToObject(json, "inputSchema", input_schema);
+    char* json_str = cJSON_PrintUnformatted(json);
+    std::string result(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(json);
+    return result;
+}
+
+static std::string LegacyToolsList(const std::vector<McpTool*>& tools) {
+    std::string json = "{\"tools\":[";
+    for (auto tool : tools) {
+        json += LegacyToolJson(*tool) + ",";
+    }
+    if (json.back() == ',') {
+        json.pop_back();
+    }
+    json += "]}";
+    return json;
+}
+
+static void WriterToolsList(const std::vector<McpTool*>& tools, std::string& json) {
+    json.clear();
+    JsonWriter writer(json);
+    writer.BeginObject();
+    writer.Key("tools").BeginArray();
+    for (auto tool : tools) {
+        tool->to_json(writer);
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
+
+static ReturnValue NoOp(const PropertyList&) {
+    return true;
+}
+
+// A tool set like the one of a board with a display, a camera and a few peripherals
+static std::vector<McpTool*> CreateTools() {
+    std::vector<McpTool*> tools;
+    tools.push_back(new McpTool("self.get_device_status",
+        "Provides the real-time information of the device, including the current status of the audio speaker, screen, battery, network, etc.\n"
+        "Use this tool for: \n1. Answering questions about current condition (e.g. what is the current volume of the audio speaker?)\n"
+        "2. As the first step to control the device (e.g. turn up / down the volume of the audio speaker, etc.)",
+        PropertyList(), NoOp));
+    tools.push_back(new McpTool("self.audio_speaker.set_volume", "Set the volume of the audio speaker. If the current volume is unknown, "
+        "you must call `self.get_device_status` tool first and then call this tool.",
+        PropertyList({ Property("volume", kPropertyTypeInteger, 0, 100) }), NoOp));
+    tools.push_back(new McpTool("self.screen.set_brightness", "Set the brightness of the screen.",
+        PropertyList({ Property("brightness", kPropertyTypeInteger, 0, 100) }), NoOp));
+    tools.push_back(new McpTool("self.screen.set_theme", "Set the theme of the screen. The theme can be `light` or `dark`.",
+        PropertyList({ Property("theme", kPropertyTypeString) }), NoOp));
+    tools.push_back(new McpTool("self.camera.take_photo", "Take a photo and explain it. Use this tool after the user asks you to see something.\n"
+        "Args:\n  `question`: The question that you want to ask about the photo.\nReturn:\n  A JSON object that provides the photo information.",
+        PropertyList({ Property("question", kPropertyTypeString) }), NoOp));
+    tools.push_back(new McpTool("self.audio.set_aec", "Turn the acoustic echo cancellation on or off, \"on\" lets the user interrupt the speech",
+        PropertyList({ Property("enabled", kPropertyTypeBoolean), Property("server_side", kPropertyTypeBoolean, false) }), NoOp));
+    tools.push_back(new McpTool("self.lamp.set_color", "Set the color of the lamp in RGB, each channel from 0 to 255",
+        PropertyList({ Property("red", kPropertyTypeInteger, 0, 255), Property("green", kPropertyTypeInteger, 0, 255),
+            Property("blue", kPropertyTypeInteger, 0, 255), Property("fade_ms", kPropertyTypeInteger, 300, 0, 5000) }), NoOp));
+    // Everything that must be escaped
+    tools.push_back(new McpTool("self.test.escaping", "Quotes \"a\", backslash \\, control \b\f\n\r\t\x01\x1f, UTF-8 \xe4\xbd\xa0\xe5\xa5\xbd",
+        PropertyList({ Property("path", kPropertyTypeString, std::string("C:\\temp\\\"x\"")) }), NoOp));
+    for (int i = 0; i < 8; i++) {
+        std::string name = "self.chassis.action_" + std::to_string(i);
+        tools.push_back(new McpTool(name, "Run a chassis action: \"forward\", \"backward\", \"turn_left\" or \"turn_right\"",
+            PropertyList({ Property("action", kPropertyTypeString, std::string("forward")),
+                Property("steps", kPropertyTypeInteger, 1, 1, 20) }), NoOp));
+    }
+    return tools;
+}
+
+template <typename F>
+static double Measure(int iterations, size_t& allocations_per_run, F run) {
+    run();
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        run();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    allocations_per_run = (allocations - before) / iterations;
+    return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    cJSON_Hooks hooks = { CountingMalloc, free };
+    cJSON_InitHooks(&hooks);
+
+    auto tools = CreateTools();
+    std::string legacy = LegacyToolsList(tools);
+    std::string json;
+    WriterToolsList(tools, json);
+    bool same = legacy == json;
+    printf("%zu tools, %zu bytes, outputs %s\n\n", tools.size(), json.size(), same ? "identical" : "DIFFER");
+    if (!same) {
+        printf("cJSON:      %s\nJsonWriter: %s\n", legacy.c_str(), json.c_str());
+        return 1;
+    }
+
+    size_t legacy_allocations;
+    size_t writer_allocations;
+    double legacy_us = Measure(iterations, legacy_allocations, [&]() {
+        legacy = LegacyToolsList(tools);
+    });
+    // The reply buffer keeps its capacity, as the tools/list reply does for one page
+    double writer_us = Measure(iterations, writer_allocations, [&]() {
+        WriterToolsList(tools, json);
+    });
+    printf("%-24s %10s %14s\n", "tools/list", "us / run", "allocations");
+    printf("%-24s %10.1f %14zu\n", "cJSON print + parse", legacy_us, legacy_allocations);
+    printf("%-24s %10.1f %14zu\n", "JsonWriter", writer_us, writer_allocations);
+    printf("\nJsonWriter is %.1fx faster\n", legacy_us / writer_us);
+    return 0;
+}
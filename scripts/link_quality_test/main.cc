@@ -0,0 +1,124 @@
+/*
+ * Host test of the link quality estimator, see README.md
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "host_test.h"
+#include "link_quality.h"
+
+#define PROBE_INTERVAL_MS (LINK_PROBE_INTERVAL_SECONDS * 1000)
+#define PROBE_LOST -1
+
+struct Run {
+    LinkQualityEstimator estimator;
+    uint32_t now_ms = 0;
+
+    // Sends one probe per interval, answered after the given round trip or never
+    void Probes(const std::vector<int>& round_trips) {
+        for (int rtt_ms : round_trips) {
+            uint32_t id = estimator.OnProbeSent(now_ms);
+            if (rtt_ms != PROBE_LOST) {
+                estimator.OnProbeAnswered(id, now_ms + rtt_ms);
+            }
+            now_ms += PROBE_INTERVAL_MS;
+            estimator.Update(now_ms);
+        }
+    }
+};
+
+static std::vector<int> Repeat(int rtt_ms, int count) {
+    return std::vector<int>(count, rtt_ms);
+}
+
+static int SelfTest() {
+    HostTest test;
+
+    Run run;
+    test.Check("unknown before any probe", run.estimator.level() == kLinkQualityUnknown);
+
+    run.Probes(Repeat(50, 5));
+    test.Check("short round trips are good", run.estimator.level() == kLinkQualityGood
+        && run.estimator.statistics().rtt_ms == 50 && run.estimator.statistics().min_rtt_ms == 50);
+
+    run = Run();
+    run.Probes(Repeat(PROBE_LOST, 5));
+    run.estimator.Update(run.now_ms + LINK_PROBE_TIMEOUT_MS);
+    test.Check("a server without pong stays unknown", run.estimator.level() == kLinkQualityUnknown
+        && run.estimator.statistics().probes_lost == 5 && run.estimator.statistics().loss_percent == 0);
+
+    run = Run();
+    run.Probes({ 900 });
+    test.Check("the first measurement is taken as is", run.estimator.level() == kLinkQualityPoor);
+
+    run = Run();
+    run.Probes(Repeat(50, 5));
+    run.Probes(Repeat(1500, 1));
+    test.Check("one slow probe does not change the level", run.estimator.level() == kLinkQualityGood);
+    run.Probes(Repeat(1500, 20));
+    test.Check("a slow link becomes poor", run.estimator.level() == kLinkQualityPoor);
+    run.Probes(Repeat(50, 40));
+    test.Check("and recovers when it is fast again", run.estimator.level() == kLinkQualityGood);
+
+    run = Run();
+    run.Probes(Repeat(50, 5));
+    std::vector<int> lossy;
+    for (int i = 0; i < 40; i++) {
+        lossy.push_back(i % 3 == 0 ? PROBE_LOST : 50);
+    }
+    run.Probes(lossy);
+    test.Check("a third of the probes lost is poor", run.estimator.level() == kLinkQualityPoor
+        && run.estimator.statistics().loss_percent >= 10);
+
+    // A new channel must not inherit the level of the previous one
+    run.estimator.Reset();
+    test.Check("reset forgets the level", run.estimator.level() == kLinkQualityUnknown
+        && run.estimator.statistics().probes_sent == 0 && run.estimator.statistics().loss_percent == 0);
+    run.Probes(Repeat(50, 1));
+    test.Check("reset then a fast probe is good", run.estimator.level() == kLinkQualityGood);
+
+    run = Run();
+    uint32_t id = run.estimator.OnProbeSent(0);
+    run.estimator.Update(LINK_PROBE_TIMEOUT_MS);
+    run.estimator.OnProbeAnswered(id, LINK_PROBE_TIMEOUT_MS + 10);
+    test.Check("an answer after the timeout is ignored", run.estimator.statistics().probes_answered == 0
+        && run.estimator.statistics().probes_lost == 1);
+
+    run = Run();
+    for (int i = 0; i < LINK_PROBE_MAX_OUTSTANDING + 2; i++) {
+        run.estimator.OnProbeSent(i * 10);
+    }
+    test.Check("outstanding probes are bounded", run.estimator.statistics().probes_lost == 2);
+
+    return test.Finish();
+}
+
+static void Usage(const char* program) {
+    fprintf(stderr, "Usage: %s\n", program);
+    fprintf(stderr, "       %s RTT|lost ...   Feed one probe per %d seconds and print the estimate after each\n",
+        program, LINK_PROBE_INTERVAL_SECONDS);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        return SelfTest();
+    }
+    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+    Run run;
+    for (int i = 1; i < argc; i++) {
+        int rtt_ms = strcmp(argv[i], "lost") == 0 ? PROBE_LOST : atoi(argv[i]);
+        run.Probes({ rtt_ms });
+        auto& statistics = run.estimator.statistics();
+        printf("%6s  rtt %4u ms  min %4u ms  jitter %4u ms  loss %5.1f%%  %s\n", argv[i], statistics.rtt_ms,
+            statistics.min_rtt_ms, statistics.jitter_ms, statistics.loss_percent,
+            LinkQualityEstimator::LevelName(run.estimator.level()));
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Host build of the loopback self-test analysis, see README.md
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "loopback_analyzer.h"
+
+static bool ReadWav(const char* filename, std::vector<int16_t>& samples, int& sample_rate) {
+    FILE* file = fopen(filename, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return false;
+    }
+
+    char riff[12];
+    if (fread(riff, 1, 12, file) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "%s is not a WAV file\n", filename);
+        fclose(file);
+        return false;
+    }
+
+    int channels = 0;
+    int bits = 0;
+    char id[4];
+    uint32_t size;
+    while (fread(id, 1, 4, file) == 4 && fread(&size, 4, 1, file) == 1) {
+        if (memcmp(id, "fmt ", 4) == 0) {
+            std::vector<uint8_t> fmt(size);
+            fread(fmt.data(), 1, size, file);
+            channels = fmt[2] | (fmt[3] << 8);
+            sample_rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+            bits = fmt[14] | (fmt[15] << 8);
+        } else if (memcmp(id, "data", 4) == 0) {
+            if (bits != 16 || channels == 0) {
+                fprintf(stderr, "Only 16-bit PCM is supported\n");
+                break;
+            }
+            std::vector<int16_t> data(size / 2);
+            fread(data.data(), 2, data.size(), file);
+            // Use the first channel, the others may be the AEC reference
+            samples.resize(data.size() / channels);
+            for (size_t i = 0; i < samples.size(); i++) {
+                samples[i] = data[i * channels];
+            }
+            fclose(file);
+            return true;
+        } else {
+            fseek(file, size + (size & 1), SEEK_CUR);
+        }
+    }
+    fclose(file);
+    return false;
+}
+
+static bool WriteWav(const char* filename, const std::vector<int16_t>& samples, int sample_rate) {
+    FILE* file = fopen(filename, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint32_t data_size = samples.size() * 2;
+    uint32_t riff_size = 36 + data_size;
+    uint32_t fmt_size = 16;
+    uint16_t format = 1, channels = 1, block_align = 2, bits = 16;
+    uint32_t byte_rate = sample_rate * 2;
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riff_size, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmt_size, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&sample_rate, 4, 1, file);
+    fwrite(&byte_rate, 4, 1, file);
+    fwrite(&block_align, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&data_size, 4, 1, file);
+    fwrite(samples.data(), 2, samples.size(), file);
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "--generate") == 0) {
+        int sample_rate = argc >= 4 ? atoi(argv[3]) : 16000;
+        // Same layout as the device self-test: pre-roll, sweep, tail
+        std::vector<int16_t> output((size_t)sample_rate * LOOPBACK_PREROLL_MS / 1000);
+        auto chirp = LoopbackAnalyzer::GenerateChirp(sample_rate);
+        output.insert(output.end(), chirp.begin(), chirp.end());
+        output.resize(output.size() + (size_t)sample_rate * LOOPBACK_TAIL_MS / 1000);
+        if (!WriteWav(argv[2], output, sample_rate)) {
+            fprintf(stderr, "Failed to write %s\n", argv[2]);
+            return 1;
+        }
+        printf("Sweep written to %s (%d Hz)\n", argv[2], sample_rate);
+        return 0;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <recording.wav> [playback_offset_ms]\n", argv[0]);
+        fprintf(stderr, "       %s --generate <sweep.wav> [sample_rate]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<int16_t> recording;
+    int sample_rate = 0;
+    if (!ReadWav(argv[1], recording, sample_rate)) {
+        return 1;
+    }
+    int offset_ms = argc >= 3 ? atoi(argv[2]) : LOOPBACK_PREROLL_MS;
+    size_t offset = (size_t)sample_rate * offset_ms / 1000;
+
+    LoopbackResult result;
+    bool detected = LoopbackAnalyzer::Analyze(recording, sample_rate, offset, result);
+    printf("detected:    %s\n", detected ? "yes" : "no");
+    printf("latency:     %.1f ms\n", result.latency_ms);
+    printf("correlation: %.2f\n", result.correlation);
+    printf("snr:         %.1f dB\n", result.snr_db);
+    printf("noise:       %.1f dBFS\n", result.noise_dbfs);
+    printf("peak:        %.1f dBFS\n", result.peak_dbfs);
+    printf("clipped:     %u samples\n", result.clipped_samples);
+    for (int i = 0; i < LOOPBACK_BANDS; i++) {
+        printf("%6.0f Hz:   %+.1f dB\n", result.band_hz[i], result.band_gain_db[i]);
+    }
+    return detected ? 0 : 2;
+}
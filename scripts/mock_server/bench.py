@@ -0,0 +1,239 @@
+import argparse
+import asyncio
+import json
+import statistics
+import time
+
+import mock_protocol as proto
+import mock_server
+
+
+'''
+  End-to-end protocol benchmark against the mock server, playing the device side as documented
+  in docs/websocket.md and docs/mqtt-udp.md. For each transport it measures:
+    - connect: from opening the connection until the server hello (the audio channel is open)
+    - stt / tts start / first audio: from listen stop until the message or the first downlink frame
+    - uplink / downlink frames per second: unpaced frames pushed through the channel
+    - uplink received: share of the unpaced uplink frames that reached the server (UDP may drop them)
+
+    python bench.py --local                         # Starts a mock server in the same process
+    python bench.py --host 192.168.1.10 --transport mqtt --turns 20
+'''
+
+
+class Channel:
+    """Device side of one audio channel, the transport specific parts are in the subclasses."""
+
+    def __init__(self, args):
+        self.args = args
+        self.messages = asyncio.Queue()
+        self.audio_times = []
+        self.session_id = ""
+
+    async def on_json(self, message):
+        if message.get("type") == "mcp":
+            # Answer the server MCP requests like the device, with an empty tool list
+            payload = message.get("payload", {})
+            result = {"tools": []} if payload.get("method") == "tools/list" else {"protocolVersion": "2024-11-05"}
+            await self.send_json({"type": "mcp", "payload": {"jsonrpc": "2.0", "id": payload.get("id"),
+                                                             "result": result}})
+            return
+        await self.messages.put((time.monotonic(), message))
+
+    def on_audio(self):
+        self.audio_times.append(time.monotonic())
+
+    async def wait_for(self, kind, state=None, timeout=10):
+        while True:
+            at, message = await asyncio.wait_for(self.messages.get(), timeout)
+            if message.get("type") == kind and (state is None or message.get("state") == state):
+                return at, message
+
+    def hello(self, transport, version):
+        return {"type": "hello", "version": version, "transport": transport, "features": {"mcp": True},
+                "audio_params": {"format": "opus", "sample_rate": 16000, "channels": 1, "frame_duration": 60}}
+
+
+class WebsocketChannel(Channel):
+    async def open(self):
+        self.version = self.args.ws_version
+        self.reader, self.writer = await proto.ws_connect(
+            self.args.host, self.args.ws_port, "/xiaozhi/v1/",
+            {"Authorization": "Bearer mock", "Protocol-Version": str(self.version),
+             "Device-Id": "02:00:00:00:00:01", "Client-Id": "mock-bench"})
+        self.receiver = asyncio.ensure_future(self.receive())
+        await self.send_json(self.hello("websocket", self.version))
+        _, hello = await self.wait_for("hello")
+        self.session_id = hello.get("session_id", "")
+
+    async def receive(self):
+        try:
+            while True:
+                opcode, data = await proto.ws_read(self.reader, self.writer, mask_replies=True)
+                if opcode is None:
+                    break
+                if opcode == proto.WS_BINARY:
+                    self.on_audio()
+                else:
+                    await self.on_json(json.loads(data))
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+
+    async def send_json(self, message):
+        self.writer.write(proto.ws_frame(proto.WS_TEXT, json.dumps(message).encode(), True))
+        await self.writer.drain()
+
+    async def send_audio(self, frame, timestamp):
+        self.writer.write(proto.ws_frame(proto.WS_BINARY, proto.pack_audio(self.version, frame, timestamp), True))
+        await self.writer.drain()
+
+    async def close(self):
+        self.writer.write(proto.ws_frame(proto.WS_CLOSE, b"", True))
+        self.receiver.cancel()
+        self.writer.close()
+
+
+class MqttChannel(Channel):
+    async def open(self):
+        loop = asyncio.get_running_loop()
+        self.reader, self.writer = await asyncio.open_connection(self.args.host, self.args.mqtt_port)
+        self.writer.write(proto.mqtt_connect("mock-bench", "mock", "mock"))
+        await self.writer.drain()
+        packet_type, _, _ = await proto.mqtt_read(self.reader)
+        if packet_type != proto.MQTT_CONNACK:
+            raise ConnectionError("MQTT connect failed")
+        self.receiver = asyncio.ensure_future(self.receive())
+        await self.send_json(self.hello("udp", 3))
+        _, hello = await self.wait_for("hello")
+        self.session_id = hello.get("session_id", "")
+        udp = hello["udp"]
+        self.key = bytes.fromhex(udp["key"])
+        self.nonce = bytes.fromhex(udp["nonce"])
+        self.sequence = 0
+        channel = self
+
+        class UdpProtocol(asyncio.DatagramProtocol):
+            def datagram_received(self, data, address):
+                if proto.decrypt_audio(channel.key, data) is not None:
+                    channel.on_audio()
+
+        self.udp, _ = await loop.create_datagram_endpoint(UdpProtocol, remote_addr=(udp["server"], udp["port"]))
+
+    async def receive(self):
+        try:
+            while True:
+                packet_type, flags, body = await proto.mqtt_read(self.reader)
+                if packet_type == proto.MQTT_PUBLISH:
+                    _, payload = proto.mqtt_parse_publish(flags, body)
+                    await self.on_json(json.loads(payload))
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+
+    async def send_json(self, message):
+        self.writer.write(proto.mqtt_publish("device-server", json.dumps(message).encode()))
+        await self.writer.drain()
+
+    async def send_audio(self, frame, timestamp):
+        self.sequence += 1
+        self.udp.sendto(proto.encrypt_audio(self.key, self.nonce, self.sequence, timestamp, frame))
+
+    async def close(self):
+        await self.send_json({"session_id": self.session_id, "type": "goodbye"})
+        self.writer.write(proto.mqtt_packet(proto.MQTT_DISCONNECT, 0, b""))
+        self.receiver.cancel()
+        self.udp.close()
+        self.writer.close()
+
+
+async def run_transport(args, transport, frames):
+    result = {"connect": [], "stt": [], "tts_start": [], "first_audio": [], "downlink_fps": [], "uplink_fps": [],
+              "uplink_received": []}
+    for _ in range(args.connections):
+        channel = WebsocketChannel(args) if transport == "websocket" else MqttChannel(args)
+        start = time.monotonic()
+        await channel.open()
+        result["connect"].append((time.monotonic() - start) * 1000)
+
+        for _ in range(args.turns):
+            await channel.send_json({"session_id": channel.session_id, "type": "listen", "state": "start",
+                                     "mode": "manual"})
+            # UDP is not ordered with the MQTT control messages, let each side of the uplink settle
+            await asyncio.sleep(args.uplink_settle / 1000)
+            # Unpaced uplink, the rate the transport accepts frames at
+            start = time.monotonic()
+            for i in range(args.uplink_frames):
+                await channel.send_audio(frames[i % len(frames)], i * 60)
+            elapsed = max(time.monotonic() - start, 1e-6)
+            result["uplink_fps"].append(args.uplink_frames / elapsed)
+            await asyncio.sleep(args.uplink_settle / 1000)
+
+            channel.audio_times = []
+            stop_time = time.monotonic()
+            await channel.send_json({"session_id": channel.session_id, "type": "listen", "state": "stop"})
+            stt_time, stt = await channel.wait_for("stt")
+            # The mock server reports the number of uplink frames it received in the recognized text
+            words = stt.get("text", "").split()
+            if len(words) > 3 and words[3].isdigit():
+                result["uplink_received"].append(int(words[3]) * 100 / args.uplink_frames)
+            tts_time, _ = await channel.wait_for("tts", "start")
+            end_time, _ = await channel.wait_for("tts", "stop", timeout=60)
+            result["stt"].append((stt_time - stop_time) * 1000)
+            result["tts_start"].append((tts_time - stop_time) * 1000)
+            if channel.audio_times:
+                result["first_audio"].append((channel.audio_times[0] - stop_time) * 1000)
+            if len(channel.audio_times) > 1:
+                span = max(channel.audio_times[-1] - channel.audio_times[0], 1e-6)
+                result["downlink_fps"].append((len(channel.audio_times) - 1) / span)
+        await channel.close()
+    return result
+
+
+def print_result(transport, result):
+    print(f"[{transport}]")
+    for name, unit in [("connect", "ms"), ("stt", "ms"), ("tts_start", "ms"), ("first_audio", "ms"),
+                       ("uplink_fps", "fps"), ("uplink_received", "%"), ("downlink_fps", "fps")]:
+        values = result[name]
+        if not values:
+            print(f"  {name:<13} -")
+            continue
+        print(f"  {name:<13} median {statistics.median(values):9.1f} {unit:<3}  "
+              f"min {min(values):9.1f}  max {max(values):9.1f}  ({len(values)})")
+
+
+async def main(args):
+    server_task = None
+    if args.local:
+        # Unpaced downlink, so that the downlink rate is that of the transport and not of the TTS pacing
+        server_args = mock_server.parse_args([
+            "--bind", args.host, "--host", args.host, "--ws-port", str(args.ws_port),
+            "--mqtt-port", str(args.mqtt_port), "--udp-port", str(args.udp_port), "--http-port", str(args.http_port),
+            "--burst-frames", "1000000", "--tts", args.tts] + (["--timeline", args.timeline] if args.timeline else []))
+        server_task = asyncio.ensure_future(mock_server.MockServer(server_args).run())
+        await asyncio.sleep(0.2)
+
+    frames = proto.read_p3(args.tts)
+    transports = ["websocket", "mqtt"] if args.transport == "all" else [args.transport]
+    for transport in transports:
+        print_result(transport, await run_transport(args, transport, frames))
+
+    if server_task:
+        server_task.cancel()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="End-to-end protocol benchmark against the mock server")
+    parser.add_argument("--local", action="store_true", help="start a mock server in this process")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--transport", choices=["websocket", "mqtt", "all"], default="all")
+    parser.add_argument("--ws-port", type=int, default=8000)
+    parser.add_argument("--ws-version", type=int, default=3, choices=[1, 2, 3])
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--udp-port", type=int, default=8888)
+    parser.add_argument("--http-port", type=int, default=8002)
+    parser.add_argument("--connections", type=int, default=3, help="audio channels opened per transport")
+    parser.add_argument("--turns", type=int, default=3, help="listen / tts turns per channel")
+    parser.add_argument("--uplink-frames", type=int, default=100)
+    parser.add_argument("--uplink-settle", type=int, default=300, help="ms to wait around the uplink for the listen start / stop")
+    parser.add_argument("--tts", default=mock_server.DEFAULT_TTS)
+    parser.add_argument("--timeline", help="timeline of the local server")
+    asyncio.run(main(parser.parse_args()))
@@ -0,0 +1,369 @@
+import asyncio
+import base64
+import hashlib
+import os
+import struct
+
+
+'''
+  Wire formats shared by the mock server and the benchmark client, as documented in
+  docs/websocket.md and docs/mqtt-udp.md: WebSocket framing (RFC 6455), the subset of MQTT 3.1.1
+  used by the device (QoS 0), the encrypted UDP audio packet and the p3 file of Opus frames.
+  Only the standard library is required; AES uses the cryptography package when it is installed.
+'''
+
+# ---------------------------------------------------------------------------
+# AES-128-CTR
+# ---------------------------------------------------------------------------
+
+try:
+    from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+
+    def aes_ctr(key, counter, data):
+        encryptor = Cipher(algorithms.AES(key), modes.CTR(counter)).encryptor()
+        return encryptor.update(data) + encryptor.finalize()
+
+    AES_BACKEND = "cryptography"
+except ImportError:
+    def _build_sbox():
+        sbox = [0] * 256
+        p = q = 1
+        while True:
+            # p iterates over the multiplicative group, q over its inverses
+            p = p ^ ((p << 1) & 0xFF) ^ (0x1B if p & 0x80 else 0)
+            q ^= q << 1
+            q ^= q << 2
+            q ^= q << 4
+            q &= 0xFF
+            if q & 0x80:
+                q ^= 0x09
+            x = q ^ (((q << 1) | (q >> 7)) & 0xFF) ^ (((q << 2) | (q >> 6)) & 0xFF) \
+                ^ (((q << 3) | (q >> 5)) & 0xFF) ^ (((q << 4) | (q >> 4)) & 0xFF)
+            sbox[p] = x ^ 0x63
+            if p == 1:
+                break
+        sbox[0] = 0x63
+        return sbox
+
+    _SBOX = _build_sbox()
+    _XTIME = [((b << 1) ^ (0x1B if b & 0x80 else 0)) & 0xFF for b in range(256)]
+    _KEY_CACHE = {}
+
+    def _expand_key(key):
+        round_keys = _KEY_CACHE.get(key)
+        if round_keys is not None:
+            return round_keys
+        words = [list(key[i:i + 4]) for i in range(0, 16, 4)]
+        rcon = 1
+        for i in range(4, 44):
+            word = list(words[i - 1])
+            if i % 4 == 0:
+                word = word[1:] + word[:1]
+                word = [_SBOX[b] for b in word]
+                word[0] ^= rcon
+                rcon = _XTIME[rcon]
+            words.append([a ^ b for a, b in zip(words[i - 4], word)])
+        round_keys = [sum(words[r * 4:r * 4 + 4], []) for r in range(11)]
+        _KEY_CACHE[key] = round_keys
+        return round_keys
+
+    def _encrypt_block(round_keys, block):
+        s = [b ^ k for b, k in zip(block, round_keys[0])]
+        for r in range(1, 11):
+            s = [_SBOX[b] for b in s]
+            # ShiftRows on the column major state
+            s = [s[(i + 4 * (i % 4)) % 16] for i in range(16)]
+            if r != 10:
+                mixed = []
+                for c in range(4):
+                    a = s[c * 4:c * 4 + 4]
+                    t = a[0] ^ a[1] ^ a[2] ^ a[3]
+                    mixed += [a[i] ^ t ^ _XTIME[a[i] ^ a[(i + 1) % 4]] for i in range(4)]
+                s = mixed
+            s = [b ^ k for b, k in zip(s, round_keys[r])]
+        return bytes(s)
+
+    def aes_ctr(key, counter, data):
+        round_keys = _expand_key(bytes(key))
+        value = int.from_bytes(counter, "big")
+        output = bytearray()
+        for offset in range(0, len(data), 16):
+            stream = _encrypt_block(round_keys, (value & ((1 << 128) - 1)).to_bytes(16, "big"))
+            chunk = data[offset:offset + 16]
+            output += bytes(a ^ b for a, b in zip(chunk, stream))
+            value += 1
+        return bytes(output)
+
+    AES_BACKEND = "python"
+
+
+# ---------------------------------------------------------------------------
+# UDP audio packet: |type 1|flags 1|payload_len 2|ssrc 4|timestamp 4|sequence 4|encrypted payload|
+# The 16 byte header is also the AES-CTR counter block
+# ---------------------------------------------------------------------------
+
+UDP_NONCE_SIZE = 16
+
+
+def encrypt_audio(key, nonce, sequence, timestamp, payload):
+    header = bytearray(nonce)
+    struct.pack_into(">H", header, 2, len(payload))
+    struct.pack_into(">II", header, 8, timestamp, sequence)
+    return bytes(header) + aes_ctr(key, bytes(header), payload)
+
+
+def decrypt_audio(key, packet):
+    """Returns (ssrc, timestamp, sequence, payload), or None for an invalid packet."""
+    if len(packet) < UDP_NONCE_SIZE or packet[0] != 0x01:
+        return None
+    ssrc, timestamp, sequence = struct.unpack_from(">III", packet, 4)
+    return ssrc, timestamp, sequence, aes_ctr(key, packet[:UDP_NONCE_SIZE], packet[UDP_NONCE_SIZE:])
+
+
+def packet_ssrc(packet):
+    if len(packet) < UDP_NONCE_SIZE:
+        return None
+    return struct.unpack_from(">I", packet, 4)[0]
+
+
+def new_udp_session():
+    """Key and nonce of a new UDP session, the ssrc in the nonce identifies the session."""
+    key = os.urandom(16)
+    nonce = bytearray(os.urandom(16))
+    nonce[0] = 0x01
+    nonce[1] = 0
+    nonce[2:4] = b"\x00\x00"
+    nonce[8:16] = bytes(8)
+    return key, bytes(nonce)
+
+
+# ---------------------------------------------------------------------------
+# WebSocket binary protocol versions (docs/websocket.md section 3)
+# ---------------------------------------------------------------------------
+
+def pack_audio(version, payload, timestamp=0):
+    if version == 2:
+        return struct.pack(">HHIII", 2, 0, 0, timestamp, len(payload)) + payload
+    if version == 3:
+        return struct.pack(">BBH", 0, 0, len(payload)) + payload
+    return payload
+
+
+def unpack_audio(version, data):
+    """Returns a list of (timestamp, payload), batched uplink (BinaryProtocol4) gives several frames."""
+    if version == 2:
+        _, kind, _, timestamp, size = struct.unpack_from(">HHIII", data, 0)
+        return [(timestamp, data[16:16 + size])] if kind == 0 else []
+    if version == 3:
+        kind, count, size = struct.unpack_from(">BBH", data, 0)
+        if kind == 0:
+            return [(0, data[4:4 + size])]
+        if kind == 2:
+            frames = []
+            offset = 4
+            for _ in range(count):
+                timestamp, frame_size = struct.unpack_from(">IH", data, offset)
+                frames.append((timestamp, data[offset + 6:offset + 6 + frame_size]))
+                offset += 6 + frame_size
+            return frames
+        return []
+    return [(0, data)]
+
+
+# ---------------------------------------------------------------------------
+# WebSocket (RFC 6455), text, binary, ping, pong and close frames
+# ---------------------------------------------------------------------------
+
+WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+WS_TEXT = 0x1
+WS_BINARY = 0x2
+WS_CLOSE = 0x8
+WS_PING = 0x9
+WS_PONG = 0xA
+
+
+async def read_http_head(reader):
+    head = await reader.readuntil(b"\r\n\r\n")
+    lines = head.decode("latin-1").split("\r\n")
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            name, value = line.split(":", 1)
+            headers[name.strip().lower()] = value.strip()
+    return lines[0], headers
+
+
+async def ws_accept(reader, writer):
+    """Server side handshake, returns the request path and headers."""
+    request_line, headers = await read_http_head(reader)
+    accept = base64.b64encode(hashlib.sha1((headers.get("sec-websocket-key", "") + WS_GUID).encode()).digest())
+    writer.write(b"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                 b"Sec-WebSocket-Accept: " + accept + b"\r\n\r\n")
+    await writer.drain()
+    return request_line.split(" ")[1] if " " in request_line else "/", headers
+
+
+async def ws_connect(host, port, path, headers):
+    reader, writer = await asyncio.open_connection(host, port)
+    key = base64.b64encode(os.urandom(16)).decode()
+    request = f"GET {path} HTTP/1.1\r\nHost: {host}:{port}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n" \
+              f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n"
+    for name, value in headers.items():
+        request += f"{name}: {value}\r\n"
+    writer.write((request + "\r\n").encode())
+    await writer.drain()
+    status, _ = await read_http_head(reader)
+    if " 101 " not in status + " ":
+        raise ConnectionError(f"WebSocket handshake failed: {status}")
+    return reader, writer
+
+
+def ws_frame(opcode, payload, mask):
+    head = bytearray([0x80 | opcode])
+    mask_bit = 0x80 if mask else 0
+    if len(payload) < 126:
+        head.append(mask_bit | len(payload))
+    elif len(payload) < 65536:
+        head.append(mask_bit | 126)
+        head += struct.pack(">H", len(payload))
+    else:
+        head.append(mask_bit | 127)
+        head += struct.pack(">Q", len(payload))
+    if not mask:
+        return bytes(head) + payload
+    key = os.urandom(4)
+    masked = bytes(b ^ key[i % 4] for i, b in enumerate(payload))
+    return bytes(head) + key + masked
+
+
+async def ws_read(reader, writer, mask_replies=False):
+    """Reads the next text or binary message, answers pings; returns (None, None) on close."""
+    message = bytearray()
+    message_opcode = None
+    while True:
+        b0, b1 = await reader.readexactly(2)
+        opcode = b0 & 0x0F
+        length = b1 & 0x7F
+        if length == 126:
+            length = struct.unpack(">H", await reader.readexactly(2))[0]
+        elif length == 127:
+            length = struct.unpack(">Q", await reader.readexactly(8))[0]
+        key = await reader.readexactly(4) if b1 & 0x80 else None
+        payload = await reader.readexactly(length)
+        if key:
+            payload = bytes(b ^ key[i % 4] for i, b in enumerate(payload))
+        if opcode == WS_CLOSE:
+            return None, None
+        if opcode == WS_PING:
+            writer.write(ws_frame(WS_PONG, payload, mask_replies))
+            continue
+        if opcode == WS_PONG:
+            continue
+        if opcode != 0:
+            message_opcode = opcode
+        message += payload
+        if b0 & 0x80:
+            return message_opcode, bytes(message)
+
+
+# ---------------------------------------------------------------------------
+# MQTT 3.1.1, QoS 0
+# ---------------------------------------------------------------------------
+
+MQTT_CONNECT = 1
+MQTT_CONNACK = 2
+MQTT_PUBLISH = 3
+MQTT_SUBSCRIBE = 8
+MQTT_SUBACK = 9
+MQTT_PINGREQ = 12
+MQTT_PINGRESP = 13
+MQTT_DISCONNECT = 14
+
+
+def mqtt_packet(packet_type, flags, body):
+    head = bytearray([(packet_type << 4) | flags])
+    length = len(body)
+    while True:
+        byte = length & 0x7F
+        length >>= 7
+        head.append(byte | (0x80 if length else 0))
+        if not length:
+            break
+    return bytes(head) + body
+
+
+def mqtt_string(value):
+    data = value.encode() if isinstance(value, str) else value
+    return struct.pack(">H", len(data)) + data
+
+
+async def mqtt_read(reader):
+    """Returns (type, flags, body)."""
+    first = (await reader.readexactly(1))[0]
+    length = 0
+    shift = 0
+    while True:
+        byte = (await reader.readexactly(1))[0]
+        length |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            break
+    body = await reader.readexactly(length) if length else b""
+    return first >> 4, first & 0x0F, body
+
+
+def mqtt_parse_connect(body):
+    """Returns (client_id, username, password)."""
+    offset = 2 + struct.unpack_from(">H", body, 0)[0]      # Protocol name
+    offset += 1                                             # Level
+    flags = body[offset]
+    offset += 3                                             # Flags and keep alive
+    fields = []
+    while offset < len(body):
+        size = struct.unpack_from(">H", body, offset)[0]
+        fields.append(body[offset + 2:offset + 2 + size].decode(errors="replace"))
+        offset += 2 + size
+    client_id = fields.pop(0) if fields else ""
+    if flags & 0x04:                                        # Will topic and message
+        fields = fields[2:]
+    username = fields.pop(0) if flags & 0x80 and fields else ""
+    password = fields.pop(0) if flags & 0x40 and fields else ""
+    return client_id, username, password
+
+
+def mqtt_parse_publish(flags, body):
+    """Returns (topic, payload), QoS 1 and 2 packets carry an id that is skipped."""
+    size = struct.unpack_from(">H", body, 0)[0]
+    topic = body[2:2 + size].decode(errors="replace")
+    offset = 2 + size + (2 if flags & 0x06 else 0)
+    return topic, body[offset:]
+
+
+def mqtt_connect(client_id, username="", password="", keepalive=240):
+    flags = 0x02 | (0x80 if username else 0) | (0x40 if password else 0)
+    body = mqtt_string("MQTT") + bytes([4, flags]) + struct.pack(">H", keepalive) + mqtt_string(client_id)
+    if username:
+        body += mqtt_string(username)
+    if password:
+        body += mqtt_string(password)
+    return mqtt_packet(MQTT_CONNECT, 0, body)
+
+
+def mqtt_publish(topic, payload):
+    return mqtt_packet(MQTT_PUBLISH, 0, mqtt_string(topic) + payload)
+
+
+# ---------------------------------------------------------------------------
+# p3 files: [type 1][reserved 1][size 2, big endian][Opus frame]
+# ---------------------------------------------------------------------------
+
+def read_p3(path):
+    frames = []
+    with open(path, "rb") as f:
+        data = f.read()
+    offset = 0
+    while offset + 4 <= len(data):
+        _, _, size = struct.unpack_from(">BBH", data, offset)
+        frames.append(data[offset + 4:offset + 4 + size])
+        offset += 4 + size
+    return frames
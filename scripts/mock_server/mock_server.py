@@ -0,0 +1,413 @@
+import argparse
+import asyncio
+import json
+import os
+import time
+import uuid
+
+import mock_protocol as proto
+
+
+'''
+  Local mock of the xiaozhi server for end-to-end tests without a cloud service.
+
+  It implements the documented flows (hello, listen, stt, llm, tts, mcp, ping, abort, goodbye) over
+    - WebSocket, binary protocol versions 1 to 3 (docs/websocket.md)
+    - MQTT + UDP with AES-CTR (docs/mqtt-udp.md), with a built-in MQTT 3.1.1 broker
+  and an OTA endpoint that hands out the configuration of either, so a real device can be pointed
+  at it with CONFIG_OTA_URL. Replies are canned Opus frames from a p3 file or an echo of the uplink.
+  Every message in and out is written with its timestamp to a JSON lines timeline.
+
+    python mock_server.py --host 192.168.1.10 --transport websocket --timeline timeline.jsonl
+'''
+
+DEFAULT_TTS = os.path.join(os.path.dirname(__file__), "..", "..", "main", "assets", "common", "success.p3")
+
+
+class Timeline:
+    def __init__(self, path):
+        self.file = open(path, "a") if path else None
+        self.start = time.monotonic()
+
+    def log(self, session, direction, kind, **fields):
+        if self.file is None:
+            return
+        entry = {"t_ms": round((time.monotonic() - self.start) * 1000, 1), "session": session,
+                 "dir": direction, "kind": kind}
+        entry.update(fields)
+        self.file.write(json.dumps(entry, ensure_ascii=False) + "\n")
+        self.file.flush()
+
+
+class Session:
+    """The dialogue logic, independent of the transport."""
+
+    def __init__(self, server, transport, send_json, send_audio):
+        self.server = server
+        self.transport = transport
+        self.send_json_raw = send_json
+        self.send_audio_raw = send_audio
+        self.session_id = uuid.uuid4().hex[:12]
+        self.mode = "auto"
+        self.listening = False
+        self.uplink = []
+        self.speak_task = None
+        self.auto_stop_task = None
+        self.mcp_id = 0
+        self.closed = False
+
+    def log(self, direction, kind, **fields):
+        self.server.timeline.log(self.session_id, direction, kind, **fields)
+
+    async def send_json(self, message):
+        message.setdefault("session_id", self.session_id)
+        self.log("out", "json", type=message.get("type"), state=message.get("state"))
+        await self.send_json_raw(message)
+
+    async def send_audio(self, frame, timestamp):
+        self.log("out", "audio", size=len(frame), ts=timestamp)
+        await self.send_audio_raw(frame, timestamp)
+
+    def hello_reply(self, hello):
+        reply = {
+            "type": "hello",
+            "transport": self.transport,
+            "session_id": self.session_id,
+            "audio_params": {
+                "format": "opus",
+                "sample_rate": self.server.sample_rate,
+                "channels": 1,
+                "frame_duration": self.server.frame_duration,
+            },
+        }
+        if hello.get("features", {}).get("mcp"):
+            self.mcp_id = 1
+        return reply
+
+    async def start_mcp(self):
+        # As the real server, initialize the MCP session and list the tools once the channel is up
+        await self.send_json({"type": "mcp", "payload": {"jsonrpc": "2.0", "id": 1, "method": "initialize",
+                                                         "params": {"capabilities": {}}}})
+        await self.send_json({"type": "mcp", "payload": {"jsonrpc": "2.0", "id": 2, "method": "tools/list",
+                                                         "params": {}}})
+
+    async def on_json(self, message):
+        kind = message.get("type")
+        state = message.get("state")
+        self.log("in", "json", type=kind, state=state)
+        if kind == "listen":
+            if state == "start":
+                self.mode = message.get("mode", "auto")
+                self.listening = True
+                self.uplink = []
+                if self.mode != "manual":
+                    self.schedule_auto_stop()
+            elif state == "stop":
+                await self.end_of_speech()
+            elif state == "detect":
+                self.log("in", "wake_word", text=message.get("text"))
+        elif kind == "abort":
+            await self.stop_speaking()
+        elif kind == "ping":
+            await self.send_json({"type": "pong", "id": message.get("id")})
+        elif kind == "mcp":
+            payload = message.get("payload", {})
+            if payload.get("id") == 2 and "result" in payload:
+                tools = [tool.get("name") for tool in payload["result"].get("tools", [])]
+                self.log("in", "mcp_tools", count=len(tools), cursor=payload["result"].get("nextCursor"))
+        elif kind == "goodbye":
+            await self.close()
+
+    def on_audio(self, frames):
+        for timestamp, frame in frames:
+            self.log("in", "audio", size=len(frame), ts=timestamp)
+            if self.listening:
+                self.uplink.append(frame)
+
+    def schedule_auto_stop(self):
+        # Stands in for the server VAD: the turn ends after a fixed amount of speech
+        if self.auto_stop_task:
+            self.auto_stop_task.cancel()
+
+        async def auto_stop():
+            await asyncio.sleep(self.server.turn_seconds)
+            await self.end_of_speech()
+        self.auto_stop_task = asyncio.ensure_future(auto_stop())
+
+    async def end_of_speech(self):
+        if not self.listening:
+            return
+        self.listening = False
+        if self.auto_stop_task and self.auto_stop_task is not asyncio.current_task():
+            self.auto_stop_task.cancel()
+        frames = list(self.uplink) if self.server.reply == "echo" else self.server.tts_frames
+        await asyncio.sleep(self.server.stt_delay)
+        await self.send_json({"type": "stt", "text": f"mock speech of {len(self.uplink)} frames"})
+        await self.send_json({"type": "llm", "emotion": "happy", "text": "😀"})
+        await self.stop_speaking()
+        self.speak_task = asyncio.ensure_future(self.speak(frames))
+
+    async def speak(self, frames):
+        await self.send_json({"type": "tts", "state": "start"})
+        await self.send_json({"type": "tts", "state": "sentence_start", "text": "This is the mock server."})
+        # Paced like a real TTS stream, one frame per frame duration after a small burst
+        start = time.monotonic()
+        duration = self.server.frame_duration / 1000
+        for i, frame in enumerate(frames):
+            delay = start + max(0, i - self.server.burst_frames) * duration - time.monotonic()
+            if delay > 0:
+                await asyncio.sleep(delay)
+            await self.send_audio(frame, int(i * self.server.frame_duration))
+        await self.send_json({"type": "tts", "state": "stop"})
+        if self.mode == "auto" or self.mode == "realtime":
+            self.listening = True
+            self.uplink = []
+            self.schedule_auto_stop()
+
+    async def stop_speaking(self):
+        if self.speak_task and not self.speak_task.done():
+            self.speak_task.cancel()
+            await self.send_json({"type": "tts", "state": "stop"})
+        self.speak_task = None
+
+    async def close(self):
+        if self.closed:
+            return
+        self.closed = True
+        for task in (self.speak_task, self.auto_stop_task):
+            if task and task is not asyncio.current_task():
+                task.cancel()
+        self.log("in", "closed")
+
+
+class MockServer:
+    def __init__(self, args):
+        self.args = args
+        self.timeline = Timeline(args.timeline)
+        self.sample_rate = 16000
+        self.frame_duration = 60
+        self.reply = args.reply
+        self.turn_seconds = args.turn_seconds
+        self.stt_delay = args.stt_delay_ms / 1000
+        self.burst_frames = args.burst_frames
+        self.tts_frames = proto.read_p3(args.tts) if os.path.exists(args.tts) else [bytes(40)] * 20
+        self.mqtt_clients = {}          # client_id -> writer
+        self.mqtt_sessions = {}         # client_id -> Session
+        self.udp_sessions = {}          # ssrc -> (Session, key, nonce)
+        self.udp = None
+
+    # ----- WebSocket -----
+
+    async def handle_websocket(self, reader, writer):
+        try:
+            _, headers = await proto.ws_accept(reader, writer)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            writer.close()
+            return
+        version = int(headers.get("protocol-version", "1"))
+
+        async def send_json(message):
+            writer.write(proto.ws_frame(proto.WS_TEXT, json.dumps(message, ensure_ascii=False).encode(), False))
+            await writer.drain()
+
+        async def send_audio(frame, timestamp):
+            writer.write(proto.ws_frame(proto.WS_BINARY, proto.pack_audio(version, frame, timestamp), False))
+            await writer.drain()
+
+        session = Session(self, "websocket", send_json, send_audio)
+        session.log("in", "connect", transport="websocket", version=version, device=headers.get("device-id"))
+        try:
+            while True:
+                opcode, data = await proto.ws_read(reader, writer)
+                if opcode is None:
+                    break
+                if opcode == proto.WS_BINARY:
+                    session.on_audio(proto.unpack_audio(version, data))
+                    continue
+                message = json.loads(data)
+                if message.get("type") == "hello":
+                    session.log("in", "json", type="hello")
+                    await send_json(session.hello_reply(message))
+                    session.log("out", "json", type="hello")
+                    if session.mcp_id:
+                        await session.start_mcp()
+                else:
+                    await session.on_json(message)
+        except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError):
+            pass
+        finally:
+            await session.close()
+            writer.close()
+
+    # ----- MQTT broker, the device publishes to its publish_topic and receives on its client id -----
+
+    async def handle_mqtt(self, reader, writer):
+        client_id = None
+        try:
+            while True:
+                packet_type, flags, body = await proto.mqtt_read(reader)
+                if packet_type == proto.MQTT_CONNECT:
+                    client_id, _, _ = proto.mqtt_parse_connect(body)
+                    self.mqtt_clients[client_id] = writer
+                    writer.write(proto.mqtt_packet(proto.MQTT_CONNACK, 0, b"\x00\x00"))
+                    self.timeline.log(None, "in", "mqtt_connect", client_id=client_id)
+                elif packet_type == proto.MQTT_PUBLISH:
+                    _, payload = proto.mqtt_parse_publish(flags, body)
+                    await self.on_mqtt_message(client_id, json.loads(payload))
+                elif packet_type == proto.MQTT_SUBSCRIBE:
+                    count = max(1, (len(body) - 2) // 3)
+                    writer.write(proto.mqtt_packet(proto.MQTT_SUBACK, 0, body[:2] + bytes(count)))
+                elif packet_type == proto.MQTT_PINGREQ:
+                    writer.write(proto.mqtt_packet(proto.MQTT_PINGRESP, 0, b""))
+                elif packet_type == proto.MQTT_DISCONNECT:
+                    break
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError, asyncio.CancelledError):
+            pass
+        finally:
+            if client_id is not None and self.mqtt_clients.get(client_id) is writer:
+                del self.mqtt_clients[client_id]
+                session = self.mqtt_sessions.pop(client_id, None)
+                if session:
+                    await session.close()
+            writer.close()
+
+    async def on_mqtt_message(self, client_id, message):
+        writer = self.mqtt_clients.get(client_id)
+        if writer is None:
+            return
+        topic = f"devices/p2p/{client_id}"
+
+        async def send_json(reply):
+            writer.write(proto.mqtt_publish(topic, json.dumps(reply, ensure_ascii=False).encode()))
+            await writer.drain()
+
+        if message.get("type") == "hello":
+            old = self.mqtt_sessions.pop(client_id, None)
+            if old:
+                await old.close()
+            key, nonce = proto.new_udp_session()
+            ssrc = proto.packet_ssrc(nonce)
+            state = {"address": None, "sequence": 0}
+
+            async def send_audio(frame, timestamp):
+                if state["address"] is None:
+                    return              # The device address is learned from its first packet
+                state["sequence"] += 1
+                self.udp.sendto(proto.encrypt_audio(key, nonce, state["sequence"], timestamp, frame), state["address"])
+
+            session = Session(self, "udp", send_json, send_audio)
+            session.udp_state = state
+            self.mqtt_sessions[client_id] = session
+            self.udp_sessions[ssrc] = (session, key, nonce)
+            reply = session.hello_reply(message)
+            reply["udp"] = {"server": self.args.host, "port": self.args.udp_port, "key": key.hex().upper(),
+                            "nonce": nonce.hex().upper()}
+            session.log("in", "json", type="hello")
+            await send_json(reply)
+            session.log("out", "json", type="hello")
+            if session.mcp_id:
+                await session.start_mcp()
+            return
+
+        session = self.mqtt_sessions.get(client_id)
+        if session is None or message.get("session_id", session.session_id) != session.session_id:
+            # A late message of a previous session, such as the goodbye sent before reconnecting
+            return
+        await session.on_json(message)
+        if message.get("type") == "goodbye":
+            self.mqtt_sessions.pop(client_id, None)
+            self.udp_sessions = {k: v for k, v in self.udp_sessions.items() if v[0] is not session}
+
+    def on_udp_packet(self, data, address):
+        entry = self.udp_sessions.get(proto.packet_ssrc(data))
+        if entry is None:
+            return
+        session, key, _ = entry
+        decrypted = proto.decrypt_audio(key, data)
+        if decrypted is None:
+            return
+        _, timestamp, _, payload = decrypted
+        session.udp_state["address"] = address
+        session.on_audio([(timestamp, payload)])
+
+    # ----- OTA, hands out the configuration of the selected transport -----
+
+    async def handle_http(self, reader, writer):
+        try:
+            request_line, headers = await proto.read_http_head(reader)
+            length = int(headers.get("content-length", "0"))
+            body = await reader.readexactly(length) if length else b""
+        except (asyncio.IncompleteReadError, ConnectionError, ValueError):
+            writer.close()
+            return
+        try:
+            version = json.loads(body).get("application", {}).get("version", "0.0.0")
+        except ValueError:
+            version = "0.0.0"
+        device_id = headers.get("device-id", "")
+        response = {
+            "server_time": {"timestamp": int(time.time() * 1000), "timezone_offset": 0},
+            # The same version, so that the device does not upgrade
+            "firmware": {"version": version, "url": ""},
+        }
+        if self.args.transport == "mqtt":
+            client_id = headers.get("client-id") or device_id or uuid.uuid4().hex
+            response["mqtt"] = {"endpoint": f"{self.args.host}:{self.args.mqtt_port}", "client_id": client_id,
+                                "username": "mock", "password": "mock", "publish_topic": "device-server",
+                                "keepalive": 240}
+        else:
+            response["websocket"] = {"url": f"ws://{self.args.host}:{self.args.ws_port}/xiaozhi/v1/",
+                                     "token": "mock", "version": self.args.ws_version}
+        content = json.dumps(response).encode()
+        self.timeline.log(None, "in", "ota", request=request_line, device=device_id)
+        writer.write(b"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n"
+                     + f"Content-Length: {len(content)}\r\n\r\n".encode() + content)
+        await writer.drain()
+        writer.close()
+
+    async def run(self):
+        loop = asyncio.get_running_loop()
+        server = self
+
+        class UdpProtocol(asyncio.DatagramProtocol):
+            def datagram_received(self, data, address):
+                server.on_udp_packet(data, address)
+
+        self.udp, _ = await loop.create_datagram_endpoint(UdpProtocol, local_addr=(self.args.bind, self.args.udp_port))
+        servers = [
+            await asyncio.start_server(self.handle_websocket, self.args.bind, self.args.ws_port),
+            await asyncio.start_server(self.handle_mqtt, self.args.bind, self.args.mqtt_port),
+            await asyncio.start_server(self.handle_http, self.args.bind, self.args.http_port),
+        ]
+        print(f"WebSocket ws://{self.args.host}:{self.args.ws_port}/xiaozhi/v1/")
+        print(f"MQTT {self.args.host}:{self.args.mqtt_port}, UDP {self.args.udp_port}, AES backend {proto.AES_BACKEND}")
+        print(f"OTA http://{self.args.host}:{self.args.http_port}/xiaozhi/ota/ ({self.args.transport})")
+        print(f"TTS {len(self.tts_frames)} frames, reply {self.reply}")
+        await asyncio.gather(*(s.serve_forever() for s in servers))
+
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description="Local mock of the xiaozhi server")
+    parser.add_argument("--host", default="127.0.0.1", help="address announced to the device")
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--ws-port", type=int, default=8000)
+    parser.add_argument("--ws-version", type=int, default=1, help="binary protocol version given by OTA")
+    parser.add_argument("--mqtt-port", type=int, default=1883)
+    parser.add_argument("--udp-port", type=int, default=8888)
+    parser.add_argument("--http-port", type=int, default=8002)
+    parser.add_argument("--transport", choices=["websocket", "mqtt"], default="websocket", help="given by OTA")
+    parser.add_argument("--tts", default=DEFAULT_TTS, help="p3 file of 16kHz 60ms Opus frames")
+    parser.add_argument("--reply", choices=["canned", "echo"], default="canned")
+    parser.add_argument("--turn-seconds", type=float, default=3, help="speech length in auto mode")
+    parser.add_argument("--stt-delay-ms", type=float, default=0, help="simulated recognition time")
+    parser.add_argument("--burst-frames", type=int, default=5, help="TTS frames sent without pacing")
+    parser.add_argument("--timeline", help="JSON lines file of every message with its timestamp")
+    return parser.parse_args(argv)
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(MockServer(parse_args()).run())
+    except KeyboardInterrupt:
+        pass
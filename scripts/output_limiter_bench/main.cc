@@ -0,0 +1,161 @@
+/*
+ * Host test bench for the playback limiter, see README.md
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "output_limiter.h"
+
+struct Clip {
+    std::string name;
+    std::vector<int16_t> pcm;
+};
+
+/* Reference clips, generated so that the bench has no binary assets */
+static std::vector<Clip> GenerateClips(int sample_rate) {
+    std::vector<Clip> clips;
+    std::mt19937 rng(1);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    size_t seconds = 4;
+    size_t samples = sample_rate * seconds;
+
+    // Full scale tone, the worst case for a small speaker
+    Clip tone{"full_scale_tone", std::vector<int16_t>(samples)};
+    for (size_t i = 0; i < samples; i++) {
+        tone.pcm[i] = (int16_t)(32767 * std::sin(2 * M_PI * 440 * i / sample_rate));
+    }
+    clips.push_back(tone);
+
+    // Hot speech: noise bursts with a syllable envelope peaking at 0 dBFS
+    Clip hot{"hot_speech", std::vector<int16_t>(samples)};
+    for (size_t i = 0; i < samples; i++) {
+        float envelope = std::pow(std::fabs(std::sin(M_PI * 4 * i / sample_rate)), 2.0f);
+        float value = 12000 * envelope * noise(rng);
+        hot.pcm[i] = (int16_t)std::fmax(-32768, std::fmin(32767, value));
+    }
+    clips.push_back(hot);
+
+    // Quiet speech at about -35 dBFS RMS, lifted by the loudness normalizer
+    Clip quiet{"quiet_speech", std::vector<int16_t>(samples)};
+    for (size_t i = 0; i < samples; i++) {
+        float envelope = std::pow(std::fabs(std::sin(M_PI * 4 * i / sample_rate)), 2.0f);
+        quiet.pcm[i] = (int16_t)(900 * envelope * noise(rng));
+    }
+    clips.push_back(quiet);
+
+    // Clicks on a quiet tone, checks the look-ahead catches single sample peaks
+    Clip clicks{"transients", std::vector<int16_t>(samples)};
+    for (size_t i = 0; i < samples; i++) {
+        clicks.pcm[i] = (int16_t)(3000 * std::sin(2 * M_PI * 1000 * i / sample_rate));
+        if (i % (sample_rate / 4) == 0) {
+            clicks.pcm[i] = 32767;
+        }
+    }
+    clips.push_back(clicks);
+    return clips;
+}
+
+static bool ReadWav(const char* filename, Clip& clip, int& sample_rate) {
+    FILE* file = fopen(filename, "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    char header[44];
+    if (fread(header, 1, 44, file) != 44 || memcmp(header, "RIFF", 4) != 0) {
+        fclose(file);
+        return false;
+    }
+    // Assume the canonical 44 byte header of mono 16-bit PCM
+    memcpy(&sample_rate, header + 24, 4);
+    int16_t sample;
+    while (fread(&sample, 2, 1, file) == 1) {
+        clip.pcm.push_back(sample);
+    }
+    clip.name = filename;
+    fclose(file);
+    return true;
+}
+
+static double Rms(const std::vector<int16_t>& pcm, size_t begin) {
+    double sum = 0;
+    for (size_t i = begin; i < pcm.size(); i++) {
+        sum += (double)pcm[i] * pcm[i];
+    }
+    return std::sqrt(sum / std::max<size_t>(1, pcm.size() - begin));
+}
+
+static int Peak(const std::vector<int16_t>& pcm) {
+    int peak = 0;
+    for (auto sample : pcm) {
+        peak = std::max(peak, std::abs((int)sample));
+    }
+    return peak;
+}
+
+static float Db(double value) {
+    return 20.0f * std::log10(std::max(value, 1e-9) / 32768.0);
+}
+
+int main(int argc, char** argv) {
+    int sample_rate = 24000;
+    OutputLimiterConfig config;
+    std::vector<Clip> clips;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            config.threshold_db = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--loudness") == 0 && i + 1 < argc) {
+            config.normalize_loudness = true;
+            config.loudness_target_db = atof(argv[++i]);
+        } else {
+            Clip clip;
+            if (!ReadWav(argv[i], clip, sample_rate)) {
+                fprintf(stderr, "Usage: %s [--threshold dBFS] [--loudness target_dBFS] [clip.wav ...]\n", argv[0]);
+                return 1;
+            }
+            clips.push_back(clip);
+        }
+    }
+    if (clips.empty()) {
+        clips = GenerateClips(sample_rate);
+    }
+
+    int failures = 0;
+    printf("%-16s %9s %9s %9s %9s %9s %9s %9s\n", "clip", "in_peak", "out_peak", "in_rms", "out_rms", "max_gr", "limited", "loud_gain");
+    for (auto& clip : clips) {
+        OutputLimiter limiter;
+        limiter.Configure(config, sample_rate);
+        std::vector<int16_t> output;
+        auto start = std::chrono::steady_clock::now();
+        // Feed 60ms frames like the playback path
+        size_t frame = sample_rate * 60 / 1000;
+        for (size_t offset = 0; offset < clip.pcm.size(); offset += frame) {
+            std::vector<int16_t> pcm(clip.pcm.begin() + offset, clip.pcm.begin() + std::min(clip.pcm.size(), offset + frame));
+            limiter.Process(pcm);
+            output.insert(output.end(), pcm.begin(), pcm.end());
+        }
+        auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        auto& stats = limiter.statistics();
+        int out_peak = Peak(output);
+        // Skip the first second, the normalizer is still converging
+        size_t settle = std::min<size_t>(sample_rate, clip.pcm.size() / 2);
+        printf("%-16s %8.1f  %8.1f  %8.1f  %8.1f  %8.1f  %7.1f%%  %+8.1f\n", clip.name.c_str(),
+            Db(Peak(clip.pcm)), Db(out_peak), Db(Rms(clip.pcm, settle)), Db(Rms(output, settle)),
+            stats.max_gain_reduction_db, stats.limited_samples * 100.0 / stats.processed_samples, stats.loudness_gain_db);
+        printf("%-16s latency %.2f ms, %.1f us per second of audio\n", "",
+            limiter.latency_samples() * 1000.0 / sample_rate, elapsed * sample_rate / clip.pcm.size());
+
+        if (Db(out_peak) > config.threshold_db + 0.01f) {
+            printf("%-16s FAIL: output peak above the %.1f dBFS ceiling\n", "", config.threshold_db);
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+/*
+ * Host test of the UDP reorder window and replay protection, see README.md
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "host_test.h"
+#include "reorder_window.h"
+
+#define FRAME_MS 60
+
+struct Packet {
+    uint32_t sequence;
+};
+
+struct Arrival {
+    uint32_t sequence;
+    uint32_t time_ms;
+};
+
+struct Result {
+    std::vector<uint32_t> released;
+    ReorderWindowStatistics statistics;
+};
+
+static Result Run(const std::vector<Arrival>& arrivals, int depth, uint32_t max_wait_ms) {
+    ReorderWindow<Packet> window;
+    window.Configure(depth, max_wait_ms);
+    Result result;
+    auto output = [&result](std::unique_ptr<Packet> packet) {
+        result.released.push_back(packet->sequence);
+    };
+    for (auto& arrival : arrivals) {
+        window.Push(arrival.sequence, std::make_unique<Packet>(Packet{ arrival.sequence }), arrival.time_ms, output);
+    }
+    window.Flush(output);
+    result.statistics = window.statistics();
+    return result;
+}
+
+static std::vector<Arrival> Sequence(std::initializer_list<uint32_t> sequences) {
+    std::vector<Arrival> arrivals;
+    uint32_t time_ms = 0;
+    for (auto sequence : sequences) {
+        arrivals.push_back({ sequence, time_ms });
+        time_ms += FRAME_MS;
+    }
+    return arrivals;
+}
+
+static bool InOrder(const std::vector<uint32_t>& released) {
+    for (size_t i = 1; i < released.size(); i++) {
+        if ((int32_t)(released[i] - released[i - 1]) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Wi-Fi like arrivals: packets sent every frame, a fraction of them delayed by one or two frames
+ * (retransmissions), some duplicated, some lost
+ */
+static std::vector<Arrival> Simulate(int packets, double reorder, double duplicate, double loss, uint32_t seed,
+    std::vector<uint32_t>& expected) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<Arrival> arrivals;
+    for (int i = 0; i < packets; i++) {
+        uint32_t sequence = 1000 + i;
+        uint32_t time_ms = i * FRAME_MS + (uint32_t)(uniform(random) * 5);
+        if (uniform(random) < loss) {
+            continue;
+        }
+        expected.push_back(sequence);
+        if (uniform(random) < reorder) {
+            time_ms += FRAME_MS * (1 + (uniform(random) < 0.3 ? 1 : 0)) + 10;
+        }
+        arrivals.push_back({ sequence, time_ms });
+        if (uniform(random) < duplicate) {
+            arrivals.push_back({ sequence, time_ms + 3 });
+        }
+    }
+    std::stable_sort(arrivals.begin(), arrivals.end(), [](const Arrival& a, const Arrival& b) {
+        return a.time_ms < b.time_ms;
+    });
+    return arrivals;
+}
+
+static int SelfTest() {
+    HostTest test;
+
+    auto result = Run(Sequence({ 1, 2, 3, 4, 5 }), 3, 200);
+    test.Check("in order", result.released == std::vector<uint32_t>({ 1, 2, 3, 4, 5 }));
+
+    result = Run(Sequence({ 1, 3, 2, 4, 5 }), 3, 200);
+    test.Check("one swap is released in order", result.released == std::vector<uint32_t>({ 1, 2, 3, 4, 5 })
+        && result.statistics.reordered == 1 && result.statistics.lost == 0);
+
+    result = Run(Sequence({ 1, 3, 2, 4, 5 }), 0, 200);
+    test.Check("depth 0 drops the late packet", result.released == std::vector<uint32_t>({ 1, 3, 4, 5 })
+        && result.statistics.late == 1);
+
+    result = Run(Sequence({ 1, 2, 2, 3, 1, 4 }), 3, 200);
+    test.Check("duplicates are dropped", result.released == std::vector<uint32_t>({ 1, 2, 3, 4 })
+        && result.statistics.duplicate == 2);
+
+    result = Run(Sequence({ 100, 101, 102, 20, 103 }), 3, 200);
+    test.Check("replay older than the bitmap is dropped", result.released == std::vector<uint32_t>({ 100, 101, 102, 103 })
+        && result.statistics.late == 1);
+
+    result = Run(Sequence({ 1, 3, 4, 5, 6, 7 }), 3, 1000);
+    test.Check("a lost packet is skipped after depth packets", result.released == std::vector<uint32_t>({ 1, 3, 4, 5, 6, 7 })
+        && result.statistics.lost == 1);
+
+    result = Run({ { 1, 0 }, { 3, 60 }, { 4, 120 }, { 5, 300 } }, 8, 200);
+    test.Check("a lost packet is skipped after max wait", result.released == std::vector<uint32_t>({ 1, 3, 4, 5 })
+        && result.statistics.lost == 1);
+
+    result = Run(Sequence({ 1, 2, 50, 51, 52 }), 3, 200);
+    test.Check("a jump gives up on the gap", result.released == std::vector<uint32_t>({ 1, 2, 50, 51, 52 }));
+
+    result = Run(Sequence({ 1, 2, 4, 1000, 1001 }), 3, 200);
+    test.Check("a large jump releases the held packets", result.released == std::vector<uint32_t>({ 1, 2, 4, 1000, 1001 })
+        && result.statistics.lost == 996);
+
+    result = Run(Sequence({ 1, 2, 4, 1000000, 1000001, 3 }), 3, 200);
+    test.Check("a huge jump restarts the window", result.released == std::vector<uint32_t>({ 1, 2, 4, 1000000, 1000001 })
+        && result.statistics.resynced == 1 && result.statistics.lost == 1 && result.statistics.late == 1);
+
+    result = Run(Sequence({ 0xFFFFFFFE, 0xFFFFFFFF, 1, 0, 2 }), 3, 200);
+    test.Check("sequence wrap", result.released == std::vector<uint32_t>({ 0xFFFFFFFE, 0xFFFFFFFF, 0, 1, 2 }));
+
+    // 2% reordered by one or two frames, 0.5% duplicated, 0.5% really lost
+    std::vector<uint32_t> expected;
+    auto arrivals = Simulate(20000, 0.02, 0.005, 0.005, 1, expected);
+    auto without = Run(arrivals, 0, 180);
+    auto with = Run(arrivals, 4, 180);
+    printf("\nSimulated %zu packets: depth 0 releases %zu (%u late), depth 4 releases %zu (%u reordered, %u duplicate, %u late)\n",
+        expected.size(), without.released.size(), without.statistics.late, with.released.size(),
+        with.statistics.reordered, with.statistics.duplicate, with.statistics.late);
+    test.Check("simulation: in order", InOrder(with.released));
+    test.Check("simulation: no reordered packet is lost", with.released == expected);
+
+    return test.Finish();
+}
+
+static void Usage(const char* program) {
+    fprintf(stderr, "Usage: %s\n", program);
+    fprintf(stderr, "       %s --depth N --wait MS SEQ[@MS] ...   Feed a sequence of arrivals and print the released order\n", program);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        return SelfTest();
+    }
+    if (argc >= 6 && strcmp(argv[1], "--depth") == 0 && strcmp(argv[3], "--wait") == 0) {
+        int depth = atoi(argv[2]);
+        uint32_t max_wait_ms = atoi(argv[4]);
+        std::vector<Arrival> arrivals;
+        for (int i = 5; i < argc; i++) {
+            std::string argument = argv[i];
+            size_t at = argument.find('@');
+            uint32_t sequence = strtoul(argument.substr(0, at).c_str(), nullptr, 10);
+            uint32_t time_ms = at == std::string::npos ? (i - 5) * FRAME_MS : strtoul(argument.substr(at + 1).c_str(), nullptr, 10);
+            arrivals.push_back({ sequence, time_ms });
+        }
+        auto result = Run(arrivals, depth, max_wait_ms);
+        printf("Released:");
+        for (auto sequence : result.released) {
+            printf(" %u", sequence);
+        }
+        auto& statistics = result.statistics;
+        printf("\nreceived %u, released %u, reordered %u, duplicate %u, late %u, lost %u, resynced %u\n", statistics.received,
+            statistics.released, statistics.reordered, statistics.duplicate, statistics.late, statistics.lost, statistics.resynced);
+        return 0;
+    }
+    Usage(argv[0]);
+    return 1;
+}
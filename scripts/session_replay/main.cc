@@ -0,0 +1,372 @@
+/*
+ * Host replay of session captures (main/protocols/session_capture.h), see README.md
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include "session_capture.h"
+
+// Value of a string member in compact JSON as written by the device, empty if there is none
+static std::string JsonString(std::string_view json, const char* key) {
+    std::string pattern = std::string("\"") + key + "\":\"";
+    size_t start = json.find(pattern);
+    if (start == std::string_view::npos) {
+        return "";
+    }
+    start += pattern.size();
+    std::string value;
+    for (size_t i = start; i < json.size() && json[i] != '"'; i++) {
+        if (json[i] == '\\' && i + 1 < json.size()) {
+            i++;
+        }
+        value.push_back(json[i]);
+    }
+    return value;
+}
+
+static bool ReadFile(const char* path, std::string& data) {
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.append(buffer, size);
+    }
+    fclose(file);
+    return true;
+}
+
+static int Dump(const std::string& capture) {
+    SessionCaptureReader reader((const uint8_t*)capture.data(), capture.size());
+    SessionCaptureHeader header;
+    std::string_view info;
+    if (!reader.ReadHeader(header, info)) {
+        fprintf(stderr, "Not a session capture\n");
+        return 1;
+    }
+    printf("start %u ms, %.*s\n", (unsigned)header.start_time_ms, (int)info.size(), info.data());
+    SessionRecord record;
+    while (reader.Next(record)) {
+        printf("%8u %-15s %5zu", (unsigned)record.time_ms, SessionRecordTypeName(record.type), record.payload.size());
+        if (record.type == kSessionRecordIncomingAudio || record.type == kSessionRecordOutgoingAudio) {
+            printf(" %u Hz %u ms ts %u\n", record.audio.sample_rate, record.audio.frame_duration,
+                (unsigned)record.audio.timestamp);
+        } else {
+            printf(" %.*s\n", (int)record.payload.size(), record.payload.data());
+        }
+    }
+    if (reader.error()) {
+        fprintf(stderr, "Truncated record at offset %zu\n", reader.offset());
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Replays the capture through a model of the device state machine. The clock is simulated unless
+ * realtime is set, so the report depends only on the capture. Per turn, the latencies are measured
+ * from the moment the device stopped listening (listen stop, or the recorded end of speech).
+ */
+struct Turn {
+    uint32_t stop_time = 0;
+    int64_t stt_ms = -1;
+    int64_t tts_start_ms = -1;
+    int64_t first_audio_ms = -1;
+};
+
+struct ReplayReport {
+    int channels = 0;
+    int incoming_json = 0;
+    int incoming_audio = 0;
+    int outgoing_text = 0;
+    int outgoing_audio = 0;
+    int errors = 0;
+    std::vector<Turn> turns;
+};
+
+static const char* kStateNames[] = { "idle", "listening", "speaking" };
+
+static bool Replay(const std::string& capture, int speed_percent, bool realtime, bool verbose, ReplayReport& report) {
+    SessionCaptureReader reader((const uint8_t*)capture.data(), capture.size());
+    SessionCaptureHeader header;
+    std::string_view info;
+    if (!reader.ReadHeader(header, info)) {
+        fprintf(stderr, "Not a session capture\n");
+        return false;
+    }
+
+    enum { kIdle, kListening, kSpeaking } state = kIdle;
+    auto set_state = [&](uint32_t time_ms, decltype(state) new_state) {
+        if (state != new_state && verbose) {
+            printf("%8u %s -> %s\n", (unsigned)time_ms, kStateNames[state], kStateNames[new_state]);
+        }
+        state = new_state;
+    };
+    Turn* turn = nullptr;
+    auto start = std::chrono::steady_clock::now();
+
+    SessionRecord record;
+    while (reader.Next(record)) {
+        if (realtime && speed_percent > 0) {
+            std::this_thread::sleep_until(start + std::chrono::milliseconds((int64_t)record.time_ms * 100 / speed_percent));
+        }
+        auto elapsed = [&]() { return (int64_t)record.time_ms - turn->stop_time; };
+        switch (record.type) {
+        case kSessionRecordChannelOpened:
+            report.channels++;
+            if (verbose) {
+                printf("%8u channel opened %.*s\n", (unsigned)record.time_ms, (int)record.payload.size(), record.payload.data());
+            }
+            break;
+        case kSessionRecordChannelClosed:
+            set_state(record.time_ms, kIdle);
+            turn = nullptr;
+            break;
+        case kSessionRecordNetworkError:
+            report.errors++;
+            set_state(record.time_ms, kIdle);
+            turn = nullptr;
+            break;
+        case kSessionRecordOutgoingText: {
+            report.outgoing_text++;
+            auto type = JsonString(record.payload, "type");
+            auto message_state = JsonString(record.payload, "state");
+            if (type == "listen" && message_state == "start") {
+                set_state(record.time_ms, kListening);
+            } else if (type == "listen" && message_state == "stop" && turn == nullptr) {
+                report.turns.push_back({ record.time_ms });
+                turn = &report.turns.back();
+            } else if (type == "abort") {
+                set_state(record.time_ms, kListening);
+                turn = nullptr;
+            }
+            break;
+        }
+        case kSessionRecordOutgoingAudio:
+            report.outgoing_audio++;
+            break;
+        case kSessionRecordIncomingJson: {
+            report.incoming_json++;
+            auto type = JsonString(record.payload, "type");
+            auto message_state = JsonString(record.payload, "state");
+            if (type == "stt") {
+                // In auto stop mode the server ends the turn, the recognized text marks the end of speech
+                if (turn == nullptr) {
+                    report.turns.push_back({ record.time_ms });
+                    turn = &report.turns.back();
+                }
+                if (turn->stt_ms < 0) {
+                    turn->stt_ms = elapsed();
+                }
+                if (verbose) {
+                    printf("%8u >> %s\n", (unsigned)record.time_ms, JsonString(record.payload, "text").c_str());
+                }
+            } else if (type == "tts" && message_state == "start") {
+                if (turn != nullptr && turn->tts_start_ms < 0) {
+                    turn->tts_start_ms = elapsed();
+                }
+                set_state(record.time_ms, kSpeaking);
+            } else if (type == "tts" && message_state == "stop") {
+                set_state(record.time_ms, kListening);
+                turn = nullptr;
+            } else if (type == "tts" && message_state == "sentence_start" && verbose) {
+                printf("%8u << %s\n", (unsigned)record.time_ms, JsonString(record.payload, "text").c_str());
+            }
+            break;
+        }
+        case kSessionRecordIncomingAudio:
+            report.incoming_audio++;
+            if (turn != nullptr && turn->first_audio_ms < 0) {
+                turn->first_audio_ms = elapsed();
+            }
+            break;
+        }
+    }
+    if (reader.error()) {
+        fprintf(stderr, "Truncated record at offset %zu\n", reader.offset());
+        return false;
+    }
+    return true;
+}
+
+static void PrintLatency(const char* name, const std::vector<Turn>& turns, int64_t Turn::*member) {
+    std::vector<int64_t> values;
+    for (auto& turn : turns) {
+        if (turn.*member >= 0) {
+            values.push_back(turn.*member);
+        }
+    }
+    if (values.empty()) {
+        printf("%-22s -\n", name);
+        return;
+    }
+    std::sort(values.begin(), values.end());
+    int64_t sum = 0;
+    for (auto value : values) {
+        sum += value;
+    }
+    printf("%-22s avg %5lld ms  median %5lld ms  max %5lld ms  (%zu turns)\n", name, (long long)(sum / (int64_t)values.size()),
+        (long long)values[values.size() / 2], (long long)values.back(), values.size());
+}
+
+static void PrintReport(const ReplayReport& report) {
+    printf("channels %d, incoming %d messages / %d audio, outgoing %d messages / %d audio, errors %d\n",
+        report.channels, report.incoming_json, report.incoming_audio, report.outgoing_text, report.outgoing_audio,
+        report.errors);
+    PrintLatency("stop -> stt", report.turns, &Turn::stt_ms);
+    PrintLatency("stop -> tts start", report.turns, &Turn::tts_start_ms);
+    PrintLatency("stop -> first audio", report.turns, &Turn::first_audio_ms);
+}
+
+static int failures = 0;
+
+static void Check(bool condition, const char* description) {
+    if (!condition) {
+        printf("FAIL: %s\n", description);
+        failures++;
+    }
+}
+
+// A capture of two turns as the device writes it
+static std::string BuildCapture(size_t max_size) {
+    std::string capture;
+    SessionCaptureWriter writer(capture, max_size);
+    writer.Begin("{\"board\":\"test\",\"version\":\"1.0.0\"}", 5000);
+    writer.Append(kSessionRecordOutgoingText, 0, "{\"type\":\"hello\",\"version\":3}");
+    writer.Append(kSessionRecordChannelOpened, 120, "{\"session_id\":\"s1\",\"sample_rate\":24000,\"frame_duration\":60}");
+    uint8_t frame[40] = {};
+    SessionAudioInfo audio = { 16000, 60, 0, 0 };
+    uint32_t time = 130;
+    for (int turn = 0; turn < 2; turn++) {
+        writer.Append(kSessionRecordOutgoingText, time, "{\"session_id\":\"s1\",\"type\":\"listen\",\"state\":\"start\",\"mode\":\"manual\"}");
+        for (int i = 0; i < 10; i++) {
+            audio.timestamp = time;
+            writer.AppendAudio(kSessionRecordOutgoingAudio, time, audio, frame, sizeof(frame));
+            time += 60;
+        }
+        writer.Append(kSessionRecordOutgoingText, time, "{\"session_id\":\"s1\",\"type\":\"listen\",\"state\":\"stop\"}");
+        writer.Append(kSessionRecordIncomingJson, time + 300 + turn * 100, "{\"type\":\"stt\",\"text\":\"\\\"hi\\\"\"}");
+        writer.Append(kSessionRecordIncomingJson, time + 700 + turn * 100, "{\"type\":\"tts\",\"state\":\"start\"}");
+        audio.sample_rate = 24000;
+        for (int i = 0; i < 5; i++) {
+            writer.AppendAudio(kSessionRecordIncomingAudio, time + 750 + turn * 100 + i * 60, audio, frame, sizeof(frame));
+        }
+        audio.sample_rate = 16000;
+        writer.Append(kSessionRecordIncomingJson, time + 1200 + turn * 100, "{\"type\":\"tts\",\"state\":\"stop\"}");
+        time += 2000;
+    }
+    writer.Append(kSessionRecordChannelClosed, time, "");
+    return capture;
+}
+
+static void SelfTest() {
+    std::string capture = BuildCapture(1 << 20);
+
+    // Round trip of the records
+    SessionCaptureReader reader((const uint8_t*)capture.data(), capture.size());
+    SessionCaptureHeader header;
+    std::string_view info;
+    Check(reader.ReadHeader(header, info), "header");
+    Check(header.start_time_ms == 5000 && info == "{\"board\":\"test\",\"version\":\"1.0.0\"}", "header fields");
+    SessionRecord record;
+    int records = 0, audio = 0;
+    bool audio_ok = true;
+    while (reader.Next(record)) {
+        records++;
+        if (record.type == kSessionRecordIncomingAudio || record.type == kSessionRecordOutgoingAudio) {
+            audio++;
+            audio_ok = audio_ok && record.payload.size() == 40 && record.audio.frame_duration == 60;
+        }
+    }
+    Check(!reader.error() && records == 2 + 2 * 20 + 1, "record count");
+    Check(audio == 30 && audio_ok, "audio records");
+    Check(JsonString("{\"type\":\"stt\",\"text\":\"\\\"hi\\\"\"}", "text") == "\"hi\"", "escaped string");
+
+    // Truncated captures fail at the broken record, never read beyond the data
+    for (size_t size = 0; size < capture.size(); size += 7) {
+        SessionCaptureReader truncated((const uint8_t*)capture.data(), size);
+        if (!truncated.ReadHeader(header, info)) {
+            continue;
+        }
+        while (truncated.Next(record)) {
+            Check(record.payload.data() + record.payload.size() <= capture.data() + size, "truncated payload bounds");
+        }
+        Check(truncated.offset() <= size, "truncated offset");
+    }
+    std::string bad = capture;
+    bad[0] = 'Y';
+    SessionCaptureReader bad_reader((const uint8_t*)bad.data(), bad.size());
+    Check(!bad_reader.ReadHeader(header, info), "bad magic");
+
+    // A full buffer keeps the records written so far
+    std::string small = BuildCapture(300);
+    Check(small.size() <= 300, "capture size limit");
+    SessionCaptureReader small_reader((const uint8_t*)small.data(), small.size());
+    Check(small_reader.ReadHeader(header, info), "limited header");
+    while (small_reader.Next(record)) {
+    }
+    Check(!small_reader.error(), "limited capture is valid");
+
+    // Replay with the simulated clock
+    ReplayReport report;
+    Check(Replay(capture, 100, false, false, report), "replay");
+    Check(report.channels == 1 && report.incoming_json == 6 && report.incoming_audio == 10, "replay counts");
+    Check(report.outgoing_text == 5 && report.outgoing_audio == 20, "replay outgoing");
+    Check(report.turns.size() == 2, "replay turns");
+    if (report.turns.size() == 2) {
+        Check(report.turns[0].stt_ms == 300 && report.turns[1].stt_ms == 400, "stt latency");
+        Check(report.turns[0].tts_start_ms == 700 && report.turns[1].tts_start_ms == 800, "tts latency");
+        Check(report.turns[0].first_audio_ms == 750 && report.turns[1].first_audio_ms == 850, "audio latency");
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) {
+        SelfTest();
+        printf(failures ? "%d checks failed\n" : "All checks passed\n", failures);
+        return failures ? 1 : 0;
+    }
+
+    int speed_percent = 100;
+    bool realtime = false;
+    bool dump = false;
+    bool quiet = false;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(argv[i], "--dump") == 0) {
+            dump = true;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            quiet = true;
+        } else {
+            path = argv[i];
+        }
+    }
+    std::string capture;
+    if (path == nullptr || !ReadFile(path, capture)) {
+        fprintf(stderr, "Usage: %s [--dump] [--realtime] [--speed percent] [--quiet] capture.xzsc\n", argv[0]);
+        return 1;
+    }
+    if (dump) {
+        return Dump(capture);
+    }
+    ReplayReport report;
+    if (!Replay(capture, speed_percent, realtime, !quiet, report)) {
+        return 1;
+    }
+    PrintReport(report);
+    return 0;
+}